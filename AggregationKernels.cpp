@@ -0,0 +1,306 @@
+#include "AggregationKernels.h"
+#include <QtAlgorithms>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AGGREGATION_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+using namespace AggregationKernels;
+
+namespace {
+
+constexpr double Infinity = std::numeric_limits<double>::infinity();
+
+template <bool Masked>
+Aggregate aggregateScalar(const double *values, const quint8 *mask, qint64 count) {
+    Aggregate result;
+    for (qint64 i = 0; i < count; ++i) {
+        if (Masked && !mask[i]) {
+            continue;
+        }
+        const double value = values[i];
+        result.sum += value;
+        ++result.count;
+        if (value < result.min) {
+            result.min = value;
+        }
+        if (value > result.max) {
+            result.max = value;
+            result.argmax = i;
+        }
+    }
+    return result;
+}
+
+Aggregate aggregateScalar(const double *values, const quint8 *mask, qint64 count) {
+    return mask ? aggregateScalar<true>(values, mask, count) : aggregateScalar<false>(values, mask, count);
+}
+
+// Folds per-lane partial results together with the scalar tail starting at `done`.
+template <int Lanes>
+Aggregate reduceLanes(const double (&sum)[Lanes], const double (&min)[Lanes], const double (&max)[Lanes],
+                      const double (&argmax)[Lanes], qint64 laneCount,
+                      const double *values, const quint8 *mask, qint64 done, qint64 count) {
+    Aggregate result;
+    result.count = laneCount;
+    for (int lane = 0; lane < Lanes; ++lane) {
+        result.sum += sum[lane];
+        result.min = qMin(result.min, min[lane]);
+        const qint64 index = static_cast<qint64>(argmax[lane]);
+        if (index < 0) {
+            continue;
+        }
+        // Lanes see interleaved rows, so on equal maxima the smallest index wins.
+        if (max[lane] > result.max || (max[lane] == result.max && index < result.argmax)) {
+            result.max = max[lane];
+            result.argmax = index;
+        }
+    }
+    Aggregate tail = aggregateScalar(values + done, mask ? mask + done : nullptr, count - done);
+    if (tail.argmax >= 0) {
+        tail.argmax += done;
+    }
+    result.merge(tail);
+    return result;
+}
+
+qint64 equalsMaskScalar(const quint32 *codes, quint32 code, quint8 *mask, qint64 count) {
+    qint64 matches = 0;
+    for (qint64 i = 0; i < count; ++i) {
+        mask[i] = codes[i] == code;
+        matches += mask[i];
+    }
+    return matches;
+}
+
+qint64 andMaskScalar(quint8 *mask, const quint8 *other, qint64 count) {
+    qint64 selected = 0;
+    for (qint64 i = 0; i < count; ++i) {
+        mask[i] &= other[i];
+        selected += mask[i];
+    }
+    return selected;
+}
+
+#ifdef AGGREGATION_KERNELS_X86
+
+template <bool Masked>
+KERNEL_TARGET("sse2")
+Aggregate aggregateSse2(const double *values, const quint8 *mask, qint64 count) {
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d step = _mm_set1_pd(2.0);
+    __m128d sum = _mm_setzero_pd();
+    __m128d selected = _mm_setzero_pd();
+    __m128d min = _mm_set1_pd(Infinity);
+    __m128d max = _mm_set1_pd(-Infinity);
+    __m128d argmax = _mm_set1_pd(-1.0);
+    __m128d index = _mm_set_pd(1.0, 0.0);
+
+    qint64 i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d x = _mm_loadu_pd(values + i);
+        __m128d xmin = x;
+        __m128d xmax = x;
+        if (Masked) {
+            __m128d lanes = _mm_castsi128_pd(_mm_set_epi64x(mask[i + 1] ? -1 : 0, mask[i] ? -1 : 0));
+            x = _mm_and_pd(x, lanes);
+            selected = _mm_add_pd(selected, _mm_and_pd(one, lanes));
+            xmin = _mm_or_pd(_mm_and_pd(lanes, xmin), _mm_andnot_pd(lanes, _mm_set1_pd(Infinity)));
+            xmax = _mm_or_pd(_mm_and_pd(lanes, xmax), _mm_andnot_pd(lanes, _mm_set1_pd(-Infinity)));
+        }
+        sum = _mm_add_pd(sum, x);
+        min = _mm_min_pd(min, xmin);
+        __m128d greater = _mm_cmpgt_pd(xmax, max);
+        max = _mm_or_pd(_mm_and_pd(greater, xmax), _mm_andnot_pd(greater, max));
+        argmax = _mm_or_pd(_mm_and_pd(greater, index), _mm_andnot_pd(greater, argmax));
+        index = _mm_add_pd(index, step);
+    }
+
+    double laneSum[2], laneMin[2], laneMax[2], laneArgmax[2], laneSelected[2];
+    _mm_storeu_pd(laneSum, sum);
+    _mm_storeu_pd(laneMin, min);
+    _mm_storeu_pd(laneMax, max);
+    _mm_storeu_pd(laneArgmax, argmax);
+    _mm_storeu_pd(laneSelected, selected);
+    qint64 laneCount = Masked ? static_cast<qint64>(laneSelected[0] + laneSelected[1]) : i;
+    return reduceLanes<2>(laneSum, laneMin, laneMax, laneArgmax, laneCount, values, mask, i, count);
+}
+
+template <bool Masked>
+KERNEL_TARGET("avx2")
+Aggregate aggregateAvx2(const double *values, const quint8 *mask, qint64 count) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d step = _mm256_set1_pd(4.0);
+    const __m256d infinity = _mm256_set1_pd(Infinity);
+    const __m256d negativeInfinity = _mm256_set1_pd(-Infinity);
+    __m256d sum = _mm256_setzero_pd();
+    __m256d selected = _mm256_setzero_pd();
+    __m256d min = infinity;
+    __m256d max = negativeInfinity;
+    __m256d argmax = _mm256_set1_pd(-1.0);
+    __m256d index = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+
+    qint64 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = _mm256_loadu_pd(values + i);
+        __m256d xmin = x;
+        __m256d xmax = x;
+        if (Masked) {
+            int bytes;
+            memcpy(&bytes, mask + i, sizeof(bytes));
+            __m256i wide = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+            __m256d lanes = _mm256_castsi256_pd(_mm256_cmpgt_epi64(wide, _mm256_setzero_si256()));
+            x = _mm256_and_pd(x, lanes);
+            selected = _mm256_add_pd(selected, _mm256_and_pd(one, lanes));
+            xmin = _mm256_blendv_pd(infinity, xmin, lanes);
+            xmax = _mm256_blendv_pd(negativeInfinity, xmax, lanes);
+        }
+        sum = _mm256_add_pd(sum, x);
+        min = _mm256_min_pd(min, xmin);
+        __m256d greater = _mm256_cmp_pd(xmax, max, _CMP_GT_OQ);
+        max = _mm256_blendv_pd(max, xmax, greater);
+        argmax = _mm256_blendv_pd(argmax, index, greater);
+        index = _mm256_add_pd(index, step);
+    }
+
+    double laneSum[4], laneMin[4], laneMax[4], laneArgmax[4], laneSelected[4];
+    _mm256_storeu_pd(laneSum, sum);
+    _mm256_storeu_pd(laneMin, min);
+    _mm256_storeu_pd(laneMax, max);
+    _mm256_storeu_pd(laneArgmax, argmax);
+    _mm256_storeu_pd(laneSelected, selected);
+    qint64 laneCount = Masked
+        ? static_cast<qint64>(laneSelected[0] + laneSelected[1] + laneSelected[2] + laneSelected[3])
+        : i;
+    return reduceLanes<4>(laneSum, laneMin, laneMax, laneArgmax, laneCount, values, mask, i, count);
+}
+
+KERNEL_TARGET("sse2")
+qint64 equalsMaskSse2(const quint32 *codes, quint32 code, quint8 *mask, qint64 count) {
+    const __m128i key = _mm_set1_epi32(static_cast<int>(code));
+    const __m128i ones = _mm_set1_epi8(1);
+    qint64 matches = 0;
+    qint64 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i *source = reinterpret_cast<const __m128i *>(codes + i);
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(source), key);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(source + 1), key);
+        __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128(source + 2), key);
+        __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(source + 3), key);
+        __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i), _mm_and_si128(bytes, ones));
+        matches += qPopulationCount(static_cast<quint32>(_mm_movemask_epi8(bytes)));
+    }
+    return matches + equalsMaskScalar(codes + i, code, mask + i, count - i);
+}
+
+KERNEL_TARGET("sse2")
+qint64 andMaskSse2(quint8 *mask, const quint8 *other, qint64 count) {
+    __m128i total = _mm_setzero_si128();
+    qint64 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i *target = reinterpret_cast<__m128i *>(mask + i);
+        __m128i bytes = _mm_and_si128(_mm_loadu_si128(target),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i *>(other + i)));
+        _mm_storeu_si128(target, bytes);
+        total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
+    qint64 halves[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(halves), total);
+    return halves[0] + halves[1] + andMaskScalar(mask + i, other + i, count - i);
+}
+
+#endif
+
+Isa detectIsa() {
+#ifdef AGGREGATION_KERNELS_X86
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::Avx2;
+    }
+#endif
+    // SSE2 is part of the x86-64 baseline.
+    return Isa::Sse2;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+std::atomic<int> &activeIsaStorage() {
+    static std::atomic<int> active(static_cast<int>(supportedIsa()));
+    return active;
+}
+
+}
+
+void Aggregate::merge(const Aggregate &other) {
+    sum += other.sum;
+    count += other.count;
+    min = qMin(min, other.min);
+    if (other.max > max) {
+        max = other.max;
+        argmax = other.argmax;
+    }
+}
+
+Isa AggregationKernels::supportedIsa() {
+    static const Isa supported = detectIsa();
+    return supported;
+}
+
+Isa AggregationKernels::activeIsa() {
+    return static_cast<Isa>(activeIsaStorage().load(std::memory_order_relaxed));
+}
+
+void AggregationKernels::setActiveIsa(Isa isa) {
+    activeIsaStorage().store(static_cast<int>(qMin(isa, supportedIsa())), std::memory_order_relaxed);
+}
+
+const char *AggregationKernels::isaName(Isa isa) {
+    switch (isa) {
+    case Isa::Avx2: return "avx2";
+    case Isa::Sse2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+Aggregate AggregationKernels::aggregate(const double *values, const quint8 *mask, qint64 count) {
+    switch (activeIsa()) {
+#ifdef AGGREGATION_KERNELS_X86
+    case Isa::Avx2:
+        return mask ? aggregateAvx2<true>(values, mask, count) : aggregateAvx2<false>(values, mask, count);
+    case Isa::Sse2:
+        return mask ? aggregateSse2<true>(values, mask, count) : aggregateSse2<false>(values, mask, count);
+#endif
+    default:
+        return aggregateScalar(values, mask, count);
+    }
+}
+
+qint64 AggregationKernels::equalsMask(const quint32 *codes, quint32 code, quint8 *mask, qint64 count) {
+#ifdef AGGREGATION_KERNELS_X86
+    if (activeIsa() != Isa::Scalar) {
+        return equalsMaskSse2(codes, code, mask, count);
+    }
+#endif
+    return equalsMaskScalar(codes, code, mask, count);
+}
+
+qint64 AggregationKernels::andMask(quint8 *mask, const quint8 *other, qint64 count) {
+#ifdef AGGREGATION_KERNELS_X86
+    if (activeIsa() != Isa::Scalar) {
+        return andMaskSse2(mask, other, count);
+    }
+#endif
+    return andMaskScalar(mask, other, count);
+}
@@ -0,0 +1,40 @@
+#ifndef AGGREGATIONKERNELS_H
+#define AGGREGATIONKERNELS_H
+
+#include <QtGlobal>
+#include <limits>
+
+// Vectorized scans over one contiguous double column. The implementation is
+// picked once at startup (AVX2, SSE2 or scalar) from what the CPU supports.
+namespace AggregationKernels {
+    enum class Isa { Scalar, Sse2, Avx2 };
+
+    struct Aggregate {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        qint64 count = 0;
+        qint64 argmax = -1;  // first index holding max, relative to the scanned column
+
+        // Keeps this side's argmax on ties; argmax stays in the caller's index space.
+        void merge(const Aggregate &other);
+        double average() const { return count > 0 ? sum / count : 0; }
+    };
+
+    Isa supportedIsa();
+    Isa activeIsa();
+    // Forces a narrower implementation (used by benchmarks); clamped to what the CPU supports.
+    void setActiveIsa(Isa isa);
+    const char *isaName(Isa isa);
+
+    // Aggregates values[0..count). When mask is not null only rows whose mask byte
+    // is 1 take part; masks hold one byte per row, 0 or 1.
+    Aggregate aggregate(const double *values, const quint8 *mask, qint64 count);
+
+    // mask[i] = (codes[i] == code); returns the number of matching rows.
+    qint64 equalsMask(const quint32 *codes, quint32 code, quint8 *mask, qint64 count);
+    // mask[i] &= other[i]; returns the number of rows still selected.
+    qint64 andMask(quint8 *mask, const quint8 *other, qint64 count);
+}
+
+#endif
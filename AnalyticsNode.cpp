@@ -5,23 +5,48 @@
 #include <QNetworkInterface>
 #include <QSysInfo>
 #include <cmath>
+#include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDebug>
+#include <QDir>
 #include <QThread>
 #include <QOperatingSystemVersion>
 #include <QStorageInfo>
+#include "Logging.h"
+#include "MetricsEndpoint.h"
 
-AnalyticsNode::AnalyticsNode(const QString &serverAddress, quint16 port, QObject *parent)
-    : QObject(parent), socket(new QTcpSocket(this)), server(new QTcpServer(this)), worker(new Worker) {
-    connect(socket, &QTcpSocket::readyRead, this, &AnalyticsNode::onReadyRead);
-    connect(server, &QTcpServer::newConnection, this, &AnalyticsNode::onNewConnection);
+AnalyticsNode::AnalyticsNode(const QString &serverAddress, quint16 port, const QHostAddress &bindAddress, int ioThreads,
+                             QObject *parent)
+    : QObject(parent), socket(new QTcpSocket(this)), upstream(new ClientConnection(socket, WireCodec::Rows::Columns, this)),
+      // Rows go straight into columns on the I/O threads; batches are then passed on to the worker thread.
+      server(new ReactorServer(ioThreads, WireCodec::Rows::Columns, this)), worker(new Worker(getNumberOfProcessors(), QDir::current().filePath(QString("analytics-data-%1").arg(port)))) {
+    connect(upstream, &ClientConnection::messagesReady, this, &AnalyticsNode::onReadyRead);
+    connect(server, &ReactorServer::newConnection, this, &AnalyticsNode::onNewConnection);
+    qRegisterMetaType<AqiBatch>("AqiBatch");
+    qRegisterMetaType<ColumnBatchPointer>("ColumnBatchPointer");
     connect(worker, &Worker::dataStored, this, &AnalyticsNode::onWorkerDataStored);
+    connect(worker, &Worker::batchStored, this, &AnalyticsNode::onWorkerBatchStored);
+    connect(worker, &Worker::batchFailed, this, &AnalyticsNode::onWorkerBatchFailed);
     connect(worker, &Worker::queryProcessed, this, &AnalyticsNode::onWorkerQueryProcessed);
+    connect(worker, &Worker::standingQueryUpdated, this, &AnalyticsNode::onStandingQueryUpdated);
     worker->moveToThread(&workerThread);
     workerThread.start();
 
+    if (!bindAddress.isNull()) {
+        socket->bind(bindAddress);
+    }
     socket->connectToHost(serverAddress, port);
-    server->listen(QHostAddress::Any, port);
+    server->listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, port);
+
+    Metrics::Registry &registry = Metrics::Registry::global();
+    registry.gaugeCallback("aqi_ingest_queued_rows", "Rows handed to the worker and not yet stored.", this,
+                           [this] { return static_cast<double>(queuedRows); });
+    registry.gaugeCallback("aqi_pending_batches", "Batches handed to the worker and not yet stored.", this,
+                           [this] { return static_cast<double>(pendingBatches.size()); });
+    registry.gaugeCallback("aqi_pending_queries", "Queries handed to the worker and not yet answered.", this,
+                           [this] { return static_cast<double>(pendingQueries.size()); });
+    registry.gaugeCallback("aqi_paused_clients", "Client connections not read from until the backlog drains.", this,
+                           [this] { return static_cast<double>(pausedClients.size()); });
 }
 
 int AnalyticsNode::getNumberOfProcessors() {
@@ -64,38 +89,78 @@ void AnalyticsNode::registerNode() {
             {"requestType", "registering"},
             {"IP", socket->localAddress().toString()},
             {"nodeType", "analytics"},
-            {"computingCapacity", capacity}
+            {"computingCapacity", capacity},
+            {"codecs", WireCodec::supportedCodecs()}
         };
-        QJsonDocument doc(registrationRequest);
-        socket->write(doc.toJson());
-        qDebug() << "Register Node: Sent registration request from" << doc;
+        socket->write(MessageFraming::frame(WireCodec::encode(registrationRequest)));
+        qDebug() << "Register Node: Sent registration request from" << registrationRequest;
     }
 }
 
+void AnalyticsNode::setIngestPolicy(IngestQueue::Policy policy) {
+    ingestPolicy = policy;
+}
+
 void AnalyticsNode::onNewConnection() {
-    QTcpSocket *client = server->nextPendingConnection();
+    ClientConnection *client = server->nextPendingConnection();
     clients.append(client);
-    connect(client, &QTcpSocket::readyRead, this, &AnalyticsNode::onReadyRead);
-    connect(client, &QTcpSocket::disconnected, this, &AnalyticsNode::onClientDisconnected);
-    qDebug() << "New client connected:" << client->peerAddress().toString();
+    connect(client, &ClientConnection::messagesReady, this, &AnalyticsNode::onReadyRead);
+    connect(client, &ClientConnection::disconnected, this, &AnalyticsNode::onClientDisconnected);
+    qCDebug(lcCluster) << "New client connected:" << client->peerAddress().toString();
 }
 
 void AnalyticsNode::onReadyRead() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
-    QJsonDocument doc = QJsonDocument::fromJson(client->readAll());
-    processMessage(client, doc.object());
+    readFrames(qobject_cast<ClientConnection*>(sender()));
+}
+
+void AnalyticsNode::readFrames(ClientConnection *client) {
+    if (pausedClients.contains(client)) {
+        return;
+    }
+    // Framed and decoded on the connection's I/O thread.
+    WireMessage message;
+    int bytes = 0;
+    while (client->nextMessage(message, bytes)) {
+        const QString type = message.fields["requestType"].toString();
+        messageMetrics.received(type, bytes);
+        QElapsedTimer handling;
+        handling.start();
+        processMessage(client, message);
+        messageMetrics.handled(type, handling.nsecsElapsed());
+        if (ingestPolicy == IngestQueue::Policy::Delay && queuedRows >= MaxQueuedRows) {
+            // The rest stays queued; onWorkerBatchStored resumes reading.
+            pausedClients.append(client);
+            client->setReadPaused(true);
+            ++delays;
+            qCDebug(lcIngest) << "Ingest backlog full at" << queuedRows << "rows; pausing" << client->peerAddress().toString();
+            return;
+        }
+    }
 }
 
 void AnalyticsNode::onClientDisconnected() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
+    ClientConnection *client = qobject_cast<ClientConnection*>(sender());
     clients.removeAll(client);
+    pausedClients.removeAll(client);
+    for (auto it = subscribers.begin(); it != subscribers.end();) {
+        if (it.value() == client) {
+            it = subscribers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    subscriberFormats.remove(client);
     client->deleteLater();
-    qDebug() << "Client disconnected:" << client->peerAddress().toString();
+    qCDebug(lcCluster) << "Client disconnected:" << client->peerAddress().toString();
 }
 
-void AnalyticsNode::processMessage(QTcpSocket* client, const QJsonObject &message) {
+void AnalyticsNode::processMessage(ClientConnection* client, const WireMessage &wireMessage) {
+    const QJsonObject &message = wireMessage.fields;
     QString type = message["requestType"].toString();
     if (type == "Node Discovery") {
+        if (client == upstream) {
+            upstreamFormat = WireCodec::negotiate(message);
+        }
         qDebug() << "Node Discovery result received:" << message;
     } else if(type == "Leader Announcement"){
         qDebug() << "Leader election result received:" << message;
@@ -105,60 +170,207 @@ void AnalyticsNode::processMessage(QTcpSocket* client, const QJsonObject &messag
     }
     else if (type == "analytics") {
         int requestID = message["requestID"].toInt();
-        QJsonArray dataArray = message["Data"].toArray();
-        qDebug() << "Analytics request received:" << message;
-        QMetaObject::invokeMethod(worker, "storeData", Q_ARG(QJsonArray, dataArray));
-        sendAcknowledgment(requestID);
+        const int rows = wireMessage.columns->size();
+        qCDebug(lcIngest) << "Analytics request received:" << rows << "rows as" << WireCodec::formatName(wireMessage.format);
+        if (ingestPolicy == IngestQueue::Policy::Shed && queuedRows > 0 && queuedRows + rows > MaxQueuedRows) {
+            ++shedBatches;
+            sendAcknowledgment(client, requestID, rows, "shed", wireMessage.format);
+            return;
+        }
+        // Acknowledged in onWorkerBatchStored once the worker has stored (and logged) it.
+        const int ticket = nextTicket++;
+        pendingBatches.insert(ticket, PendingBatch{client, requestID, rows, wireMessage.format});
+        queuedRows += rows;
+        peakQueuedRows = qMax(peakQueuedRows, queuedRows);
+        // "shard" is set when these rows are a replica of another node's keys.
+        QMetaObject::invokeMethod(worker, "storeColumns", Q_ARG(ColumnBatchPointer, wireMessage.columns),
+                                  Q_ARG(QString, message["shard"].toString()), Q_ARG(int, ticket));
     }
     else if (type == "query") {
-        qDebug() << "Query request received:" << message;
-        QMetaObject::invokeMethod(worker, "processQuery", Q_ARG(QJsonObject, message));
+        qCDebug(lcQuery) << "Query request received:" << message;
+        startQuery(client, message, wireMessage.format);
+    }
+    else if (type == "subscribe") {
+        // {"standingQuery": {"name": ...}} subscribes to an existing standing query;
+        // a full definition (see StandingQuery.h) registers or replaces it first.
+        QJsonObject definition = message["standingQuery"].toObject();
+        QString name = definition["name"].toString();
+        if (!subscribers.contains(name, client)) {
+            subscribers.insert(name, client);
+        }
+        subscriberFormats.insert(client, wireMessage.format);
+        QMetaObject::invokeMethod(worker, "registerStandingQuery", Q_ARG(QJsonObject, definition));
+    }
+    else if (type == "unsubscribe") {
+        subscribers.remove(message["name"].toString(), client);
+    }
+    else if (type == "metrics") {
+        QJsonObject response{
+            {"requestType", "metrics response"},
+            {"requestID", message["requestID"]},
+            {"ingest", ingestMetrics()}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
+    }
+    else if (type == "log level") {
+        Logging::setRules(message["rules"].toString());
+        qInfo() << "Analytics Node: log rules set to" << Logging::rules();
+        QJsonObject response{
+            {"requestType", "log level acknowledgment"},
+            {"requestID", message["requestID"]},
+            {"rules", Logging::rules()}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
     }
     else if (type == "Init Analytics") {
         qDebug() << "Init Analytics received:" << message;
     }
     else {
-        qDebug() << "Received message of type:" << type << message;
+        qCWarning(lcCluster) << "Received message of type:" << type;
     }
 }
 
-void AnalyticsNode::sendHeartBeat(QTcpSocket *clientSocket) {
+void AnalyticsNode::sendHeartBeat(ClientConnection *clientSocket) {
     QJsonObject responseObj;
     responseObj["requestType"] = "Heartbeat Response";
     responseObj["message"] = "I am alive";
     responseObj["status"] = "OK";
 
-    QJsonDocument responseDoc(responseObj);
-    QByteArray responseData = responseDoc.toJson();
-
-    clientSocket->write(responseData);
+    clientSocket->write(MessageFraming::frame(WireCodec::encode(responseObj)));
 }
 
-void AnalyticsNode::sendAcknowledgment(int requestID) {
+void AnalyticsNode::sendAcknowledgment(ClientConnection *client, int requestID, int rows, const QString &status,
+                                       WireCodec::Format format) {
+    // Sent back on the connection the batch came in on; "credits" is how many more
+    // rows the sender may have outstanding with this node.
     QJsonObject ackObj;
     ackObj["requestType"] = "analytics acknowledgment";
-    ackObj["requestID"] = QString::number(requestID);
-    QJsonDocument doc(ackObj);
-    socket->write(doc.toJson());
+    ackObj["requestID"] = requestID;
+    ackObj["rows"] = rows;
+    ackObj["status"] = status;
+    ackObj["credits"] = static_cast<double>(qMax<qint64>(0, MaxQueuedRows - queuedRows));
+    client->write(MessageFraming::frame(WireCodec::encode(ackObj, format)));
 }
 
 void AnalyticsNode::processQuery(const QJsonObject &message) {
-    QMetaObject::invokeMethod(worker, "processQuery", Q_ARG(QJsonObject, message));
+    startQuery(upstream, message, upstreamFormat);
+}
+
+void AnalyticsNode::startQuery(ClientConnection *client, const QJsonObject &message, WireCodec::Format format) {
+    const int ticket = nextQueryTicket++;
+    PendingQuery &pending = pendingQueries[ticket];
+    pending.client = client;
+    pending.requestId = message["requestID"].toInt();
+    pending.format = format;
+    pending.span.start(message["trace"].toString());
+    QJsonObject query = message;
+    query["requestID"] = ticket;
+    QMetaObject::invokeMethod(worker, "processQuery", Q_ARG(QJsonObject, query));
 }
 
 void AnalyticsNode::onWorkerDataStored() {
-    qDebug() << "Worker: Data stored successfully.";
+    qCDebug(lcIngest) << "Worker: Data stored successfully.";
 }
 
-void AnalyticsNode::onWorkerQueryProcessed(const QJsonObject &response) {
-    QJsonDocument doc(response);
-    socket->write(doc.toJson());
-    qDebug() << "Register Node: Sent query response:" << doc;
+void AnalyticsNode::onWorkerBatchStored(int ticket) {
+    ++storedBatches;
+    settleBatch(ticket, "stored");
+}
+
+void AnalyticsNode::onWorkerBatchFailed(int ticket) {
+    ++failedBatches;
+    settleBatch(ticket, "failed");
+}
+
+void AnalyticsNode::settleBatch(int ticket, const QString &status) {
+    const PendingBatch batch = pendingBatches.take(ticket);
+    queuedRows -= batch.rows;
+    if (batch.client) {
+        sendAcknowledgment(batch.client, batch.requestId, batch.rows, status, batch.format);
+    }
+    if (queuedRows <= MaxQueuedRows / 2 && !pausedClients.isEmpty()) {
+        const QList<QPointer<ClientConnection>> resumed = pausedClients;
+        pausedClients.clear();
+        for (const QPointer<ClientConnection> &client : resumed) {
+            if (client) {
+                client->setReadPaused(false);
+                readFrames(client);
+            }
+        }
+    }
+}
+
+QJsonObject AnalyticsNode::ingestMetrics() const {
+    return QJsonObject{
+        {"policy", IngestQueue::policyName(ingestPolicy)},
+        {"queuedRows", static_cast<double>(queuedRows)},
+        {"peakQueuedRows", static_cast<double>(peakQueuedRows)},
+        {"maxQueuedRows", static_cast<double>(MaxQueuedRows)},
+        {"queuedBatches", pendingBatches.size()},
+        {"storedBatches", static_cast<double>(storedBatches)},
+        {"shedBatches", static_cast<double>(shedBatches)},
+        {"failedBatches", static_cast<double>(failedBatches)},
+        {"delays", static_cast<double>(delays)},
+        {"pausedConnections", pausedClients.size()}
+    };
+}
+
+void AnalyticsNode::onWorkerQueryProcessed(const QJsonObject &result) {
+    auto it = pendingQueries.find(result["requestID"].toInt());
+    if (it == pendingQueries.end()) {
+        return;
+    }
+    PendingQuery query = it.value();
+    pendingQueries.erase(it);
+    // Answer on the connection the query came from, so the coordinator that sent it
+    // gets the partial; nobody else is waiting for it once that connection is gone.
+    if (!query.client) {
+        qCDebug(lcQuery) << "Requester of query" << query.requestId << "went away; dropping result";
+        return;
+    }
+    QJsonObject response = result;
+    response["requestID"] = query.requestId;
+    query.span.finish(response, socket->localAddress().toString(), "analytics.execute");
+    query.client->write(MessageFraming::frame(WireCodec::encode(response, query.format)));
+    qCDebug(lcQuery) << "Sent query response:" << response;
+}
+
+void AnalyticsNode::onStandingQueryUpdated(const QJsonObject &result) {
+    QJsonObject update = result;
+    update["requestType"] = "standing query update";
+    for (ClientConnection *subscriber : subscribers.values(result["name"].toString())) {
+        subscriber->write(MessageFraming::frame(WireCodec::encode(update, subscriberFormats.value(subscriber))));
+    }
 }
 
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
-    AnalyticsNode node("192.168.1.102", 12351); // Replace with Register node IP and port
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOptions({
+        {"register", "Address of the register node.", "address", "192.168.1.102"},
+        {"bind", "Address to listen on and connect from (default: all interfaces).", "address"},
+        {"metrics-port", "Port of the plain-text metrics endpoint, 0 to disable.", "port",
+         QString::number(MetricsEndpoint::DefaultPort)},
+        {"io-threads", "Threads reading and decoding client connections.", "count",
+         QString::number(ReactorServer::defaultThreadCount())},
+        {"raw-retention-days", "Days of raw readings to keep behind the newest one; older readings "
+                               "remain only in the rollups. 0 keeps every reading.", "days", "0"},
+        {"query-cache-mb", "Memory for cached query results, 0 to disable.", "megabytes",
+         QString::number(QueryCache::DefaultMaxBytes / (1024 * 1024))}
+    });
+    parser.process(app);
+    const QHostAddress bindAddress(parser.value("bind"));
+    AnalyticsNode node(parser.value("register"), 12351, bindAddress, parser.value("io-threads").toInt());
+    node.setIngestPolicy(IngestQueue::policyFromName(qEnvironmentVariable("AQI_INGEST_POLICY")));
+    node.setRawRetention(parser.value("raw-retention-days").toLongLong() * 24 * 3600);
+    node.setQueryCacheBytes(parser.value("query-cache-mb").toLongLong() * 1024 * 1024);
     node.registerNode();
+
+    Metrics::Registry::global().setConstantLabels({{"node", "analytics"}, {"address", node.address()}});
+    MetricsEndpoint metrics;
+    if (const quint16 metricsPort = parser.value("metrics-port").toUShort()) {
+        metrics.listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, metricsPort);
+    }
     return app.exec();
 }
@@ -1,37 +1,102 @@
 #ifndef ANALYTICSNODE_H
 #define ANALYTICSNODE_H
 
+#include <QHostAddress>
 #include <QObject>
 #include <QTcpSocket>
-#include <QTcpServer>
 #include <QThread>
+#include <QPointer>
+#include "IngestQueue.h"
 #include "Worker.h"
+#include "MessageFraming.h"
+#include "ReactorServer.h"
+#include "Metrics.h"
+#include "WireCodec.h"
 
 class AnalyticsNode : public QObject {
     Q_OBJECT
 
 public:
-    explicit AnalyticsNode(const QString &serverAddress, quint16 port, QObject *parent = nullptr);
+    // bindAddress, when set, is the address this node listens on and connects from;
+    // otherwise it listens on every interface. Client connections are read and decoded
+    // on ioThreads threads of their own.
+    explicit AnalyticsNode(const QString &serverAddress, quint16 port, const QHostAddress &bindAddress = QHostAddress(),
+                           int ioThreads = ReactorServer::defaultThreadCount(), QObject *parent = nullptr);
     void registerNode();
+    // The address this node reached the register node from, once registered.
+    QString address() const { return socket->localAddress().toString(); }
+    // What happens to an analytics batch that arrives while MaxQueuedRows are already
+    // waiting for the worker: Delay stops reading from the sending connection until
+    // the backlog halves, Shed acknowledges it as "shed" without storing it.
+    void setIngestPolicy(IngestQueue::Policy policy);
+    // See Worker::setRawRetention; rollups outlive the raw readings.
+    void setRawRetention(qint64 seconds) { worker->setRawRetention(seconds); }
+    void setQueryCacheBytes(qint64 bytes) { worker->setQueryCacheBytes(bytes); }
+
+    static constexpr qint64 MaxQueuedRows = 1024 * 1024;
 
 private slots:
     void onNewConnection();
     void onReadyRead();
+    void readFrames(ClientConnection *client);
     void onClientDisconnected();
-    void processMessage(QTcpSocket* client, const QJsonObject &message);
-    void sendHeartBeat(QTcpSocket *clientSocket);
-    void sendAcknowledgment(int requestID);
+    void processMessage(ClientConnection* client, const WireMessage &wireMessage);
+    void sendHeartBeat(ClientConnection *clientSocket);
+    void sendAcknowledgment(ClientConnection *client, int requestID, int rows, const QString &status,
+                            WireCodec::Format format);
     void processQuery(const QJsonObject &message);
+    void startQuery(ClientConnection *client, const QJsonObject &message, WireCodec::Format format);
     void onWorkerDataStored();
-    void onWorkerQueryProcessed(const QJsonObject &response);
+    void onWorkerBatchStored(int ticket);
+    void onWorkerBatchFailed(int ticket);
+    void onWorkerQueryProcessed(const QJsonObject &result);
+    void onStandingQueryUpdated(const QJsonObject &result);
 
 private:
     QTcpSocket *socket;
-    QTcpServer *server;
-    QList<QTcpSocket *> clients;
+    ClientConnection *upstream;  // socket, read on this thread
+    ReactorServer *server;
+    QList<ClientConnection *> clients;
+    WireCodec::Format upstreamFormat = WireCodec::Format::Json;
+    // Queries handed to the worker and not yet answered, by a ticket of our own passed
+    // along as their requestID: several coordinators may use the same request IDs.
+    struct PendingQuery {
+        QPointer<ClientConnection> client;  // connection the query arrived on
+        int requestId = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+        Metrics::Span span;
+    };
+    QHash<int, PendingQuery> pendingQueries;
+    int nextQueryTicket = 1;
+    QMultiHash<QString, ClientConnection *> subscribers;  // standing query name -> pushed-to sockets
+    QHash<ClientConnection *, WireCodec::Format> subscriberFormats;
+    // Batches handed to the worker and not yet stored, by the ticket passed along.
+    struct PendingBatch {
+        QPointer<ClientConnection> client;
+        int requestId = 0;
+        int rows = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+    };
+    QHash<int, PendingBatch> pendingBatches;
+    int nextTicket = 1;
+    qint64 queuedRows = 0;
+    qint64 peakQueuedRows = 0;
+    qint64 storedBatches = 0;
+    qint64 shedBatches = 0;
+    qint64 failedBatches = 0;
+    qint64 delays = 0;
+    IngestQueue::Policy ingestPolicy = IngestQueue::Policy::Delay;
+    QList<QPointer<ClientConnection>> pausedClients;  // not read from until the backlog halves
+    Metrics::MessageMetrics messageMetrics{QStringList{
+        "Node Discovery", "Leader Announcement", "Heartbeat", "analytics", "query", "subscribe",
+        "unsubscribe", "metrics", "log level", "Init Analytics"}};
     QThread workerThread;
     Worker *worker;
 
+    QJsonObject ingestMetrics() const;
+    // Acknowledges a batch the worker is done with and resumes paused clients.
+    void settleBatch(int ticket, const QString &status);
+
     static int getNumberOfProcessors();
     static double getMemoryCapacity();
     static double sigmoid(double x);
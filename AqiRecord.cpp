@@ -0,0 +1,220 @@
+#include "AqiRecord.h"
+#include <charconv>
+#include <type_traits>
+#include "StringPool.h"
+
+namespace {
+
+// Days since 1970-01-01 for a proleptic Gregorian date (Howard Hinnant's algorithm).
+qint64 daysFromCivil(int year, int month, int day) {
+    year -= month <= 2;
+    const qint64 era = (year >= 0 ? year : year - 399) / 400;
+    const int yearOfEra = static_cast<int>(year - era * 400);
+    const int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+void civilFromDays(qint64 days, int &year, int &month, int &day) {
+    days += 719468;
+    const qint64 era = (days >= 0 ? days : days - 146096) / 146097;
+    const int dayOfEra = static_cast<int>(days - era * 146097);
+    const int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const int mp = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    month = mp + (mp < 10 ? 3 : -9);
+    year = static_cast<int>(yearOfEra + era * 400) + (month <= 2);
+}
+
+bool readNumber(const QString &text, int offset, int digits, int &value) {
+    if (offset + digits > text.size()) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < digits; ++i) {
+        const QChar c = text[offset + i];
+        if (!c.isDigit()) {
+            return false;
+        }
+        value = value * 10 + c.digitValue();
+    }
+    return true;
+}
+
+// A JSON string holding value, as UTF-8.
+void appendJsonString(QByteArray &out, const QString &value) {
+    static const char hex[] = "0123456789abcdef";
+    const QChar *text = value.constData();
+    const int size = value.size();
+    out.append('"');
+    for (int i = 0; i < size; ++i) {
+        uint c = text[i].unicode();
+        if (c == '"' || c == '\\') {
+            out.append('\\');
+            out.append(static_cast<char>(c));
+        } else if (c < 0x20) {
+            const char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            out.append(escape, sizeof(escape));
+        } else if (c < 0x80) {
+            out.append(static_cast<char>(c));
+        } else if (c < 0x800) {
+            out.append(static_cast<char>(0xc0 | c >> 6));
+            out.append(static_cast<char>(0x80 | (c & 0x3f)));
+        } else {
+            if (QChar::isHighSurrogate(c) && i + 1 < size && text[i + 1].isLowSurrogate()) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (text[++i].unicode() - 0xdc00);
+                out.append(static_cast<char>(0xf0 | c >> 18));
+                out.append(static_cast<char>(0x80 | (c >> 12 & 0x3f)));
+            } else {
+                if (QChar::isSurrogate(c)) {
+                    c = QChar::ReplacementCharacter;
+                }
+                out.append(static_cast<char>(0xe0 | c >> 12));
+            }
+            out.append(static_cast<char>(0x80 | (c >> 6 & 0x3f)));
+            out.append(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+    }
+    out.append('"');
+}
+
+// Numbers travel as JSON strings, formatted like QString::number(value, 'g', precision)
+// but without the intermediate QString.
+template <typename T>
+void appendJsonNumber(QByteArray &out, T value, int precision = 6) {
+    char text[40];
+    std::to_chars_result result;
+    if constexpr (std::is_floating_point<T>::value) {
+        result = std::to_chars(text, text + sizeof(text), value, std::chars_format::general, precision);
+    } else {
+        Q_UNUSED(precision);
+        result = std::to_chars(text, text + sizeof(text), value);
+    }
+    out.append('"');
+    out.append(text, static_cast<int>(result.ptr - text));
+    out.append('"');
+}
+
+void appendDigits(QByteArray &out, int value, int width) {
+    char text[4];
+    for (int i = width - 1; i >= 0; --i, value /= 10) {
+        text[i] = static_cast<char>('0' + value % 10);
+    }
+    out.append(text, width);
+}
+
+}
+
+qint64 AqiRecord::parseTimestamp(const QString &text) {
+    // "yyyy-MM-ddTHH:mm" with optional ":ss" and an optional "@n" suffix.
+    int year, month, day, hour, minute, second = 0;
+    if (!readNumber(text, 0, 4, year) || !readNumber(text, 5, 2, month) || !readNumber(text, 8, 2, day)
+        || !readNumber(text, 11, 2, hour) || !readNumber(text, 14, 2, minute)) {
+        return 0;
+    }
+    if (text.size() > 16 && text[16] == ':') {
+        readNumber(text, 17, 2, second);
+    }
+    return daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+QString AqiRecord::formatTimestamp(qint64 timestamp) {
+    qint64 days = timestamp >= 0 ? timestamp / 86400 : (timestamp - 86399) / 86400;
+    int secondsOfDay = static_cast<int>(timestamp - days * 86400);
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+    return QString("%1-%2-%3T%4:%5")
+        .arg(year, 4, 10, QChar('0'))
+        .arg(month, 2, 10, QChar('0'))
+        .arg(day, 2, 10, QChar('0'))
+        .arg(secondsOfDay / 3600, 2, 10, QChar('0'))
+        .arg(secondsOfDay / 60 % 60, 2, 10, QChar('0'));
+}
+
+bool AqiRecord::fromJsonArray(const QJsonArray &row, AqiRecord &record) {
+    if (row.size() < AqiColumn::Count) {
+        return false;
+    }
+    record.timestamp = parseTimestamp(row[AqiColumn::Timestamp].toString());
+    record.latitude = row[AqiColumn::Latitude].toString().toDouble();
+    record.longitude = row[AqiColumn::Longitude].toString().toDouble();
+    StringPool &pool = StringPool::global();
+    record.pollutant = pool.intern(row[AqiColumn::Pollutant].toString());
+    record.concentration = row[AqiColumn::Concentration].toString().toDouble();
+    record.unit = pool.intern(row[AqiColumn::Unit].toString());
+    record.rawConcentration = row[AqiColumn::RawConcentration].toString().toDouble();
+    record.aqi = row[AqiColumn::Aqi].toString().toInt();
+    record.category = row[AqiColumn::Category].toString().toInt();
+    record.siteName = pool.intern(row[AqiColumn::SiteName].toString());
+    record.agency = pool.intern(row[AqiColumn::Agency].toString());
+    record.aqsId = pool.intern(row[AqiColumn::AqsId].toString());
+    record.fullAqsId = pool.intern(row[AqiColumn::FullAqsId].toString());
+    return true;
+}
+
+QJsonArray AqiRecord::toJsonArray() const {
+    return QJsonArray({
+        formatTimestamp(timestamp),
+        QString::number(latitude, 'g', 10),
+        QString::number(longitude, 'g', 10),
+        pollutant,
+        QString::number(concentration),
+        unit,
+        QString::number(rawConcentration),
+        QString::number(aqi),
+        QString::number(category),
+        siteName,
+        agency,
+        aqsId,
+        fullAqsId
+    });
+}
+
+void AqiRecord::appendJsonArray(QByteArray &out) const {
+    const qint64 days = timestamp >= 0 ? timestamp / 86400 : (timestamp - 86399) / 86400;
+    const int secondsOfDay = static_cast<int>(timestamp - days * 86400);
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+    out.append('[');
+    if (year >= 0 && year <= 9999) {
+        out.append('"');
+        appendDigits(out, year, 4);
+        out.append('-');
+        appendDigits(out, month, 2);
+        out.append('-');
+        appendDigits(out, day, 2);
+        out.append('T');
+        appendDigits(out, secondsOfDay / 3600, 2);
+        out.append(':');
+        appendDigits(out, secondsOfDay / 60 % 60, 2);
+        out.append('"');
+    } else {
+        appendJsonString(out, formatTimestamp(timestamp));
+    }
+    out.append(',');
+    appendJsonNumber(out, latitude, 10);
+    out.append(',');
+    appendJsonNumber(out, longitude, 10);
+    out.append(',');
+    appendJsonString(out, pollutant);
+    out.append(',');
+    appendJsonNumber(out, concentration);
+    out.append(',');
+    appendJsonString(out, unit);
+    out.append(',');
+    appendJsonNumber(out, rawConcentration);
+    out.append(',');
+    appendJsonNumber(out, aqi);
+    out.append(',');
+    appendJsonNumber(out, category);
+    out.append(',');
+    appendJsonString(out, siteName);
+    out.append(',');
+    appendJsonString(out, agency);
+    out.append(',');
+    appendJsonString(out, aqsId);
+    out.append(',');
+    appendJsonString(out, fullAqsId);
+    out.append(']');
+}
@@ -0,0 +1,60 @@
+#ifndef AQIRECORD_H
+#define AQIRECORD_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <QJsonArray>
+#include <QMetaType>
+
+// Column positions of an AQI row as producers send it (13 strings per row).
+namespace AqiColumn {
+    enum {
+        Timestamp = 0,        // "2020-08-10T01:00@1"
+        Latitude = 1,
+        Longitude = 2,
+        Pollutant = 3,        // "PM2.5"
+        Concentration = 4,
+        Unit = 5,             // "UG/M3"
+        RawConcentration = 6,
+        Aqi = 7,
+        Category = 8,
+        SiteName = 9,         // area, e.g. "Crescent City"
+        Agency = 10,
+        AqsId = 11,
+        FullAqsId = 12,
+        Count = 13
+    };
+}
+
+// One AQI reading with its numeric fields parsed. fromJsonArray() takes the string
+// fields from StringPool::global(), so rows share one copy of each distinct value.
+struct AqiRecord {
+    qint64 timestamp = 0;  // seconds since epoch, UTC
+    double latitude = 0;
+    double longitude = 0;
+    QString pollutant;
+    double concentration = 0;
+    QString unit;
+    double rawConcentration = 0;
+    int aqi = 0;
+    int category = 0;
+    QString siteName;
+    QString agency;
+    QString aqsId;
+    QString fullAqsId;
+
+    static bool fromJsonArray(const QJsonArray &row, AqiRecord &record);
+    QJsonArray toJsonArray() const;
+    // toJsonArray() as compact JSON text appended to out, without building the array.
+    void appendJsonArray(QByteArray &out) const;
+
+    static qint64 parseTimestamp(const QString &text);
+    static QString formatTimestamp(qint64 timestamp);
+};
+
+using AqiBatch = QVector<AqiRecord>;
+
+Q_DECLARE_METATYPE(AqiBatch)
+
+#endif
@@ -0,0 +1,703 @@
+#include "BenchmarkDriver.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const quint16 NodePort = 12351;
+const char *const Areas[] = {
+    "Crescent City", "Eureka", "Redding", "Sacramento", "Fresno", "Bakersfield", "Los Angeles", "San Diego"
+};
+const char *const Pollutants[] = {"PM2.5", "PM10", "OZONE", "NO2"};
+
+// Value at the given percentile (nearest rank) of an unsorted sample.
+double percentileOf(QVector<double> values, double p) {
+    if (values.isEmpty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    const int rank = qBound(0, static_cast<int>(std::ceil(p / 100.0 * values.size())) - 1, values.size() - 1);
+    return values[rank];
+}
+
+QJsonObject latencySummary(const QVector<double> &values) {
+    return QJsonObject{
+        {"count", values.size()},
+        {"p50Ms", percentileOf(values, 50)},
+        {"p99Ms", percentileOf(values, 99)},
+        {"p999Ms", percentileOf(values, 99.9)},
+        {"maxMs", percentileOf(values, 100)}
+    };
+}
+
+// "VmRSS" / "VmHWM" of a process in bytes, or -1 where /proc is not available.
+qint64 processMemory(qint64 pid, const QByteArray &field) {
+    QFile status(QString("/proc/%1/status").arg(pid));
+    if (!status.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    for (const QByteArray &line : status.readAll().split('\n')) {
+        if (line.startsWith(field + ':')) {
+            return line.mid(field.size() + 1).trimmed().split(' ').first().toLongLong() * 1024;
+        }
+    }
+    return -1;
+}
+
+// Bytes received on the loopback interface: every hop between the nodes and the
+// driver, on Linux. -1 elsewhere.
+qint64 loopbackBytes() {
+    QFile dev("/proc/net/dev");
+    if (!dev.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    for (const QByteArray &line : dev.readAll().split('\n')) {
+        const QByteArray trimmed = line.trimmed();
+        if (trimmed.startsWith("lo:")) {
+            return trimmed.mid(3).simplified().split(' ').first().toLongLong();
+        }
+    }
+    return -1;
+}
+
+// Splits one CSV line, honouring double quotes around fields.
+QJsonArray csvFields(const QString &line) {
+    QJsonArray fields;
+    QString field;
+    bool quoted = false;
+    for (int i = 0; i < line.size(); ++i) {
+        const QChar c = line[i];
+        if (c == '"') {
+            if (quoted && i + 1 < line.size() && line[i + 1] == '"') {
+                field.append('"');
+                ++i;
+            } else {
+                quoted = !quoted;
+            }
+        } else if (c == ',' && !quoted) {
+            fields.append(field);
+            field.clear();
+        } else {
+            field.append(c);
+        }
+    }
+    fields.append(field);
+    return fields;
+}
+
+double megabytes(qint64 bytes) {
+    return bytes < 0 ? -1 : bytes / (1024.0 * 1024.0);
+}
+
+}
+
+QStringList BenchmarkDriver::queryNames() {
+    return {"area", "percentiles", "distinct", "hourly"};
+}
+
+QJsonObject BenchmarkDriver::query(const QString &name) const {
+    if (name == "percentiles") {
+        return QJsonObject{
+            {"groupBy", QJsonArray{"area"}},
+            {"aggregates", QJsonArray{"p50(aqi)", "p95(aqi)", "p99(aqi)"}}
+        };
+    }
+    if (name == "distinct") {
+        return QJsonObject{
+            {"groupBy", QJsonArray{"area", "pollutant"}},
+            {"aggregates", QJsonArray{"count", "distinct(station)"}}
+        };
+    }
+    if (name == "hourly") {
+        return QJsonObject{
+            {"filters", QJsonObject{{"pollutant", QJsonArray{"OZONE"}}, {"area", QJsonArray{"Fresno"}}}},
+            {"groupBy", QJsonArray{"hour"}},
+            {"aggregates", QJsonArray{"avg(aqi)", "max(aqi)"}}
+        };
+    }
+    return QJsonObject{
+        {"filters", QJsonObject{{"pollutant", QJsonArray{"PM2.5"}}}},
+        {"groupBy", QJsonArray{"area"}},
+        {"aggregates", QJsonArray{"count", "avg(aqi)", "max(aqi)"}}
+    };
+}
+
+BenchmarkDriver::BenchmarkDriver(const Options &options, QObject *parent)
+    : QObject(parent), options(options) {
+    runDirectory.setAutoRemove(!options.keepRunDirectory);
+    for (const auto &entry : options.queryMix) {
+        for (int i = 0; i < entry.second; ++i) {
+            schedule.append(entry.first);
+        }
+    }
+
+    connect(&ingestSocket, &QTcpSocket::readyRead, this, &BenchmarkDriver::onIngestReadyRead);
+    connect(&querySocket, &QTcpSocket::readyRead, this, &BenchmarkDriver::onQueryReadyRead);
+    connect(&probeTimer, &QTimer::timeout, this, &BenchmarkDriver::probe);
+    connect(&pumpTimer, &QTimer::timeout, this, &BenchmarkDriver::pump);
+    connect(&queryTimer, &QTimer::timeout, this, &BenchmarkDriver::sendQuery);
+    pumpTimer.setTimerType(Qt::PreciseTimer);
+    queryTimer.setTimerType(Qt::PreciseTimer);
+    runTimer.setSingleShot(true);
+    connect(&runTimer, &QTimer::timeout, this, [this] { fail("run timed out"); });
+}
+
+BenchmarkDriver::~BenchmarkDriver() {
+    stopCluster();
+}
+
+bool BenchmarkDriver::loadRows() {
+    if (options.csvPath.isEmpty()) {
+        // Hourly readings from every station, one station after another within an hour;
+        // longer runs replay the first million rows again.
+        const int count = static_cast<int>(qMin<qint64>(options.rows, 1000000));
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            const int station = i % options.stations;
+            AqiRecord record;
+            record.timestamp = 1597021200 + static_cast<qint64>(i / options.stations) * 3600;
+            record.latitude = 32.5 + (station % 50) * 0.19;
+            record.longitude = -124.2 + (station / 50) * 0.2;
+            record.pollutant = Pollutants[station % 4];
+            record.concentration = 10 + (station + i) % 40;
+            record.unit = "UG/M3";
+            record.rawConcentration = record.concentration;
+            record.aqi = 20 + (station * 7 + i / options.stations) % 120;
+            record.category = 1 + record.aqi / 50;
+            record.siteName = Areas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            record.fullAqsId = record.aqsId;
+            rows.append(record);
+        }
+        return true;
+    }
+
+    QFile file(options.csvPath);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning().noquote() << "BenchmarkDriver: cannot read" << options.csvPath;
+        return false;
+    }
+    QTextStream in(&file);
+    while (!in.atEnd() && rows.size() < options.rows) {
+        AqiRecord record;
+        if (AqiRecord::fromJsonArray(csvFields(in.readLine()), record)) {
+            rows.append(record);
+        }
+    }
+    if (rows.isEmpty()) {
+        qWarning().noquote() << "BenchmarkDriver: no AQI rows in" << options.csvPath;
+        return false;
+    }
+    return true;
+}
+
+bool BenchmarkDriver::launch(const QString &program, const QString &name, const QString &address,
+                             const QStringList &arguments) {
+    // Each node gets its own working directory, so analytics data directories do not collide.
+    const QString directory = runDirectory.filePath(name);
+    QDir().mkpath(directory);
+    QProcess *process = new QProcess(this);
+    process->setWorkingDirectory(directory);
+    process->setProcessChannelMode(QProcess::MergedChannels);
+    process->setStandardOutputFile(runDirectory.filePath(name + ".log"));
+    if (!options.ingestPolicy.isEmpty()) {
+        QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+        environment.insert("AQI_INGEST_POLICY", options.ingestPolicy);
+        process->setProcessEnvironment(environment);
+    }
+    process->start(QDir(options.binaryDirectory).filePath(program), arguments);
+    if (!process->waitForStarted(5000)) {
+        qWarning().noquote() << "BenchmarkDriver: cannot start" << program << ":" << process->errorString();
+        delete process;
+        return false;
+    }
+    nodes.append(Node{name, address, process});
+    qInfo().noquote() << QString("driver: started %1 on %2 (pid %3)").arg(name, address).arg(process->processId());
+    return true;
+}
+
+bool BenchmarkDriver::waitForListener(const QString &address, int timeoutMs) {
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < timeoutMs) {
+        QTcpSocket socket;
+        socket.connectToHost(address, NodePort);
+        if (socket.waitForConnected(200)) {
+            socket.disconnectFromHost();
+            return true;
+        }
+        QThread::msleep(100);
+    }
+    return false;
+}
+
+void BenchmarkDriver::start() {
+    if (!runDirectory.isValid() || !loadRows()) {
+        fail("cannot prepare the run");
+        return;
+    }
+    startup.start();
+    // Node identity is its IP on a fixed port, so every node gets its own loopback address.
+    const QString registerAddress = "127.0.0.1";
+    if (!launch("RegisterNode", "register", registerAddress, {"--bind", registerAddress})
+        || !waitForListener(registerAddress, 5000)) {
+        fail("register node did not start");
+        return;
+    }
+    if (!launch("MetadataNode", "metadata", "127.0.0.2", {"--register", registerAddress, "--bind", "127.0.0.2"})
+        || !waitForListener("127.0.0.2", 5000)) {
+        fail("metadata node did not start");
+        return;
+    }
+    for (int i = 0; i < options.analyticsNodes; ++i) {
+        const QString address = QString("127.0.0.%1").arg(3 + i);
+        if (!launch("AnalyticsNode", QString("analytics-%1").arg(i + 1), address,
+                    {"--register", registerAddress, "--bind", address})) {
+            fail("analytics node did not start");
+            return;
+        }
+    }
+
+    ingestSocket.connectToHost(registerAddress, NodePort);
+    querySocket.connectToHost(registerAddress, NodePort);
+    if (!ingestSocket.waitForConnected(5000) || !querySocket.waitForConnected(5000)) {
+        fail("cannot connect to the register node");
+        return;
+    }
+    probeTimer.start(500);
+}
+
+void BenchmarkDriver::probe() {
+    if (startup.elapsed() > options.startupTimeoutMs) {
+        fail(QString("cluster not ready after %1 ms; node logs are in %2")
+                 .arg(options.startupTimeoutMs).arg(runDirectory.path()));
+        return;
+    }
+    const int id = -(nextRequestId++);  // negative IDs are readiness probes
+    QJsonObject request{
+        {"requestType", "query"},
+        {"requestID", id},
+        {"query", QJsonObject{{"aggregates", QJsonArray{"count"}}}},
+        {"deadlineMs", 1000}
+    };
+    querySocket.write(MessageFraming::frame(WireCodec::encode(request)));
+}
+
+void BenchmarkDriver::beginLoad() {
+    probeTimer.stop();
+    qInfo().noquote() << QString("driver: cluster of %1 analytics node(s) ready after %2 ms; replaying %3 rows%4")
+                             .arg(options.analyticsNodes).arg(startup.elapsed()).arg(options.rows)
+                             .arg(options.rowsPerSecond > 0 ? QString(" at %1 rows/s").arg(options.rowsPerSecond)
+                                                            : QString(" as fast as acknowledged"));
+    loading = true;
+    loopbackBytesAtStart = loopbackBytes();
+    load.start();
+    pumpTimer.start(5);
+    if (options.queriesPerSecond > 0 && !schedule.isEmpty()) {
+        queryTimer.start(qMax(1, static_cast<int>(1000 / options.queriesPerSecond)));
+    }
+    runTimer.start(options.runTimeoutMs);
+    pump();
+}
+
+void BenchmarkDriver::pump() {
+    while (loading && rowsSent < options.rows && ingestsInFlight.size() < options.inFlight) {
+        if (options.rowsPerSecond > 0 && rowsSent >= options.rowsPerSecond * load.nsecsElapsed() / 1e9) {
+            return;  // ahead of the target rate
+        }
+        const int count = static_cast<int>(qMin<qint64>(options.batchRows, options.rows - rowsSent));
+        AqiBatch batch;
+        batch.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            batch.append(rows[static_cast<int>((rowsSent + i) % rows.size())]);
+        }
+        const int id = nextRequestId++;
+        QJsonObject request{{"requestType", "ingestion"}, {"requestID", id}};
+        const QByteArray frame = MessageFraming::frame(WireCodec::encode(request, batch, options.format));
+        Sent &sent = ingestsInFlight[id];
+        sent.rows = count;
+        sent.timer.start();
+        ingestSocket.write(frame);
+        clientBytesSent += frame.size();
+        rowsSent += count;
+    }
+}
+
+void BenchmarkDriver::sendQuery() {
+    const QString name = schedule[nextQuery++ % schedule.size()];
+    const int id = nextRequestId++;
+    QJsonObject request{
+        {"requestType", "query"},
+        {"requestID", id},
+        {"query", query(name)}
+    };
+    const QByteArray frame = MessageFraming::frame(WireCodec::encode(request, options.format));
+    Sent &sent = queriesInFlight[id];
+    sent.name = name;
+    sent.timer.start();
+    querySocket.write(frame);
+    clientBytesSent += frame.size();
+}
+
+void BenchmarkDriver::onIngestReadyRead() {
+    clientBytesReceived += ingestSocket.bytesAvailable();
+    ingestReader.readFrom(&ingestSocket);
+    QByteArray payload;
+    while (ingestReader.nextFrame(payload)) {
+        WireMessage message;
+        if (WireCodec::decode(payload, message)) {
+            processIngestFrame(message.fields);
+        }
+    }
+}
+
+void BenchmarkDriver::onQueryReadyRead() {
+    clientBytesReceived += querySocket.bytesAvailable();
+    queryReader.readFrom(&querySocket);
+    QByteArray payload;
+    while (queryReader.nextFrame(payload)) {
+        WireMessage message;
+        if (WireCodec::decode(payload, message)) {
+            processQueryFrame(message.fields);
+        }
+    }
+}
+
+void BenchmarkDriver::processIngestFrame(const QJsonObject &message) {
+    if (message["requestType"].toString() != "ingestion acknowledgment") {
+        return;
+    }
+    auto it = ingestsInFlight.find(message["requestID"].toInt());
+    if (it == ingestsInFlight.end()) {
+        return;
+    }
+    ackLatencies.append(it->timer.nsecsElapsed() / 1e6);
+    const QString status = message["status"].toString();
+    if (status == "stored") {
+        rowsStored += it->rows;
+    } else if (status == "shed") {
+        rowsShed += it->rows;
+    } else {
+        rowsFailed += it->rows;
+    }
+    ingestsInFlight.erase(it);
+    if (rowsSent >= options.rows && ingestsInFlight.isEmpty()) {
+        ingestNs = load.nsecsElapsed();
+        pumpTimer.stop();
+        queryTimer.stop();
+        // Queries still unanswered a while after the load ends count as errors.
+        QTimer::singleShot(10000, this, [this] {
+            queryErrors += queriesInFlight.size();
+            queriesInFlight.clear();
+            maybeFinish();
+        });
+        maybeFinish();
+    } else {
+        pump();
+    }
+}
+
+void BenchmarkDriver::processQueryFrame(const QJsonObject &message) {
+    const QString type = message["requestType"].toString();
+    if (type == "metrics response") {
+        QJsonObject report = buildReport(message);
+        done = true;
+        stopCluster();
+        emit finished(report);
+        return;
+    }
+    if (type != "query response") {
+        return;
+    }
+    const int id = message["requestID"].toInt();
+    if (id < 0) {
+        if (!loading && message["complete"].toBool()
+            && message["shardsExpected"].toInt() == options.analyticsNodes) {
+            beginLoad();
+        }
+        return;
+    }
+    auto it = queriesInFlight.find(id);
+    if (it == queriesInFlight.end()) {
+        return;
+    }
+    queryLatencies[it->name].append(it->timer.nsecsElapsed() / 1e6);
+    if (message.contains("error")) {
+        ++queryErrors;
+    } else if (!message["complete"].toBool(true)) {
+        ++queriesIncomplete;
+    }
+    queriesInFlight.erase(it);
+    maybeFinish();
+}
+
+void BenchmarkDriver::maybeFinish() {
+    if (!loading || ingestNs == 0 || !queriesInFlight.isEmpty()) {
+        return;
+    }
+    loading = false;
+    runTimer.stop();
+    // The register node's own counters go into the report; finish() follows its answer.
+    const QJsonObject request{{"requestType", "metrics"}, {"requestID", nextRequestId++}};
+    querySocket.write(MessageFraming::frame(WireCodec::encode(request)));
+}
+
+void BenchmarkDriver::fail(const QString &error) {
+    if (done) {
+        return;
+    }
+    done = true;
+    qWarning().noquote() << "driver:" << error;
+    QJsonObject report = buildReport(QJsonObject());
+    report["error"] = error;
+    stopCluster();
+    emit finished(report);
+}
+
+QJsonObject BenchmarkDriver::buildReport(const QJsonObject &registerMetrics) {
+    const double seconds = (ingestNs > 0 ? ingestNs : load.isValid() ? load.nsecsElapsed() : 0) / 1e9;
+    QVector<double> allQueries;
+    QJsonObject byName;
+    for (auto it = queryLatencies.constBegin(); it != queryLatencies.constEnd(); ++it) {
+        allQueries += it.value();
+        byName[it.key()] = latencySummary(it.value());
+    }
+    QJsonObject queries = latencySummary(allQueries);
+    queries["errors"] = static_cast<double>(queryErrors);
+    queries["incomplete"] = static_cast<double>(queriesIncomplete);
+    queries["byQuery"] = byName;
+
+    const qint64 loopbackNow = loopbackBytes();
+    QJsonArray processes;
+    for (const Node &node : nodes) {
+        const qint64 pid = node.process->processId();
+        processes.append(QJsonObject{
+            {"name", node.name},
+            {"address", node.address},
+            {"rssMB", megabytes(processMemory(pid, "VmRSS"))},
+            {"peakRssMB", megabytes(processMemory(pid, "VmHWM"))}
+        });
+    }
+
+    return QJsonObject{
+        {"analyticsNodes", options.analyticsNodes},
+        {"format", WireCodec::formatName(options.format)},
+        {"ingest", QJsonObject{
+            {"rowsSent", static_cast<double>(rowsSent)},
+            {"rowsStored", static_cast<double>(rowsStored)},
+            {"rowsShed", static_cast<double>(rowsShed)},
+            {"rowsFailed", static_cast<double>(rowsFailed)},
+            {"seconds", seconds},
+            {"rowsPerSecond", seconds > 0 ? rowsStored / seconds : 0},
+            {"acknowledgment", latencySummary(ackLatencies)}
+        }},
+        {"queries", queries},
+        {"wire", QJsonObject{
+            {"clientBytesSent", static_cast<double>(clientBytesSent)},
+            {"clientBytesReceived", static_cast<double>(clientBytesReceived)},
+            {"loopbackBytes", loopbackBytesAtStart < 0 || loopbackNow < 0
+                                  ? -1.0 : static_cast<double>(loopbackNow - loopbackBytesAtStart)}
+        }},
+        {"processes", processes},
+        {"register", registerMetrics}
+    };
+}
+
+void BenchmarkDriver::stopCluster() {
+    // Analytics nodes first, so nothing upstream sees them drop as a failure mid-run.
+    for (int i = nodes.size() - 1; i >= 0; --i) {
+        QProcess *process = nodes[i].process;
+        if (process->state() != QProcess::NotRunning) {
+            process->terminate();
+            if (!process->waitForFinished(3000)) {
+                process->kill();
+                process->waitForFinished(1000);
+            }
+        }
+    }
+    nodes.clear();
+    if (options.keepRunDirectory) {
+        qInfo().noquote() << "driver: node logs and data kept in" << runDirectory.path();
+    }
+}
+
+// Prints the report and returns the metrics that regressed by more than tolerance
+// percent against the baseline report.
+static QStringList compareToBaseline(const QJsonObject &report, const QJsonObject &baseline, double tolerance) {
+    struct Check {
+        QString name;
+        double current;
+        double previous;
+        bool higherIsBetter;
+    };
+    auto sumOfPeaks = [](const QJsonObject &json) {
+        double total = 0;
+        for (const QJsonValue &process : json["processes"].toArray()) {
+            total += qMax(0.0, process.toObject()["peakRssMB"].toDouble());
+        }
+        return total;
+    };
+    const QVector<Check> checks = {
+        {"ingest rows/s", report["ingest"].toObject()["rowsPerSecond"].toDouble(),
+         baseline["ingest"].toObject()["rowsPerSecond"].toDouble(), true},
+        {"query p99", report["queries"].toObject()["p99Ms"].toDouble(),
+         baseline["queries"].toObject()["p99Ms"].toDouble(), false},
+        {"acknowledgment p99", report["ingest"].toObject()["acknowledgment"].toObject()["p99Ms"].toDouble(),
+         baseline["ingest"].toObject()["acknowledgment"].toObject()["p99Ms"].toDouble(), false},
+        {"peak RSS", sumOfPeaks(report), sumOfPeaks(baseline), false}
+    };
+    QStringList regressions;
+    for (const Check &check : checks) {
+        if (check.previous <= 0) {
+            continue;
+        }
+        const double change = (check.current - check.previous) / check.previous * 100;
+        const bool worse = check.higherIsBetter ? -change > tolerance : change > tolerance;
+        if (worse) {
+            regressions.append(QString("%1: %2 -> %3 (%4%5%)").arg(check.name).arg(check.previous, 0, 'f', 2)
+                                   .arg(check.current, 0, 'f', 2).arg(change > 0 ? "+" : "").arg(change, 0, 'f', 1));
+        }
+    }
+    return regressions;
+}
+
+static void printReport(const QJsonObject &report) {
+    const QJsonObject ingest = report["ingest"].toObject();
+    const QJsonObject ack = ingest["acknowledgment"].toObject();
+    const QJsonObject queries = report["queries"].toObject();
+    const QJsonObject wire = report["wire"].toObject();
+    qInfo().noquote() << QString("ingest: %1 rows stored (%2 shed, %3 failed) in %4 s, %5 rows/s; "
+                                 "ack p50 %6 ms p99 %7 ms p999 %8 ms")
+                             .arg(ingest["rowsStored"].toDouble(), 0, 'f', 0)
+                             .arg(ingest["rowsShed"].toDouble(), 0, 'f', 0)
+                             .arg(ingest["rowsFailed"].toDouble(), 0, 'f', 0)
+                             .arg(ingest["seconds"].toDouble(), 0, 'f', 2)
+                             .arg(ingest["rowsPerSecond"].toDouble(), 0, 'f', 0)
+                             .arg(ack["p50Ms"].toDouble(), 0, 'f', 2)
+                             .arg(ack["p99Ms"].toDouble(), 0, 'f', 2)
+                             .arg(ack["p999Ms"].toDouble(), 0, 'f', 2);
+    const QJsonObject byQuery = queries["byQuery"].toObject();
+    for (auto it = byQuery.constBegin(); it != byQuery.constEnd(); ++it) {
+        const QJsonObject latency = it.value().toObject();
+        qInfo().noquote() << QString("query %1: %2 runs, p50 %3 ms p99 %4 ms p999 %5 ms")
+                                 .arg(it.key(), -12).arg(latency["count"].toInt())
+                                 .arg(latency["p50Ms"].toDouble(), 0, 'f', 2)
+                                 .arg(latency["p99Ms"].toDouble(), 0, 'f', 2)
+                                 .arg(latency["p999Ms"].toDouble(), 0, 'f', 2);
+    }
+    qInfo().noquote() << QString("queries: %1 runs, %2 errors, %3 incomplete, p50 %4 ms p99 %5 ms p999 %6 ms")
+                             .arg(queries["count"].toInt())
+                             .arg(queries["errors"].toDouble(), 0, 'f', 0)
+                             .arg(queries["incomplete"].toDouble(), 0, 'f', 0)
+                             .arg(queries["p50Ms"].toDouble(), 0, 'f', 2)
+                             .arg(queries["p99Ms"].toDouble(), 0, 'f', 2)
+                             .arg(queries["p999Ms"].toDouble(), 0, 'f', 2);
+    const double loopback = wire["loopbackBytes"].toDouble();
+    qInfo().noquote() << QString("wire: client sent %1 MB, received %2 MB; all hops on loopback %3")
+                             .arg(megabytes(static_cast<qint64>(wire["clientBytesSent"].toDouble())), 0, 'f', 1)
+                             .arg(megabytes(static_cast<qint64>(wire["clientBytesReceived"].toDouble())), 0, 'f', 1)
+                             .arg(loopback < 0 ? QString("n/a")
+                                               : QString("%1 MB").arg(megabytes(static_cast<qint64>(loopback)), 0, 'f', 1));
+    for (const QJsonValue &value : report["processes"].toArray()) {
+        const QJsonObject process = value.toObject();
+        qInfo().noquote() << QString("rss %1: %2 MB (peak %3 MB)")
+                                 .arg(process["name"].toString(), -12)
+                                 .arg(process["rssMB"].toDouble(), 0, 'f', 1)
+                                 .arg(process["peakRssMB"].toDouble(), 0, 'f', 1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Runs a local cluster on loopback and measures ingest and query performance.");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"analytics", "Number of analytics nodes.", "n", "2"},
+        {"rows", "Rows to ingest.", "n", "200000"},
+        {"batch", "Rows per ingestion request.", "n", "500"},
+        {"rate", "Target ingest rate in rows/s (0: as fast as acknowledged).", "rows", "0"},
+        {"in-flight", "Unacknowledged ingestion requests.", "n", "8"},
+        {"stations", "Stations in the synthetic data.", "n", "500"},
+        {"csv", "Replay AQI rows from a CSV file (13 columns) instead of synthetic data.", "file"},
+        {"format", "Client wire format: binary or json.", "format", "binary"},
+        {"qps", "Queries per second while ingesting.", "n", "20"},
+        {"mix", "Query mix as name:weight pairs; names are " + BenchmarkDriver::queryNames().join(", ") + ".",
+         "mix", "area:4,percentiles:2,distinct:1,hourly:1"},
+        {"policy", "AQI_INGEST_POLICY for the nodes (delay or shed).", "policy"},
+        {"bin-dir", "Directory of the node executables (default: next to this one).", "dir"},
+        {"report", "Write the JSON report to this file.", "file"},
+        {"baseline", "Compare against this earlier JSON report.", "file"},
+        {"tolerance", "Allowed regression against the baseline in percent.", "percent", "10"},
+        {"timeout", "Abort the run after this many seconds.", "s", "600"},
+        {"keep", "Keep the node logs and data directories."}
+    });
+    parser.process(app);
+
+    BenchmarkDriver::Options options;
+    options.binaryDirectory = parser.isSet("bin-dir") ? parser.value("bin-dir") : QCoreApplication::applicationDirPath();
+    options.analyticsNodes = qMax(1, parser.value("analytics").toInt());
+    options.rows = qMax<qint64>(1, parser.value("rows").toLongLong());
+    options.batchRows = qMax(1, parser.value("batch").toInt());
+    options.rowsPerSecond = parser.value("rate").toDouble();
+    options.inFlight = qMax(1, parser.value("in-flight").toInt());
+    options.stations = qMax(1, parser.value("stations").toInt());
+    options.csvPath = parser.value("csv");
+    options.format = parser.value("format") == "json" ? WireCodec::Format::Json : WireCodec::Format::Binary;
+    options.queriesPerSecond = parser.value("qps").toDouble();
+    options.ingestPolicy = parser.value("policy");
+    options.runTimeoutMs = parser.value("timeout").toInt() * 1000;
+    options.keepRunDirectory = parser.isSet("keep");
+    for (const QString &entry : parser.value("mix").split(',')) {
+        if (entry.trimmed().isEmpty()) {
+            continue;
+        }
+        const QStringList parts = entry.trimmed().split(':');
+        if (!BenchmarkDriver::queryNames().contains(parts.first())) {
+            qWarning().noquote() << "Unknown query in mix:" << parts.first();
+            return 2;
+        }
+        options.queryMix.append({parts.first(), parts.size() > 1 ? qMax(0, parts[1].toInt()) : 1});
+    }
+
+    int exitCode = 0;
+    BenchmarkDriver driver(options);
+    QObject::connect(&driver, &BenchmarkDriver::finished, &app, [&](const QJsonObject &report) {
+        printReport(report);
+        if (parser.isSet("report")) {
+            QFile file(parser.value("report"));
+            if (file.open(QIODevice::WriteOnly)) {
+                file.write(QJsonDocument(report).toJson(QJsonDocument::Indented));
+            }
+        }
+        exitCode = report.contains("error") ? 1 : 0;
+        if (parser.isSet("baseline")) {
+            QFile file(parser.value("baseline"));
+            if (!file.open(QIODevice::ReadOnly)) {
+                qWarning().noquote() << "Cannot read baseline" << parser.value("baseline");
+                exitCode = 1;
+            } else {
+                const QStringList regressions = compareToBaseline(
+                    report, QJsonDocument::fromJson(file.readAll()).object(), parser.value("tolerance").toDouble());
+                for (const QString &regression : regressions) {
+                    qWarning().noquote() << "regression:" << regression;
+                }
+                exitCode = regressions.isEmpty() ? exitCode : 1;
+            }
+        }
+        app.exit(exitCode);
+    });
+    QTimer::singleShot(0, &driver, &BenchmarkDriver::start);
+    app.exec();
+    return exitCode;
+}
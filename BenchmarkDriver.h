@@ -0,0 +1,124 @@
+#ifndef BENCHMARKDRIVER_H
+#define BENCHMARKDRIVER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QProcess>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QTimer>
+#include <QVector>
+#include "AqiRecord.h"
+#include "MessageFraming.h"
+#include "WireCodec.h"
+
+// End-to-end load test. Starts a RegisterNode, a MetadataNode and N AnalyticsNodes
+// as child processes on their own loopback addresses (127.0.0.1, .2, .3...), waits
+// until every analytics node answers queries, then replays synthetic or CSV rows
+// through the register node at a fixed rate (or as fast as acknowledgments allow)
+// while a weighted mix of queries runs. Reports ingest rows/s, acknowledgment and
+// query latency percentiles, bytes on the wire and the RSS of every node.
+class BenchmarkDriver : public QObject {
+    Q_OBJECT
+
+public:
+    struct Options {
+        QString binaryDirectory;          // where the node executables are
+        int analyticsNodes = 2;
+        qint64 rows = 200000;
+        int batchRows = 500;              // rows per ingestion request
+        double rowsPerSecond = 0;         // 0: as fast as acknowledgments allow
+        int inFlight = 8;                 // unacknowledged ingestion requests
+        int stations = 500;               // synthetic data only
+        QString csvPath;                  // replayed instead of synthetic rows when set
+        WireCodec::Format format = WireCodec::Format::Binary;
+        double queriesPerSecond = 20;
+        QVector<QPair<QString, int>> queryMix;  // query name, weight
+        QString ingestPolicy;             // AQI_INGEST_POLICY for the nodes
+        int startupTimeoutMs = 60000;
+        int runTimeoutMs = 600000;
+        bool keepRunDirectory = false;
+    };
+
+    // Names accepted in the query mix.
+    static QStringList queryNames();
+
+    explicit BenchmarkDriver(const Options &options, QObject *parent = nullptr);
+    ~BenchmarkDriver();
+
+    // Launches the cluster; finished() is emitted with the report, or with an
+    // "error" entry when the cluster did not come up or the run timed out.
+    void start();
+
+signals:
+    void finished(const QJsonObject &report);
+
+private slots:
+    void probe();
+    void pump();
+    void sendQuery();
+    void onIngestReadyRead();
+    void onQueryReadyRead();
+
+private:
+    struct Node {
+        QString name;
+        QString address;
+        QProcess *process = nullptr;
+    };
+    struct Sent {
+        QElapsedTimer timer;
+        int rows = 0;
+        QString name;  // queries only
+    };
+
+    bool loadRows();
+    bool launch(const QString &program, const QString &name, const QString &address, const QStringList &arguments);
+    bool waitForListener(const QString &address, int timeoutMs);
+    void beginLoad();
+    void processIngestFrame(const QJsonObject &message);
+    void processQueryFrame(const QJsonObject &message);
+    void maybeFinish();
+    void fail(const QString &error);
+    QJsonObject buildReport(const QJsonObject &registerMetrics);
+    void stopCluster();
+    QJsonObject query(const QString &name) const;
+
+    Options options;
+    QTemporaryDir runDirectory;
+    QVector<Node> nodes;
+    AqiBatch rows;
+    QTcpSocket ingestSocket;
+    QTcpSocket querySocket;
+    FrameReader ingestReader;
+    FrameReader queryReader;
+    QTimer probeTimer;
+    QTimer pumpTimer;
+    QTimer queryTimer;
+    QTimer runTimer;
+    QElapsedTimer startup;
+    QElapsedTimer load;
+    QStringList schedule;  // the query mix expanded by weight
+    int nextQuery = 0;
+    int nextRequestId = 1;
+    QHash<int, Sent> ingestsInFlight;
+    QHash<int, Sent> queriesInFlight;
+    qint64 rowsSent = 0;
+    qint64 rowsStored = 0;
+    qint64 rowsShed = 0;
+    qint64 rowsFailed = 0;
+    qint64 ingestNs = 0;       // first send to last acknowledgment
+    qint64 queryErrors = 0;
+    qint64 queriesIncomplete = 0;
+    qint64 clientBytesSent = 0;
+    qint64 clientBytesReceived = 0;
+    qint64 loopbackBytesAtStart = -1;
+    QVector<double> ackLatencies;  // ms
+    QHash<QString, QVector<double>> queryLatencies;  // ms, by query name
+    bool loading = false;
+    bool done = false;
+};
+
+#endif
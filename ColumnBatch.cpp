@@ -0,0 +1,120 @@
+#include "ColumnBatch.h"
+#include <QHash>
+#include <QMutex>
+
+namespace {
+
+// Released batches waiting to be handed out again. Never destroyed, so batches still
+// in flight at exit can be released safely.
+struct BatchPool {
+    static constexpr int MaxBatches = 16;
+    static constexpr int MaxRows = 1 << 20;  // larger batches are freed, not kept
+
+    QMutex lock;
+    QVector<ColumnBatch *> free;
+};
+
+BatchPool &batchPool() {
+    static BatchPool *pool = new BatchPool;
+    return *pool;
+}
+
+void recycle(ColumnBatch *batch) {
+    if (batch->timestamp.capacity() <= BatchPool::MaxRows) {
+        batch->resize(0);
+        batch->strings.resize(0);
+        BatchPool &pool = batchPool();
+        QMutexLocker locker(&pool.lock);
+        if (pool.free.size() < BatchPool::MaxBatches) {
+            pool.free.append(batch);
+            return;
+        }
+    }
+    delete batch;
+}
+
+}
+
+void ColumnBatch::resize(int rows) {
+    timestamp.resize(rows);
+    latitude.resize(rows);
+    longitude.resize(rows);
+    concentration.resize(rows);
+    rawConcentration.resize(rows);
+    aqi.resize(rows);
+    category.resize(rows);
+    pollutant.resize(rows);
+    unit.resize(rows);
+    siteName.resize(rows);
+    agency.resize(rows);
+    aqsId.resize(rows);
+    fullAqsId.resize(rows);
+}
+
+void ColumnBatch::assign(const AqiBatch &rows) {
+    resize(rows.size());
+    strings.resize(0);
+    QHash<QString, quint32> indexes;
+    auto intern = [&](const QString &value) {
+        auto it = indexes.constFind(value);
+        if (it != indexes.constEnd()) {
+            return it.value();
+        }
+        const quint32 index = static_cast<quint32>(strings.size());
+        indexes.insert(value, index);
+        strings.append(value);
+        return index;
+    };
+    for (int i = 0; i < rows.size(); ++i) {
+        const AqiRecord &record = rows[i];
+        timestamp[i] = record.timestamp;
+        latitude[i] = record.latitude;
+        longitude[i] = record.longitude;
+        concentration[i] = record.concentration;
+        rawConcentration[i] = record.rawConcentration;
+        aqi[i] = record.aqi;
+        category[i] = record.category;
+        pollutant[i] = intern(record.pollutant);
+        unit[i] = intern(record.unit);
+        siteName[i] = intern(record.siteName);
+        agency[i] = intern(record.agency);
+        aqsId[i] = intern(record.aqsId);
+        fullAqsId[i] = intern(record.fullAqsId);
+    }
+}
+
+ColumnBatch ColumnBatch::fromRows(const AqiBatch &rows) {
+    ColumnBatch batch;
+    batch.assign(rows);
+    return batch;
+}
+
+QSharedPointer<ColumnBatch> ColumnBatch::pooled() {
+    BatchPool &pool = batchPool();
+    ColumnBatch *batch = nullptr;
+    {
+        QMutexLocker locker(&pool.lock);
+        if (!pool.free.isEmpty()) {
+            batch = pool.free.takeLast();
+        }
+    }
+    return QSharedPointer<ColumnBatch>(batch ? batch : new ColumnBatch, recycle);
+}
+
+AqiRecord ColumnBatch::record(int row) const {
+    AqiRecord record;
+    record.timestamp = timestamp[row];
+    record.latitude = latitude[row];
+    record.longitude = longitude[row];
+    record.pollutant = string(pollutant[row]);
+    record.concentration = concentration[row];
+    record.unit = string(unit[row]);
+    record.rawConcentration = rawConcentration[row];
+    record.aqi = aqi[row];
+    record.category = category[row];
+    record.siteName = string(siteName[row]);
+    record.agency = string(agency[row]);
+    record.aqsId = string(aqsId[row]);
+    record.fullAqsId = string(fullAqsId[row]);
+    return record;
+}
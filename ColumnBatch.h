@@ -0,0 +1,49 @@
+#ifndef COLUMNBATCH_H
+#define COLUMNBATCH_H
+
+#include <QMetaType>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include "AqiRecord.h"
+
+// AQI rows column by column, with every string field an index into the batch's own
+// string table. The binary wire decoder fills one straight from the payload with a
+// single allocation per column, so ingesting a batch costs no per-row allocations;
+// it then travels to the Worker thread by pointer, never by value. Batches from
+// pooled() go back to a free list when released and keep their column capacity, so
+// in steady state decoding one does not allocate the columns either.
+struct ColumnBatch {
+    QVector<qint64> timestamp;
+    QVector<double> latitude;
+    QVector<double> longitude;
+    QVector<double> concentration;
+    QVector<double> rawConcentration;
+    QVector<qint32> aqi;
+    QVector<qint32> category;
+    QVector<quint32> pollutant;
+    QVector<quint32> unit;
+    QVector<quint32> siteName;
+    QVector<quint32> agency;
+    QVector<quint32> aqsId;
+    QVector<quint32> fullAqsId;
+    QVector<QString> strings;
+
+    int size() const { return timestamp.size(); }
+    bool isEmpty() const { return timestamp.isEmpty(); }
+    void resize(int rows);
+    const QString &string(quint32 index) const { return strings[static_cast<int>(index)]; }
+
+    // Replaces the contents with rows, interning their strings into the table.
+    void assign(const AqiBatch &rows);
+    static ColumnBatch fromRows(const AqiBatch &rows);
+    // An empty batch, recycled when the last pointer to it is dropped.
+    static QSharedPointer<ColumnBatch> pooled();
+    AqiRecord record(int row) const;
+};
+
+using ColumnBatchPointer = QSharedPointer<ColumnBatch>;
+
+Q_DECLARE_METATYPE(ColumnBatchPointer)
+
+#endif
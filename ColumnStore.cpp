@@ -0,0 +1,338 @@
+#include "ColumnStore.h"
+#include "SegmentFile.h"
+#include <QSet>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+namespace {
+
+// Segment ids and store versions, drawn from one sequence so neither ever repeats.
+quint64 nextSequence() {
+    static std::atomic<quint64> sequence{0};
+    return sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+}
+
+quint32 StringDictionary::intern(const QString &value) {
+    auto it = codes.constFind(value);
+    if (it != codes.constEnd()) {
+        return it.value();
+    }
+    quint32 code = static_cast<quint32>(values.size());
+    codes.insert(value, code);
+    values.append(value);
+    return code;
+}
+
+qint64 StringDictionary::memoryUsage() const {
+    qint64 bytes = values.capacity() * static_cast<qint64>(sizeof(QString));
+    for (const QString &value : values) {
+        // Shared by the hash key, so counted once.
+        bytes += value.capacity() * static_cast<qint64>(sizeof(QChar));
+    }
+    return bytes + codes.capacity() * static_cast<qint64>(sizeof(QString) + sizeof(quint32) + sizeof(void *));
+}
+
+void ZoneMap::add(qint64 timestamp, double aqi, double latitude, double longitude, quint32 pollutantCode) {
+    minTimestamp = qMin(minTimestamp, timestamp);
+    maxTimestamp = qMax(maxTimestamp, timestamp);
+    minAqi = qMin(minAqi, aqi);
+    maxAqi = qMax(maxAqi, aqi);
+    minLatitude = qMin(minLatitude, latitude);
+    maxLatitude = qMax(maxLatitude, latitude);
+    minLongitude = qMin(minLongitude, longitude);
+    maxLongitude = qMax(maxLongitude, longitude);
+    if (!pollutants.contains(pollutantCode)) {
+        pollutants.append(pollutantCode);
+    }
+}
+
+bool ZoneMap::containsAnyPollutant(const QVector<quint32> &codes) const {
+    for (quint32 code : codes) {
+        if (pollutants.contains(code)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AqiSegment::seal() {
+    sealed = true;
+    id = nextSequence();
+    timestamp.squeeze();
+    aqi.squeeze();
+    concentration.squeeze();
+    latitude.squeeze();
+    longitude.squeeze();
+    pollutant.squeeze();
+    area.squeeze();
+    agency.squeeze();
+    station.squeeze();
+    index = SegmentIndex::build(*this);
+}
+
+qint64 AqiSegment::memoryUsage() const {
+    return timestamp.capacity() * static_cast<qint64>(sizeof(qint64))
+         + (aqi.capacity() + concentration.capacity() + latitude.capacity() + longitude.capacity())
+               * static_cast<qint64>(sizeof(double))
+         + (pollutant.capacity() + area.capacity() + agency.capacity() + station.capacity())
+               * static_cast<qint64>(sizeof(quint32))
+         + (index ? index->memoryUsage() : 0);
+}
+
+SegmentColumns AqiSegment::columns() const {
+    SegmentColumns columns;
+    columns.rows = size();
+    columns.zone = &zone;
+    columns.timestamp = timestamp.constData();
+    columns.aqi = aqi.constData();
+    columns.concentration = concentration.constData();
+    columns.latitude = latitude.constData();
+    columns.longitude = longitude.constData();
+    columns.pollutant = pollutant.constData();
+    columns.area = area.constData();
+    columns.agency = agency.constData();
+    columns.station = station.constData();
+    return columns;
+}
+
+ColumnStore::ColumnStore(qint64 bucketSeconds)
+    : bucketLength(qMax<qint64>(1, bucketSeconds)), changes(nextSequence()) {}
+
+ColumnStore ColumnStore::restored(qint64 bucketSeconds, const QVector<QString> &dictionary,
+                                  const QVector<AqiSegment> &segments,
+                                  const QVector<QSharedPointer<const SegmentFile>> &files) {
+    ColumnStore store(bucketSeconds);
+    for (const QString &value : dictionary) {
+        store.strings.intern(value);
+    }
+    store.files = files;
+    for (const QSharedPointer<const SegmentFile> &file : files) {
+        for (int i = 0; i < file->segmentCount(); ++i) {
+            store.coldSegments.append(qMakePair(file.data(), i));
+            store.coldIds.append(nextSequence());
+        }
+        store.rows += file->rowCount();
+    }
+    store.segmentList = segments;
+    for (int i = 0; i < segments.size(); ++i) {
+        AqiSegment &segment = store.segmentList[i];
+        store.rows += segment.size();
+        store.newestBucket = qMax(store.newestBucket, segment.bucket);
+        if (!segment.sealed) {
+            store.openSegments.insert(segment.bucket, i);
+        } else if (!segment.index) {
+            segment.seal();  // indexes and ids are not saved, only rebuilt
+        }
+    }
+    store.changes = nextSequence();
+    return store;
+}
+
+const ZoneMap &ColumnStore::zone(int index) const {
+    if (index < segmentList.size()) {
+        return segmentList[index].zone;
+    }
+    const auto &cold = coldSegments[index - segmentList.size()];
+    return cold.first->zone(cold.second);
+}
+
+SegmentColumns ColumnStore::columns(int index, int decode) const {
+    if (index < segmentList.size()) {
+        return segmentList[index].columns();
+    }
+    const auto &cold = coldSegments[index - segmentList.size()];
+    return cold.first->columns(cold.second, decode);
+}
+
+const SegmentIndex *ColumnStore::index(int index) const {
+    return index < segmentList.size() ? segmentList[index].index.data() : nullptr;
+}
+
+quint64 ColumnStore::segmentId(int index) const {
+    return index < segmentList.size() ? segmentList[index].id : coldIds[index - segmentList.size()];
+}
+
+QVector<int> ColumnStore::coldCandidates(qint64 maxHotBytes) const {
+    QVector<int> sealed;
+    for (int i = 0; i < segmentList.size(); ++i) {
+        if (segmentList[i].sealed) {
+            sealed.append(i);
+        }
+    }
+    std::stable_sort(sealed.begin(), sealed.end(),
+                     [this](int a, int b) { return segmentList[a].bucket < segmentList[b].bucket; });
+
+    QVector<int> chosen;
+    qint64 hot = memoryUsage();
+    for (int index : sealed) {
+        if (hot <= maxHotBytes) {
+            break;
+        }
+        hot -= segmentList[index].memoryUsage();
+        chosen.append(index);
+    }
+    return chosen;
+}
+
+void ColumnStore::moveToFile(const QVector<int> &indexes, const QSharedPointer<const SegmentFile> &file) {
+    for (int index : indexes) {
+        coldIds.append(segmentList[index].id);
+    }
+    QVector<int> removed = indexes;
+    std::sort(removed.begin(), removed.end(), std::greater<int>());
+    for (int index : removed) {
+        segmentList.remove(index);
+    }
+    // Only sealed segments move, so the open ones just shift down.
+    openSegments.clear();
+    for (int i = 0; i < segmentList.size(); ++i) {
+        if (!segmentList[i].sealed) {
+            openSegments.insert(segmentList[i].bucket, i);
+        }
+    }
+    files.append(file);
+    for (int i = 0; i < file->segmentCount(); ++i) {
+        coldSegments.append(qMakePair(file.data(), i));
+    }
+}
+
+qint64 ColumnStore::dropBefore(qint64 timestamp) {
+    qint64 dropped = 0;
+    QVector<AqiSegment> kept;
+    for (const AqiSegment &segment : qAsConst(segmentList)) {
+        if (segment.sealed && segment.zone.maxTimestamp < timestamp) {
+            dropped += segment.size();
+        } else {
+            kept.append(segment);
+        }
+    }
+    if (kept.size() != segmentList.size()) {
+        segmentList = kept;
+        openSegments.clear();
+        for (int i = 0; i < segmentList.size(); ++i) {
+            if (!segmentList[i].sealed) {
+                openSegments.insert(segmentList[i].bucket, i);
+            }
+        }
+    }
+
+    QVector<QPair<const SegmentFile *, int>> keptCold;
+    QVector<quint64> keptIds;
+    QSet<const SegmentFile *> used;
+    for (int i = 0; i < coldSegments.size(); ++i) {
+        const auto &cold = coldSegments[i];
+        if (cold.first->zone(cold.second).maxTimestamp < timestamp) {
+            dropped += cold.first->columns(cold.second, 0).rows;
+        } else {
+            keptCold.append(cold);
+            keptIds.append(coldIds[i]);
+            used.insert(cold.first);
+        }
+    }
+    if (keptCold.size() != coldSegments.size()) {
+        coldSegments = keptCold;
+        coldIds = keptIds;
+        QVector<QSharedPointer<const SegmentFile>> keptFiles;
+        for (const QSharedPointer<const SegmentFile> &file : qAsConst(files)) {
+            if (used.contains(file.data())) {
+                keptFiles.append(file);
+            }
+        }
+        files = keptFiles;
+    }
+    rows -= dropped;
+    if (dropped > 0) {
+        changes = nextSequence();
+    }
+    return dropped;
+}
+
+AqiSegment &ColumnStore::openSegment(qint64 bucket) {
+    if (bucket > newestBucket) {
+        newestBucket = bucket;
+        for (auto it = openSegments.begin(); it != openSegments.end();) {
+            if (it.key() < newestBucket - LateBuckets * bucketLength) {
+                segmentList[it.value()].seal();
+                it = openSegments.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    auto it = openSegments.constFind(bucket);
+    if (it != openSegments.constEnd() && !segmentList[it.value()].isFull()) {
+        return segmentList[it.value()];
+    }
+    if (it != openSegments.constEnd()) {
+        segmentList[it.value()].seal();
+    }
+    AqiSegment segment;
+    segment.bucket = bucket;
+    segmentList.append(segment);
+    // Rows later than the lateness window get a fresh segment that seals on the next advance.
+    openSegments.insert(bucket, segmentList.size() - 1);
+    return segmentList.last();
+}
+
+AqiSegment &ColumnStore::segmentFor(qint64 timestamp) {
+    return openSegment(timestamp - ((timestamp % bucketLength) + bucketLength) % bucketLength);
+}
+
+void ColumnStore::append(const AqiRecord *records, int count) {
+    for (int i = 0; i < count; ++i) {
+        const AqiRecord &record = records[i];
+        AqiSegment &segment = segmentFor(record.timestamp);
+        const quint32 pollutantCode = strings.intern(record.pollutant);
+        segment.zone.add(record, pollutantCode);
+        segment.timestamp.append(record.timestamp);
+        segment.aqi.append(record.aqi);
+        segment.concentration.append(record.concentration);
+        segment.latitude.append(record.latitude);
+        segment.longitude.append(record.longitude);
+        segment.pollutant.append(pollutantCode);
+        segment.area.append(strings.intern(record.siteName));
+        segment.agency.append(strings.intern(record.agency));
+        segment.station.append(strings.intern(record.aqsId));
+    }
+    rows += count;
+    changes = nextSequence();
+}
+
+void ColumnStore::append(const ColumnBatch &batch, int offset, int count) {
+    QVector<quint32> codes(batch.strings.size(), StringDictionary::NotFound);
+    auto code = [&](quint32 index) {
+        quint32 &slot = codes[static_cast<int>(index)];
+        if (slot == StringDictionary::NotFound) {
+            slot = strings.intern(batch.string(index));
+        }
+        return slot;
+    };
+    for (int i = offset; i < offset + count; ++i) {
+        const qint64 timestamp = batch.timestamp[i];
+        AqiSegment &segment = segmentFor(timestamp);
+        const quint32 pollutantCode = code(batch.pollutant[i]);
+        segment.zone.add(timestamp, batch.aqi[i], batch.latitude[i], batch.longitude[i], pollutantCode);
+        segment.timestamp.append(timestamp);
+        segment.aqi.append(batch.aqi[i]);
+        segment.concentration.append(batch.concentration[i]);
+        segment.latitude.append(batch.latitude[i]);
+        segment.longitude.append(batch.longitude[i]);
+        segment.pollutant.append(pollutantCode);
+        segment.area.append(code(batch.siteName[i]));
+        segment.agency.append(code(batch.agency[i]));
+        segment.station.append(code(batch.aqsId[i]));
+    }
+    rows += count;
+    changes = nextSequence();
+}
+
+qint64 ColumnStore::memoryUsage() const {
+    qint64 bytes = strings.memoryUsage();
+    for (const AqiSegment &segment : segmentList) {
+        bytes += segment.memoryUsage();
+    }
+    return bytes;
+}
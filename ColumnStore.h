@@ -0,0 +1,177 @@
+#ifndef COLUMNSTORE_H
+#define COLUMNSTORE_H
+
+#include <QHash>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <limits>
+#include "AqiRecord.h"
+#include "ColumnBatch.h"
+#include "GeoGrid.h"
+#include "InvertedIndex.h"
+
+// Maps repeated strings (areas, agencies, pollutants, station IDs) to dense codes.
+class StringDictionary {
+public:
+    static constexpr quint32 NotFound = 0xffffffffu;
+
+    quint32 intern(const QString &value);
+    quint32 find(const QString &value) const { return codes.value(value, NotFound); }
+    const QString &value(quint32 code) const { return values[static_cast<int>(code)]; }
+    int size() const { return values.size(); }
+    qint64 memoryUsage() const;
+
+private:
+    QHash<QString, quint32> codes;
+    QVector<QString> values;
+};
+
+// Min/max statistics of one segment, used to skip segments a query cannot match.
+struct ZoneMap {
+    qint64 minTimestamp = std::numeric_limits<qint64>::max();
+    qint64 maxTimestamp = std::numeric_limits<qint64>::min();
+    double minAqi = std::numeric_limits<double>::infinity();
+    double maxAqi = -std::numeric_limits<double>::infinity();
+    double minLatitude = std::numeric_limits<double>::infinity();
+    double maxLatitude = -std::numeric_limits<double>::infinity();
+    double minLongitude = std::numeric_limits<double>::infinity();
+    double maxLongitude = -std::numeric_limits<double>::infinity();
+    QVector<quint32> pollutants;  // distinct pollutant codes present
+
+    void add(qint64 timestamp, double aqi, double latitude, double longitude, quint32 pollutantCode);
+    void add(const AqiRecord &record, quint32 pollutantCode) {
+        add(record.timestamp, record.aqi, record.latitude, record.longitude, pollutantCode);
+    }
+    bool overlapsTime(qint64 from, qint64 to) const { return maxTimestamp >= from && minTimestamp < to; }
+    bool withinTime(qint64 from, qint64 to) const { return minTimestamp >= from && maxTimestamp < to; }
+    GeoBox box() const { return GeoBox{minLatitude, minLongitude, maxLatitude, maxLongitude}; }
+    bool containsAnyPollutant(const QVector<quint32> &codes) const;
+};
+
+// Read-only column pointers of one segment, in memory or mapped from a SegmentFile.
+struct SegmentColumns {
+    // Columns a SegmentFile stores encoded; the others are always available in place.
+    enum Decode { Timestamp = 1, Aqi = 2, Area = 4, Agency = 8, DecodeAll = 15 };
+
+    int rows = 0;
+    const ZoneMap *zone = nullptr;
+    const qint64 *timestamp = nullptr;
+    const double *aqi = nullptr;
+    const double *concentration = nullptr;
+    const double *latitude = nullptr;
+    const double *longitude = nullptr;
+    const quint32 *pollutant = nullptr;
+    const quint32 *area = nullptr;
+    const quint32 *agency = nullptr;
+    const quint32 *station = nullptr;
+
+    int size() const { return rows; }
+};
+
+class SegmentFile;
+
+// A run of AQI readings from one time bucket, stored column by column. Numeric
+// fields are parsed once at ingest; string fields hold codes into the store's
+// dictionary. A segment is sealed (immutable) once full or once ingestion has
+// moved past its bucket.
+struct AqiSegment {
+    static constexpr int Capacity = 64 * 1024;
+
+    qint64 bucket = 0;  // bucket start, seconds since epoch
+    bool sealed = false;
+    quint64 id = 0;  // unique in the process once sealed, kept through moves to files
+    ZoneMap zone;
+
+    QVector<qint64> timestamp;
+    QVector<double> aqi;
+    QVector<double> concentration;
+    QVector<double> latitude;
+    QVector<double> longitude;
+    QVector<quint32> pollutant;
+    QVector<quint32> area;
+    QVector<quint32> agency;
+    QVector<quint32> station;
+    // Posting lists of the area, station and pollutant codes; built on sealing.
+    QSharedPointer<const SegmentIndex> index;
+
+    int size() const { return aqi.size(); }
+    bool isFull() const { return size() >= Capacity; }
+    // Squeezes the columns, builds the index and assigns the id.
+    void seal();
+    qint64 memoryUsage() const;
+    SegmentColumns columns() const;
+};
+
+// Segments bucketed by reading time. Rows go to the open segment of their bucket;
+// buckets more than LateBuckets behind the newest one seen are sealed, and rows
+// arriving later than that start a fresh segment in their bucket. Sealed segments
+// can be moved out of memory into segment files; scans see hot and cold alike.
+class ColumnStore {
+public:
+    static constexpr qint64 DefaultBucketSeconds = 24 * 3600;
+    static constexpr qint64 LateBuckets = 1;
+
+    explicit ColumnStore(qint64 bucketSeconds = DefaultBucketSeconds);
+    // Rebuilds a store from its dictionary values (in code order), in-memory segments
+    // and segment files, as saved in a snapshot. Unsealed segments become the open
+    // segments of their buckets.
+    static ColumnStore restored(qint64 bucketSeconds, const QVector<QString> &dictionary,
+                                const QVector<AqiSegment> &segments,
+                                const QVector<QSharedPointer<const SegmentFile>> &files);
+
+    void append(const AqiRecord *records, int count);
+    void append(const AqiBatch &rows) { append(rows.constData(), rows.size()); }
+    // Rows [offset, offset + count) of batch; each batch string is looked up once.
+    void append(const ColumnBatch &batch, int offset, int count);
+
+    qint64 rowCount() const { return rows; }
+    // In-memory segments only.
+    const QVector<AqiSegment> &segments() const { return segmentList; }
+    const QVector<QSharedPointer<const SegmentFile>> &segmentFiles() const { return files; }
+
+    // Every segment, in-memory ones first and then those in segment files.
+    int segmentCount() const { return segmentList.size() + coldSegments.size(); }
+    const ZoneMap &zone(int index) const;
+    // decode is a set of SegmentColumns::Decode flags; it only matters for file segments,
+    // whose decoded columns are valid until the next columns() call on the same thread.
+    SegmentColumns columns(int index, int decode = SegmentColumns::DecodeAll) const;
+    // Index of a sealed in-memory segment; null for open and file segments.
+    const SegmentIndex *index(int index) const;
+    // AqiSegment::id of a sealed segment, in memory or in a file; 0 for open ones.
+    quint64 segmentId(int index) const;
+    // Changes with every change to the rows and is unique in the process, so a scan
+    // result stays valid while the version it was taken at does.
+    quint64 version() const { return changes; }
+
+    // Sealed in-memory segments, oldest bucket first, whose removal brings
+    // memoryUsage() down to maxHotBytes.
+    QVector<int> coldCandidates(qint64 maxHotBytes) const;
+    // Replaces the in-memory segments at indexes (from coldCandidates, unchanged since)
+    // with the segments of file, which holds them in the same order.
+    void moveToFile(const QVector<int> &indexes, const QSharedPointer<const SegmentFile> &file);
+    // Drops sealed segments, in memory or in files, whose newest reading is older than
+    // timestamp, and returns their row count. A file is let go once none of its segments
+    // is left; it stays on disk until recovery finds no snapshot referencing it.
+    qint64 dropBefore(qint64 timestamp);
+    const StringDictionary &dictionary() const { return strings; }
+    qint64 bucketSeconds() const { return bucketLength; }
+    qint64 memoryUsage() const;
+
+private:
+    AqiSegment &openSegment(qint64 bucket);
+    AqiSegment &segmentFor(qint64 timestamp);
+
+    StringDictionary strings;
+    QVector<AqiSegment> segmentList;
+    QVector<QSharedPointer<const SegmentFile>> files;
+    QVector<QPair<const SegmentFile *, int>> coldSegments;  // file and index within it
+    QVector<quint64> coldIds;  // AqiSegment::id of each cold segment
+    QHash<qint64, int> openSegments;  // bucket -> index of its open segment
+    qint64 bucketLength;
+    qint64 newestBucket = std::numeric_limits<qint64>::min();
+    qint64 rows = 0;
+    quint64 changes = 0;
+};
+
+#endif
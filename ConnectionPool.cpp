@@ -0,0 +1,233 @@
+#include "ConnectionPool.h"
+#include <QDebug>
+
+namespace {
+const int InitialBackoffMs = 100;
+const int MaxBackoffMs = 5000;
+const int MaxFailures = 8;  // queued frames are dropped after this many failed reconnects
+}
+
+ConnectionPool::ConnectionPool(QObject *parent, int idleTimeoutMs)
+    : QObject(parent), idleTimeout(idleTimeoutMs) {
+    connect(&idleTimer, &QTimer::timeout, this, &ConnectionPool::closeIdleConnections);
+    idleTimer.start(qMax(1000, idleTimeout / 2));
+}
+
+ConnectionPool::~ConnectionPool() {
+    for (Peer &peer : peers) {
+        if (peer.socket) {
+            peer.socket->disconnect(this);
+        }
+    }
+}
+
+QString ConnectionPool::key(const QString &host, quint16 port) {
+    return host + ':' + QString::number(port);
+}
+
+void ConnectionPool::send(const QString &host, quint16 port, const QByteArray &payload, int tag) {
+    const QString peerKey = key(host, port);
+    Peer &peer = peers[peerKey];
+    if (peer.host.isEmpty()) {
+        peer.host = host;
+        peer.port = port;
+        const Metrics::Labels labels{{"peer", peerKey}};
+        peer.bytesSent = &Metrics::Registry::global().counter(
+            "aqi_peer_bytes_sent_total", "Bytes written to a peer on pooled connections.", labels);
+        peer.bytesReceived = &Metrics::Registry::global().counter(
+            "aqi_peer_bytes_received_total", "Bytes read from a peer on pooled connections.", labels);
+    }
+    peer.lastUsed.start();
+
+    QByteArray frame = MessageFraming::frame(payload);
+    if (peer.socket && peer.socket->state() == QAbstractSocket::ConnectedState) {
+        peer.socket->write(frame);
+        peer.bytesSent->add(frame.size());
+        ++sent;
+        return;
+    }
+
+    peer.queuedBytes += frame.size();
+    peer.queue.append(Frame{frame, tag});
+    QList<int> lost;
+    while (peer.queuedBytes > MaxQueuedBytes && peer.queue.size() > 1) {
+        const Frame oldest = peer.queue.takeFirst();
+        peer.queuedBytes -= oldest.bytes.size();
+        ++dropped;
+        if (oldest.tag != 0) {
+            lost.append(oldest.tag);
+        }
+    }
+    if (!peer.socket && !peer.reconnectScheduled) {
+        connectPeer(peer);
+    }
+    if (!lost.isEmpty()) {
+        emit framesLost(host, port, lost);
+    }
+}
+
+QSet<int> ConnectionPool::queuedTags(const QString &host, quint16 port) const {
+    QSet<int> tags;
+    auto it = peers.constFind(key(host, port));
+    if (it != peers.constEnd()) {
+        for (const Frame &frame : it->queue) {
+            if (frame.tag != 0) {
+                tags.insert(frame.tag);
+            }
+        }
+    }
+    return tags;
+}
+
+int ConnectionPool::openConnections() const {
+    int count = 0;
+    for (const Peer &peer : peers) {
+        if (peer.socket) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void ConnectionPool::connectPeer(Peer &peer) {
+    const QString peerKey = key(peer.host, peer.port);
+    QTcpSocket *socket = new QTcpSocket(this);
+    peer.socket = socket;
+    peer.reader = FrameReader();
+    connect(socket, &QTcpSocket::connected, this, [this, peerKey] { onConnected(peerKey); });
+    connect(socket, &QTcpSocket::readyRead, this, [this, peerKey] { onReadyRead(peerKey); });
+    // Covers both a refused connect and a drop after connecting.
+    connect(socket, &QAbstractSocket::stateChanged, this, [this, peerKey](QAbstractSocket::SocketState state) {
+        if (state == QAbstractSocket::UnconnectedState) {
+            onDisconnected(peerKey);
+        }
+    });
+    if (!localAddress.isNull()) {
+        socket->bind(localAddress);
+    }
+    socket->connectToHost(peer.host, peer.port);
+    ++opened;
+}
+
+void ConnectionPool::flush(Peer &peer) {
+    for (const Frame &frame : peer.queue) {
+        peer.socket->write(frame.bytes);
+    }
+    peer.bytesSent->add(peer.queuedBytes);
+    sent += peer.queue.size();
+    peer.queue.clear();
+    peer.queuedBytes = 0;
+}
+
+void ConnectionPool::onConnected(const QString &peerKey) {
+    auto it = peers.find(peerKey);
+    if (it == peers.end() || !it->socket) {
+        return;
+    }
+    it->socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    it->socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+    it->failures = 0;
+    flush(*it);
+    const QString host = it->host;
+    const quint16 port = it->port;
+    emit peerConnected(host, port);
+}
+
+void ConnectionPool::onReadyRead(const QString &peerKey) {
+    auto it = peers.find(peerKey);
+    if (it == peers.end() || !it->socket) {
+        return;
+    }
+    it->bytesReceived->add(it->socket->bytesAvailable());
+    it->reader.readFrom(it->socket);
+    // Handlers may send, and so add or remove peers, which moves or frees what it
+    // points to; the peer is looked up again after every frame.
+    const QString host = it->host;
+    const quint16 port = it->port;
+    QByteArray payload;
+    while (it->reader.nextFrame(payload)) {
+        emit frameReceived(host, port, payload);
+        it = peers.find(peerKey);
+        if (it == peers.end() || !it->socket) {
+            return;
+        }
+    }
+    if (it->reader.hasError()) {
+        qDebug() << "ConnectionPool: dropping connection with malformed frame:" << peerKey;
+        it->socket->abort();
+    }
+}
+
+void ConnectionPool::dropSocket(Peer &peer) {
+    if (peer.socket) {
+        peer.socket->disconnect(this);
+        peer.socket->abort();
+        peer.socket->deleteLater();
+        peer.socket = nullptr;
+    }
+}
+
+void ConnectionPool::onDisconnected(const QString &peerKey) {
+    auto it = peers.find(peerKey);
+    if (it == peers.end() || !it->socket) {
+        return;
+    }
+    // Frames already handed to the old socket are lost with it; only queued ones are retried.
+    dropSocket(*it);
+    const QString host = it->host;
+    const quint16 port = it->port;
+    emit peerDisconnected(host, port);
+    it = peers.find(peerKey);  // handlers may have added or removed peers
+    if (it == peers.end() || it->socket || it->queue.isEmpty()) {
+        return;
+    }
+    if (++it->failures > MaxFailures) {
+        qDebug() << "ConnectionPool: giving up on" << peerKey << "after" << MaxFailures
+                 << "attempts, dropping" << it->queue.size() << "messages";
+        QList<int> lost;
+        for (const Frame &frame : it->queue) {
+            if (frame.tag != 0) {
+                lost.append(frame.tag);
+            }
+        }
+        dropped += it->queue.size();
+        it->queue.clear();
+        it->queuedBytes = 0;
+        it->failures = 0;
+        if (!lost.isEmpty()) {
+            emit framesLost(host, port, lost);
+        }
+        return;
+    }
+    const int delay = qMin(MaxBackoffMs, InitialBackoffMs << (it->failures - 1));
+    it->reconnectScheduled = true;
+    QTimer::singleShot(delay, this, [this, peerKey] {
+        auto peer = peers.find(peerKey);
+        if (peer == peers.end()) {
+            return;
+        }
+        peer->reconnectScheduled = false;
+        if (!peer->socket && !peer->queue.isEmpty()) {
+            connectPeer(*peer);
+        }
+    });
+}
+
+void ConnectionPool::closeIdleConnections() {
+    for (auto it = peers.begin(); it != peers.end();) {
+        Peer &peer = it.value();
+        const bool idle = peer.queue.isEmpty() && !peer.reconnectScheduled
+                          && (!peer.lastUsed.isValid() || peer.lastUsed.elapsed() > idleTimeout);
+        if (idle && (!peer.socket || peer.socket->bytesToWrite() == 0)) {
+            if (peer.socket) {
+                peer.socket->disconnect(this);
+                peer.socket->disconnectFromHost();
+                peer.socket->deleteLater();
+                peer.socket = nullptr;
+            }
+            it = peers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+#include <QSet>
+#include <QTcpSocket>
+#include <QTimer>
+#include "MessageFraming.h"
+#include "Metrics.h"
+
+// One persistent outgoing connection per peer (host:port). Messages sent while the
+// connection is being established are queued and flushed once it is up; a dropped
+// connection with queued messages is re-established with exponential backoff, and
+// connections idle for longer than the idle timeout are closed. Bytes in and out are
+// counted per peer in aqi_peer_bytes_{sent,received}_total. Frames sent with a
+// non-zero tag are reported through framesLost() if they are dropped before being
+// written, so that the caller can tell them apart from frames still awaiting delivery.
+class ConnectionPool : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr int DefaultIdleTimeoutMs = 60 * 1000;
+    static constexpr qint64 MaxQueuedBytes = 64 * 1024 * 1024;
+
+    explicit ConnectionPool(QObject *parent = nullptr, int idleTimeoutMs = DefaultIdleTimeoutMs);
+    ~ConnectionPool();
+
+    // Frames payload and sends it to host:port, connecting first if needed.
+    void send(const QString &host, quint16 port, const QByteArray &payload, int tag = 0);
+    // Tags of the frames still queued for host:port, which a reconnect will deliver.
+    QSet<int> queuedTags(const QString &host, quint16 port) const;
+    // Address outgoing connections are made from, so that peers see this node's own
+    // address when several nodes share a host (e.g. 127.0.0.N on loopback).
+    void setLocalAddress(const QHostAddress &address) { localAddress = address; }
+
+    int openConnections() const;
+    qint64 connectionsOpened() const { return opened; }
+    qint64 framesSent() const { return sent; }
+    qint64 framesDropped() const { return dropped; }
+
+signals:
+    // A frame the peer wrote back on a pooled connection.
+    void frameReceived(const QString &host, quint16 port, const QByteArray &payload);
+    void peerConnected(const QString &host, quint16 port);
+    // A connection attempt failed or an established connection dropped.
+    void peerDisconnected(const QString &host, quint16 port);
+    // Tagged frames that were dropped from the queue and will never be written: the
+    // queue outgrew MaxQueuedBytes, or the peer could not be reached.
+    void framesLost(const QString &host, quint16 port, const QList<int> &tags);
+
+private slots:
+    void closeIdleConnections();
+
+private:
+    struct Frame {
+        QByteArray bytes;
+        int tag = 0;
+    };
+
+    struct Peer {
+        QString host;
+        quint16 port = 0;
+        QTcpSocket *socket = nullptr;
+        FrameReader reader;
+        QList<Frame> queue;  // frames waiting for the connection
+        qint64 queuedBytes = 0;
+        int failures = 0;
+        bool reconnectScheduled = false;
+        QElapsedTimer lastUsed;
+        Metrics::Counter *bytesSent = nullptr;
+        Metrics::Counter *bytesReceived = nullptr;
+    };
+
+    static QString key(const QString &host, quint16 port);
+    void connectPeer(Peer &peer);
+    void flush(Peer &peer);
+    void onConnected(const QString &peerKey);
+    void onDisconnected(const QString &peerKey);
+    void onReadyRead(const QString &peerKey);
+    void dropSocket(Peer &peer);
+
+    QHash<QString, Peer> peers;
+    QHostAddress localAddress;  // null: chosen by the OS
+    QTimer idleTimer;
+    int idleTimeout;
+    qint64 opened = 0;
+    qint64 sent = 0;
+    qint64 dropped = 0;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <QJsonArray>
 #include <QDebug>
 #include <QThread>
+#include "MessageFraming.h"
 
 int main(int argc, char *argv[]) {
     QCoreApplication a(argc, argv);
@@ -73,25 +74,39 @@ int main(int argc, char *argv[]) {
     };
 
     // Send ingestion data
-    socket.write(QJsonDocument(ingestionRequest).toJson());
+    socket.write(MessageFraming::frame(QJsonDocument(ingestionRequest).toJson(QJsonDocument::Compact)));
     socket.flush();
     qDebug() << "Ingestion request sent.";
 
     QThread::sleep(3);
-    // Prepare a query request
-    QJsonArray queryParam = QJsonArray::fromVariantList({0});
+    // Prepare a query request: max and average PM2.5 AQI per area
+    QJsonObject querySpec{
+        {"filters", QJsonObject{{"pollutant", QJsonArray{"PM2.5"}}}},
+        {"groupBy", QJsonArray{"area"}},
+        {"aggregates", QJsonArray{"count", "max(aqi)", "avg(aqi)", "p95(aqi)"}}
+    };
     QJsonObject queryRequest{
         {"requestType", "query"},
-        {"param", queryParam}
+        {"query", querySpec}
     };
 
     // Send query request
-    socket.write(QJsonDocument(queryRequest).toJson());
+    socket.write(MessageFraming::frame(QJsonDocument(queryRequest).toJson(QJsonDocument::Compact)));
     socket.flush();
     qDebug() << "Query request sent.";
     if (!socket.waitForBytesWritten(5000)) {
         qDebug() << "Failed to write data.";
     }
 
+    // The merged answer comes back on the same connection.
+    FrameReader reader;
+    QObject::connect(&socket, &QTcpSocket::readyRead, [&socket, &reader]() {
+        reader.readFrom(&socket);
+        QByteArray payload;
+        while (reader.nextFrame(payload)) {
+            qDebug().noquote() << "Response:" << QJsonDocument::fromJson(payload).toJson(QJsonDocument::Indented);
+        }
+    });
+
     return a.exec();
 }
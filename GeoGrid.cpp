@@ -0,0 +1,112 @@
+#include "GeoGrid.h"
+#include <cmath>
+
+namespace {
+
+constexpr double Pi = 3.14159265358979323846;
+constexpr double Radians = Pi / 180;
+const char Base32[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+double haversine(double latitude1, double longitude1, double cosLatitude1, double latitude2, double longitude2) {
+    const double dLatitude = std::sin((latitude2 - latitude1) * Radians / 2);
+    const double dLongitude = std::sin((longitude2 - longitude1) * Radians / 2);
+    return dLatitude * dLatitude + cosLatitude1 * std::cos(latitude2 * Radians) * dLongitude * dLongitude;
+}
+
+}
+
+GeoCircle::GeoCircle(double latitude, double longitude, double radiusKm)
+    : latitude(latitude), longitude(longitude), radiusKm(radiusKm), cosLatitude(std::cos(latitude * Radians)) {
+    const double angle = qMax(0.0, radiusKm) / GeoGrid::EarthRadiusKm;
+    const double half = std::sin(qMin(angle, Pi) / 2);
+    haversineLimit = half * half;
+
+    const double dLatitude = angle / Radians;
+    box.minLatitude = qMax(-90.0, latitude - dLatitude);
+    box.maxLatitude = qMin(90.0, latitude + dLatitude);
+    box.minLongitude = -180;
+    box.maxLongitude = 180;
+    const double spread = cosLatitude > 0 ? std::sin(angle) / cosLatitude : 2;
+    if (box.minLatitude > -90 && box.maxLatitude < 90 && angle < Pi / 2 && spread < 1) {
+        const double dLongitude = std::asin(spread) / Radians;
+        box.minLongitude = qMax(-180.0, longitude - dLongitude);
+        box.maxLongitude = qMin(180.0, longitude + dLongitude);
+    }
+}
+
+bool GeoCircle::contains(double pointLatitude, double pointLongitude) const {
+    return haversine(latitude, longitude, cosLatitude, pointLatitude, pointLongitude) <= haversineLimit;
+}
+
+bool GeoCircle::covers(const GeoBox &area) const {
+    if (!area.within(box)) {
+        return false;
+    }
+    // Corners bound the distance in a plane; on the sphere an edge along a parallel
+    // bows away from the pole by up to its sagitta, so that much is kept in reserve.
+    const double edgeLatitude = qMax(std::fabs(area.minLatitude), std::fabs(area.maxLatitude));
+    const double width = (area.maxLongitude - area.minLongitude) * Radians * GeoGrid::EarthRadiusKm
+                       * std::cos(qMin(std::fabs(area.minLatitude), std::fabs(area.maxLatitude)) * Radians);
+    const double sagitta = width * width * std::tan(qMin(edgeLatitude, 89.0) * Radians) / (8 * GeoGrid::EarthRadiusKm);
+    const double limit = radiusKm - sagitta;
+    const double corners[4][2] = {{area.minLatitude, area.minLongitude}, {area.minLatitude, area.maxLongitude},
+                                  {area.maxLatitude, area.minLongitude}, {area.maxLatitude, area.maxLongitude}};
+    for (const auto &corner : corners) {
+        if (GeoGrid::distanceKm(latitude, longitude, corner[0], corner[1]) > limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+quint64 GeoGrid::cell(double latitude, double longitude, int precision) {
+    const int bits = 5 * qBound(1, precision, MaxPrecision);
+    double minLatitude = -90, maxLatitude = 90, minLongitude = -180, maxLongitude = 180;
+    quint64 id = 0;
+    for (int bit = 0; bit < bits; ++bit) {
+        // Even bits split longitude, odd bits latitude; the upper half sets the bit.
+        double &low = bit % 2 == 0 ? minLongitude : minLatitude;
+        double &high = bit % 2 == 0 ? maxLongitude : maxLatitude;
+        const double value = bit % 2 == 0 ? longitude : latitude;
+        const double middle = (low + high) / 2;
+        id <<= 1;
+        if (value >= middle) {
+            id |= 1;
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return id;
+}
+
+GeoBox GeoGrid::bounds(quint64 cell, int precision) {
+    const int bits = 5 * qBound(1, precision, MaxPrecision);
+    GeoBox box{-90, -180, 90, 180};
+    for (int bit = 0; bit < bits; ++bit) {
+        double &low = bit % 2 == 0 ? box.minLongitude : box.minLatitude;
+        double &high = bit % 2 == 0 ? box.maxLongitude : box.maxLatitude;
+        const double middle = (low + high) / 2;
+        if ((cell >> (bits - 1 - bit)) & 1) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return box;
+}
+
+QString GeoGrid::name(quint64 cell, int precision) {
+    precision = qBound(1, precision, MaxPrecision);
+    QString text(precision, QChar('0'));
+    for (int i = precision - 1; i >= 0; --i) {
+        text[i] = QChar(Base32[cell & 31]);
+        cell >>= 5;
+    }
+    return text;
+}
+
+double GeoGrid::distanceKm(double latitude1, double longitude1, double latitude2, double longitude2) {
+    const double a = haversine(latitude1, longitude1, std::cos(latitude1 * Radians), latitude2, longitude2);
+    return 2 * EarthRadiusKm * std::asin(std::sqrt(qMin(1.0, a)));
+}
@@ -0,0 +1,72 @@
+#ifndef GEOGRID_H
+#define GEOGRID_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Latitude/longitude rectangle, in degrees. Does not wrap across the antimeridian.
+struct GeoBox {
+    double minLatitude = 0, minLongitude = 0, maxLatitude = 0, maxLongitude = 0;
+
+    bool contains(double latitude, double longitude) const {
+        return latitude >= minLatitude && latitude <= maxLatitude && longitude >= minLongitude
+            && longitude <= maxLongitude;
+    }
+    bool overlaps(const GeoBox &other) const {
+        return maxLatitude >= other.minLatitude && minLatitude <= other.maxLatitude
+            && maxLongitude >= other.minLongitude && minLongitude <= other.maxLongitude;
+    }
+    bool within(const GeoBox &other) const {
+        return minLatitude >= other.minLatitude && maxLatitude <= other.maxLatitude
+            && minLongitude >= other.minLongitude && maxLongitude <= other.maxLongitude;
+    }
+};
+
+// Points within radiusKm (great-circle distance) of a center.
+struct GeoCircle {
+    GeoCircle() = default;
+    GeoCircle(double latitude, double longitude, double radiusKm);
+
+    bool contains(double latitude, double longitude) const;
+    // Smallest box holding the circle.
+    GeoBox bounds() const { return box; }
+    // Whether every point of area lies inside the circle. Conservative: a box close
+    // to the rim may be reported as not inside.
+    bool covers(const GeoBox &area) const;
+
+    double latitude = 0, longitude = 0, radiusKm = 0;
+
+private:
+    double cosLatitude = 1;
+    double haversineLimit = 0;  // sin²(d / 2R) of the radius
+    GeoBox box;
+};
+
+/*
+ * Geohash cells: the world halved alternately by longitude and latitude, five
+ * halvings per base-32 character. A cell is kept as its 5 * precision bits, so a
+ * cell's parent at a lower precision is a right shift away.
+ *
+ *   precision   cell size at 40° N, east-west x north-south
+ *   3           ~120 km x 156 km
+ *   4           ~30 km x 20 km
+ *   5           ~3.7 km x 4.9 km
+ */
+namespace GeoGrid {
+    constexpr int MaxPrecision = 12;
+    // Cells the segment indexes summarise rows by.
+    constexpr int IndexPrecision = 4;
+    constexpr double EarthRadiusKm = 6371.0088;
+
+    quint64 cell(double latitude, double longitude, int precision);
+    GeoBox bounds(quint64 cell, int precision);
+    inline quint64 parent(quint64 cell, int precision, int parentPrecision) {
+        return cell >> (5 * (precision - parentPrecision));
+    }
+    // Base-32 geohash text of a cell, e.g. "9q8y".
+    QString name(quint64 cell, int precision);
+
+    double distanceKm(double latitude1, double longitude1, double latitude2, double longitude2);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include "IngestQueue.h"
+
+IngestQueue::IngestQueue(const Options &options) : options(options) {
+}
+
+IngestQueue::Destination &IngestQueue::destination(const QString &name) {
+    auto it = destinations.find(name);
+    if (it == destinations.end()) {
+        it = destinations.insert(name, Destination());
+        it->window = options.windowRows;
+    }
+    return it.value();
+}
+
+bool IngestQueue::push(const QString &name, int id, const QByteArray &payload, int rows) {
+    if (isFull() && options.policy == Policy::Shed) {
+        ++shedBatches;
+        shedRows += rows;
+        return false;
+    }
+    Destination &target = destination(name);
+    target.backlog.append(Batch{id, payload, rows});
+    target.queuedRows += rows;
+    queued += rows;
+    peakQueued = qMax(peakQueued, queued);
+    return true;
+}
+
+QList<IngestQueue::Batch> IngestQueue::takeSendable(const QString &name) {
+    QList<Batch> sendable;
+    Destination &target = destination(name);
+    while (!target.backlog.isEmpty()
+           && (target.inFlightRows == 0 || target.inFlightRows + target.backlog.first().rows <= target.window)) {
+        Batch batch = target.backlog.takeFirst();
+        target.queuedRows -= batch.rows;
+        queued -= batch.rows;
+        target.inFlight.insert(batch.id, batch.rows);
+        target.inFlightRows += batch.rows;
+        sendable.append(batch);
+    }
+    return sendable;
+}
+
+void IngestQueue::acknowledge(const QString &name, int id, qint64 credits) {
+    Destination &target = destination(name);
+    target.inFlightRows -= target.inFlight.take(id);
+    if (credits >= 0) {
+        target.window = credits;
+    }
+}
+
+QList<int> IngestQueue::inFlight(const QString &name) const {
+    auto it = destinations.constFind(name);
+    return it == destinations.constEnd() ? QList<int>() : it->inFlight.keys();
+}
+
+QJsonObject IngestQueue::metrics() const {
+    qint64 inFlight = 0;
+    QJsonObject perDestination;
+    for (auto it = destinations.constBegin(); it != destinations.constEnd(); ++it) {
+        inFlight += it->inFlightRows;
+        perDestination[it.key()] = QJsonObject{
+            {"queuedRows", static_cast<double>(it->queuedRows)},
+            {"inFlightRows", static_cast<double>(it->inFlightRows)},
+            {"window", static_cast<double>(it->window)}
+        };
+    }
+    return QJsonObject{
+        {"policy", policyName(options.policy)},
+        {"queuedRows", static_cast<double>(queued)},
+        {"peakQueuedRows", static_cast<double>(peakQueued)},
+        {"maxQueuedRows", static_cast<double>(options.maxQueuedRows)},
+        {"inFlightRows", static_cast<double>(inFlight)},
+        {"shedBatches", static_cast<double>(shedBatches)},
+        {"shedRows", static_cast<double>(shedRows)},
+        {"delays", static_cast<double>(delays)},
+        {"destinations", perDestination}
+    };
+}
+
+QString IngestQueue::policyName(Policy policy) {
+    return policy == Policy::Shed ? "shed" : "delay";
+}
+
+IngestQueue::Policy IngestQueue::policyFromName(const QString &name) {
+    return name.trimmed().toLower() == "shed" ? Policy::Shed : Policy::Delay;
+}
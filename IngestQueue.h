@@ -0,0 +1,84 @@
+#ifndef INGESTQUEUE_H
+#define INGESTQUEUE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+
+// Flow control for ingested batches forwarded to downstream nodes. Each destination
+// grants a window of rows that may be sent but not yet acknowledged (its credits);
+// acknowledgments return credits and may resize the window. Batches beyond the window
+// wait in a backlog bounded in rows across all destinations. Once the backlog is full
+// Policy::Shed refuses new batches, while Policy::Delay accepts them and the caller
+// stops reading from its own upstream until the backlog drains below half.
+class IngestQueue {
+public:
+    enum class Policy { Delay, Shed };
+
+    struct Options {
+        qint64 windowRows = 256 * 1024;     // credits a destination starts with
+        qint64 maxQueuedRows = 1024 * 1024;  // backlog bound
+        Policy policy = Policy::Delay;
+    };
+
+    struct Batch {
+        int id = 0;
+        QByteArray payload;
+        int rows = 0;
+    };
+
+    explicit IngestQueue(const Options &options = Options());
+
+    // Queues a batch for destination; false when the backlog is full and it was shed.
+    bool push(const QString &destination, int id, const QByteArray &payload, int rows);
+    // Removes and returns the batches that fit the destination's window; they count as
+    // in flight until acknowledged. A destination with nothing in flight always gets
+    // its next batch, so a zero window cannot stall it.
+    QList<Batch> takeSendable(const QString &destination);
+    // The destination has stored (or shed) batch id, or the batch was lost on the way;
+    // credits >= 0 replace its window.
+    void acknowledge(const QString &destination, int id, qint64 credits = -1);
+    // Ids of the batches sent to destination and not yet acknowledged.
+    QList<int> inFlight(const QString &destination) const;
+
+    bool isFull() const { return queued >= options.maxQueuedRows; }
+    bool canResume() const { return queued <= options.maxQueuedRows / 2; }
+    // Rows this node can still take from upstream, advertised as credits in its acks.
+    qint64 freeRows() const { return qMax<qint64>(0, options.maxQueuedRows - queued); }
+    qint64 queuedRows() const { return queued; }
+    Policy policy() const { return options.policy; }
+    void setPolicy(Policy policy) { options.policy = policy; }
+    // Counts a pause of upstream reading under Policy::Delay, for metrics().
+    void countDelay() { ++delays; }
+
+    // {"policy", "queuedRows", "peakQueuedRows", "maxQueuedRows", "inFlightRows", "shedBatches",
+    //  "shedRows", "delays", "destinations": {name: {"queuedRows", "inFlightRows", "window"}}}
+    QJsonObject metrics() const;
+
+    static QString policyName(Policy policy);
+    // "shed" or "delay"; anything else is Delay.
+    static Policy policyFromName(const QString &name);
+
+private:
+    struct Destination {
+        QList<Batch> backlog;
+        QHash<int, int> inFlight;  // batch id -> rows
+        qint64 queuedRows = 0;
+        qint64 inFlightRows = 0;
+        qint64 window = 0;
+    };
+
+    Destination &destination(const QString &name);
+
+    Options options;
+    QHash<QString, Destination> destinations;
+    qint64 queued = 0;
+    qint64 peakQueued = 0;
+    qint64 shedBatches = 0;
+    qint64 shedRows = 0;
+    qint64 delays = 0;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include "InvertedIndex.h"
+#include "ColumnStore.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+void RowBitmap::add(quint16 row) {
+    if (dense()) {
+        quint64 &word = words[row >> 6];
+        const quint64 bit = quint64(1) << (row & 63);
+        count += (word & bit) ? 0 : 1;
+        word |= bit;
+        return;
+    }
+    if (!sparse.isEmpty() && sparse.constLast() >= row) {
+        return;  // out of order or repeated; both are caller bugs or no-ops
+    }
+    sparse.append(row);
+    ++count;
+    if (count > ArrayLimit) {
+        makeDense();
+    }
+}
+
+bool RowBitmap::contains(quint16 row) const {
+    if (dense()) {
+        return words[row >> 6] & (quint64(1) << (row & 63));
+    }
+    return std::binary_search(sparse.cbegin(), sparse.cend(), row);
+}
+
+void RowBitmap::makeDense() {
+    words.fill(0, Words);
+    for (quint16 row : qAsConst(sparse)) {
+        words[row >> 6] |= quint64(1) << (row & 63);
+    }
+    sparse = QVector<quint16>();
+}
+
+void RowBitmap::makeSparseIfSmall() {
+    if (!dense() || count > ArrayLimit) {
+        return;
+    }
+    QVector<quint16> rows;
+    rows.reserve(count);
+    for (int i = 0; i < Words; ++i) {
+        quint64 word = words[i];
+        while (word) {
+            rows.append(quint16(i * 64 + int(qCountTrailingZeroBits(word))));
+            word &= word - 1;
+        }
+    }
+    sparse = rows;
+    words = QVector<quint64>();
+}
+
+RowBitmap RowBitmap::intersect(const RowBitmap &a, const RowBitmap &b) {
+    RowBitmap out;
+    if (!a.dense() && !b.dense()) {
+        out.sparse.reserve(qMin(a.count, b.count));
+        std::set_intersection(a.sparse.cbegin(), a.sparse.cend(), b.sparse.cbegin(), b.sparse.cend(),
+                              std::back_inserter(out.sparse));
+        out.count = out.sparse.size();
+        return out;
+    }
+    if (!a.dense() || !b.dense()) {
+        // Probe the bitset with each entry of the array.
+        const RowBitmap &small = a.dense() ? b : a;
+        const RowBitmap &large = a.dense() ? a : b;
+        out.sparse.reserve(small.count);
+        for (quint16 row : small.sparse) {
+            if (large.contains(row)) {
+                out.sparse.append(row);
+            }
+        }
+        out.count = out.sparse.size();
+        return out;
+    }
+    out.words.resize(Words);
+    for (int i = 0; i < Words; ++i) {
+        out.words[i] = a.words[i] & b.words[i];
+        out.count += int(qPopulationCount(out.words[i]));
+    }
+    out.makeSparseIfSmall();
+    return out;
+}
+
+RowBitmap RowBitmap::unite(const RowBitmap &a, const RowBitmap &b) {
+    RowBitmap out;
+    if (!a.dense() && !b.dense() && a.count + b.count <= ArrayLimit) {
+        out.sparse.reserve(a.count + b.count);
+        std::set_union(a.sparse.cbegin(), a.sparse.cend(), b.sparse.cbegin(), b.sparse.cend(),
+                       std::back_inserter(out.sparse));
+        out.count = out.sparse.size();
+        return out;
+    }
+    out = a;
+    if (!out.dense()) {
+        out.makeDense();
+    }
+    if (b.dense()) {
+        for (int i = 0; i < Words; ++i) {
+            out.words[i] |= b.words[i];
+        }
+    } else {
+        for (quint16 row : b.sparse) {
+            out.words[row >> 6] |= quint64(1) << (row & 63);
+        }
+    }
+    out.count = 0;
+    for (quint64 word : qAsConst(out.words)) {
+        out.count += int(qPopulationCount(word));
+    }
+    out.makeSparseIfSmall();
+    return out;
+}
+
+RowBitmap RowBitmap::unite(const QVector<const RowBitmap *> &lists) {
+    RowBitmap out;
+    if (lists.size() == 1) {
+        out = *lists.first();
+        return out;
+    }
+    qint64 total = 0;
+    bool anyDense = false;
+    for (const RowBitmap *list : lists) {
+        total += list->count;
+        anyDense = anyDense || list->dense();
+    }
+    if (!anyDense && total <= ArrayLimit) {
+        out.sparse.reserve(int(total));
+        for (const RowBitmap *list : lists) {
+            out.sparse += list->sparse;
+        }
+        std::sort(out.sparse.begin(), out.sparse.end());
+        out.sparse.erase(std::unique(out.sparse.begin(), out.sparse.end()), out.sparse.end());
+        out.count = out.sparse.size();
+        return out;
+    }
+    out.words.fill(0, Words);
+    for (const RowBitmap *list : lists) {
+        if (list->dense()) {
+            for (int i = 0; i < Words; ++i) {
+                out.words[i] |= list->words[i];
+            }
+        } else {
+            for (quint16 row : list->sparse) {
+                out.words[row >> 6] |= quint64(1) << (row & 63);
+            }
+        }
+    }
+    for (quint64 word : qAsConst(out.words)) {
+        out.count += int(qPopulationCount(word));
+    }
+    out.makeSparseIfSmall();
+    return out;
+}
+
+void RowBitmap::fillMask(quint8 *mask, int rows) const {
+    if (!dense()) {
+        std::memset(mask, 0, size_t(rows));
+        for (quint16 row : sparse) {
+            if (row >= rows) {
+                break;
+            }
+            mask[row] = 1;
+        }
+        return;
+    }
+    for (int row = 0; row < rows; ++row) {
+        mask[row] = quint8((words[row >> 6] >> (row & 63)) & 1);
+    }
+}
+
+qint64 RowBitmap::memoryUsage() const {
+    return qint64(sizeof(RowBitmap)) + qint64(sparse.capacity()) * qint64(sizeof(quint16)) +
+           qint64(words.capacity()) * qint64(sizeof(quint64));
+}
+
+QSharedPointer<const SegmentIndex> SegmentIndex::build(const AqiSegment &segment) {
+    QSharedPointer<SegmentIndex> index = QSharedPointer<SegmentIndex>::create();
+    const int rows = segment.size();
+    const quint32 *columns[ColumnCount] = {segment.area.constData(), segment.station.constData(),
+                                           segment.pollutant.constData()};
+    for (int column = 0; column < ColumnCount; ++column) {
+        const quint32 *codes = columns[column];
+        // Rows come in order, and runs of one code are common (a station's upload), so
+        // the slot of the last code is kept at hand.
+        QHash<quint32, int> slots;
+        std::vector<RowBitmap> lists;
+        int last = -1;
+        quint32 lastCode = 0;
+        for (int row = 0; row < rows; ++row) {
+            if (last < 0 || codes[row] != lastCode) {
+                lastCode = codes[row];
+                auto found = slots.constFind(lastCode);
+                if (found == slots.cend()) {
+                    found = slots.insert(lastCode, int(lists.size()));
+                    lists.emplace_back();
+                }
+                last = found.value();
+            }
+            lists[size_t(last)].add(quint16(row));
+        }
+        QHash<quint32, RowBitmap> &postings = index->postings[column];
+        postings.reserve(slots.size());
+        for (auto slot = slots.cbegin(); slot != slots.cend(); ++slot) {
+            RowBitmap &list = lists[size_t(slot.value())];
+            list.squeeze();
+            postings.insert(slot.key(), std::move(list));
+        }
+    }
+
+    auto fold = [](AggregationKernels::Aggregate &aggregate, double value) {
+        aggregate.sum += value;
+        aggregate.min = qMin(aggregate.min, value);
+        aggregate.max = qMax(aggregate.max, value);
+        ++aggregate.count;
+    };
+    // A station's readings share its coordinates, so consecutive rows mostly fall in
+    // the cell of the row before.
+    CellSummary *summary = nullptr;
+    quint64 lastCell = 0;
+    double lastLatitude = std::numeric_limits<double>::quiet_NaN(), lastLongitude = 0;
+    for (int row = 0; row < rows; ++row) {
+        const double latitude = segment.latitude[row];
+        const double longitude = segment.longitude[row];
+        if (!summary || latitude != lastLatitude || longitude != lastLongitude) {
+            const quint64 cell = GeoGrid::cell(latitude, longitude, GeoGrid::IndexPrecision);
+            if (!summary || cell != lastCell) {
+                auto found = index->cellSummaries.find(cell);
+                if (found == index->cellSummaries.end()) {
+                    found = index->cellSummaries.insert(cell, CellSummary());
+                    found->bounds = GeoBox{latitude, longitude, latitude, longitude};
+                }
+                summary = &found.value();
+                lastCell = cell;
+            }
+            lastLatitude = latitude;
+            lastLongitude = longitude;
+            GeoBox &bounds = summary->bounds;
+            bounds.minLatitude = qMin(bounds.minLatitude, latitude);
+            bounds.maxLatitude = qMax(bounds.maxLatitude, latitude);
+            bounds.minLongitude = qMin(bounds.minLongitude, longitude);
+            bounds.maxLongitude = qMax(bounds.maxLongitude, longitude);
+        }
+        summary->rows.add(quint16(row));
+        fold(summary->aqi, segment.aqi[row]);
+        fold(summary->concentration, segment.concentration[row]);
+    }
+    for (CellSummary &cell : index->cellSummaries) {
+        cell.rows.squeeze();
+    }
+    return index;
+}
+
+RowBitmap SegmentIndex::rows(Column column, const QVector<quint32> &codes) const {
+    const QHash<quint32, RowBitmap> &lists = postings[column];
+    QVector<const RowBitmap *> matches;
+    for (quint32 code : codes) {
+        auto found = lists.constFind(code);
+        if (found != lists.cend()) {
+            matches.append(&found.value());
+        }
+    }
+    return matches.isEmpty() ? RowBitmap() : RowBitmap::unite(matches);
+}
+
+qint64 SegmentIndex::memoryUsage() const {
+    qint64 bytes = sizeof(SegmentIndex);
+    for (const QHash<quint32, RowBitmap> &lists : postings) {
+        // hash node: key, value and a next pointer
+        bytes += qint64(lists.size()) * qint64(sizeof(void *) + sizeof(quint32));
+        for (const RowBitmap &list : lists) {
+            bytes += list.memoryUsage();
+        }
+    }
+    for (const CellSummary &cell : cellSummaries) {
+        bytes += qint64(sizeof(void *) + sizeof(quint64) + sizeof(CellSummary) - sizeof(RowBitmap))
+               + cell.rows.memoryUsage();
+    }
+    return bytes;
+}
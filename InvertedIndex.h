@@ -0,0 +1,92 @@
+#ifndef INVERTEDINDEX_H
+#define INVERTEDINDEX_H
+
+#include <QHash>
+#include <QSharedPointer>
+#include <QVector>
+#include <QtAlgorithms>
+#include "AggregationKernels.h"
+#include "GeoGrid.h"
+
+// Set of row numbers within one segment (below 65536), kept like a roaring bitmap
+// container: a sorted array of 16-bit rows while it holds at most ArrayLimit of them,
+// a 64K-bit bitset beyond that. Either way it costs at most 8 KB, and intersecting
+// sparse lists walks only their entries.
+class RowBitmap {
+public:
+    static constexpr int ArrayLimit = 4096;
+    static constexpr int Words = 65536 / 64;
+
+    // Rows must be added in ascending order.
+    void add(quint16 row);
+    int cardinality() const { return count; }
+    bool isEmpty() const { return count == 0; }
+    bool contains(quint16 row) const;
+
+    static RowBitmap intersect(const RowBitmap &a, const RowBitmap &b);
+    static RowBitmap unite(const RowBitmap &a, const RowBitmap &b);
+    // One pass over all lists rather than a chain of pairwise unions.
+    static RowBitmap unite(const QVector<const RowBitmap *> &lists);
+    // mask[row] = 1 for every row in the set, 0 for the others below rows.
+    void fillMask(quint8 *mask, int rows) const;
+    // Calls f(row) for every row in ascending order.
+    template <typename F>
+    void forEach(F f) const {
+        if (!dense()) {
+            for (quint16 row : sparse) {
+                f(row);
+            }
+            return;
+        }
+        for (int i = 0; i < Words; ++i) {
+            for (quint64 word = words[i]; word; word &= word - 1) {
+                f(quint16(i * 64 + int(qCountTrailingZeroBits(word))));
+            }
+        }
+    }
+    void squeeze() { sparse.squeeze(); }
+    qint64 memoryUsage() const;
+
+private:
+    bool dense() const { return !words.isEmpty(); }
+    void makeDense();
+    void makeSparseIfSmall();
+
+    QVector<quint16> sparse;  // sorted, while count <= ArrayLimit
+    QVector<quint64> words;   // Words bits once dense
+    int count = 0;
+};
+
+struct AqiSegment;
+
+// Rows of one segment in one GeoGrid cell at IndexPrecision.
+struct CellSummary {
+    RowBitmap rows;
+    GeoBox bounds;  // of the readings themselves, usually far smaller than the cell
+    AggregationKernels::Aggregate aqi;
+    AggregationKernels::Aggregate concentration;
+};
+
+// Posting lists of one sealed segment: for the area, station and pollutant columns,
+// the rows holding each dictionary code. An equality filter is then the union of
+// its codes' lists, and a conjunction their intersection, found before any column
+// is read. Rows are also listed by grid cell with per-cell aggregates, so a region
+// query reads only cells on its edge row by row and takes those inside whole.
+class SegmentIndex {
+public:
+    enum Column { Area, Station, Pollutant };
+    static constexpr int ColumnCount = 3;
+
+    static QSharedPointer<const SegmentIndex> build(const AqiSegment &segment);
+
+    // Rows whose column holds any of codes.
+    RowBitmap rows(Column column, const QVector<quint32> &codes) const;
+    const QHash<quint64, CellSummary> &cells() const { return cellSummaries; }
+    qint64 memoryUsage() const;
+
+private:
+    QHash<quint32, RowBitmap> postings[ColumnCount];
+    QHash<quint64, CellSummary> cellSummaries;
+};
+
+#endif
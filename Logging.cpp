@@ -0,0 +1,27 @@
+#include "Logging.h"
+
+// Info and above are on by default; debug needs a rule.
+Q_LOGGING_CATEGORY(lcIngest, "aqi.ingest", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcQuery, "aqi.query", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcCluster, "aqi.cluster", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcTrace, "aqi.trace", QtInfoMsg)
+
+namespace {
+QString currentRules;
+}
+
+namespace Logging {
+
+void setRules(const QString &rules) {
+    QString normalized = rules;
+    normalized.replace(';', '\n');
+    currentRules = normalized.trimmed();
+    // Rules from QT_LOGGING_RULES still take precedence over these.
+    QLoggingCategory::setFilterRules(currentRules);
+}
+
+QString rules() {
+    return currentRules;
+}
+
+}
@@ -0,0 +1,23 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <QLoggingCategory>
+#include <QString>
+
+// Per-message logging goes to these categories at debug level, which is off unless
+// turned on with QT_LOGGING_RULES or at runtime through Logging::setRules (the "log
+// level" message, or GET /log on the metrics endpoint). A disabled qCDebug does not
+// evaluate its arguments, so hot-path logging costs a flag check.
+Q_DECLARE_LOGGING_CATEGORY(lcIngest)   // "aqi.ingest": ingestion requests and batches
+Q_DECLARE_LOGGING_CATEGORY(lcQuery)    // "aqi.query": queries and their results
+Q_DECLARE_LOGGING_CATEGORY(lcCluster)  // "aqi.cluster": node messages and connections
+Q_DECLARE_LOGGING_CATEGORY(lcTrace)    // "aqi.trace": one line per finished span
+
+namespace Logging {
+// Replaces the rules set at runtime, e.g. "aqi.query.debug=true;aqi.ingest.debug=true"
+// (";" or newlines separate rules). An empty string reverts to the defaults.
+void setRules(const QString &rules);
+QString rules();
+}
+
+#endif
@@ -0,0 +1,70 @@
+#include "MessageFraming.h"
+#include <QtEndian>
+#include <cstring>
+
+QByteArray MessageFraming::frame(const QByteArray &payload) {
+    QByteArray &framed = buffer(Buffer::Frame, HeaderSize + payload.size());
+    framed.resize(HeaderSize + payload.size());
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), framed.data());
+    memcpy(framed.data() + HeaderSize, payload.constData(), payload.size());
+    return framed;
+}
+
+QByteArray &MessageFraming::buffer(Buffer which, int reserve) {
+    thread_local QByteArray buffers[2];
+    QByteArray &buffer = buffers[static_cast<int>(which)];
+    if (!buffer.isDetached() || buffer.capacity() > MaxPooledBytes) {
+        buffer = QByteArray();
+    }
+    buffer.reserve(reserve);  // reserved capacity also survives resize(0) on Qt 5
+    buffer.resize(0);
+    return buffer;
+}
+
+void FrameReader::compact() {
+    // Only the unconsumed tail is moved, and only once per read.
+    if (readOffset == 0) {
+        return;
+    }
+    if (readOffset >= buffer.size()) {
+        buffer.resize(0);  // keeps the allocation around for the next read
+    } else {
+        buffer.remove(0, readOffset);
+    }
+    readOffset = 0;
+}
+
+void FrameReader::readFrom(QIODevice *device) {
+    compact();
+    qint64 available = device->bytesAvailable();
+    if (available <= 0) {
+        return;
+    }
+    int oldSize = buffer.size();
+    buffer.resize(oldSize + static_cast<int>(available));
+    qint64 bytesRead = device->read(buffer.data() + oldSize, available);
+    buffer.resize(oldSize + static_cast<int>(qMax<qint64>(bytesRead, 0)));
+}
+
+void FrameReader::append(const QByteArray &data) {
+    compact();
+    buffer.append(data);
+}
+
+bool FrameReader::nextFrame(QByteArray &payload) {
+    if (error || buffer.size() - readOffset < MessageFraming::HeaderSize) {
+        return false;
+    }
+    quint32 length = qFromBigEndian<quint32>(buffer.constData() + readOffset);
+    if (length > MessageFraming::MaxFrameSize) {
+        error = true;
+        return false;
+    }
+    if (buffer.size() - readOffset - MessageFraming::HeaderSize < static_cast<int>(length)) {
+        return false;
+    }
+    payload = QByteArray::fromRawData(buffer.constData() + readOffset + MessageFraming::HeaderSize,
+                                      static_cast<int>(length));
+    readOffset += MessageFraming::HeaderSize + static_cast<int>(length);
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef MESSAGEFRAMING_H
+#define MESSAGEFRAMING_H
+
+#include <QByteArray>
+#include <QIODevice>
+
+// Every message on the wire is a 4-byte big-endian payload length followed by the payload.
+namespace MessageFraming {
+    constexpr int HeaderSize = 4;
+    constexpr quint32 MaxFrameSize = 64 * 1024 * 1024;
+
+    QByteArray frame(const QByteArray &payload);
+
+    // Message buffers reused on each thread; a payload and its frame use separate ones.
+    enum class Buffer { Payload, Frame };
+    constexpr int MaxPooledBytes = 4 * 1024 * 1024;
+    // This thread's buffer, emptied, with room for at least reserve bytes. Callers
+    // return it by value: while a socket or queue still holds the last message built
+    // in it the next one detaches into a fresh allocation, otherwise its capacity is
+    // reused. Buffers grown past MaxPooledBytes are dropped rather than kept.
+    QByteArray &buffer(Buffer buffer, int reserve);
+}
+
+// Per-connection receive buffer. TCP may split or coalesce messages, so bytes are
+// accumulated here and complete frames are handed out one at a time.
+class FrameReader {
+public:
+    // Appends everything currently available on the device to the buffer.
+    void readFrom(QIODevice *device);
+    void append(const QByteArray &data);
+
+    // Returns the next complete frame as a view into the internal buffer. The view is
+    // only valid until the next readFrom()/append() call.
+    bool nextFrame(QByteArray &payload);
+
+    bool hasError() const { return error; }
+    int bufferedBytes() const { return buffer.size() - readOffset; }
+
+private:
+    void compact();
+
+    QByteArray buffer;
+    int readOffset = 0;
+    bool error = false;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "MetadataNode.h"
+#include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDateTime>
@@ -6,20 +7,82 @@
 #include <QNetworkInterface>
 #include <QTcpSocket>
 #include <QCryptographicHash>
-
-MetadataNode::MetadataNode(const QString &serverAddress, quint16 port, QObject *parent)
-    : QObject(parent), socket(new QTcpSocket(this)), server(new QTcpServer(this)), myId(10), electionInitiated(false)
+#include "Logging.h"
+#include "MetricsEndpoint.h"
+
+MetadataNode::MetadataNode(const QString &serverAddress, quint16 port, const QHostAddress &bindAddress, int ioThreads,
+                           QObject *parent)
+    : QObject(parent), socket(new QTcpSocket(this)), upstream(new ClientConnection(socket, WireCodec::Rows::Records, this)),
+      server(new ReactorServer(ioThreads, WireCodec::Rows::Records, this)), connections(new ConnectionPool(this)),
+      coordinator(new QueryCoordinator(this)), batcher(new MicroBatcher(MicroBatcher::Options(), this)),
+      ingestAckLatency(Metrics::Registry::global().histogram(
+          "aqi_ingest_ack_seconds", "Time from an ingestion request to its acknowledgment.")),
+      myId(10), electionInitiated(false)
 {
-    connect(socket, &QTcpSocket::readyRead, this, &MetadataNode::onReadyRead);
-    connect(server, &QTcpServer::newConnection, this, &MetadataNode::onNewConnection);
+    connect(upstream, &ClientConnection::messagesReady, this, &MetadataNode::onReadyRead);
+    connect(server, &ReactorServer::newConnection, this, &MetadataNode::onNewConnection);
     connect(&electionTimer, &QTimer::timeout, this, &MetadataNode::handleElectionTimeout);
     connect(&registrationTimer, &QTimer::timeout, this, &MetadataNode::initiateElection);
-    server->listen(QHostAddress::Any, port);
+    if (!bindAddress.isNull()) {
+        socket->bind(bindAddress);
+        connections->setLocalAddress(bindAddress);
+    }
+    server->listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, port);
     socket->connectToHost(serverAddress, port);
 
     registrationTimer.start(10000);  // 10 sec timer
     connect(&initAnalyticsTimer, &QTimer::timeout, this, &MetadataNode::initAnalyticsNodes);
     initAnalyticsTimer.setSingleShot(true);
+    connect(connections, &ConnectionPool::peerConnected, this, [this](const QString &host, quint16) {
+        unreachableNodes.remove(host);
+    });
+    connect(connections, &ConnectionPool::peerDisconnected, this, [this](const QString &host, quint16 port) {
+        unreachableNodes.insert(host);
+        // Batches still queued in the pool go out on reconnect; those already written
+        // to the dropped connection will not be acknowledged.
+        const QSet<int> queued = connections->queuedTags(host, port);
+        QList<int> lost;
+        for (int batchId : ingest.inFlight(host)) {
+            if (!queued.contains(batchId)) {
+                lost.append(batchId);
+            }
+        }
+        loseBatches(host, lost);
+    });
+    connect(connections, &ConnectionPool::framesLost, this, [this](const QString &host, quint16, const QList<int> &tags) {
+        loseBatches(host, tags);
+    });
+    connect(connections, &ConnectionPool::frameReceived, this, &MetadataNode::onPeerFrame);
+    connect(coordinator, &QueryCoordinator::finished, this, &MetadataNode::onQueryFinished);
+    connect(batcher, &MicroBatcher::batchReady, this, &MetadataNode::onBatchReady);
+
+    Metrics::Registry &registry = Metrics::Registry::global();
+    registry.gaugeCallback("aqi_ingest_queued_rows", "Rows waiting for analytics node credits.", this,
+                           [this] { return static_cast<double>(ingest.queuedRows()); });
+    registry.gaugeCallback("aqi_batcher_pending_rows", "Rows waiting to be coalesced into a batch.", this,
+                           [this] { return static_cast<double>(batcher->pendingRows()); });
+    registry.gaugeCallback("aqi_pending_ingests", "Ingestion requests not yet acknowledged.", this,
+                           [this] { return static_cast<double>(pendingIngests.size()); });
+    registry.gaugeCallback("aqi_pending_queries", "Queries waiting for their shards.", this,
+                           [this] { return static_cast<double>(coordinator->pendingQueries()); });
+    registry.gaugeCallback("aqi_paused_clients", "Client connections not read from until the backlog drains.", this,
+                           [this] { return static_cast<double>(pausedClients.size()); });
+    registry.gaugeCallback("aqi_pool_connections", "Open pooled connections to other nodes.", this,
+                           [this] { return static_cast<double>(connections->openConnections()); });
+    registry.gaugeCallback("aqi_unreachable_nodes", "Analytics nodes the last connection attempt failed for.", this,
+                           [this] { return static_cast<double>(unreachableNodes.size()); });
+}
+
+void MetadataNode::setReplicationFactor(int factor) {
+    ring.setReplicationFactor(factor);
+}
+
+void MetadataNode::setIngestPolicy(IngestQueue::Policy policy) {
+    ingest.setPolicy(policy);
+}
+
+void MetadataNode::setMicroBatching(const MicroBatcher::Options &options) {
+    batcher->setOptions(options);
 }
 
 MetadataNode::~MetadataNode() {
@@ -91,31 +154,57 @@ void MetadataNode::registerNode() {
         {"requestType", "registering"},
         {"IP", socket->localAddress().toString()},
         {"nodeType", "metadata Analytics"},
-        {"computingCapacity", capacity}
+        {"computingCapacity", capacity},
+        {"codecs", WireCodec::supportedCodecs()}
     };
-    QJsonDocument doc(registrationRequest);
-    socket->write(doc.toJson());
-    qDebug() << "Register Node: Sent registration request from" << doc.toJson(QJsonDocument::Compact);
+    QByteArray payload = WireCodec::encode(registrationRequest);
+    socket->write(MessageFraming::frame(payload));
+    qDebug() << "Register Node: Sent registration request from" << payload;
 }
 
 void MetadataNode::onNewConnection() {
-    QTcpSocket *client = server->nextPendingConnection();
+    ClientConnection *client = server->nextPendingConnection();
     clients.append(client);
-    connect(client, &QTcpSocket::readyRead, this, &MetadataNode::onReadyRead);
-    connect(client, &QTcpSocket::disconnected, this, &MetadataNode::onClientDisconnected);
-    qDebug() << "Metadata Node: New connection " << client;
+    connect(client, &ClientConnection::messagesReady, this, &MetadataNode::onReadyRead);
+    connect(client, &ClientConnection::disconnected, this, &MetadataNode::onClientDisconnected);
+    qCDebug(lcCluster) << "Metadata Node: New connection" << client->peerAddress().toString();
 }
 
 void MetadataNode::onReadyRead() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
-    QJsonDocument doc = QJsonDocument::fromJson(client->readAll());
-    processMessage(client, doc.object());
+    readFrames(qobject_cast<ClientConnection*>(sender()));
+}
+
+void MetadataNode::readFrames(ClientConnection *client) {
+    if (pausedClients.contains(client)) {
+        return;
+    }
+    // Framed and decoded on the connection's I/O thread.
+    WireMessage message;
+    int bytes = 0;
+    while (client->nextMessage(message, bytes)) {
+        const QString type = message.fields["requestType"].toString();
+        messageMetrics.received(type, bytes);
+        QElapsedTimer handling;
+        handling.start();
+        processMessage(client, message);
+        messageMetrics.handled(type, handling.nsecsElapsed());
+        if (ingest.policy() == IngestQueue::Policy::Delay && ingest.isFull()) {
+            // The rest stays queued; finishIngest resumes reading once the backlog drains.
+            pausedClients.append(client);
+            client->setReadPaused(true);
+            ingest.countDelay();
+            qCDebug(lcIngest) << "[MetadataNode] Ingest backlog full at" << ingest.queuedRows() << "rows; pausing"
+                              << client->peerAddress().toString();
+            return;
+        }
+    }
 }
 
 void MetadataNode::onClientDisconnected() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
+    ClientConnection *client = qobject_cast<ClientConnection*>(sender());
     QString clientIp = extractIPv4Address(client->peerAddress().toString());
     clients.removeAll(client);
+    pausedClients.removeAll(client);
     client->deleteLater();
     for (auto it = nodeList.begin(); it != nodeList.end(); ++it) {
         if ((*it)["IP"].toString() == clientIp) {
@@ -127,11 +216,12 @@ void MetadataNode::onClientDisconnected() {
     //broadcastNodeList();
 }
 
-void MetadataNode::processMessage(QTcpSocket* client, const QJsonObject &message) {
+void MetadataNode::processMessage(ClientConnection* client, const WireMessage &wireMessage) {
+    const QJsonObject &message = wireMessage.fields;
     QString type = message["requestType"].toString();
 
     if (type == "Node Discovery") {
-        qDebug() << "Metadata Node: node desc request from Register node" << message;
+        qCDebug(lcCluster) << "Metadata Node: node desc request from Register node" << message;
 
         updateNodeList(message);
     } else if (type == "Election Message") {
@@ -159,17 +249,40 @@ void MetadataNode::processMessage(QTcpSocket* client, const QJsonObject &message
         sendHeartBeat(client);
     }
     else if (type == "ingestion") {
-        QJsonArray dataArray = message["Data"].toArray();
-        sendAnalyticsRequest(dataArray);
+        sendAnalyticsRequest(client, wireMessage);
     } else if (type == "query") {
-        processQueryRequest(message);
+        processQueryRequest(client, wireMessage);
     } else if (type == "query response"){
-        qDebug() << "Received query response:" << message;
+        if (!coordinator->addPartial(extractIPv4Address(client->peerAddress().toString()), message)) {
+            qCDebug(lcQuery) << "Received query response for no pending query" << message["requestID"].toInt();
+        }
     } else if (type == "analytics acknowledgment"){
-        qDebug() << "Received analytics acknowledgment:" << message;
+        onAnalyticsAcknowledgment(extractIPv4Address(client->peerAddress().toString()), message);
+    } else if (type == "metrics") {
+        QJsonObject response{
+            {"requestType", "metrics response"},
+            {"requestID", message["requestID"]},
+            {"ingest", ingest.metrics()},
+            {"batching", QJsonObject{
+                {"pendingRows", static_cast<double>(batcher->pendingRows())},
+                {"batches", static_cast<double>(batcher->batchesFlushed())},
+                {"rows", static_cast<double>(batcher->rowsFlushed())}
+            }}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
+    }
+    else if (type == "log level") {
+        Logging::setRules(message["rules"].toString());
+        qInfo() << "Metadata Node: log rules set to" << Logging::rules();
+        QJsonObject response{
+            {"requestType", "log level acknowledgment"},
+            {"requestID", message["requestID"]},
+            {"rules", Logging::rules()}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
     }
     else {
-        qDebug() << "Received unrecognized message type:" << type << message;
+        qCWarning(lcCluster) << "Received unrecognized message type:" << type;
     }
 }
 
@@ -182,16 +295,13 @@ QJsonObject MetadataNode::createMessage(const QString &type, const QVariantMap &
     return message;
 }
 
-void MetadataNode::sendHeartBeat(QTcpSocket *clientSocket) {
+void MetadataNode::sendHeartBeat(ClientConnection *clientSocket) {
     QJsonObject responseObj;
     responseObj["requestType"] = "Heartbeat Response";
     responseObj["message"] = "I am alive";
     responseObj["status"] = "OK";
 
-    QJsonDocument responseDoc(responseObj);
-    QByteArray responseData = responseDoc.toJson();
-
-    clientSocket->write(responseData);
+    clientSocket->write(MessageFraming::frame(WireCodec::encode(responseObj)));
 }
 void MetadataNode::updateNodeList(const QJsonObject &nodeData) {
     nodeList.clear();
@@ -206,11 +316,13 @@ void MetadataNode::updateNodeList(const QJsonObject &nodeData) {
         QJsonObject newNode{
             {"IP", ip},
             {"nodeType", nodeType},
-            {"computingCapacity", computingCapacity}
+            {"computingCapacity", computingCapacity},
+            {"codecs", node["codecs"]}
         };
         nodeList.append(newNode);
     }
     qDebug() << "[MetadataNode] Updated node list. Total nodes:" << nodeList.toList();
+    rebuildShardRing();
     if(nodeData["metadataAnalyticsLeader"] == ""){
         initiateElection();
     }
@@ -226,14 +338,14 @@ void MetadataNode::broadcastNodeList() {
     data["metadataAnalyticsLeader"] = leaderIP;
     data["metadataIngestionLeader"] = "";
     data["initElectionIngestion"] = "192.168.1.104";
+    data["codecs"] = WireCodec::supportedCodecs();
     QJsonObject message = createMessage("Node Discovery", data);
-    QJsonDocument doc(message);
-    //QString messageString = doc.toJson(QJsonDocument::Compact);
+    QByteArray payload = WireCodec::encode(message);
     qDebug() << "Clients:" << clients.size();
-    for (QTcpSocket *client : clients) {
-        client->write(doc.toJson());
+    for (ClientConnection *client : clients) {
+        client->write(MessageFraming::frame(payload));
         qDebug() << "[MetadataNode] Broadcasting node list to" << extractIPv4Address(client->peerAddress().toString());
-        qDebug() << "Processed broadcasting request, message: " << message;
+        qCDebug(lcCluster) << "Processed broadcasting request, message: " << message;
     }
 }
 
@@ -303,11 +415,8 @@ void MetadataNode::sendMessageToNextNode(const QJsonDocument &doc, QString ip) {
         return;
     }
     QString nextNodeIp = nodeList[nextIndex]["IP"].toString();
-    QTcpSocket *nextNodeClient = new QTcpSocket(this);
     qDebug() << "Next metadata node: " << nextNodeIp;
-    nextNodeClient->connectToHost(nextNodeIp, 12351);
-
-    nextNodeClient->write(doc.toJson());
+    connections->send(nextNodeIp, 12351, WireCodec::encode(doc.object()));
     qDebug() << "Sent message to next metadata node:" << nextNodeIp;
 }
 
@@ -347,75 +456,355 @@ void MetadataNode::initAnalyticsNodes() {
 }
 
 QJsonArray MetadataNode::getReplicasFor(const QString &ip) {
-    QJsonArray replicas;
+    return QJsonArray::fromStringList(ring.replicasFor(ip));
+}
+
+void MetadataNode::rebuildShardRing() {
+    // Rebuilt from scratch: the ring depends only on the node set, so keys stay put
+    // for nodes that remain.
+    ring.clear();
     for (const QJsonObject &node : nodeList) {
-        if (node["IP"].toString() != ip && node["nodeType"].toString() == "analytics") {
-            replicas.append(node["IP"].toString());
+        if (node["nodeType"].toString() == "analytics") {
+            ring.addNode(node["IP"].toString(), node["computingCapacity"].toDouble());
         }
     }
-    return replicas;
+    qDebug() << "[MetadataNode] Shard ring:" << ring.nodes() << "replication factor" << ring.replicationFactor();
 }
 
 void MetadataNode::sendMessageToNode(const QString &ip, const QJsonDocument &doc) {
-    QTcpSocket *analyticsClient = new QTcpSocket(this);
-    analyticsClient->connectToHost(ip, 12351);
-    analyticsClient->write(doc.toJson());
-    qDebug() << "send message to IP:" << ip;
+    sendMessageToNode(ip, WireCodec::encode(doc.object()));
+}
+
+void MetadataNode::sendMessageToNode(const QString &ip, const QByteArray &payload) {
+    connections->send(ip, 12351, payload);
+    qCDebug(lcCluster) << "send message to IP:" << ip;
 }
 
 void MetadataNode::sendMessageToRegisterNode(const QJsonDocument &doc) {
-    QTcpSocket *registerClient = new QTcpSocket(this);
-    //registerClient->connectToHost("192.168.1.107", 12351); //Jahnvi's IP
-    registerClient->connectToHost("192.168.1.102", 27500);  //Harshit's IP
-    registerClient->write(doc.toJson());
+    //connections->send("192.168.1.107", 12351, ...); //Jahnvi's IP
+    connections->send("192.168.1.102", 27500, WireCodec::encode(doc.object()));  //Harshit's IP
     qDebug() << "send to leader ip to register node.";
 }
 
-void MetadataNode::sendAnalyticsRequest(const QJsonArray& data) {
+void MetadataNode::sendAnalyticsRequest(ClientConnection *requester, const WireMessage &wireMessage) {
+    const AqiBatch &rows = wireMessage.rows;
+    const int id = nextIngestId++;
+    PendingIngest &pending = pendingIngests[id];
+    pending.requester = requester;
+    pending.requestId = wireMessage.fields["requestID"].toInt();
+    pending.format = wireMessage.format;
+    pending.rows = rows.size();
+    pending.received.start();
+
+    // Each row goes to the owners of its shard key: the primary stores it as its own,
+    // the rank-k replica under shard "<primary>#k".
+    QHash<QString, QHash<QString, AqiBatch>> batches;  // node -> shard -> rows
+    int unplaced = 0;  // rows no analytics node owns, i.e. the ring is empty
+    for (const AqiRecord &record : rows) {
+        const QStringList owners = ring.owners(ring.keyOf(record));
+        unplaced += owners.isEmpty();
+        for (int rank = 0; rank < owners.size(); ++rank) {
+            const QString shard = rank == 0 ? QString() : owners[0] + '#' + QString::number(rank);
+            batches[owners[rank]][shard].append(record);
+        }
+    }
+
+    // Small requests are coalesced per node and shard; onBatchReady sends the result.
+    // add() may flush, and so settle a part, at once: one extra count keeps the
+    // request open until every part is handed over.
+    for (const QHash<QString, AqiBatch> &shards : batches) {
+        pending.outstanding += shards.size();
+    }
+    ++pending.outstanding;
+    for (auto node = batches.constBegin(); node != batches.constEnd(); ++node) {
+        for (auto shard = node->constBegin(); shard != node->constEnd(); ++shard) {
+            batcher->add(node.key(), shard.key(), shard->constData(), shard->size(), id);
+        }
+    }
+    if (unplaced > 0) {
+        qCWarning(lcIngest) << "[MetadataNode] No analytics node to store" << unplaced << "rows";
+    }
+    settleIngest(id, unplaced > 0 ? "failed" : "stored");
+}
+
+void MetadataNode::onBatchReady(const QString &ip, const QString &shard, const AqiBatch &rows, const QVector<int> &tags) {
+    const QJsonObject *target = nullptr;
     for (const QJsonObject &node : nodeList) {
-        if (node["nodeType"].toString() == "analytics") {
-            QString analyticsNodeIp = node["IP"].toString();
-            QJsonObject requestObj;
-            requestObj["requestType"] = "analytics";
-            requestObj["requestID"] = 123;
-            requestObj["Data"] = data;
+        if (node["nodeType"].toString() == "analytics" && node["IP"].toString() == ip) {
+            target = &node;
+            break;
+        }
+    }
+    if (!target) {
+        qCWarning(lcIngest) << "[MetadataNode] Analytics node" << ip << "left; dropping" << rows.size() << "rows";
+        for (int id : tags) {
+            settleIngest(id, "failed");
+        }
+        return;
+    }
 
+    const int batchId = nextBatchId++;
+    QJsonObject requestObj;
+    requestObj["requestType"] = "analytics";
+    requestObj["requestID"] = batchId;
+    if (!shard.isEmpty()) {
+        requestObj["shard"] = shard;
+    }
+    const WireCodec::Format format = WireCodec::negotiate(*target);
+    if (!ingest.push(ip, batchId, WireCodec::encode(requestObj, rows, format), rows.size())) {
+        qCDebug(lcIngest) << "[MetadataNode] Ingest backlog full; shed" << rows.size() << "rows for" << ip;
+        for (int id : tags) {
+            settleIngest(id, "shed");
+        }
+        return;
+    }
+    ingestsOfBatch.insert(batchId, tags);
+    qCDebug(lcIngest) << "[MetadataNode] Batch" << batchId << "for" << ip
+             << (shard.isEmpty() ? QString("as primary") : "as replica " + shard) << ":" << rows.size()
+             << "rows from" << tags.size() << "requests," << WireCodec::formatName(format);
+    flushIngest(ip);
+}
+
+void MetadataNode::flushIngest(const QString &ip) {
+    for (const IngestQueue::Batch &batch : ingest.takeSendable(ip)) {
+        connections->send(ip, 12351, batch.payload, batch.id);
+        qCDebug(lcIngest) << "Analytics request sent: -> " << ip << batch.rows << "rows as batch" << batch.id;
+    }
+}
 
-            QJsonDocument doc(requestObj);
-            sendMessageToNode(analyticsNodeIp, doc);
-            qDebug() << "Analytics request sent: -> " << analyticsNodeIp;
+void MetadataNode::loseBatches(const QString &ip, const QList<int> &batchIds) {
+    if (batchIds.isEmpty()) {
+        return;
+    }
+    for (int batchId : batchIds) {
+        ingest.acknowledge(ip, batchId);
+        finishBatch(batchId, "failed");
+    }
+    flushIngest(ip);
+}
+
+void MetadataNode::onAnalyticsAcknowledgment(const QString &ip, const QJsonObject &ack) {
+    const int batchId = ack["requestID"].toInt();
+    ingest.acknowledge(ip, batchId, ack.contains("credits") ? static_cast<qint64>(ack["credits"].toDouble()) : -1);
+    finishBatch(batchId, ack["status"].toString("stored"));
+    flushIngest(ip);
+}
+
+void MetadataNode::finishBatch(int batchId, const QString &status) {
+    for (int id : ingestsOfBatch.take(batchId)) {
+        settleIngest(id, status);
+    }
+}
+
+void MetadataNode::settleIngest(int id, const QString &status) {
+    auto it = pendingIngests.find(id);
+    if (it == pendingIngests.end()) {
+        return;
+    }
+    if (status == "shed") {
+        ++it->shed;
+    } else if (status != "stored") {
+        ++it->failed;
+    }
+    if (--it->outstanding == 0) {
+        finishIngest(id);
+    }
+}
+
+void MetadataNode::finishIngest(int id) {
+    const PendingIngest pending = pendingIngests.take(id);
+    ingestAckLatency.record(pending.received.nsecsElapsed());
+    if (pending.requester) {
+        // "credits" is how many more rows this node can take before its backlog is full.
+        QJsonObject ack{
+            {"requestType", "ingestion acknowledgment"},
+            {"requestID", pending.requestId},
+            {"rows", pending.rows},
+            {"status", pending.failed > 0 ? "failed" : pending.shed > 0 ? "shed" : "stored"},
+            {"credits", static_cast<double>(ingest.freeRows())}
+        };
+        pending.requester->write(MessageFraming::frame(WireCodec::encode(ack, pending.format)));
+    }
+    if (!pausedClients.isEmpty() && ingest.canResume()) {
+        const QList<QPointer<ClientConnection>> resumed = pausedClients;
+        pausedClients.clear();
+        for (const QPointer<ClientConnection> &client : resumed) {
+            if (client) {
+                client->setReadPaused(false);
+                readFrames(client);
+            }
         }
     }
 }
 
-void MetadataNode::processQueryRequest(const QJsonObject &message) {
-    int requestId = 1;
-    int queryType = message["param"].toInt(); // Assuming 0 or 1 indicates different types of queries
+QHash<QString, QStringList> MetadataNode::routeQuery(const QJsonObject &query, QStringList &uncovered) const {
+    // Only shards that can hold matching rows are asked: those owning the filtered
+    // keys, or every shard when the query does not filter on the shard key. With no
+    // analytics node in the ring there is no shard to ask.
+    if (ring.isEmpty()) {
+        return QHash<QString, QStringList>();
+    }
+    QStringList primaries;
+    const QJsonValue keys = query["filters"].toObject()[ring.keyFilterName()];
+    if (keys.isString()) {
+        primaries.append(ring.primaryOf(keys.toString()));
+    } else if (keys.isArray()) {
+        for (const QJsonValue &key : keys.toArray()) {
+            const QString primary = ring.primaryOf(key.toString());
+            if (!primaries.contains(primary)) {
+                primaries.append(primary);
+            }
+        }
+    } else {
+        primaries = ring.nodes();
+    }
+
+    // node -> shards it answers for; "" is the node's own data.
+    QHash<QString, QStringList> targets;
+    for (const QString &primary : primaries) {
+        if (!unreachableNodes.contains(primary)) {
+            targets[primary].append(QString());
+            continue;
+        }
+        // The rank-k replicas of a shard hold each of its keys exactly once between them.
+        bool covered = false;
+        for (int rank = 1; rank < ring.replicationFactor() && !covered; ++rank) {
+            const QStringList holders = ring.replicaHolders(primary, rank);
+            covered = !holders.isEmpty();
+            for (const QString &holder : holders) {
+                covered = covered && !unreachableNodes.contains(holder);
+            }
+            if (covered) {
+                for (const QString &holder : holders) {
+                    targets[holder].append(primary + '#' + QString::number(rank));
+                }
+            }
+        }
+        if (!covered) {
+            qCWarning(lcQuery) << "[MetadataNode] No reachable copy of shard" << primary << "; results will be partial";
+            uncovered.append(primary);
+        }
+    }
+    return targets;
+}
+
+void MetadataNode::processQueryRequest(ClientConnection *client, const WireMessage &wireMessage) {
+    const QJsonObject &message = wireMessage.fields;
+    int requestId = message.contains("requestID") ? message["requestID"].toInt() : 1;
+    // A query spec object (see QuerySpec.h) is passed through untouched; older
+    // clients send a bare "param" number, which analytics nodes treat as max/avg.
+    QJsonValue query = message.contains("query") ? message["query"] : QJsonValue(message["param"].toInt());
+    const int deadlineMs = message.contains("deadlineMs") ? message["deadlineMs"].toInt()
+                                                          : QueryCoordinator::DefaultDeadlineMs;
+
+    // Scatter to the owning shards, asking for mergeable partials; the coordinator
+    // gathers them and onQueryFinished answers the requester once.
+    QStringList uncovered;
+    const QHash<QString, QStringList> targets = routeQuery(query.toObject(), uncovered);
+    QString error;
+    int id = 0;
+    if (ring.isEmpty()) {
+        error = "no analytics nodes to query";
+    } else {
+        id = coordinator->begin(query, targets.keys(), deadlineMs, error, uncovered);
+    }
+    if (id == 0) {
+        QJsonObject response{
+            {"requestType", "query response"},
+            {"requestID", requestId},
+            {"error", error}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
+        return;
+    }
+    PendingQuery &pending = pendingQueries[id];
+    pending.requester = client;
+    pending.requestId = requestId;
+    pending.format = wireMessage.format;
+    pending.span.start(message["trace"].toString());
 
     QJsonObject queryRequest{
         {"requestType", "query"},
-        {"requestId", requestId},
-        {"query", queryType}
+        {"requestID", id},
+        {"query", query},
+        {"partial", true}
     };
-    QJsonDocument doc(queryRequest);
-    forwardQueryToAnalyticsNode(doc);
+    if (message.contains("trace")) {
+        queryRequest["trace"] = message["trace"];
+    }
+    forwardQueryToAnalyticsNode(queryRequest, targets);
 }
 
-void MetadataNode::forwardQueryToAnalyticsNode(const QJsonDocument &doc) {
+void MetadataNode::onPeerFrame(const QString &host, quint16 port, const QByteArray &payload) {
+    Q_UNUSED(port);
+    // Analytics nodes answer queries and acknowledge batches on the pooled connection
+    // the request went out on.
+    WireMessage message;
+    if (!WireCodec::decode(payload, message)) {
+        qCWarning(lcCluster) << "Dropping undecodable message from" << host;
+        return;
+    }
+    messageMetrics.received(message.fields["requestType"].toString(), payload.size());
+    if (message.fields["requestType"].toString() == "query response") {
+        if (!coordinator->addPartial(host, message.fields)) {
+            qCDebug(lcQuery) << "Received query response for no pending query" << message.fields["requestID"].toInt()
+                             << "from" << host;
+        }
+    } else if (message.fields["requestType"].toString() == "analytics acknowledgment") {
+        onAnalyticsAcknowledgment(host, message.fields);
+    } else {
+        qCDebug(lcCluster) << "Received message on pooled connection from" << host << ":" << message.fields;
+    }
+}
+
+void MetadataNode::onQueryFinished(int id, const QJsonObject &result) {
+    PendingQuery query = pendingQueries.take(id);
+    QJsonObject response = result;
+    response["requestType"] = "query response";
+    response["requestID"] = query.requestId;
+    query.span.finish(response, localIP, "metadata.coordinate");
+    if (!query.requester) {
+        qCDebug(lcQuery) << "Requester of query" << query.requestId << "went away; dropping result";
+        return;
+    }
+    query.requester->write(MessageFraming::frame(WireCodec::encode(response, query.format)));
+    qCDebug(lcQuery) << "Sent merged query response:" << response;
+}
+
+void MetadataNode::forwardQueryToAnalyticsNode(const QJsonObject &query, const QHash<QString, QStringList> &targets) {
     for (const QJsonObject &node : nodeList) {
-        if (node["nodeType"].toString() == "analytics") {
-            QString analyticsNodeIp = node["IP"].toString();
-            sendMessageToNode(analyticsNodeIp, doc);
-            qDebug() << "Send query to analytics node:" << analyticsNodeIp;
+        QString analyticsNodeIp = node["IP"].toString();
+        if (node["nodeType"].toString() == "analytics" && targets.contains(analyticsNodeIp)) {
+            QJsonObject shardQuery = query;
+            shardQuery["shards"] = QJsonArray::fromStringList(targets[analyticsNodeIp]);
+            sendMessageToNode(analyticsNodeIp, WireCodec::encode(shardQuery, WireCodec::negotiate(node)));
+            qCDebug(lcQuery) << "Send query to analytics node:" << analyticsNodeIp << "for shards" << targets[analyticsNodeIp];
         }
     }
 }
 
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
-    MetadataNode node("192.168.1.102", 12351); // Harshit's IP
-    //MetadataNode node("127.0.0.1", 12351); // Local IP
-    //MetadataNode node("192.168.1.107", 12351);
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOptions({
+        {"register", "Address of the register node.", "address", "192.168.1.102"},
+        {"bind", "Address to listen on and connect from (default: all interfaces).", "address"},
+        {"metrics-port", "Port of the plain-text metrics endpoint, 0 to disable.", "port",
+         QString::number(MetricsEndpoint::DefaultPort)},
+        {"io-threads", "Threads reading and decoding client connections.", "count",
+         QString::number(ReactorServer::defaultThreadCount())}
+    });
+    parser.process(app);
+    const QHostAddress bindAddress(parser.value("bind"));
+    MetadataNode node(parser.value("register"), 12351, bindAddress, parser.value("io-threads").toInt());
+    node.setIngestPolicy(IngestQueue::policyFromName(qEnvironmentVariable("AQI_INGEST_POLICY")));
     node.registerNode();
+
+    Metrics::Registry::global().setConstantLabels({{"node", "metadata"}, {"address", node.localIP}});
+    MetricsEndpoint metrics;
+    if (const quint16 metricsPort = parser.value("metrics-port").toUShort()) {
+        metrics.listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, metricsPort);
+    }
     return app.exec();
 }
@@ -1,33 +1,95 @@
 #ifndef METADATANODE_H
 #define METADATANODE_H
 
-#include <QTcpServer>
 #include <QTcpSocket>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QTimer>
+#include <QPointer>
+#include "ConnectionPool.h"
+#include "IngestQueue.h"
+#include "MessageFraming.h"
+#include "Metrics.h"
+#include "MicroBatcher.h"
+#include "QueryCoordinator.h"
+#include "ReactorServer.h"
+#include "ShardRing.h"
+#include "WireCodec.h"
 
 class MetadataNode : public QObject {
     Q_OBJECT
 public:
-    explicit MetadataNode(const QString &serverAddress,quint16 port, QObject *parent = nullptr);
+    // bindAddress, when set, is the address this node listens on and connects from;
+    // otherwise it listens on every interface. Client connections are read and decoded
+    // on ioThreads threads of their own.
+    explicit MetadataNode(const QString &serverAddress,quint16 port, const QHostAddress &bindAddress = QHostAddress(),
+                          int ioThreads = ReactorServer::defaultThreadCount(), QObject *parent = nullptr);
     ~MetadataNode();
     QString localIP; //"192.168.1.107";
     void registerNode();
+    // Number of analytics nodes each ingested row is stored on (primary + replicas).
+    void setReplicationFactor(int factor);
+    // Applies when more rows are waiting for analytics node credits than the ingest
+    // backlog holds: Delay stops reading from upstream, Shed refuses the batch.
+    void setIngestPolicy(IngestQueue::Policy policy);
+    // Size and latency budget for coalescing rows per analytics node and shard.
+    void setMicroBatching(const MicroBatcher::Options &options);
 
 private slots:
     void onNewConnection();
     void onReadyRead();
+    void readFrames(ClientConnection *client);
     void onClientDisconnected();
     void startElection();
     void handleElectionTimeout();
     void initiateElection();
+    void onPeerFrame(const QString &host, quint16 port, const QByteArray &payload);
+    void onQueryFinished(int id, const QJsonObject &result);
+    void onBatchReady(const QString &ip, const QString &shard, const AqiBatch &rows, const QVector<int> &tags);
 
 private:
     QTcpSocket *socket;
-    QTcpServer *server;
-    QList<QTcpSocket*> clients;
+    ClientConnection *upstream;  // socket, read on this thread
+    ReactorServer *server;
+    ConnectionPool *connections;
+    ShardRing ring;
+    QSet<QString> unreachableNodes;  // analytics nodes the pool last failed to reach
+    // Queries this node coordinates, by the request ID used towards the shards.
+    struct PendingQuery {
+        QPointer<ClientConnection> requester;
+        int requestId = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+        Metrics::Span span;
+    };
+    QueryCoordinator *coordinator;
+    QHash<int, PendingQuery> pendingQueries;
+    // Ingestion requests waiting for the analytics nodes to store their rows. Each is
+    // split per node and shard and coalesced with other requests' rows into batches;
+    // the requester is acknowledged once every batch holding its rows is acknowledged,
+    // shed or lost.
+    struct PendingIngest {
+        QPointer<ClientConnection> requester;
+        int requestId = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+        int rows = 0;
+        int outstanding = 0;
+        int shed = 0;
+        int failed = 0;
+        QElapsedTimer received;
+    };
+    MicroBatcher *batcher;
+    IngestQueue ingest;
+    QHash<int, PendingIngest> pendingIngests;
+    QHash<int, QVector<int>> ingestsOfBatch;  // batch request ID -> pending ingests with rows in it
+    int nextIngestId = 1;
+    int nextBatchId = 1;
+    QList<QPointer<ClientConnection>> pausedClients;  // not read from until the backlog halves
+    QList<ClientConnection*> clients;
+    Metrics::MessageMetrics messageMetrics{QStringList{
+        "Node Discovery", "Election Message", "Leader Announcement", "Heartbeat", "ingestion", "query",
+        "query response", "analytics acknowledgment", "metrics", "log level"}};
+    Metrics::Histogram &ingestAckLatency;
     QList<QJsonObject> nodeList;
     int myId;
     QString leaderIP;
@@ -36,7 +98,7 @@ private:
     QTimer registrationTimer;
     QTimer initAnalyticsTimer;
 
-    void processMessage(QTcpSocket* client, const QJsonObject &message);
+    void processMessage(ClientConnection* client, const WireMessage &wireMessage);
     QJsonObject createMessage(const QString &type, const QVariantMap &data);
     void updateNodeList(const QJsonObject &nodeData);
     void broadcastNodeList();
@@ -48,12 +110,21 @@ private:
     void initAnalyticsNodes();
     QJsonArray getReplicasFor(const QString &ip);
     void sendMessageToNode(const QString &ip, const QJsonDocument &doc);
-    void sendAnalyticsRequest(const QJsonArray& data);
-    void processQueryRequest(const QJsonObject &message);
-    void forwardQueryToAnalyticsNode(const QJsonDocument &doc);
+    void sendMessageToNode(const QString &ip, const QByteArray &payload);
+    void rebuildShardRing();
+    void sendAnalyticsRequest(ClientConnection *requester, const WireMessage &wireMessage);
+    void flushIngest(const QString &ip);
+    void loseBatches(const QString &ip, const QList<int> &batchIds);
+    void onAnalyticsAcknowledgment(const QString &ip, const QJsonObject &ack);
+    void finishBatch(int batchId, const QString &status);
+    void settleIngest(int id, const QString &status);
+    void finishIngest(int id);
+    QHash<QString, QStringList> routeQuery(const QJsonObject &query, QStringList &uncovered) const;
+    void processQueryRequest(ClientConnection *client, const WireMessage &wireMessage);
+    void forwardQueryToAnalyticsNode(const QJsonObject &query, const QHash<QString, QStringList> &targets);
     void sendMessageToRegisterNode(const QJsonDocument &doc);
     void generateNodeUID();
-    void sendHeartBeat(QTcpSocket *clientSocket);
+    void sendHeartBeat(ClientConnection *clientSocket);
 };
 
 #endif
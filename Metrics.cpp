@@ -0,0 +1,269 @@
+#include "Metrics.h"
+#include <QDebug>
+#include <QJsonArray>
+#include <QMutexLocker>
+#include <QObject>
+#include <QTextStream>
+#include <QtAlgorithms>
+#include <cmath>
+#include "Logging.h"
+
+namespace Metrics {
+
+namespace {
+
+QString escape(const QString &value) {
+    QString escaped;
+    escaped.reserve(value.size());
+    for (QChar c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// name{constant,own,extra}
+QString seriesName(const QString &name, const QStringList &parts) {
+    QStringList present;
+    for (const QString &part : parts) {
+        if (!part.isEmpty()) {
+            present.append(part);
+        }
+    }
+    return present.isEmpty() ? name : name + '{' + present.join(',') + '}';
+}
+
+}
+
+void Histogram::record(qint64 value) {
+    const quint64 v = value < 0 ? 0 : static_cast<quint64>(value);
+    buckets[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+    samples.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(static_cast<qint64>(v), std::memory_order_relaxed);
+    qint64 seen = largest.load(std::memory_order_relaxed);
+    while (static_cast<qint64>(v) > seen
+           && !largest.compare_exchange_weak(seen, static_cast<qint64>(v), std::memory_order_relaxed)) {
+    }
+}
+
+int Histogram::bucketOf(quint64 value) {
+    if (value < SubBuckets) {
+        return static_cast<int>(value);
+    }
+    const int exponent = 63 - static_cast<int>(qCountLeadingZeroBits(value));  // >= 5
+    const int sub = static_cast<int>(value >> (exponent - 5)) - SubBuckets;
+    return (exponent - 4) * SubBuckets + sub;
+}
+
+quint64 Histogram::lowerBound(int bucket) {
+    if (bucket < SubBuckets) {
+        return static_cast<quint64>(bucket);
+    }
+    const int exponent = bucket / SubBuckets + 4;
+    return static_cast<quint64>(SubBuckets + bucket % SubBuckets) << (exponent - 5);
+}
+
+double Histogram::percentile(double q) const {
+    const qint64 n = count();
+    if (n == 0) {
+        return 0;
+    }
+    if (q >= 1) {
+        return static_cast<double>(max());
+    }
+    const qint64 rank = qMax<qint64>(1, static_cast<qint64>(std::ceil(q * n)));
+    qint64 seen = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            const double width = i < SubBuckets ? 1.0 : static_cast<double>(quint64(1) << (i / SubBuckets - 1));
+            return qMin(static_cast<double>(lowerBound(i)) + width / 2, static_cast<double>(max()));
+        }
+    }
+    return static_cast<double>(max());
+}
+
+Registry &Registry::global() {
+    static Registry registry;
+    return registry;
+}
+
+QString Registry::render(const Labels &labels) {
+    QStringList parts;
+    for (const auto &label : labels) {
+        parts.append(label.first + "=\"" + escape(label.second) + '"');
+    }
+    return parts.join(',');
+}
+
+Registry::Series &Registry::series(const QString &name, const QString &help, Type type, const Labels &labels) {
+    Family &family = families[name];
+    if (family.series.isEmpty()) {
+        family.help = help;
+        family.type = type;
+    } else if (family.type != type) {
+        qWarning() << "Metrics: family" << name << "registered with two types";
+    }
+    return family.series[render(labels)];
+}
+
+Counter &Registry::counter(const QString &name, const QString &help, const Labels &labels) {
+    QMutexLocker lock(&mutex);
+    Series &s = series(name, help, Type::Counter, labels);
+    if (!s.counter) {
+        s.counter = std::make_shared<Counter>();
+    }
+    return *s.counter;
+}
+
+Gauge &Registry::gauge(const QString &name, const QString &help, const Labels &labels) {
+    QMutexLocker lock(&mutex);
+    Series &s = series(name, help, Type::Gauge, labels);
+    if (!s.gauge) {
+        s.gauge = std::make_shared<Gauge>();
+    }
+    return *s.gauge;
+}
+
+Histogram &Registry::histogram(const QString &name, const QString &help, const Labels &labels) {
+    QMutexLocker lock(&mutex);
+    Series &s = series(name, help, Type::Summary, labels);
+    if (!s.histogram) {
+        s.histogram = std::make_shared<Histogram>();
+    }
+    return *s.histogram;
+}
+
+void Registry::gaugeCallback(const QString &name, const QString &help, QObject *owner,
+                             std::function<double()> read, const Labels &labels) {
+    callback(name, help, Type::Gauge, owner, std::move(read), labels);
+}
+
+void Registry::counterCallback(const QString &name, const QString &help, QObject *owner,
+                               std::function<double()> read, const Labels &labels) {
+    callback(name, help, Type::Counter, owner, std::move(read), labels);
+}
+
+void Registry::callback(const QString &name, const QString &help, Type type, QObject *owner,
+                        std::function<double()> read, const Labels &labels) {
+    const QString key = render(labels);
+    {
+        QMutexLocker lock(&mutex);
+        series(name, help, type, labels).read = std::move(read);
+    }
+    QObject::connect(owner, &QObject::destroyed, [this, name, key] {
+        QMutexLocker lock(&mutex);
+        auto family = families.find(name);
+        if (family != families.end()) {
+            family->series.remove(key);
+        }
+    });
+}
+
+void Registry::setConstantLabels(const Labels &labels) {
+    QMutexLocker lock(&mutex);
+    constantLabels = render(labels);
+}
+
+QByteArray Registry::scrape() const {
+    static const double Quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    QString text;
+    QTextStream out(&text);
+    QMutexLocker lock(&mutex);
+    for (auto family = families.constBegin(); family != families.constEnd(); ++family) {
+        if (family->series.isEmpty()) {
+            continue;
+        }
+        const QString &name = family.key();
+        out << "# HELP " << name << ' ' << family->help << '\n';
+        out << "# TYPE " << name << ' '
+            << (family->type == Type::Counter ? "counter" : family->type == Type::Gauge ? "gauge" : "summary") << '\n';
+        for (auto s = family->series.constBegin(); s != family->series.constEnd(); ++s) {
+            const QString &labels = s.key();
+            if (s->counter) {
+                out << seriesName(name, {constantLabels, labels}) << ' ' << s->counter->value() << '\n';
+            } else if (s->gauge) {
+                out << seriesName(name, {constantLabels, labels}) << ' ' << s->gauge->value() << '\n';
+            } else if (s->read) {
+                out << seriesName(name, {constantLabels, labels}) << ' ' << s->read() << '\n';
+            } else if (s->histogram) {
+                const Histogram &h = *s->histogram;
+                for (double q : Quantiles) {
+                    out << seriesName(name, {constantLabels, labels, "quantile=\"" + QString::number(q) + '"'})
+                        << ' ' << h.percentile(q) / 1e9 << '\n';
+                }
+                out << seriesName(name + "_sum", {constantLabels, labels}) << ' ' << h.sum() / 1e9 << '\n';
+                out << seriesName(name + "_count", {constantLabels, labels}) << ' ' << h.count() << '\n';
+            }
+        }
+    }
+    out.flush();
+    return text.toUtf8();
+}
+
+MessageMetrics::MessageMetrics(const QStringList &knownTypes) {
+    for (const QString &type : knownTypes) {
+        known.insert(type);
+    }
+}
+
+MessageMetrics::Series &MessageMetrics::series(const QString &requestType) {
+    const QString type = known.contains(requestType) ? requestType : QStringLiteral("other");
+    auto it = cache.find(type);
+    if (it != cache.end()) {
+        return *it;
+    }
+    Registry &registry = Registry::global();
+    const Labels labels{{"type", type}};
+    Series s;
+    s.messages = &registry.counter("aqi_messages_received_total", "Messages received, by requestType.", labels);
+    s.bytes = &registry.counter("aqi_message_bytes_received_total", "Payload bytes received, by requestType.", labels);
+    s.latency = &registry.histogram("aqi_message_handling_seconds",
+                                    "Time spent handling a received message, by requestType.", labels);
+    return *cache.insert(type, s);
+}
+
+void MessageMetrics::received(const QString &type, qint64 bytes) {
+    Series &s = series(type);
+    s.messages->add();
+    s.bytes->add(bytes);
+}
+
+void MessageMetrics::handled(const QString &type, qint64 nanoseconds) {
+    series(type).latency->record(nanoseconds);
+}
+
+void Span::start(const QString &traceId) {
+    trace = traceId;
+    timer.start();
+}
+
+void Span::finish(QJsonObject &response, const QString &node, const QString &stage) const {
+    const qint64 ns = timer.nsecsElapsed();
+    // Stages are few and fixed, so a per-thread cache keeps the registry lock off this path.
+    thread_local QHash<QString, Histogram *> histograms;
+    Histogram *&histogram = histograms[stage];
+    if (!histogram) {
+        histogram = &Registry::global().histogram("aqi_span_duration_seconds",
+                                                  "Time a traced request spent at this node, by stage.",
+                                                  {{"stage", stage}});
+    }
+    histogram->record(ns);
+
+    const double ms = ns / 1e6;
+    QJsonArray spans = response["spans"].toArray();
+    spans.append(QJsonObject{{"node", node}, {"stage", stage}, {"ms", ms}});
+    response["spans"] = spans;
+    if (!trace.isEmpty()) {
+        response["trace"] = trace;
+    }
+    qCDebug(lcTrace) << trace << stage << "at" << node << ms << "ms";
+}
+
+}
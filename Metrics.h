@@ -0,0 +1,155 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QMap>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+class QObject;
+
+namespace Metrics {
+
+using Labels = QVector<QPair<QString, QString>>;
+
+// Counters, gauges and histograms are updated with relaxed atomics and never lock, so
+// any thread may record into them; the registry only locks to create a series or to
+// scrape. Look a series up once and keep the reference: it lives as long as the process.
+class Counter {
+public:
+    void add(qint64 n = 1) { total.fetch_add(n, std::memory_order_relaxed); }
+    qint64 value() const { return total.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<qint64> total{0};
+};
+
+class Gauge {
+public:
+    void set(double v) { current.store(v, std::memory_order_relaxed); }
+    double value() const { return current.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> current{0};
+};
+
+// Log-linear (HDR-style) histogram of non-negative integers, here nanoseconds: values
+// below 32 get a bucket each, and every power of two above is split into 32 buckets,
+// so a recorded value is known to within ~3% across the whole 64-bit range.
+class Histogram {
+public:
+    static constexpr int SubBuckets = 32;
+    static constexpr int BucketCount = (64 - 5 + 1) * SubBuckets;
+
+    void record(qint64 value);
+    qint64 count() const { return samples.load(std::memory_order_relaxed); }
+    qint64 sum() const { return total.load(std::memory_order_relaxed); }
+    qint64 max() const { return largest.load(std::memory_order_relaxed); }
+    // Midpoint of the bucket holding the q-th quantile (0 <= q <= 1), or 0 when empty.
+    double percentile(double q) const;
+
+    static int bucketOf(quint64 value);
+    static quint64 lowerBound(int bucket);
+
+private:
+    std::array<std::atomic<qint64>, BucketCount> buckets{};
+    std::atomic<qint64> samples{0};
+    std::atomic<qint64> total{0};
+    std::atomic<qint64> largest{0};
+};
+
+// Named metric families, each a set of series told apart by their labels. scrape()
+// renders them in the Prometheus text format; histograms are exposed as summaries in
+// seconds (quantiles 0.5, 0.9, 0.99, 0.999 and 1, plus _sum and _count).
+class Registry {
+public:
+    static Registry &global();
+
+    Counter &counter(const QString &name, const QString &help, const Labels &labels = Labels());
+    Gauge &gauge(const QString &name, const QString &help, const Labels &labels = Labels());
+    Histogram &histogram(const QString &name, const QString &help, const Labels &labels = Labels());
+    // A gauge read when scraped. It is removed when owner is destroyed, so read may
+    // use owner's members; it runs on the scraping thread.
+    void gaugeCallback(const QString &name, const QString &help, QObject *owner,
+                       std::function<double()> read, const Labels &labels = Labels());
+    // The same for a count kept elsewhere that only grows.
+    void counterCallback(const QString &name, const QString &help, QObject *owner,
+                         std::function<double()> read, const Labels &labels = Labels());
+    // Labels added to every series, e.g. {"node", "register"}.
+    void setConstantLabels(const Labels &labels);
+
+    QByteArray scrape() const;
+
+private:
+    enum class Type { Counter, Gauge, Summary };
+    struct Series {
+        std::shared_ptr<Counter> counter;
+        std::shared_ptr<Gauge> gauge;
+        std::shared_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+    struct Family {
+        QString help;
+        Type type = Type::Counter;
+        QMap<QString, Series> series;  // by rendered labels
+    };
+
+    Series &series(const QString &name, const QString &help, Type type, const Labels &labels);
+    void callback(const QString &name, const QString &help, Type type, QObject *owner,
+                  std::function<double()> read, const Labels &labels);
+    static QString render(const Labels &labels);
+
+    mutable QMutex mutex;
+    QMap<QString, Family> families;
+    QString constantLabels;
+};
+
+// Traffic and handling time per requestType of one node. Series are looked up once per
+// type and cached, so recording is a hash lookup and a few relaxed adds; the cache
+// itself is not thread-safe, so use one instance per thread. requestType comes from
+// the peer, so only the node's known types get a label of their own; any other is
+// counted as "other", which keeps the number of series fixed.
+class MessageMetrics {
+public:
+    explicit MessageMetrics(const QStringList &knownTypes);
+
+    void received(const QString &type, qint64 bytes);
+    void handled(const QString &type, qint64 nanoseconds);
+
+private:
+    struct Series {
+        Counter *messages = nullptr;
+        Counter *bytes = nullptr;
+        Histogram *latency = nullptr;
+    };
+    Series &series(const QString &requestType);
+
+    QSet<QString> known;
+    QHash<QString, Series> cache;
+};
+
+// One hop of a traced request. Register nodes give each query a "trace" ID (unless
+// the client sent one) that is forwarded with it; every node it passes through records
+// how long it held the request in aqi_span_duration_seconds and appends
+// {"node", "stage", "ms"} to the response's "spans", so the client sees the breakdown.
+struct Span {
+    QString trace;
+    QElapsedTimer timer;
+
+    void start(const QString &traceId);
+    void finish(QJsonObject &response, const QString &node, const QString &stage) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "MetricsEndpoint.h"
+#include <QDebug>
+#include <QTcpSocket>
+#include <QUrl>
+#include <QUrlQuery>
+#include "Logging.h"
+#include "Metrics.h"
+
+namespace {
+const int MaxRequestHeadBytes = 8 * 1024;
+}
+
+MetricsEndpoint::MetricsEndpoint(QObject *parent) : QObject(parent) {
+    connect(&server, &QTcpServer::newConnection, this, &MetricsEndpoint::onNewConnection);
+}
+
+bool MetricsEndpoint::listen(const QHostAddress &address, quint16 port) {
+    if (!server.listen(address, port)) {
+        qWarning() << "MetricsEndpoint: cannot listen on" << address.toString() << port << ":" << server.errorString();
+        return false;
+    }
+    return true;
+}
+
+void MetricsEndpoint::onNewConnection() {
+    while (QTcpSocket *socket = server.nextPendingConnection()) {
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket] { onReadyRead(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket] {
+            requests.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void MetricsEndpoint::onReadyRead(QTcpSocket *socket) {
+    QByteArray &head = requests[socket];
+    head += socket->readAll();
+    if (!head.contains("\r\n\r\n") && !head.contains("\n\n")) {
+        if (head.size() > MaxRequestHeadBytes) {
+            respond(socket, 400, "request too large\n");
+        }
+        return;
+    }
+    const QList<QByteArray> requestLine = head.left(head.indexOf('\n')).trimmed().split(' ');
+    if (requestLine.size() < 2 || requestLine[0] != "GET") {
+        respond(socket, 405, "only GET is supported\n");
+        return;
+    }
+    const QUrl url(QString::fromLatin1(requestLine[1]));
+    if (url.path() == "/metrics") {
+        respond(socket, 200, Metrics::Registry::global().scrape());
+    } else if (url.path() == "/log") {
+        const QUrlQuery query(url);
+        if (query.hasQueryItem("rules")) {
+            Logging::setRules(query.queryItemValue("rules", QUrl::FullyDecoded));
+            qInfo() << "Log rules set to" << Logging::rules();
+        }
+        respond(socket, 200, Logging::rules().toUtf8() + '\n');
+    } else {
+        respond(socket, 404, "not found\n");
+    }
+}
+
+void MetricsEndpoint::respond(QTcpSocket *socket, int status, const QByteArray &body) {
+    const QByteArray reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+                              : status == 405 ? "Method Not Allowed" : "Bad Request";
+    QByteArray response = "HTTP/1.0 " + QByteArray::number(status) + ' ' + reason + "\r\n";
+    response += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+    response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    response += "Connection: close\r\n\r\n";
+    response += body;
+    requests.remove(socket);
+    socket->disconnect(this);
+    connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    socket->write(response);
+    socket->disconnectFromHost();
+}
@@ -0,0 +1,36 @@
+#ifndef METRICSENDPOINT_H
+#define METRICSENDPOINT_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+#include <QTcpServer>
+
+class QTcpSocket;
+
+// Minimal HTTP/1.0 server for operators and scrapers, separate from the framed node
+// port. GET /metrics returns Metrics::Registry::global().scrape() as plain text;
+// GET /log shows the runtime log rules and GET /log?rules=... replaces them
+// (see Logging::setRules). Every response closes the connection.
+class MetricsEndpoint : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr quint16 DefaultPort = 12352;
+
+    explicit MetricsEndpoint(QObject *parent = nullptr);
+
+    bool listen(const QHostAddress &address, quint16 port);
+
+private slots:
+    void onNewConnection();
+
+private:
+    void onReadyRead(QTcpSocket *socket);
+    void respond(QTcpSocket *socket, int status, const QByteArray &body);
+
+    QTcpServer server;
+    QHash<QTcpSocket *, QByteArray> requests;  // request head read so far
+};
+
+#endif
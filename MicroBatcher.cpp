@@ -0,0 +1,76 @@
+#include "MicroBatcher.h"
+#include "WireCodec.h"
+
+MicroBatcher::MicroBatcher(const Options &options, QObject *parent)
+    : QObject(parent), options(options) {
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    connect(&timer, &QTimer::timeout, this, &MicroBatcher::flushExpired);
+}
+
+void MicroBatcher::setOptions(const Options &newOptions) {
+    options = newOptions;
+    flushAll();
+}
+
+void MicroBatcher::add(const QString &destination, const QString &shard, const AqiRecord *rows, int count, int tag) {
+    const Key key(destination, shard);
+    Buffer &buffer = buffers[key];
+    if (buffer.rows.isEmpty()) {
+        buffer.age.start();
+        if (!timer.isActive() && options.maxDelayMs > 0) {
+            // Buffers only get younger, so the running timer already covers this one.
+            timer.start(options.maxDelayMs);
+        }
+    }
+    buffer.rows.reserve(buffer.rows.size() + count);
+    for (int i = 0; i < count; ++i) {
+        buffer.rows.append(rows[i]);
+    }
+    buffer.tags.append(tag);
+    pending += count;
+
+    if (options.maxBytes <= 0 || options.maxDelayMs <= 0
+        || qint64(buffer.rows.size()) * WireCodec::BinaryRowSize >= options.maxBytes) {
+        flush(key);
+    }
+}
+
+void MicroBatcher::flush(const Key &key) {
+    auto it = buffers.find(key);
+    if (it == buffers.end()) {
+        return;
+    }
+    const Buffer buffer = std::move(it.value());
+    buffers.erase(it);
+    pending -= buffer.rows.size();
+    ++flushed;
+    flushedRows += buffer.rows.size();
+    emit batchReady(key.first, key.second, buffer.rows, buffer.tags);
+}
+
+void MicroBatcher::flushAll() {
+    timer.stop();
+    for (const Key &key : buffers.keys()) {
+        flush(key);
+    }
+}
+
+void MicroBatcher::flushExpired() {
+    qint64 next = -1;
+    for (const Key &key : buffers.keys()) {
+        auto it = buffers.constFind(key);
+        if (it == buffers.constEnd()) {
+            continue;  // flushed by a batchReady handler
+        }
+        const qint64 waited = it->age.elapsed();
+        if (waited >= options.maxDelayMs) {
+            flush(key);
+        } else if (next < 0 || options.maxDelayMs - waited < next) {
+            next = options.maxDelayMs - waited;
+        }
+    }
+    if (next >= 0) {
+        timer.start(static_cast<int>(next));
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef MICROBATCHER_H
+#define MICROBATCHER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QTimer>
+#include <QVector>
+#include "AqiRecord.h"
+
+// Coalesces the rows of many small ingestion requests bound for the same destination
+// (and shard) into one message. A destination's rows are flushed once their binary
+// encoding would reach maxBytes or the oldest of them has waited maxDelayMs, whichever
+// comes first. Each request's tag travels with the batch that carries its rows, so
+// acknowledgments can be mapped back to the requests. A maxBytes or maxDelayMs of 0
+// turns batching off: every add() is flushed at once.
+class MicroBatcher : public QObject {
+    Q_OBJECT
+
+public:
+    struct Options {
+        qint64 maxBytes = 64 * 1024;
+        int maxDelayMs = 5;
+    };
+
+    explicit MicroBatcher(const Options &options = Options(), QObject *parent = nullptr);
+
+    void add(const QString &destination, const QString &shard, const AqiRecord *rows, int count, int tag);
+    void flushAll();
+    void setOptions(const Options &options);
+
+    qint64 pendingRows() const { return pending; }
+    qint64 batchesFlushed() const { return flushed; }
+    qint64 rowsFlushed() const { return flushedRows; }
+
+signals:
+    // tags holds one entry per add() whose rows are in this batch.
+    void batchReady(const QString &destination, const QString &shard, const AqiBatch &rows, const QVector<int> &tags);
+
+private slots:
+    void flushExpired();
+
+private:
+    struct Buffer {
+        AqiBatch rows;
+        QVector<int> tags;
+        QElapsedTimer age;
+    };
+    using Key = QPair<QString, QString>;
+
+    void flush(const Key &key);
+
+    Options options;
+    QHash<Key, Buffer> buffers;
+    QTimer timer;
+    qint64 pending = 0;
+    qint64 flushed = 0;
+    qint64 flushedRows = 0;
+};
+
+#endif
@@ -0,0 +1,1609 @@
+#include <QCoreApplication>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QDebug>
+#include <QFile>
+#include <QThread>
+#include <QDir>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSemaphore>
+#include <QTemporaryDir>
+#include <QTimer>
+#include <QRandomGenerator>
+#include "ConnectionPool.h"
+#include "MicroBatcher.h"
+#include "ReactorServer.h"
+#include "ShardRing.h"
+#include "MessageFraming.h"
+#include "WireCodec.h"
+#include "ColumnStore.h"
+#include "AggregationKernels.h"
+#include "QueryEngine.h"
+#include "QueryCache.h"
+#include "StandingQuery.h"
+#include "PartitionedStore.h"
+#include "Rollups.h"
+#include "WriteAheadLog.h"
+#include "SegmentFile.h"
+#include "Worker.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "StringPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <ctime>
+#include <new>
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+// Usage: MicroBenchmarks [suite...]   (runs every suite when none is given)
+
+// Result checks that failed in any suite; main() returns non-zero when there are any.
+static int failedChecks = 0;
+
+static bool check(bool ok) {
+    if (!ok) {
+        ++failedChecks;
+    }
+    return ok;
+}
+
+// Every heap allocation in the process, so suites can report allocations per row.
+static std::atomic<qint64> allocationCount{0};
+
+void *operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+static const char *const sampleAreas[] = {
+    "Crescent City", "Eureka", "Redding", "Sacramento", "Fresno", "Bakersfield", "Los Angeles", "San Diego"
+};
+static const char *const samplePollutants[] = {"PM2.5", "PM10", "OZONE", "NO2"};
+
+static QJsonArray sampleRow(int i) {
+    int station = i % 64;
+    return QJsonArray({
+        AqiRecord::formatTimestamp(1597021200 + (i / 64) * 3600) + "@1",
+        QString::number(41.75613 - station * 0.11, 'f', 5),
+        QString::number(-124.20347 + station * 0.07, 'f', 5),
+        samplePollutants[i % 4],
+        QString::number(10 + i % 40),
+        "UG/M3",
+        "18.0",
+        QString::number(20 + i % 80),
+        "2",
+        sampleAreas[station % 8],
+        "North Coast Unified Air Quality Management District",
+        QString::number(840060150000LL + station),
+        QString::number(840060150000LL + station)
+    });
+}
+
+static AqiBatch sampleBatch(int rows) {
+    AqiBatch batch;
+    batch.reserve(rows);
+    for (int i = 0; i < rows; ++i) {
+        AqiRecord record;
+        AqiRecord::fromJsonArray(sampleRow(i), record);
+        batch.append(record);
+    }
+    return batch;
+}
+
+// Resident set size of this process, or -1 where it cannot be read.
+static qint64 residentBytes() {
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (statm.open(QIODevice::ReadOnly)) {
+        QList<QByteArray> fields = statm.readAll().split(' ');
+        if (fields.size() > 1) {
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    return -1;
+}
+
+// Open file descriptors of this process, or -1 where they cannot be listed.
+static int openDescriptors() {
+#ifdef Q_OS_LINUX
+    return QDir("/proc/self/fd").entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System).size();
+#else
+    return -1;
+#endif
+}
+
+static QString megabytes(qint64 bytes) {
+    return bytes < 0 ? QString("n/a") : QString("%1 MB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+}
+
+static QJsonObject sampleIngestionMessage(int rows) {
+    QJsonArray data;
+    for (int i = 0; i < rows; ++i) {
+        data.append(sampleRow(i));
+    }
+    return QJsonObject{
+        {"requestType", "analytics"},
+        {"requestID", 123},
+        {"Data", data}
+    };
+}
+
+// Pipelines back-to-back frames over loopback and parses them on the receiving side.
+static void benchmarkFraming() {
+    const int messageCount = 20000;
+
+    QTcpServer server;
+    if (!check(server.listen(QHostAddress::LocalHost, 0))) {
+        qInfo() << "framing: failed to listen on loopback";
+        return;
+    }
+    QTcpSocket client;
+    client.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    if (!check(client.waitForConnected(5000) && server.waitForNewConnection(5000))) {
+        qInfo() << "framing: failed to connect over loopback";
+        return;
+    }
+    QTcpSocket *peer = server.nextPendingConnection();
+
+    QByteArray frame = MessageFraming::frame(
+        QJsonDocument(sampleIngestionMessage(3)).toJson(QJsonDocument::Compact));
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < messageCount; ++i) {
+        client.write(frame);
+    }
+
+    FrameReader reader;
+    QByteArray payload;
+    int received = 0;
+    int reads = 0;
+    while (received < messageCount) {
+        client.flush();
+        if (!peer->waitForReadyRead(1000) && client.bytesToWrite() == 0) {
+            break;
+        }
+        reader.readFrom(peer);
+        ++reads;
+        while (reader.nextFrame(payload)) {
+            if (!QJsonDocument::fromJson(payload).isNull()) {
+                ++received;
+            }
+        }
+    }
+    qint64 elapsedNs = timer.nsecsElapsed();
+
+    double seconds = elapsedNs / 1e9;
+    double megabytes = static_cast<double>(frame.size()) * received / (1024 * 1024);
+    qInfo().noquote() << QString("framing: %1/%2 messages, %3 reads, %4 msg/s, %5 MB/s")
+                             .arg(received).arg(messageCount).arg(reads)
+                             .arg(received / seconds, 0, 'f', 0)
+                             .arg(megabytes / seconds, 0, 'f', 1);
+}
+
+// Bytes on wire and encode/decode time of one 100k-row ingestion batch per encoding.
+static void benchmarkWireFormat() {
+    const int rowCount = 100000;
+    AqiBatch batch = sampleBatch(rowCount);
+    QJsonObject fields{{"requestType", "analytics"}, {"requestID", 123}};
+
+    auto report = [](const char *name, qint64 bytes, qint64 encodeNs, qint64 decodeNs) {
+        qInfo().noquote() << QString("wire: %1 %2 bytes (%3 B/row), encode %4 ms, decode %5 ms")
+                                 .arg(name, -14).arg(bytes)
+                                 .arg(static_cast<double>(bytes) / rowCount, 0, 'f', 1)
+                                 .arg(encodeNs / 1e6, 0, 'f', 1)
+                                 .arg(decodeNs / 1e6, 0, 'f', 1);
+    };
+
+    QElapsedTimer timer;
+
+    // What the nodes sent before: an indented document of 13-string arrays.
+    timer.start();
+    QJsonArray data;
+    for (const AqiRecord &record : batch) {
+        data.append(record.toJsonArray());
+    }
+    QJsonObject legacy = fields;
+    legacy["Data"] = data;
+    QByteArray indented = QJsonDocument(legacy).toJson();
+    qint64 encodeNs = timer.nsecsElapsed();
+    timer.restart();
+    QJsonArray parsed = QJsonDocument::fromJson(indented).object()["Data"].toArray();
+    qint64 decodeNs = timer.nsecsElapsed();
+    Q_UNUSED(parsed);
+    report("legacy json", indented.size(), encodeNs, decodeNs);
+
+    for (WireCodec::Format format : {WireCodec::Format::Json, WireCodec::Format::Binary}) {
+        timer.restart();
+        QByteArray payload = WireCodec::encode(fields, batch, format);
+        encodeNs = timer.nsecsElapsed();
+        WireMessage message;
+        timer.restart();
+        bool ok = WireCodec::decode(payload, message);
+        decodeNs = timer.nsecsElapsed();
+        if (!check(ok && message.rows.size() == rowCount)) {
+            qInfo() << "wire: round trip failed for" << WireCodec::formatName(format);
+        }
+        report(qPrintable(WireCodec::formatName(format)), payload.size(), encodeNs, decodeNs);
+    }
+}
+
+// Memory and max/avg scan time for one million rows, as QJsonArray rows and as columns.
+static void benchmarkColumnStore() {
+    const int rowCount = 1000000;
+    QElapsedTimer timer;
+
+    qint64 before = residentBytes();
+    {
+        QList<QJsonArray> aqiData;
+        for (int i = 0; i < rowCount; ++i) {
+            aqiData.append(sampleRow(i));
+        }
+        qint64 after = residentBytes();
+
+        timer.start();
+        double maxAqi = 0, totalAqi = 0;
+        for (const QJsonArray &entry : aqiData) {
+            double aqi = entry[AqiColumn::Aqi].toString().toDouble();
+            totalAqi += aqi;
+            maxAqi = qMax(maxAqi, aqi);
+        }
+        qint64 scanNs = timer.nsecsElapsed();
+        qInfo().noquote() << QString("store: json rows  rss +%1, scan %2 ms (max %3, avg %4)")
+                                 .arg(megabytes(after < 0 ? -1 : after - before))
+                                 .arg(scanNs / 1e6, 0, 'f', 2)
+                                 .arg(maxAqi).arg(totalAqi / rowCount, 0, 'f', 2);
+    }
+
+    before = residentBytes();
+    ColumnStore store;
+    for (int offset = 0; offset < rowCount; offset += AqiSegment::Capacity) {
+        AqiBatch chunk;
+        chunk.reserve(AqiSegment::Capacity);
+        for (int i = offset; i < qMin(rowCount, offset + AqiSegment::Capacity); ++i) {
+            AqiRecord record;
+            AqiRecord::fromJsonArray(sampleRow(i), record);
+            chunk.append(record);
+        }
+        store.append(chunk);
+    }
+    qint64 after = residentBytes();
+
+    timer.restart();
+    double maxAqi = 0, totalAqi = 0;
+    for (const AqiSegment &segment : store.segments()) {
+        const double *aqi = segment.aqi.constData();
+        for (int i = 0; i < segment.size(); ++i) {
+            totalAqi += aqi[i];
+            maxAqi = qMax(maxAqi, aqi[i]);
+        }
+    }
+    qint64 scanNs = timer.nsecsElapsed();
+    qInfo().noquote() << QString("store: columns    rss +%1 (accounted %2), scan %3 ms (max %4, avg %5)")
+                             .arg(megabytes(after < 0 ? -1 : after - before))
+                             .arg(megabytes(store.memoryUsage()))
+                             .arg(scanNs / 1e6, 0, 'f', 2)
+                             .arg(maxAqi).arg(totalAqi / rowCount, 0, 'f', 2);
+}
+
+// Max/avg scan over ten million AQI values with and without a pollutant mask, per ISA.
+static void benchmarkKernels() {
+    const int rowCount = 10000000;
+    QVector<double> aqi(rowCount);
+    QVector<quint32> pollutant(rowCount);
+    QVector<quint8> mask(rowCount);
+    for (int i = 0; i < rowCount; ++i) {
+        aqi[i] = (i * 7919) % 500;
+        pollutant[i] = static_cast<quint32>(i % 4);
+    }
+
+    const AggregationKernels::Isa supported = AggregationKernels::supportedIsa();
+    for (int level = 0; level <= static_cast<int>(supported); ++level) {
+        auto isa = static_cast<AggregationKernels::Isa>(level);
+        AggregationKernels::setActiveIsa(isa);
+
+        QElapsedTimer timer;
+        timer.start();
+        AggregationKernels::Aggregate all = AggregationKernels::aggregate(aqi.constData(), nullptr, rowCount);
+        qint64 scanNs = timer.nsecsElapsed();
+
+        timer.restart();
+        AggregationKernels::equalsMask(pollutant.constData(), 0, mask.data(), rowCount);
+        AggregationKernels::Aggregate filtered = AggregationKernels::aggregate(aqi.constData(), mask.constData(), rowCount);
+        qint64 maskedNs = timer.nsecsElapsed();
+
+        qInfo().noquote() << QString("kernels: %1 full %2 ms (max %3 @%4, avg %5), masked %6 ms (%7 rows)")
+                                 .arg(AggregationKernels::isaName(isa), -6)
+                                 .arg(scanNs / 1e6, 0, 'f', 2)
+                                 .arg(all.max).arg(all.argmax).arg(all.average(), 0, 'f', 2)
+                                 .arg(maskedNs / 1e6, 0, 'f', 2)
+                                 .arg(filtered.count);
+    }
+    AggregationKernels::setActiveIsa(supported);
+}
+
+// Parallel max/avg query latency over eight million rows as the pool grows to the core count.
+static void benchmarkPartitions() {
+    const int cores = QThread::idealThreadCount();
+    const AqiBatch batch = sampleBatch(AqiSegment::Capacity);
+    PartitionedStore store(cores);
+    for (int i = 0; i < 128; ++i) {
+        store.append(batch);
+    }
+
+    double baselineMs = 0;
+    for (int threads = 1; threads <= cores; threads = threads < cores ? qMin(threads * 2, cores) : cores + 1) {
+        WorkStealingPool pool(threads);
+        qint64 bestNs = std::numeric_limits<qint64>::max();
+        MaxAverageResult result;
+        for (int run = 0; run < 5; ++run) {
+            QElapsedTimer timer;
+            timer.start();
+            result = QueryEngine::maxAverage(store, pool, QString());
+            bestNs = qMin(bestNs, timer.nsecsElapsed());
+        }
+        double ms = bestNs / 1e6;
+        if (threads == 1) {
+            baselineMs = ms;
+        }
+        qInfo().noquote() << QString("partitions: %1 rows, %2 threads %3 ms (x%4), max %5 in %6")
+                                 .arg(store.rowCount()).arg(threads, 2)
+                                 .arg(ms, 0, 'f', 2).arg(baselineMs / ms, 0, 'f', 2)
+                                 .arg(result.aqi.max).arg(result.maxArea);
+    }
+}
+
+// One-day query over a month of hourly readings from 2000 stations, uploaded station by
+// station: daily buckets with zone maps against a single bucket (append-order segments).
+static void benchmarkZoneMaps() {
+    const int stations = 2000;
+    const int hours = 30 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+    const qint64 unbucketed = 10LL * 365 * 24 * 3600;
+
+    PartitionedStore::Partition daily, single;
+    single.store = ColumnStore(unbucketed);
+    for (int station = 0; station < stations; ++station) {
+        AqiBatch upload;
+        upload.reserve(hours);
+        for (int hour = 0; hour < hours; ++hour) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.latitude = 32.5 + (station % 50) * 0.19;
+            record.longitude = -124.2 + (station / 50) * 0.2;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour) % 120;
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            upload.append(record);
+        }
+        daily.store.append(upload);
+        single.store.append(upload);
+    }
+
+    QuerySpec spec;
+    spec.pollutants = QStringList{"PM2.5"};
+    spec.from = start + 14 * 24 * 3600;
+    spec.to = spec.from + 24 * 3600;
+    spec.groupBy = {GroupField::Area};
+    AggregateSpec avg, max;
+    AggregateSpec::parse("avg(aqi)", avg);
+    AggregateSpec::parse("max(aqi)", max);
+    spec.aggregates = {avg, max};
+
+    double singleMs = 0;
+    for (PartitionedStore::Partition *partition : {&single, &daily}) {
+        qint64 bestNs = std::numeric_limits<qint64>::max();
+        QueryResult result;
+        for (int run = 0; run < 5; ++run) {
+            QElapsedTimer timer;
+            timer.start();
+            result = QueryEngine::execute(spec, *partition);
+            bestNs = qMin(bestNs, timer.nsecsElapsed());
+        }
+        const double ms = bestNs / 1e6;
+        if (partition == &single) {
+            singleMs = ms;
+        }
+        qInfo().noquote() << QString("zonemaps: %1 bucket, %2 rows in %3 segments, scanned %4 skipped %5, "
+                                     "%6 ms (x%7), %8 groups")
+                                 .arg(partition == &single ? "single" : "daily ")
+                                 .arg(partition->store.rowCount()).arg(partition->store.segments().size())
+                                 .arg(result.segmentsScanned).arg(result.segmentsSkipped)
+                                 .arg(ms, 0, 'f', 2).arg(singleMs / ms, 0, 'f', 1)
+                                 .arg(result.groups.size());
+    }
+}
+
+// Dashboard queries answered from the rollup tiers against the same queries scanning
+// raw rows: daily AQI per area over a week, and hourly AQI per area over one day.
+static void benchmarkRollups() {
+    const int stations = 2000;
+    const int hours = 30 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+
+    WorkStealingPool pool(QThread::idealThreadCount());
+    PartitionedStore store(QThread::idealThreadCount());
+    QElapsedTimer ingest;
+    ingest.start();
+    for (int station = 0; station < stations; ++station) {
+        AqiBatch upload;
+        upload.reserve(hours);
+        for (int hour = 0; hour < hours; ++hour) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour) % 120;
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            upload.append(record);
+        }
+        store.append(ColumnBatch::fromRows(upload));
+    }
+    const RollupStore &rollups = store.rollups();
+    qInfo().noquote() << QString("rollups: %1 rows stored in %2 ms; cells minute %3, hour %4, day %5")
+                             .arg(store.rowCount()).arg(ingest.elapsed())
+                             .arg(rollups.cellCount(RollupStore::Minute)).arg(rollups.cellCount(RollupStore::Hour))
+                             .arg(rollups.cellCount(RollupStore::Day));
+
+    auto aggregates = [](const QStringList &names) {
+        QVector<AggregateSpec> list;
+        for (const QString &name : names) {
+            AggregateSpec aggregate;
+            AggregateSpec::parse(name, aggregate);
+            list.append(aggregate);
+        }
+        return list;
+    };
+    QuerySpec weekly;
+    weekly.from = start + 7 * 24 * 3600;
+    weekly.to = weekly.from + 7 * 24 * 3600;
+    weekly.groupBy = {GroupField::Area, GroupField::Pollutant};
+    weekly.aggregates = aggregates({"count", "avg(aqi)", "max(aqi)", "p95(aqi)", "distinct(station)"});
+    QuerySpec hourly;
+    hourly.pollutants = QStringList{"PM2.5"};
+    hourly.from = start + 14 * 24 * 3600;
+    hourly.to = hourly.from + 24 * 3600;
+    hourly.groupBy = {GroupField::Area, GroupField::Hour};
+    hourly.aggregates = aggregates({"count", "avg(aqi)", "min(concentration)"});
+
+    for (const auto &query : {qMakePair(QString("weekly"), weekly), qMakePair(QString("hourly"), hourly)}) {
+        qint64 rawNs = std::numeric_limits<qint64>::max();
+        qint64 rollupNs = std::numeric_limits<qint64>::max();
+        QueryResult raw, rolled;
+        RollupStore::Tier tier = RollupStore::Minute;
+        bool answered = false;
+        for (int run = 0; run < 5; ++run) {
+            QElapsedTimer timer;
+            timer.start();
+            raw = QueryEngine::execute(query.second, store, pool);
+            rawNs = qMin(rawNs, timer.nsecsElapsed());
+            timer.restart();
+            answered = rollups.answer(query.second, rolled, tier);
+            rollupNs = qMin(rollupNs, timer.nsecsElapsed());
+        }
+        const bool same = answered
+                          && raw.toJson()["rows"].toArray().size() == rolled.toJson()["rows"].toArray().size()
+                          && std::all_of(raw.groups.keyBegin(), raw.groups.keyEnd(), [&](const QString &key) {
+                                 return rolled.groups.value(key).aqi.count == raw.groups[key].aqi.count
+                                        && rolled.groups.value(key).aqi.sum == raw.groups[key].aqi.sum;
+                             });
+        qInfo().noquote() << QString("rollups: %1 query, raw scan %2 ms, %3 tier %4 ms (x%5), %6 groups, %7")
+                                 .arg(query.first).arg(rawNs / 1e6, 0, 'f', 2)
+                                 .arg(answered ? RollupStore::tierName(tier) : QString("no"))
+                                 .arg(rollupNs / 1e6, 0, 'f', 3).arg(double(rawNs) / rollupNs, 0, 'f', 0)
+                                 .arg(raw.groups.size()).arg(check(same) ? "same counts and sums" : "MISMATCH");
+    }
+}
+
+// Station lookups and area-and-pollutant queries over a month of hourly readings from
+// 2000 stations, resolved through the sealed segments' posting lists against masking
+// every row of the filtered columns.
+static void benchmarkIndexes() {
+    const int stations = 2000;
+    const int hours = 30 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+
+    PartitionedStore::Partition partition;
+    QElapsedTimer ingest;
+    ingest.start();
+    for (int hour = 0; hour < hours; ++hour) {
+        AqiBatch readings;
+        readings.reserve(stations);
+        for (int station = 0; station < stations; ++station) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.latitude = 32.5 + (station % 50) * 0.19;
+            record.longitude = -124.2 + (station / 50) * 0.2;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour) % 120;
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            readings.append(record);
+        }
+        partition.store.append(readings);
+    }
+    qint64 indexBytes = 0;
+    int indexed = 0;
+    for (const AqiSegment &segment : partition.store.segments()) {
+        if (segment.index) {
+            indexBytes += segment.index->memoryUsage();
+            ++indexed;
+        }
+    }
+    qInfo().noquote() << QString("indexes: %1 rows stored in %2 ms, %3 of %4 segments indexed, "
+                                 "%5 MB of postings (%6% of the store)")
+                             .arg(partition.store.rowCount()).arg(ingest.elapsed())
+                             .arg(indexed).arg(partition.store.segments().size())
+                             .arg(indexBytes / 1e6, 0, 'f', 1)
+                             .arg(100.0 * indexBytes / partition.store.memoryUsage(), 0, 'f', 1);
+
+    auto aggregates = [](const QStringList &names) {
+        QVector<AggregateSpec> list;
+        for (const QString &name : names) {
+            AggregateSpec aggregate;
+            AggregateSpec::parse(name, aggregate);
+            list.append(aggregate);
+        }
+        return list;
+    };
+    QuerySpec station;
+    station.stations = QStringList{QString::number(840060000000LL + 1234)};
+    station.aggregates = aggregates({"count", "avg(aqi)", "max(aqi)"});
+    QuerySpec conjunction;
+    conjunction.areas = QStringList{sampleAreas[5]};
+    conjunction.pollutants = QStringList{samplePollutants[1]};
+    conjunction.from = start + 7 * 24 * 3600;
+    conjunction.to = conjunction.from + 7 * 24 * 3600;
+    conjunction.aggregates = aggregates({"count", "avg(aqi)", "min(concentration)"});
+    QuerySpec disjoint = conjunction;
+    disjoint.pollutants = QStringList{samplePollutants[2]};  // no station of the area measures it
+
+    const QVector<QPair<QString, QuerySpec>> queries = {
+        {"station", station}, {"area+pollutant", conjunction}, {"disjoint", disjoint}};
+    for (const auto &query : queries) {
+        qint64 scanNs = std::numeric_limits<qint64>::max();
+        qint64 indexNs = std::numeric_limits<qint64>::max();
+        QueryResult scanned, looked;
+        for (int run = 0; run < 5; ++run) {
+            QElapsedTimer timer;
+            timer.start();
+            scanned = QueryEngine::execute(query.second, partition, false);
+            scanNs = qMin(scanNs, timer.nsecsElapsed());
+            timer.restart();
+            looked = QueryEngine::execute(query.second, partition);
+            indexNs = qMin(indexNs, timer.nsecsElapsed());
+        }
+        const GroupState scannedGroup = scanned.groups.value(QString());
+        const GroupState lookedGroup = looked.groups.value(QString());
+        const bool same = scannedGroup.aqi.count == lookedGroup.aqi.count
+                          && scannedGroup.aqi.sum == lookedGroup.aqi.sum;
+        qInfo().noquote() << QString("indexes: %1 query, %2 rows, mask scan %3 ms, postings %4 ms (x%5), "
+                                     "skipped %6 of %7 segments, %8")
+                                 .arg(query.first).arg(lookedGroup.aqi.count)
+                                 .arg(scanNs / 1e6, 0, 'f', 3).arg(indexNs / 1e6, 0, 'f', 3)
+                                 .arg(double(scanNs) / indexNs, 0, 'f', 1)
+                                 .arg(looked.segmentsSkipped).arg(looked.segmentsScanned + looked.segmentsSkipped)
+                                 .arg(check(same) ? "same counts and sums" : "MISMATCH");
+    }
+}
+
+// Region queries over two weeks of hourly readings from 4000 stations scattered over
+// the contiguous US: the grid cells of the segment indexes against testing every row.
+static void benchmarkGeo() {
+    const int stations = 4000;
+    const int hours = 14 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+
+    QRandomGenerator random(42);
+    QVector<QPair<double, double>> sites;
+    for (int station = 0; station < stations; ++station) {
+        sites.append(qMakePair(25.0 + random.bounded(24.0), -124.5 + random.bounded(57.5)));
+    }
+    PartitionedStore::Partition partition;
+    for (int hour = 0; hour < hours; ++hour) {
+        AqiBatch readings;
+        readings.reserve(stations);
+        for (int station = 0; station < stations; ++station) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.latitude = sites[station].first;
+            record.longitude = sites[station].second;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour) % 120;
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "EPA";
+            record.aqsId = QString::number(840000000000LL + station);
+            readings.append(record);
+        }
+        partition.store.append(readings);
+    }
+
+    auto aggregates = [](const QStringList &names) {
+        QVector<AggregateSpec> list;
+        for (const QString &name : names) {
+            AggregateSpec aggregate;
+            AggregateSpec::parse(name, aggregate);
+            list.append(aggregate);
+        }
+        return list;
+    };
+    QuerySpec denver;
+    denver.hasRadius = true;
+    denver.centerLatitude = 39.7392;
+    denver.centerLongitude = -104.9903;
+    denver.radiusKm = 50;
+    denver.aggregates = aggregates({"count", "avg(aqi)", "max(aqi)"});
+    QuerySpec chicago = denver;
+    chicago.centerLatitude = 41.8781;
+    chicago.centerLongitude = -87.6298;
+    chicago.radiusKm = 300;
+    chicago.pollutants = QStringList{"PM2.5"};
+    chicago.from = start + 7 * 24 * 3600;
+    chicago.to = chicago.from + 7 * 24 * 3600;
+    QuerySpec california;
+    california.hasBoundingBox = true;
+    california.minLatitude = 32.5;
+    california.minLongitude = -124.5;
+    california.maxLatitude = 42;
+    california.maxLongitude = -114;
+    california.from = start + 24 * 3600;
+    california.to = california.from + 24 * 3600;
+    california.groupBy = {GroupField::Cell};
+    california.cellPrecision = 3;
+    california.aggregates = aggregates({"count", "avg(aqi)", "max(aqi)"});
+
+    const QVector<QPair<QString, QuerySpec>> queries = {
+        {"50 km of Denver", denver}, {"300 km of Chicago, PM2.5, one week", chicago},
+        {"California per cell:3, one day", california}};
+    for (const auto &query : queries) {
+        qint64 scanNs = std::numeric_limits<qint64>::max();
+        qint64 gridNs = std::numeric_limits<qint64>::max();
+        QueryResult scanned, gridded;
+        for (int run = 0; run < 5; ++run) {
+            QElapsedTimer timer;
+            timer.start();
+            scanned = QueryEngine::execute(query.second, partition, false);
+            scanNs = qMin(scanNs, timer.nsecsElapsed());
+            timer.restart();
+            gridded = QueryEngine::execute(query.second, partition);
+            gridNs = qMin(gridNs, timer.nsecsElapsed());
+        }
+        qint64 rows = 0;
+        bool same = scanned.groups.size() == gridded.groups.size();
+        for (auto it = scanned.groups.constBegin(); it != scanned.groups.constEnd(); ++it) {
+            const FieldState &expected = it.value().aqi;
+            const FieldState &actual = gridded.groups.value(it.key()).aqi;
+            rows += actual.count;
+            same = same && expected.count == actual.count && expected.max == actual.max
+                   && std::fabs(expected.sum - actual.sum) <= 1e-9 * std::fabs(expected.sum);
+        }
+        qInfo().noquote() << QString("geo: %1, %2 rows in %3 groups, row scan %4 ms, grid cells %5 ms (x%6), %7")
+                                 .arg(query.first).arg(rows).arg(gridded.groups.size())
+                                 .arg(scanNs / 1e6, 0, 'f', 3).arg(gridNs / 1e6, 0, 'f', 3)
+                                 .arg(double(scanNs) / gridNs, 0, 'f', 1)
+                                 .arg(check(same) ? "same results" : "MISMATCH");
+    }
+}
+
+// A dashboard query repeated between ingest batches: a full scan, the cached answer
+// while nothing changed, and the cached result merged with a scan of what the next
+// hourly batch touched, over a month of hourly readings from 2000 stations.
+static void benchmarkQueryCache() {
+    const int stations = 2000;
+    const int hours = 30 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+
+    auto hourOf = [&](int hour) {
+        AqiBatch readings;
+        readings.reserve(stations);
+        for (int station = 0; station < stations; ++station) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour) % 120;
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            readings.append(record);
+        }
+        return ColumnBatch::fromRows(readings);
+    };
+    WorkStealingPool pool(QThread::idealThreadCount());
+    PartitionedStore store(QThread::idealThreadCount());
+    for (int hour = 0; hour < hours; ++hour) {
+        store.append(hourOf(hour));
+    }
+
+    // Per-station maximum and p95 over the month: no rollup answers it.
+    QuerySpec spec;
+    spec.pollutants = QStringList{"PM2.5"};
+    spec.groupBy = {GroupField::Station};
+    for (const QString &name : {QString("count"), QString("max(aqi)"), QString("p95(aqi)")}) {
+        AggregateSpec aggregate;
+        AggregateSpec::parse(name, aggregate);
+        spec.aggregates.append(aggregate);
+    }
+
+    QueryCache cache;
+    auto timed = [&](QueryCache *through, QueryResult &result) {
+        QElapsedTimer timer;
+        timer.start();
+        result = QueryEngine::execute(spec, store, pool, through);
+        return timer.nsecsElapsed();
+    };
+    QueryResult uncached, miss, hit, partial, rescanned;
+    const qint64 uncachedNs = timed(nullptr, uncached);
+    const qint64 missNs = timed(&cache, miss);
+    const qint64 hitNs = timed(&cache, hit);
+    store.append(hourOf(hours));
+    const qint64 partialNs = timed(&cache, partial);
+    timed(nullptr, rescanned);
+
+    auto same = [](const QueryResult &a, const QueryResult &b) {
+        return a.groups.size() == b.groups.size()
+               && std::all_of(a.groups.keyBegin(), a.groups.keyEnd(), [&](const QString &key) {
+                      return a.groups[key].aqi.count == b.groups.value(key).aqi.count
+                             && a.groups[key].aqi.max == b.groups.value(key).aqi.max;
+                  });
+    };
+    qInfo().noquote() << QString("querycache: %1 rows, %2 groups; uncached %3 ms, miss %4 ms, hit %5 ms (x%6), "
+                                 "after one more hour %7 ms (x%8) scanning %9 segments; %10; cache %11 KB")
+                             .arg(store.rowCount()).arg(uncached.groups.size())
+                             .arg(uncachedNs / 1e6, 0, 'f', 2).arg(missNs / 1e6, 0, 'f', 2)
+                             .arg(hitNs / 1e6, 0, 'f', 3).arg(double(uncachedNs) / hitNs, 0, 'f', 0)
+                             .arg(partialNs / 1e6, 0, 'f', 2).arg(double(uncachedNs) / partialNs, 0, 'f', 1)
+                             .arg(partial.segmentsScanned)
+                             .arg(check(same(uncached, hit) && same(rescanned, partial)) ? "same results" : "MISMATCH")
+                             .arg(cache.bytes() / 1024);
+}
+
+// Bytes and accuracy of the sketch-based partials a node sends the coordinator for
+// p50/p95/p99 and distinct stations per area, against shipping every AQI value.
+static void benchmarkSketches() {
+    const int stations = 2000;
+    const int hours = 7 * 24;
+    const qint64 start = 1596240000;  // 2020-08-01T00:00
+
+    PartitionedStore::Partition partition;
+    QHash<QString, QVector<double>> exact;
+    for (int station = 0; station < stations; ++station) {
+        AqiBatch upload;
+        upload.reserve(hours);
+        for (int hour = 0; hour < hours; ++hour) {
+            AqiRecord record;
+            record.timestamp = start + hour * 3600;
+            record.pollutant = samplePollutants[station % 4];
+            record.concentration = 10 + (station + hour) % 40;
+            // Skewed so the upper percentiles sit in a long tail.
+            const double u = ((station * 7919 + hour * 104729) % 10007) / 10007.0;
+            record.aqi = std::round(20 + 15 * -std::log(1 - u * 0.9999));
+            record.siteName = sampleAreas[station % 8];
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            upload.append(record);
+            exact[record.siteName].append(record.aqi);
+        }
+        partition.store.append(upload);
+    }
+
+    QuerySpec spec;
+    QString error;
+    QuerySpec::fromJson(QJsonObject{
+        {"groupBy", "area"},
+        {"aggregates", QJsonArray{"p50(aqi)", "p95(aqi)", "p99(aqi)", "distinct(station)"}}
+    }, spec, error);
+
+    QElapsedTimer timer;
+    timer.start();
+    const QueryResult result = QueryEngine::execute(spec, partition);
+    const double scanMs = timer.nsecsElapsed() / 1e6;
+
+    const QByteArray partial = QJsonDocument(result.toPartialJson()).toJson(QJsonDocument::Compact);
+    qint64 rawBytes = 0;
+    for (const QVector<double> &values : qAsConst(exact)) {
+        QJsonArray list;
+        for (double value : values) {
+            list.append(value);
+        }
+        rawBytes += QJsonDocument(list).toJson(QJsonDocument::Compact).size();
+    }
+
+    // A coordinator merging the same partial from eight nodes.
+    timer.restart();
+    QueryResult merged;
+    merged.spec = spec;
+    for (int node = 0; node < 8; ++node) {
+        merged.merge(QueryResult::fromPartialJson(spec, QJsonDocument::fromJson(partial).object()));
+    }
+    const double mergeMs = timer.nsecsElapsed() / 1e6;
+
+    double worstRankError = 0;
+    double worstDistinctError = 0;
+    for (auto it = exact.begin(); it != exact.end(); ++it) {
+        QVector<double> &values = it.value();
+        std::sort(values.begin(), values.end());
+        const GroupState &group = result.groups[it.key()];
+        for (double p : {50.0, 95.0, 99.0}) {
+            // Error as the distance in rank between the estimate and the requested quantile.
+            const double estimate = group.aqi.percentile(p);
+            const double below = std::lower_bound(values.begin(), values.end(), estimate) - values.begin();
+            const double upTo = std::upper_bound(values.begin(), values.end(), estimate) - values.begin();
+            const double target = p / 100.0 * values.size();
+            const double miss = target < below ? below - target : (target > upTo ? target - upTo : 0);
+            worstRankError = qMax(worstRankError, miss / values.size());
+        }
+        const double distinct = stations / 8;
+        worstDistinctError = qMax(worstDistinctError, std::abs(group.stations.estimate() - distinct) / distinct);
+    }
+
+    qInfo().noquote() << QString("sketches: %1 rows in %2 areas, scan %3 ms, partial %4 KB vs %5 KB of raw values (x%6)")
+                             .arg(partition.store.rowCount()).arg(exact.size())
+                             .arg(scanMs, 0, 'f', 2)
+                             .arg(partial.size() / 1024.0, 0, 'f', 1)
+                             .arg(rawBytes / 1024.0, 0, 'f', 1)
+                             .arg(double(rawBytes) / partial.size(), 0, 'f', 0);
+    qInfo().noquote() << QString("sketches: worst quantile rank error %1%, worst distinct station error %2%, "
+                                 "8-node merge %3 ms")
+                             .arg(worstRankError * 100, 0, 'f', 3)
+                             .arg(worstDistinctError * 100, 0, 'f', 2)
+                             .arg(mergeMs, 0, 'f', 2);
+}
+
+// Cost of maintaining a 24h rolling average per area at ingest, and reading it
+// against rescanning the same window on every dashboard poll.
+static void benchmarkStandingQueries() {
+    const AqiBatch batch = sampleBatch(AqiSegment::Capacity);
+    const int batches = 16;
+
+    StandingQuerySpec definition;
+    definition.name = "aqi-24h-area";
+    definition.windowSeconds = 24 * 3600;
+    definition.paneSeconds = 3600;
+    StandingQuery standing(definition);
+    PartitionedStore::Partition partition;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < batches; ++i) {
+        partition.store.append(batch);
+    }
+    const qint64 storeNs = timer.nsecsElapsed();
+    timer.restart();
+    for (int i = 0; i < batches; ++i) {
+        standing.add(batch.constData(), batch.size());
+    }
+    const qint64 standingNs = timer.nsecsElapsed();
+    const qint64 rows = static_cast<qint64>(batches) * batch.size();
+    qInfo().noquote() << QString("standing: ingest %1 rows, store %2 ns/row, window upkeep %3 ns/row")
+                             .arg(rows).arg(storeNs / double(rows), 0, 'f', 1)
+                             .arg(standingNs / double(rows), 0, 'f', 1);
+
+    QuerySpec spec;
+    spec.to = AqiRecord::parseTimestamp(standing.result()["windowEnd"].toString());
+    spec.from = spec.to - definition.windowSeconds;
+    spec.groupBy = {GroupField::Area};
+    AggregateSpec avg;
+    AggregateSpec::parse("avg(aqi)", avg);
+    spec.aggregates = {avg};
+
+    const int polls = 1000;
+    timer.restart();
+    int groups = 0;
+    for (int i = 0; i < polls; ++i) {
+        groups += standing.result()["rows"].toArray().size();
+    }
+    const qint64 readNs = timer.nsecsElapsed() / polls;
+    timer.restart();
+    for (int i = 0; i < 10; ++i) {
+        groups += QueryEngine::execute(spec, partition).groups.size();
+    }
+    const qint64 rescanNs = timer.nsecsElapsed() / 10;
+    qInfo().noquote() << QString("standing: read %1 us, rescan %2 us (x%3), %4 groups")
+                             .arg(readNs / 1e3, 0, 'f', 2).arg(rescanNs / 1e3, 0, 'f', 1)
+                             .arg(rescanNs / double(qMax<qint64>(1, readNs)), 0, 'f', 0)
+                             .arg(standing.result()["rows"].toArray().size());
+}
+
+// Loopback server counting the frames it receives over any number of connections.
+class FrameSink : public QObject {
+public:
+    QTcpServer server;
+    qint64 received = 0;
+    std::function<void(const QByteArray &)> onFrame;  // optional, sees every frame
+
+    FrameSink() {
+        connect(&server, &QTcpServer::newConnection, this, [this] {
+            while (QTcpSocket *peer = server.nextPendingConnection()) {
+                connect(peer, &QTcpSocket::readyRead, this, [this, peer] {
+                    FrameReader &reader = readers[peer];
+                    reader.readFrom(peer);
+                    QByteArray payload;
+                    while (reader.nextFrame(payload)) {
+                        ++received;
+                        if (onFrame) {
+                            onFrame(payload);
+                        }
+                    }
+                });
+                connect(peer, &QTcpSocket::disconnected, this, [this, peer] {
+                    readers.remove(peer);
+                    peer->deleteLater();
+                });
+            }
+        });
+        server.listen(QHostAddress::LocalHost, 0);
+    }
+
+    // Runs the event loop until count frames have arrived or the timeout passes.
+    bool waitFor(qint64 count, int timeoutMs) {
+        QElapsedTimer timer;
+        timer.start();
+        while (received < count && timer.elapsed() < timeoutMs) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+        return received >= count;
+    }
+
+private:
+    QHash<QTcpSocket *, FrameReader> readers;
+};
+
+// Soak test of node-to-node sends: a socket per message (the old sendMessageToNode)
+// against the persistent ConnectionPool, reporting delivered msg/s and open fds.
+static void benchmarkConnectionPool() {
+    const QByteArray payload = WireCodec::encode(sampleIngestionMessage(3));
+    FrameSink sink;
+    if (!check(sink.server.isListening())) {
+        qInfo() << "pool: failed to listen on loopback";
+        return;
+    }
+    const quint16 port = sink.server.serverPort();
+    const int baselineFds = openDescriptors();
+
+    {
+        // Capped well below the usual 1024 fd limit, since every message leaks a socket.
+        const int messages = 500;
+        QObject owner;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < messages; ++i) {
+            QTcpSocket *client = new QTcpSocket(&owner);
+            client->connectToHost(QHostAddress::LocalHost, port);
+            client->write(MessageFraming::frame(payload));
+        }
+        sink.waitFor(messages, 10000);
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        qInfo().noquote() << QString("pool: socket per message  %1/%2 delivered, %3 msg/s, fds %4 -> %5")
+                                 .arg(sink.received).arg(messages).arg(sink.received / seconds, 0, 'f', 0)
+                                 .arg(baselineFds).arg(openDescriptors());
+    }
+    sink.waitFor(std::numeric_limits<qint64>::max(), 500);  // let the sink close its ends
+
+    const int soakMs = 5000;
+    const int inFlight = 10000;
+    ConnectionPool pool(nullptr, 1000);
+    const qint64 start = sink.received;
+    qint64 sent = 0;
+    int minFds = std::numeric_limits<int>::max(), maxFds = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < soakMs) {
+        for (int i = 0; i < 256; ++i, ++sent) {
+            pool.send("127.0.0.1", port, payload);
+        }
+        sink.waitFor(start + sent - inFlight, 1000);
+        const int fds = openDescriptors();
+        minFds = qMin(minFds, fds);
+        maxFds = qMax(maxFds, fds);
+    }
+    sink.waitFor(start + sent, 10000);
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    const qint64 delivered = sink.received - start;
+    qInfo().noquote() << QString("pool: persistent pool      %1/%2 delivered, %3 msg/s, fds %4..%5, %6 connects")
+                             .arg(delivered).arg(sent).arg(delivered / seconds, 0, 'f', 0)
+                             .arg(minFds).arg(maxFds).arg(pool.connectionsOpened());
+
+    // Past the idle timeout the pooled connection is closed again.
+    sink.waitFor(std::numeric_limits<qint64>::max(), 2500);
+    qInfo().noquote() << QString("pool: after idle timeout %1 open connections, fds %2")
+                             .arg(pool.openConnections()).arg(openDescriptors());
+}
+
+// 5-row ingestion requests forwarded over loopback through a MicroBatcher at several
+// size/latency budgets: delivered rows/s, messages sent, and the latency between a
+// request arriving and the frame carrying its rows being received.
+static void benchmarkMicroBatching() {
+    const int requests = 20000;
+    const AqiBatch request = sampleBatch(5);
+    FrameSink sink;
+    if (!check(sink.server.isListening())) {
+        qInfo() << "batching: failed to listen on loopback";
+        return;
+    }
+    const quint16 port = sink.server.serverPort();
+
+    const QList<QPair<QString, MicroBatcher::Options>> settings = {
+        {"off", MicroBatcher::Options{0, 0}},
+        {"16KB/1ms", MicroBatcher::Options{16 * 1024, 1}},
+        {"64KB/5ms", MicroBatcher::Options{64 * 1024, 5}},
+        {"256KB/20ms", MicroBatcher::Options{256 * 1024, 20}},
+    };
+    for (const auto &setting : settings) {
+        ConnectionPool pool;
+        MicroBatcher batcher(setting.second);
+        QElapsedTimer clock;
+        QVector<qint64> arrived(requests);
+        QHash<int, QVector<int>> requestsOfBatch;
+        QVector<qint64> latencies;
+        latencies.reserve(requests);
+        int nextBatch = 1;
+        QObject::connect(&batcher, &MicroBatcher::batchReady, &batcher,
+                         [&](const QString &, const QString &, const AqiBatch &rows, const QVector<int> &tags) {
+            const int id = nextBatch++;
+            requestsOfBatch.insert(id, tags);
+            pool.send("127.0.0.1", port, WireCodec::encode(QJsonObject{{"requestType", "ingestion"}, {"requestID", id}},
+                                                           rows, WireCodec::Format::Binary));
+        });
+        sink.onFrame = [&](const QByteArray &payload) {
+            WireMessage message;
+            WireCodec::decode(payload, message);
+            const qint64 now = clock.nsecsElapsed();
+            for (int tag : requestsOfBatch.take(message.fields["requestID"].toInt())) {
+                latencies.append(now - arrived[tag]);
+            }
+        };
+
+        clock.start();
+        for (int i = 0; i < requests; ++i) {
+            arrived[i] = clock.nsecsElapsed();
+            batcher.add("127.0.0.1", QString(), request.constData(), request.size(), i);
+            if (i % 64 == 63) {
+                QCoreApplication::processEvents();
+            }
+        }
+        while (latencies.size() < requests && clock.elapsed() < 30000) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+        const double seconds = clock.nsecsElapsed() / 1e9;
+        sink.onFrame = nullptr;
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) {
+            return latencies.isEmpty() ? 0.0 : latencies[qMin(latencies.size() - 1, int(p * latencies.size()))] / 1e6;
+        };
+        qInfo().noquote() << QString("batching: %1 %2 rows/s, %3 messages for %4 requests, latency p50 %5 ms p99 %6 ms")
+                                 .arg(setting.first, -10)
+                                 .arg(latencies.size() * request.size() / seconds, 0, 'f', 0)
+                                 .arg(batcher.batchesFlushed()).arg(requests)
+                                 .arg(percentile(0.5), 0, 'f', 2).arg(percentile(0.99), 0, 'f', 2);
+    }
+}
+
+// Share of 20000 station keys owned by each node against its capacity share, and
+// the fraction of keys that move when a fifth node joins.
+static void benchmarkSharding() {
+    const QList<QPair<QString, double>> nodes = {
+        {"10.0.0.1", 0.38}, {"10.0.0.2", 0.5}, {"10.0.0.3", 0.5}, {"10.0.0.4", 0.73}
+    };
+    const int keys = 20000;
+    ShardRing ring(2);
+    double totalCapacity = 0;
+    for (const auto &node : nodes) {
+        ring.addNode(node.first, node.second);
+        totalCapacity += node.second;
+    }
+
+    QHash<QString, int> owned;
+    QStringList before;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < keys; ++i) {
+        const QString primary = ring.primaryOf(QString::number(840060000000LL + i));
+        ++owned[primary];
+        before.append(primary);
+    }
+    const double lookupNs = timer.nsecsElapsed() / double(keys);
+    for (const auto &node : nodes) {
+        qInfo().noquote() << QString("sharding: %1 capacity %2%, owns %3% of keys, replicas on %4")
+                                 .arg(node.first).arg(100 * node.second / totalCapacity, 0, 'f', 1)
+                                 .arg(100.0 * owned[node.first] / keys, 0, 'f', 1)
+                                 .arg(ring.replicasFor(node.first).join(","));
+    }
+
+    ring.addNode("10.0.0.5", 0.5);
+    int moved = 0;
+    for (int i = 0; i < keys; ++i) {
+        if (ring.primaryOf(QString::number(840060000000LL + i)) != before[i]) {
+            ++moved;
+        }
+    }
+    qInfo().noquote() << QString("sharding: %1 ns per lookup, adding a node moved %2% of keys (ideal %3%)")
+                             .arg(lookupNs, 0, 'f', 0).arg(100.0 * moved / keys, 0, 'f', 1)
+                             .arg(100 * 0.5 / (totalCapacity + 0.5), 0, 'f', 1);
+}
+
+// Size of sealed segments in memory against segment files, and the same queries over
+// hot (in-memory) and cold (mapped file) segments.
+static void benchmarkSegmentFiles() {
+    const int cores = QThread::idealThreadCount();
+    const AqiBatch batch = sampleBatch(AqiSegment::Capacity);
+    PartitionedStore hot(cores), cold(cores);
+    for (int i = 0; i < 32; ++i) {
+        hot.append(batch);
+        cold.append(batch);
+    }
+
+    QTemporaryDir dir;
+    const qint64 before = cold.memoryUsage();
+    QElapsedTimer timer;
+    timer.start();
+    QString error;
+    const int moved = cold.moveColdSegments(0, dir.path(), error);
+    const double writeMs = timer.nsecsElapsed() / 1e6;
+    qint64 fileBytes = 0;
+    for (const QFileInfo &file : QDir(dir.path()).entryInfoList(QStringList{"*.seg"}, QDir::Files)) {
+        fileBytes += file.size();
+    }
+    qInfo().noquote() << QString("segmentfiles: %1 rows, %2 segments moved in %3 ms: %4 in memory -> %5 on disk (x%6), %7 left in memory")
+                             .arg(cold.rowCount()).arg(moved).arg(writeMs, 0, 'f', 1)
+                             .arg(megabytes(before)).arg(megabytes(fileBytes))
+                             .arg(double(before) / qMax<qint64>(1, fileBytes), 0, 'f', 2)
+                             .arg(megabytes(cold.memoryUsage()));
+
+    QuerySpec daily;
+    daily.from = 1597021200 + 10 * 24 * 3600;
+    daily.to = daily.from + 24 * 3600;
+    daily.groupBy = {GroupField::Area};
+    AggregateSpec avg;
+    AggregateSpec::parse("avg(aqi)", avg);
+    daily.aggregates = {avg};
+
+    WorkStealingPool pool(cores);
+    for (PartitionedStore *store : {&hot, &cold}) {
+        qint64 scanNs = std::numeric_limits<qint64>::max();
+        qint64 dayNs = std::numeric_limits<qint64>::max();
+        MaxAverageResult result;
+        QueryResult day;
+        for (int run = 0; run < 5; ++run) {
+            timer.restart();
+            result = QueryEngine::maxAverage(*store, pool, QString());
+            scanNs = qMin(scanNs, timer.nsecsElapsed());
+            timer.restart();
+            day = QueryEngine::execute(daily, *store, pool);
+            dayNs = qMin(dayNs, timer.nsecsElapsed());
+        }
+        qInfo().noquote() << QString("segmentfiles: %1 full scan %2 ms (max %3 in %4), one day by area %5 ms (scanned %6 skipped %7)")
+                                 .arg(store == &hot ? "hot " : "cold")
+                                 .arg(scanNs / 1e6, 0, 'f', 2).arg(result.aqi.max).arg(result.maxArea)
+                                 .arg(dayNs / 1e6, 0, 'f', 2).arg(day.segmentsScanned).arg(day.segmentsSkipped);
+    }
+}
+
+// Ingest rate with no log, with group-committed syncs and with a sync per batch, then
+// time to first query after a restart: snapshot load, log tail replay and one query.
+// AQI_RECOVERY_ROWS sets the size of the restarted node (default 5M rows).
+static void benchmarkWriteAheadLog() {
+    const int batchRows = 1000;
+    const int ingestBatches = 2000;
+    const AqiBatch batch = sampleBatch(batchRows);
+
+    auto ingest = [&](WriteAheadLog *wal, bool syncEachBatch) {
+        PartitionedStore store(QThread::idealThreadCount());
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < ingestBatches; ++i) {
+            if (wal) {
+                const quint64 sequence = wal->append(WireCodec::encode(QJsonObject{{"shard", ""}}, batch,
+                                                                      WireCodec::Format::Binary));
+                if (syncEachBatch) {
+                    wal->waitDurable(sequence);
+                }
+            }
+            store.append(batch);
+        }
+        return batchRows * double(ingestBatches) / (timer.nsecsElapsed() / 1e9);
+    };
+
+    qInfo().noquote() << QString("wal: no log            %1 rows/s").arg(ingest(nullptr, false), 0, 'f', 0);
+    {
+        QTemporaryDir dir;
+        WriteAheadLog wal(dir.path());
+        QString error;
+        check(wal.start(1, error));
+        const double rate = ingest(&wal, false);
+        qInfo().noquote() << QString("wal: group commit      %1 rows/s, %2 syncs, %3 written")
+                                 .arg(rate, 0, 'f', 0).arg(wal.commits()).arg(megabytes(wal.bytesWritten()));
+    }
+    {
+        QTemporaryDir dir;
+        WriteAheadLog wal(dir.path());
+        QString error;
+        check(wal.start(1, error));
+        const double rate = ingest(&wal, true);
+        qInfo().noquote() << QString("wal: sync per batch    %1 rows/s, %2 syncs")
+                                 .arg(rate, 0, 'f', 0).arg(wal.commits());
+    }
+
+    // The Worker logs every batch; keep the recovery run quiet.
+    QLoggingCategory::setFilterRules("default.debug=false");
+    const qint64 recoveryRows = qEnvironmentVariableIsSet("AQI_RECOVERY_ROWS")
+                                    ? qEnvironmentVariable("AQI_RECOVERY_ROWS").toLongLong()
+                                    : 5000000;
+    QTemporaryDir dir;
+    const AqiBatch recoveryBatch = sampleBatch(10000);
+    {
+        Worker worker(QThread::idealThreadCount(), dir.path());
+        for (qint64 rows = 0; rows < recoveryRows; rows += recoveryBatch.size()) {
+            worker.storeData(recoveryBatch);
+        }
+    }  // waits for the last snapshot to finish writing
+
+    QElapsedTimer timer;
+    timer.start();
+    Worker restarted(QThread::idealThreadCount(), dir.path());
+    const qint64 recoveredNs = timer.nsecsElapsed();
+    QSemaphore answered;
+    qint64 recovered = 0;
+    QObject::connect(&restarted, &Worker::queryProcessed, &restarted, [&](const QJsonObject &response) {
+        recovered = static_cast<qint64>(response["partial"].toObject()["count"].toDouble());
+        answered.release();
+    }, Qt::DirectConnection);
+    restarted.processQuery(QJsonObject{{"requestType", "query"}, {"requestID", 1}, {"partial", true}});
+    answered.acquire();
+    const qint64 firstQueryNs = timer.nsecsElapsed();
+    QLoggingCategory::setFilterRules(QString());
+
+    const qint64 stored = (recoveryRows + recoveryBatch.size() - 1) / recoveryBatch.size() * recoveryBatch.size();
+    qInfo().noquote() << QString("wal: restart with %1 rows: recovered in %2 ms, first query answered at %3 ms, %4")
+                             .arg(recoveryRows).arg(recoveredNs / 1e6, 0, 'f', 1)
+                             .arg(firstQueryNs / 1e6, 0, 'f', 1)
+                             .arg(check(recovered == stored) ? "every row back" : "ROWS LOST");
+}
+
+// Decoding a binary ingestion payload and appending it to a store, once into AqiRecords
+// as the node used to and once straight into a ColumnBatch: CPU time and heap
+// allocations per row, store growth included in both.
+static void benchmarkIngest() {
+    const int batchRows = 10000;
+    const int batches = 200;
+    const QByteArray payload = WireCodec::encode(QJsonObject{{"requestType", "analytics"}, {"requestID", 1}},
+                                                 sampleBatch(batchRows), WireCodec::Format::Binary);
+
+    for (WireCodec::Rows rows : {WireCodec::Rows::Records, WireCodec::Rows::Columns}) {
+        PartitionedStore store(QThread::idealThreadCount());
+        const qint64 allocations = allocationCount.load();
+        const std::clock_t cpu = std::clock();
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < batches; ++i) {
+            WireMessage message;
+            if (!check(WireCodec::decode(payload, message, rows))) {
+                qInfo() << "ingest: decode failed";
+                return;
+            }
+            if (rows == WireCodec::Rows::Columns) {
+                store.append(*message.columns);
+            } else {
+                store.append(message.rows);
+            }
+        }
+        const double totalRows = double(batchRows) * batches;
+        const double wallNs = timer.nsecsElapsed();
+        const double cpuNs = double(std::clock() - cpu) / CLOCKS_PER_SEC * 1e9;
+        qInfo().noquote() << QString("ingest: %1 %2 ns/row cpu, %3 ns/row wall, %4 allocations/row")
+                                 .arg(rows == WireCodec::Rows::Columns ? "columns" : "records")
+                                 .arg(cpuNs / totalRows, 0, 'f', 1)
+                                 .arg(wallNs / totalRows, 0, 'f', 1)
+                                 .arg((allocationCount.load() - allocations) / totalRows, 0, 'f', 3);
+    }
+}
+
+// Heap allocations per 10k rows at each hot-path step a batch goes through: decoding
+// it as it arrives, encoding and framing it to forward, and the same JSON built with a
+// QJsonArray per row as it used to be. Each step runs once before it is measured, so
+// the string pool, pooled batches and message buffers are warm as on a running node.
+static void benchmarkAllocations() {
+    const int batchRows = 10000;
+    const int iterations = 50;
+    const QJsonObject fields{{"requestType", "ingestion"}, {"requestID", 1}};
+    const AqiBatch rows = sampleBatch(batchRows);
+    const QByteArray jsonPayload = WireCodec::encode(fields, rows, WireCodec::Format::Json);
+    const QByteArray binaryPayload = WireCodec::encode(fields, rows, WireCodec::Format::Binary);
+    const ColumnBatch columns = ColumnBatch::fromRows(rows);
+
+    const QVector<QPair<QString, std::function<qint64()>>> steps{
+        {"decode json -> rows", [&] {
+             WireMessage message;
+             WireCodec::decode(jsonPayload, message);
+             return qint64(message.rows.size());
+         }},
+        {"decode binary -> columns", [&] {
+             WireMessage message;
+             WireCodec::decode(binaryPayload, message, WireCodec::Rows::Columns);
+             return qint64(message.columns->size());
+         }},
+        {"rows -> columns", [&] {
+             ColumnBatchPointer batch = ColumnBatch::pooled();
+             batch->assign(rows);
+             return qint64(batch->size());
+         }},
+        {"encode json + frame", [&] {
+             return qint64(MessageFraming::frame(WireCodec::encode(fields, rows, WireCodec::Format::Json)).size());
+         }},
+        {"encode json via QJsonArray", [&] {
+             QJsonArray data;
+             for (const AqiRecord &record : rows) {
+                 data.append(record.toJsonArray());
+             }
+             QJsonObject message = fields;
+             message["Data"] = data;
+             return qint64(MessageFraming::frame(QJsonDocument(message).toJson(QJsonDocument::Compact)).size());
+         }},
+        {"encode binary + frame", [&] {
+             return qint64(MessageFraming::frame(WireCodec::encode(fields, rows, WireCodec::Format::Binary)).size());
+         }},
+        {"encode columns + frame", [&] {
+             return qint64(MessageFraming::frame(WireCodec::encode(fields, columns)).size());
+         }}};
+
+    for (const auto &step : steps) {
+        step.second();
+        const qint64 allocations = allocationCount.load();
+        QElapsedTimer timer;
+        timer.start();
+        qint64 checksum = 0;
+        for (int i = 0; i < iterations; ++i) {
+            checksum += step.second();
+        }
+        const double ns = timer.nsecsElapsed();
+        const double totalRows = double(batchRows) * iterations;
+        qInfo().noquote() << QString("allocations: %1 %2 per 10k rows, %3 ns/row (%4)")
+                                 .arg(step.first, -28)
+                                 .arg((allocationCount.load() - allocations) / totalRows * 10000, 9, 'f', 1)
+                                 .arg(ns / totalRows, 0, 'f', 1)
+                                 .arg(checksum);
+    }
+    qInfo().noquote() << QString("allocations: string pool holds %1 values")
+                             .arg(StringPool::global().size());
+}
+
+// Recording cost of the metrics registry, alone and with every thread hitting the same
+// histogram, and what a disabled qCDebug on the hot path costs.
+static void benchmarkMetrics() {
+    const int iterations = 10000000;
+    Metrics::Registry &registry = Metrics::Registry::global();
+    Metrics::Counter &counter = registry.counter("bench_counter_total", "Benchmark counter.");
+    Metrics::Histogram &histogram = registry.histogram("bench_latency_seconds", "Benchmark histogram.");
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        counter.add();
+    }
+    const double counterNs = double(timer.nsecsElapsed()) / iterations;
+
+    timer.restart();
+    for (int i = 0; i < iterations; ++i) {
+        histogram.record(1000 + (i & 0xffff) * 37);
+    }
+    const double histogramNs = double(timer.nsecsElapsed()) / iterations;
+
+    const int threads = qMax(2, QThread::idealThreadCount());
+    QVector<QThread *> recorders;
+    for (int t = 0; t < threads; ++t) {
+        recorders.append(QThread::create([&histogram, iterations, t] {
+            for (int i = 0; i < iterations / 10; ++i) {
+                histogram.record(1000 + ((i + t) & 0xffff) * 37);
+            }
+        }));
+    }
+    timer.restart();
+    for (QThread *thread : recorders) {
+        thread->start();
+    }
+    for (QThread *thread : recorders) {
+        thread->wait();
+        delete thread;
+    }
+    const double contendedNs = double(timer.nsecsElapsed()) / (iterations / 10);
+
+    QLoggingCategory::setFilterRules("aqi.ingest.debug=false");
+    const QString payload(4096, 'x');
+    const qint64 allocations = allocationCount.load();
+    timer.restart();
+    for (int i = 0; i < iterations; ++i) {
+        qCDebug(lcIngest) << "Analytics request received:" << i << "rows as" << payload;
+    }
+    const double loggingNs = double(timer.nsecsElapsed()) / iterations;
+    const qint64 loggingAllocations = allocationCount.load() - allocations;
+    QLoggingCategory::setFilterRules(QString());
+
+    timer.restart();
+    const QByteArray text = registry.scrape();
+    const double scrapeMs = timer.nsecsElapsed() / 1e6;
+
+    qInfo().noquote() << QString("metrics: counter %1 ns, histogram %2 ns, histogram from %3 threads %4 ns per record; "
+                                 "p99 %5 us")
+                             .arg(counterNs, 0, 'f', 2).arg(histogramNs, 0, 'f', 2)
+                             .arg(threads).arg(contendedNs / threads, 0, 'f', 2)
+                             .arg(histogram.percentile(0.99) / 1e3, 0, 'f', 1);
+    qInfo().noquote() << QString("metrics: disabled qCDebug %1 ns and %2 allocations per call; scrape %3 KB in %4 ms")
+                             .arg(loggingNs, 0, 'f', 2).arg(loggingAllocations)
+                             .arg(text.size() / 1024.0, 0, 'f', 1).arg(scrapeMs, 0, 'f', 2);
+}
+
+// Ingestion traffic from many producer connections, read and decoded on the node's
+// event loop as before, against the same connections spread over I/O threads that
+// hand decoded messages to the loop. Producers write from a thread of their own.
+static void benchmarkReactor() {
+    const int producers = 64;
+    const int messagesPerProducer = 50;
+    const int rowsPerMessage = 200;
+    const qint64 total = qint64(producers) * messagesPerProducer;
+    const QByteArray frame = MessageFraming::frame(WireCodec::encode(
+        QJsonObject{{"requestType", "ingestion"}, {"requestID", 1}}, sampleBatch(rowsPerMessage),
+        WireCodec::Format::Binary));
+
+    auto run = [&](quint16 port, qint64 &received, QEventLoop &loop) {
+        QThread *producer = QThread::create([port, &frame, producers, messagesPerProducer] {
+            QVector<QTcpSocket *> sockets;
+            for (int i = 0; i < producers; ++i) {
+                QTcpSocket *socket = new QTcpSocket;
+                socket->connectToHost(QHostAddress::LocalHost, port);
+                socket->waitForConnected(5000);
+                sockets.append(socket);
+            }
+            for (int m = 0; m < messagesPerProducer; ++m) {
+                for (QTcpSocket *socket : sockets) {
+                    socket->write(frame);
+                    socket->waitForBytesWritten(0);
+                }
+            }
+            for (QTcpSocket *socket : sockets) {
+                while (socket->bytesToWrite() > 0 && socket->waitForBytesWritten(5000)) {
+                }
+                socket->disconnectFromHost();
+                delete socket;
+            }
+        });
+        QTimer::singleShot(60000, &loop, &QEventLoop::quit);
+        const std::clock_t cpu = std::clock();
+        QElapsedTimer timer;
+        timer.start();
+        producer->start();
+        loop.exec();
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        const double cpuSeconds = double(std::clock() - cpu) / CLOCKS_PER_SEC;
+        producer->wait();
+        delete producer;
+        return qMakePair(received == total ? total / seconds : 0.0, cpuSeconds / seconds);
+    };
+    auto report = [&](const QString &name, QPair<double, double> result) {
+        qInfo().noquote() << QString("reactor: %1: %2 messages/s (%3 rows/s), %4 cores busy")
+                                 .arg(name, -16)
+                                 .arg(result.first, 0, 'f', 0)
+                                 .arg(result.first * rowsPerMessage, 0, 'f', 0)
+                                 .arg(result.second, 0, 'f', 2);
+    };
+
+    {
+        QTcpServer server;
+        server.listen(QHostAddress::LocalHost, 0);
+        QHash<QTcpSocket *, FrameReader> readers;
+        QList<QTcpSocket *> sockets;
+        qint64 received = 0;
+        QEventLoop loop;
+        QObject::connect(&server, &QTcpServer::newConnection, [&] {
+            while (QTcpSocket *socket = server.nextPendingConnection()) {
+                sockets.append(socket);
+                QObject::connect(socket, &QTcpSocket::readyRead, [&, socket] {
+                    FrameReader &reader = readers[socket];
+                    reader.readFrom(socket);
+                    QByteArray payload;
+                    while (reader.nextFrame(payload)) {
+                        WireMessage message;
+                        if (WireCodec::decode(payload, message) && ++received == total) {
+                            loop.quit();
+                        }
+                    }
+                });
+            }
+        });
+        report("event loop", run(server.serverPort(), received, loop));
+        qDeleteAll(sockets);
+    }
+
+    for (int threads : {1, 2, 4}) {
+        ReactorServer server(threads);
+        server.listen(QHostAddress::LocalHost, 0);
+        qint64 received = 0;
+        QEventLoop loop;
+        QObject::connect(&server, &ReactorServer::newConnection, [&] {
+            while (ClientConnection *connection = server.nextPendingConnection()) {
+                QObject::connect(connection, &ClientConnection::messagesReady, [&, connection] {
+                    WireMessage message;
+                    int bytes = 0;
+                    while (connection->nextMessage(message, bytes)) {
+                        if (++received == total) {
+                            loop.quit();
+                        }
+                    }
+                });
+            }
+        });
+        report(QString("%1 I/O thread%2").arg(threads).arg(threads == 1 ? "" : "s"),
+               run(server.serverPort(), received, loop));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    const QList<QPair<QString, void (*)()>> suites = {
+        {"framing", benchmarkFraming},
+        {"wire", benchmarkWireFormat},
+        {"store", benchmarkColumnStore},
+        {"kernels", benchmarkKernels},
+        {"partitions", benchmarkPartitions},
+        {"zonemaps", benchmarkZoneMaps},
+        {"rollups", benchmarkRollups},
+        {"indexes", benchmarkIndexes},
+        {"geo", benchmarkGeo},
+        {"querycache", benchmarkQueryCache},
+        {"sketches", benchmarkSketches},
+        {"standing", benchmarkStandingQueries},
+        {"pool", benchmarkConnectionPool},
+        {"sharding", benchmarkSharding},
+        {"wal", benchmarkWriteAheadLog},
+        {"segmentfiles", benchmarkSegmentFiles},
+        {"ingest", benchmarkIngest},
+        {"allocations", benchmarkAllocations},
+        {"batching", benchmarkMicroBatching},
+        {"metrics", benchmarkMetrics},
+        {"reactor", benchmarkReactor},
+    };
+
+    QStringList selected = app.arguments().mid(1);
+    for (const auto &suite : suites) {
+        if (selected.isEmpty() || selected.contains(suite.first)) {
+            suite.second();
+        }
+    }
+    if (failedChecks > 0) {
+        qWarning() << failedChecks << "checks failed";
+        return 1;
+    }
+    return 0;
+}
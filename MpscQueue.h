@@ -0,0 +1,54 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue for any number of producer threads and a single consumer
+// thread (Vyukov's linked MPSC queue). push() is one allocation, one exchange and one
+// store. pop() may not yet see an element whose push() is still in progress, so
+// producers should wake the consumer only after push() has returned.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head(new Node), tail(head.load(std::memory_order_relaxed)) {}
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {
+        }
+        delete tail;
+    }
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value) {
+        Node *node = new Node;
+        node->value = std::move(value);
+        Node *previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer thread only.
+    bool pop(T &value) {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        next->value = T();
+        delete tail;
+        tail = next;  // the popped node becomes the new stub
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+    std::atomic<Node *> head;  // last pushed; producers
+    Node *tail;                // stub before the next element; consumer
+};
+
+#endif
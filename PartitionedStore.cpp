@@ -0,0 +1,143 @@
+#include "PartitionedStore.h"
+#include "Rollups.h"
+#include "SegmentFile.h"
+#include <QDir>
+#include <QUuid>
+
+namespace {
+// Batches smaller than this go to a single partition.
+constexpr int MinChunkRows = 4096;
+}
+
+PartitionedStore::PartitionedStore(int partitionCount) : rollupStore(std::make_unique<RollupStore>()) {
+    for (int i = 0; i < qMax(1, partitionCount); ++i) {
+        partitions.push_back(std::make_unique<Partition>());
+    }
+}
+
+PartitionedStore::~PartitionedStore() = default;
+
+PartitionedStore::Partition &PartitionedStore::lockForIngest() {
+    const int count = partitionCount();
+    const int first = static_cast<int>(nextPartition.fetch_add(1, std::memory_order_relaxed) % count);
+    // Prefer a partition no query is reading right now.
+    for (int offset = 0; offset < count; ++offset) {
+        Partition &candidate = *partitions[(first + offset) % count];
+        if (candidate.lock.tryLockForWrite()) {
+            return candidate;
+        }
+    }
+    Partition &fallback = *partitions[first];
+    fallback.lock.lockForWrite();
+    return fallback;
+}
+
+void PartitionedStore::append(const AqiBatch &batch) {
+    const int total = batch.size();
+    const int chunkRows = qMax(MinChunkRows, (total + partitionCount() - 1) / partitionCount());
+    for (int offset = 0; offset < total; offset += chunkRows) {
+        const int count = qMin(chunkRows, total - offset);
+        Partition &partition = lockForIngest();
+        partition.store.append(batch.constData() + offset, count);
+        partition.lock.unlock();
+    }
+    rollupStore->add(batch.constData(), total);
+    rows.fetch_add(total, std::memory_order_relaxed);
+}
+
+void PartitionedStore::append(const ColumnBatch &batch) {
+    const int total = batch.size();
+    const int chunkRows = qMax(MinChunkRows, (total + partitionCount() - 1) / partitionCount());
+    for (int offset = 0; offset < total; offset += chunkRows) {
+        const int count = qMin(chunkRows, total - offset);
+        Partition &partition = lockForIngest();
+        partition.store.append(batch, offset, count);
+        partition.lock.unlock();
+    }
+    rollupStore->add(batch, 0, total);
+    rows.fetch_add(total, std::memory_order_relaxed);
+}
+
+void PartitionedStore::restore(std::vector<ColumnStore> stores, const RollupTiers *rollups) {
+    if (stores.empty()) {
+        return;
+    }
+    partitions.clear();
+    rollupStore = std::make_unique<RollupStore>();
+    qint64 total = 0;
+    for (ColumnStore &store : stores) {
+        total += store.rowCount();
+        partitions.push_back(std::make_unique<Partition>());
+        partitions.back()->store = std::move(store);
+        if (!rollups) {
+            rollupStore->add(partitions.back()->store);
+        }
+    }
+    if (rollups) {
+        rollupStore->restore(*rollups);
+    }
+    rows.store(total, std::memory_order_relaxed);
+}
+
+std::vector<ColumnStore> PartitionedStore::snapshot() const {
+    std::vector<ColumnStore> stores;
+    for (const auto &partition : partitions) {
+        QReadLocker locker(&partition->lock);
+        stores.push_back(partition->store);
+    }
+    return stores;
+}
+
+int PartitionedStore::moveColdSegments(qint64 maxHotBytes, const QString &directory, QString &error) {
+    const qint64 partitionBudget = maxHotBytes / partitionCount();
+    int moved = 0;
+    for (const auto &partition : partitions) {
+        QVector<int> indexes;
+        QVector<AqiSegment> segments;
+        {
+            QReadLocker locker(&partition->lock);
+            indexes = partition->store.coldCandidates(partitionBudget);
+            for (int index : indexes) {
+                segments.append(partition->store.segments()[index]);
+            }
+        }
+        if (indexes.isEmpty()) {
+            continue;
+        }
+        // Ingest only appends and only this call removes, so the indexes stay valid.
+        const QString path = QDir(directory).filePath(
+            QString("segments-%1.seg").arg(QUuid::createUuid().toString(QUuid::Id128)));
+        QSharedPointer<const SegmentFile> file = SegmentFile::write(path, segments, error);
+        if (!file) {
+            return moved;
+        }
+        QWriteLocker locker(&partition->lock);
+        partition->store.moveToFile(indexes, file);
+        moved += indexes.size();
+    }
+    return moved;
+}
+
+qint64 PartitionedStore::applyRetention(qint64 rawSeconds) {
+    rollupStore->expire();
+    const qint64 newest = rollupStore->newestTimestamp();
+    if (rawSeconds <= 0 || newest == std::numeric_limits<qint64>::min()) {
+        return 0;
+    }
+    qint64 dropped = 0;
+    for (const auto &partition : partitions) {
+        QWriteLocker locker(&partition->lock);
+        dropped += partition->store.dropBefore(newest - rawSeconds);
+    }
+    rows.fetch_sub(dropped, std::memory_order_relaxed);
+    return dropped;
+}
+
+qint64 PartitionedStore::memoryUsage() const {
+    qint64 bytes = 0;
+    for (const auto &partition : partitions) {
+        QReadLocker locker(&partition->lock);
+        bytes += partition->store.memoryUsage();
+    }
+    return bytes;
+}
@@ -0,0 +1,61 @@
+#ifndef PARTITIONEDSTORE_H
+#define PARTITIONEDSTORE_H
+
+#include <QReadWriteLock>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "ColumnStore.h"
+
+class RollupStore;
+struct RollupTiers;
+
+// Worker data split into independent partitions, normally one per core. Each
+// partition has its own dictionary and lock, so scans of different partitions
+// run in parallel and ingestion skips partitions that are being scanned. Every
+// row appended is also folded into the store's rollup tiers.
+class PartitionedStore {
+public:
+    struct Partition {
+        ColumnStore store;
+        mutable QReadWriteLock lock;
+    };
+
+    explicit PartitionedStore(int partitionCount);
+    ~PartitionedStore();
+
+    void append(const AqiBatch &rows);
+    void append(const ColumnBatch &batch);
+    // Replaces all partitions, one per store, and the rollups, which are rebuilt from
+    // the rows when null; only before the store is shared.
+    void restore(std::vector<ColumnStore> stores, const RollupTiers *rollups = nullptr);
+    // Point-in-time copy of every partition. Columns are implicitly shared, so this
+    // costs a reference per segment column; ingest detaches only what it appends to.
+    std::vector<ColumnStore> snapshot() const;
+    // Moves the oldest sealed segments of each partition holding more than
+    // maxHotBytes / partitionCount() in memory into a new segment file in directory.
+    // Partitions stay readable while files are written. Returns the segments moved;
+    // stops with error set if a file cannot be written. Not for concurrent use with
+    // itself or applyRetention().
+    int moveColdSegments(qint64 maxHotBytes, const QString &directory, QString &error);
+    // Expires rollup buckets past their tier's retention and, when rawSeconds > 0,
+    // drops sealed segments holding only readings more than rawSeconds older than the
+    // newest one. Returns the rows dropped.
+    qint64 applyRetention(qint64 rawSeconds);
+
+    int partitionCount() const { return static_cast<int>(partitions.size()); }
+    const Partition &partition(int index) const { return *partitions[index]; }
+    const RollupStore &rollups() const { return *rollupStore; }
+    qint64 rowCount() const { return rows.load(std::memory_order_relaxed); }
+    qint64 memoryUsage() const;
+
+private:
+    Partition &lockForIngest();
+
+    std::vector<std::unique_ptr<Partition>> partitions;
+    std::unique_ptr<RollupStore> rollupStore;
+    std::atomic<unsigned> nextPartition{0};
+    std::atomic<qint64> rows{0};
+};
+
+#endif
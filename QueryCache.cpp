@@ -0,0 +1,120 @@
+#include "QueryCache.h"
+
+namespace {
+
+QString sortedList(QStringList values) {
+    values.sort();
+    values.removeDuplicates();
+    return values.join(QChar(0x1f));
+}
+
+}
+
+QueryCache::QueryCache(qint64 maxBytes) : budget(maxBytes) {}
+
+QString QueryCache::fingerprint(const QuerySpec &spec) {
+    bool aqi = false, concentration = false;
+    for (const AggregateSpec &aggregate : spec.aggregates) {
+        aqi = aqi || aggregate.field == AggregateSpec::Field::Aqi;
+        concentration = concentration || aggregate.field == AggregateSpec::Field::Concentration;
+    }
+    QStringList groups;
+    for (GroupField field : spec.groupBy) {
+        groups.append(field == GroupField::Cell ? QString("cell:%1").arg(spec.cellPrecision)
+                                                : QuerySpec::groupFieldName(field));
+    }
+    QStringList parts{sortedList(spec.pollutants), sortedList(spec.areas), sortedList(spec.agencies),
+                      sortedList(spec.stations), QString::number(spec.from), QString::number(spec.to),
+                      groups.join(','),
+                      QString("%1%2%3%4").arg(int(aqi)).arg(int(concentration))
+                          .arg(int(spec.needsPercentiles())).arg(int(spec.needsDistinctStations()))};
+    if (spec.hasBoundingBox) {
+        parts << QString("box %1 %2 %3 %4").arg(spec.minLatitude, 0, 'g', 17).arg(spec.minLongitude, 0, 'g', 17)
+                     .arg(spec.maxLatitude, 0, 'g', 17).arg(spec.maxLongitude, 0, 'g', 17);
+    }
+    if (spec.hasRadius) {
+        parts << QString("radius %1 %2 %3").arg(spec.centerLatitude, 0, 'g', 17)
+                     .arg(spec.centerLongitude, 0, 'g', 17).arg(spec.radiusKm, 0, 'g', 17);
+    }
+    return parts.join(QChar(0x1e));
+}
+
+QString QueryCache::key(const QString &fingerprint, const void *store, int partition) {
+    return QString("%1/%2/").arg(quintptr(store), 0, 16).arg(partition) + fingerprint;
+}
+
+qint64 QueryCache::entryBytes(const Entry &entry) {
+    qint64 bytes = sizeof(Slot) + entry.segments.size() * qint64(2 * sizeof(quint64));
+    for (const QueryResult *result : {&entry.sealed, &entry.open}) {
+        for (auto it = result->groups.constBegin(); it != result->groups.constEnd(); ++it) {
+            const GroupState &group = it.value();
+            bytes += it.key().size() * qint64(sizeof(QChar)) + qint64(sizeof(GroupState))
+                   + group.aqi.digest.memoryUsage() + group.concentration.digest.memoryUsage()
+                   + group.stations.memoryUsage();
+        }
+    }
+    return bytes;
+}
+
+bool QueryCache::find(const QString &fingerprint, const void *store, int partition, Entry &entry) {
+    QMutexLocker locker(&lock);
+    auto it = entries.find(key(fingerprint, store, partition));
+    if (it == entries.end()) {
+        return false;
+    }
+    recency.splice(recency.begin(), recency, it->recent);
+    entry = it->entry;
+    return true;
+}
+
+void QueryCache::insert(const QString &fingerprint, const void *store, int partition, Entry entry) {
+    entry.bytes = entryBytes(entry);
+    const QString slotKey = key(fingerprint, store, partition);
+    QMutexLocker locker(&lock);
+    if (entry.bytes > budget) {
+        return;
+    }
+    auto it = entries.find(slotKey);
+    if (it != entries.end()) {
+        used -= it->entry.bytes;
+        recency.splice(recency.begin(), recency, it->recent);
+        it->entry = std::move(entry);
+        used += it->entry.bytes;
+    } else {
+        recency.push_front(slotKey);
+        used += entry.bytes;
+        entries.insert(slotKey, Slot{std::move(entry), recency.begin()});
+    }
+    evict();
+}
+
+void QueryCache::evict() {
+    while (used > budget && !recency.empty()) {
+        auto it = entries.find(recency.back());
+        used -= it->entry.bytes;
+        entries.erase(it);
+        recency.pop_back();
+        evicted.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void QueryCache::setMaxBytes(qint64 bytes) {
+    QMutexLocker locker(&lock);
+    budget = qMax<qint64>(0, bytes);
+    evict();
+}
+
+qint64 QueryCache::maxBytes() const {
+    QMutexLocker locker(&lock);
+    return budget;
+}
+
+qint64 QueryCache::bytes() const {
+    QMutexLocker locker(&lock);
+    return used;
+}
+
+int QueryCache::entryCount() const {
+    QMutexLocker locker(&lock);
+    return entries.size();
+}
@@ -0,0 +1,80 @@
+#ifndef QUERYCACHE_H
+#define QUERYCACHE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <array>
+#include <atomic>
+#include <list>
+#include "QueryEngine.h"
+
+/*
+ * Partition scan results of spec queries, kept for the next identical query. An entry
+ * is keyed by the query's fingerprint, the store and the partition, and holds
+ *
+ *   - the partition's ColumnStore::version when it was taken: while that is unchanged,
+ *     i.e. no rows were stored in the partition since, the entry is the answer;
+ *   - otherwise the result over the sealed segments it covered, by id. Sealed segments
+ *     never change, so as long as none of them was dropped only the segments sealed
+ *     since and the open ones are scanned again and merged in.
+ *
+ * Entries are evicted least recently used first to stay within the byte budget.
+ */
+class QueryCache {
+public:
+    static constexpr qint64 DefaultMaxBytes = 256LL * 1024 * 1024;
+
+    struct Entry {
+        quint64 version = 0;
+        QSet<quint64> segments;  // sealed segments covered by sealed
+        QueryResult sealed;
+        QueryResult open;        // over the open segments at version
+        qint64 bytes = 0;
+    };
+
+    // How a partition lookup went: answered whole, reused in part, or scanned afresh.
+    enum Outcome { Hit, Partial, Miss };
+    static constexpr int OutcomeCount = 3;
+
+    explicit QueryCache(qint64 maxBytes = DefaultMaxBytes);
+
+    // Key of everything a partition scan depends on: the filters as sets, the groupBy
+    // fields and the state the aggregates need, so "avg(aqi)" and "max(aqi)" share one.
+    static QString fingerprint(const QuerySpec &spec);
+
+    bool find(const QString &fingerprint, const void *store, int partition, Entry &entry);
+    void insert(const QString &fingerprint, const void *store, int partition, Entry entry);
+
+    void record(Outcome outcome) { outcomes[outcome].fetch_add(1, std::memory_order_relaxed); }
+    qint64 lookups(Outcome outcome) const { return outcomes[outcome].load(std::memory_order_relaxed); }
+    qint64 evictions() const { return evicted.load(std::memory_order_relaxed); }
+
+    // 0 disables the cache and drops every entry.
+    void setMaxBytes(qint64 bytes);
+    qint64 maxBytes() const;
+    qint64 bytes() const;
+    int entryCount() const;
+
+private:
+    struct Slot {
+        Entry entry;
+        std::list<QString>::iterator recent;
+    };
+
+    static QString key(const QString &fingerprint, const void *store, int partition);
+    static qint64 entryBytes(const Entry &entry);
+    // Drops least recently used entries until the budget holds; called with lock held.
+    void evict();
+
+    mutable QMutex lock;
+    QHash<QString, Slot> entries;
+    std::list<QString> recency;  // keys, most recently used first
+    qint64 budget;
+    qint64 used = 0;
+    std::array<std::atomic<qint64>, OutcomeCount> outcomes{};
+    std::atomic<qint64> evicted{0};
+};
+
+#endif
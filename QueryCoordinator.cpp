@@ -0,0 +1,89 @@
+#include "QueryCoordinator.h"
+#include <QDebug>
+#include <QTimer>
+
+QueryCoordinator::QueryCoordinator(QObject *parent) : QObject(parent) {}
+
+int QueryCoordinator::begin(const QJsonValue &query, const QStringList &shards, int deadlineMs, QString &error,
+                            const QStringList &missing) {
+    Gather gather;
+    gather.legacy = !query.isObject();
+    if (!gather.legacy && !QuerySpec::fromJson(query.toObject(), gather.spec, error)) {
+        return 0;
+    }
+    gather.result.spec = gather.spec;
+    if (!gather.legacy && gather.spec.groupBy.isEmpty()) {
+        gather.result.groups.insert(QString(), GroupState());  // an ungrouped query always yields one row
+    }
+    gather.waiting = shards;
+    gather.expected = shards.size();
+    for (const QString &shard : missing) {
+        gather.errors.append(shard + ": no reachable copy");
+    }
+    gather.elapsed.start();
+
+    const int id = nextId++;
+    if (nextId <= 0) {
+        nextId = 1;
+    }
+    pending.insert(id, gather);
+    QTimer::singleShot(shards.isEmpty() ? 0 : qMax(1, deadlineMs), this, [this, id] { finish(id, true); });
+    return id;
+}
+
+bool QueryCoordinator::addPartial(const QString &shard, const QJsonObject &response) {
+    const int id = response["requestID"].toInt();
+    auto it = pending.find(id);
+    if (it == pending.end() || !it->waiting.removeOne(shard)) {
+        return false;
+    }
+    for (const QJsonValue &span : response["spans"].toArray()) {
+        it->spans.append(span);
+    }
+    if (response.contains("error")) {
+        it->errors.append(shard + ": " + response["error"].toString());
+    } else if (it->legacy) {
+        it->maxAverage.merge(MaxAverageResult::fromJson(response["partial"].toObject()));
+    } else {
+        it->result.merge(QueryResult::fromPartialJson(it->spec, response["partial"].toObject()));
+    }
+    if (it->waiting.isEmpty()) {
+        finish(id, false);
+    }
+    return true;
+}
+
+void QueryCoordinator::finish(int id, bool timedOut) {
+    auto it = pending.find(id);
+    if (it == pending.end()) {
+        return;  // already finished by its last shard
+    }
+    const Gather gather = it.value();
+    pending.erase(it);
+
+    QJsonObject result;
+    if (gather.legacy) {
+        result = QJsonObject{
+            {"maxArea", gather.maxAverage.maxArea},
+            {"maxAqi", gather.maxAverage.aqi.count > 0 ? gather.maxAverage.aqi.max : 0},
+            {"maxAverage", gather.maxAverage.aqi.average()}
+        };
+    } else {
+        result = gather.result.toJson();
+    }
+    const int answered = gather.expected - gather.waiting.size();
+    result["shardsExpected"] = gather.expected;
+    result["shardsAnswered"] = answered;
+    result["complete"] = gather.waiting.isEmpty() && gather.errors.isEmpty();
+    if (!gather.errors.isEmpty()) {
+        result["error"] = gather.errors.join("; ");
+    }
+    if (!gather.spans.isEmpty()) {
+        result["spans"] = gather.spans;
+    }
+    if (timedOut && !gather.waiting.isEmpty()) {
+        qDebug() << "QueryCoordinator: query" << id << "deadline passed after" << gather.elapsed.elapsed()
+                 << "ms, missing shards" << gather.waiting;
+    }
+    emit finished(id, result);
+}
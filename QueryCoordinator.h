@@ -0,0 +1,61 @@
+#ifndef QUERYCOORDINATOR_H
+#define QUERYCOORDINATOR_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QObject>
+#include <QStringList>
+#include "QueryEngine.h"
+
+// Gathers the partial results of one query from every shard it was scattered to
+// and merges them into a single answer. A query finishes when every shard has
+// answered or its deadline passes, whichever comes first; a late or missing shard
+// makes the answer partial ("complete": false) rather than holding it back. The
+// shards' trace spans are passed on in the answer's "spans".
+class QueryCoordinator : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr int DefaultDeadlineMs = 5000;
+
+    explicit QueryCoordinator(QObject *parent = nullptr);
+
+    // Registers a query about to be sent to the given shards and returns the request
+    // ID to put on the shard requests, or 0 with error set if the spec is invalid.
+    // query is the "query" value: a QuerySpec object, or anything else for the
+    // legacy max/average query. missing names shards no reachable node holds a copy
+    // of; the answer is then partial and lists them in its "error".
+    int begin(const QJsonValue &query, const QStringList &shards, int deadlineMs, QString &error,
+              const QStringList &missing = QStringList());
+    // Folds in a "query response" carrying a "partial"; returns false if it is not
+    // for a pending query (unknown, already finished, or a duplicate).
+    bool addPartial(const QString &shard, const QJsonObject &response);
+
+    int pendingQueries() const { return pending.size(); }
+
+signals:
+    // result is a complete "query response" body except for requestType/requestID.
+    void finished(int id, const QJsonObject &result);
+
+private:
+    struct Gather {
+        bool legacy = false;
+        QuerySpec spec;
+        QueryResult result;
+        MaxAverageResult maxAverage;
+        QStringList waiting;  // shards that have not answered yet
+        int expected = 0;
+        QStringList errors;
+        QJsonArray spans;  // of the shards that answered
+        QElapsedTimer elapsed;
+    };
+
+    void finish(int id, bool timedOut);
+
+    QHash<int, Gather> pending;
+    int nextId = 1;
+};
+
+#endif
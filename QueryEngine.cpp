@@ -0,0 +1,750 @@
+#include "QueryEngine.h"
+#include "GeoGrid.h"
+#include "QueryCache.h"
+#include <QDebug>
+#include <QJsonArray>
+#include <algorithm>
+#include <cmath>
+
+void MaxAverageResult::merge(const MaxAverageResult &other) {
+    if (other.aqi.count > 0 && other.aqi.max > aqi.max) {
+        maxArea = other.maxArea;
+    }
+    aqi.merge(other.aqi);
+}
+
+QJsonObject MaxAverageResult::toJson() const {
+    return QJsonObject{
+        {"count", static_cast<double>(aqi.count)},
+        {"sum", aqi.sum},
+        {"max", aqi.count > 0 ? aqi.max : 0},
+        {"min", aqi.count > 0 ? aqi.min : 0},
+        {"maxArea", maxArea}
+    };
+}
+
+MaxAverageResult MaxAverageResult::fromJson(const QJsonObject &json) {
+    MaxAverageResult result;
+    result.aqi.count = static_cast<qint64>(json["count"].toDouble());
+    if (result.aqi.count > 0) {
+        result.aqi.sum = json["sum"].toDouble();
+        result.aqi.max = json["max"].toDouble();
+        result.aqi.min = json["min"].toDouble();
+        result.maxArea = json["maxArea"].toString();
+    }
+    return result;
+}
+
+MaxAverageResult QueryEngine::maxAverage(const PartitionedStore::Partition &partition, const QString &pollutant) {
+    thread_local QVector<quint8> mask(AqiSegment::Capacity);
+
+    QReadLocker locker(&partition.lock);
+    const ColumnStore &store = partition.store;
+    const bool filtered = !pollutant.isEmpty();
+    const quint32 pollutantCode = filtered ? store.dictionary().find(pollutant) : StringDictionary::NotFound;
+
+    MaxAverageResult result;
+    if (filtered && pollutantCode == StringDictionary::NotFound) {
+        return result;
+    }
+    for (int index = 0; index < store.segmentCount(); ++index) {
+        const ZoneMap &zone = store.zone(index);
+        if (filtered && !zone.pollutants.contains(pollutantCode)) {
+            continue;
+        }
+        const SegmentColumns segment = store.columns(index, SegmentColumns::Aqi | SegmentColumns::Area);
+        const quint8 *rowMask = nullptr;
+        // A single-pollutant segment needs no mask: every row matches.
+        if (filtered && zone.pollutants.size() > 1) {
+            if (AggregationKernels::equalsMask(segment.pollutant, pollutantCode, mask.data(), segment.size()) == 0) {
+                continue;
+            }
+            rowMask = mask.constData();
+        }
+        AggregationKernels::Aggregate part = AggregationKernels::aggregate(segment.aqi, rowMask, segment.size());
+        if (part.count > 0 && part.max > result.aqi.max) {
+            result.maxArea = store.dictionary().value(segment.area[part.argmax]);
+        }
+        result.aqi.merge(part);
+    }
+    return result;
+}
+
+MaxAverageResult QueryEngine::maxAverage(const PartitionedStore &store, WorkStealingPool &pool, const QString &pollutant) {
+    QVector<MaxAverageResult> partials(store.partitionCount());
+    pool.parallelFor(store.partitionCount(), [&](int index) {
+        partials[index] = maxAverage(store.partition(index), pollutant);
+    });
+
+    MaxAverageResult result;
+    for (const MaxAverageResult &partial : partials) {
+        result.merge(partial);
+    }
+    return result;
+}
+
+namespace {
+
+// A QuerySpec bound to one partition: filter strings resolved to dictionary codes.
+struct ScanPlan {
+    struct CodeFilter {
+        const quint32 *SegmentColumns::*column;
+        QVector<quint32> codes;
+        int indexColumn;  // SegmentIndex::Column, or -1 when the column has no index
+    };
+
+    bool matchesNothing = false;
+    QVector<CodeFilter> codeFilters;
+    bool indexed = false;  // some code filter can be answered from segment indexes
+    QVector<quint32> pollutantCodes;  // empty when pollutant is not filtered
+    bool timeFilter = false;
+    bool boxFilter = false;
+    bool radiusFilter = false;
+    GeoBox box;
+    GeoCircle circle;
+    GeoBox region;  // box bounding both spatial filters
+    bool needAqi = false;
+    bool needConcentration = false;
+    bool keepDigests = false;
+    bool needStations = false;
+    int decode = 0;  // SegmentColumns::Decode flags of the columns the scan reads
+
+    bool filtered() const { return !codeFilters.isEmpty() || timeFilter || regionFilter(); }
+    bool regionFilter() const { return boxFilter || radiusFilter; }
+    bool inRegion(double latitude, double longitude) const {
+        return (!boxFilter || box.contains(latitude, longitude))
+            && (!radiusFilter || circle.contains(latitude, longitude));
+    }
+    // Whether every point of area passes the spatial filters.
+    bool regionCovers(const GeoBox &area) const {
+        return (!boxFilter || area.within(box)) && (!radiusFilter || circle.covers(area));
+    }
+};
+
+ScanPlan plan(const QuerySpec &spec, const ColumnStore &store) {
+    ScanPlan scan;
+    auto addFilter = [&](const QStringList &values, const quint32 *SegmentColumns::*column, int indexColumn) {
+        if (values.isEmpty()) {
+            return;
+        }
+        ScanPlan::CodeFilter filter{column, {}, indexColumn};
+        for (const QString &value : values) {
+            quint32 code = store.dictionary().find(value);
+            if (code != StringDictionary::NotFound) {
+                filter.codes.append(code);
+            }
+        }
+        if (filter.codes.isEmpty()) {
+            scan.matchesNothing = true;
+        }
+        scan.codeFilters.append(filter);
+        scan.indexed = scan.indexed || indexColumn >= 0;
+    };
+    addFilter(spec.pollutants, &SegmentColumns::pollutant, SegmentIndex::Pollutant);
+    if (!scan.codeFilters.isEmpty()) {
+        scan.pollutantCodes = scan.codeFilters.first().codes;
+    }
+    addFilter(spec.areas, &SegmentColumns::area, SegmentIndex::Area);
+    addFilter(spec.agencies, &SegmentColumns::agency, -1);
+    addFilter(spec.stations, &SegmentColumns::station, SegmentIndex::Station);
+    scan.timeFilter = spec.hasTimeRange();
+    scan.boxFilter = spec.hasBoundingBox;
+    scan.radiusFilter = spec.hasRadius;
+    scan.box = GeoBox{spec.minLatitude, spec.minLongitude, spec.maxLatitude, spec.maxLongitude};
+    scan.region = scan.box;
+    if (scan.radiusFilter) {
+        scan.circle = GeoCircle(spec.centerLatitude, spec.centerLongitude, spec.radiusKm);
+        const GeoBox bounds = scan.circle.bounds();
+        if (!scan.boxFilter) {
+            scan.region = bounds;
+        } else if (scan.box.overlaps(bounds)) {
+            scan.region = GeoBox{qMax(scan.box.minLatitude, bounds.minLatitude),
+                                 qMax(scan.box.minLongitude, bounds.minLongitude),
+                                 qMin(scan.box.maxLatitude, bounds.maxLatitude),
+                                 qMin(scan.box.maxLongitude, bounds.maxLongitude)};
+        } else {
+            scan.matchesNothing = true;
+        }
+    }
+
+    for (const AggregateSpec &aggregate : spec.aggregates) {
+        if (aggregate.field == AggregateSpec::Field::Concentration) {
+            scan.needConcentration = true;
+        } else if (aggregate.field == AggregateSpec::Field::Aqi) {
+            scan.needAqi = true;
+        }
+    }
+    scan.keepDigests = spec.needsPercentiles();
+    scan.needStations = spec.needsDistinctStations();
+
+    if (scan.timeFilter || spec.groupBy.contains(GroupField::Hour)) {
+        scan.decode |= SegmentColumns::Timestamp;
+    }
+    if (scan.needAqi) {
+        scan.decode |= SegmentColumns::Aqi;
+    }
+    if (!spec.areas.isEmpty() || spec.groupBy.contains(GroupField::Area)) {
+        scan.decode |= SegmentColumns::Area;
+    }
+    if (!spec.agencies.isEmpty() || spec.groupBy.contains(GroupField::Agency)) {
+        scan.decode |= SegmentColumns::Agency;
+    }
+    return scan;
+}
+
+// Narrows mask by predicate; the first restriction of a segment initialises it.
+// Rows already masked out are not tested again.
+template <typename Predicate>
+qint64 restrictMask(quint8 *mask, bool first, int count, Predicate predicate) {
+    qint64 selected = 0;
+    for (int i = 0; i < count; ++i) {
+        mask[i] = (first || mask[i]) && predicate(i) ? 1 : 0;
+        selected += mask[i];
+    }
+    return selected;
+}
+
+
+// True when the segment's zone map proves no row can satisfy the spec.
+bool canSkip(const QuerySpec &spec, const ScanPlan &scan, const ZoneMap &zone) {
+    if (scan.timeFilter && !zone.overlapsTime(spec.from, spec.to)) {
+        return true;
+    }
+    if (scan.regionFilter() && !zone.box().overlaps(scan.region)) {
+        return true;
+    }
+    return !scan.pollutantCodes.isEmpty() && !zone.containsAnyPollutant(scan.pollutantCodes);
+}
+
+// What a segment's index resolves of a scan before any column is read.
+struct IndexedRows {
+    RowBitmap rows;      // rows that may match
+    RowBitmap edge;      // rows in grid cells straddling the region, still to be tested
+    bool spatial = false;
+    qint64 folded = 0;   // rows of cells inside the region summed into aqi and concentration
+    AggregationKernels::Aggregate aqi;
+    AggregationKernels::Aggregate concentration;
+};
+
+// Code filters the index covers are the union of each filter's posting lists,
+// intersected across filters. The spatial filters keep the grid cells overlapping
+// the region; with foldInside, cells wholly inside it are taken from their summaries
+// and left out of rows.
+IndexedRows indexedRows(const ScanPlan &scan, const SegmentIndex &index, bool foldInside) {
+    IndexedRows indexed;
+    bool first = true;
+    for (const ScanPlan::CodeFilter &filter : scan.codeFilters) {
+        if (filter.indexColumn < 0) {
+            continue;
+        }
+        const RowBitmap matches = index.rows(static_cast<SegmentIndex::Column>(filter.indexColumn), filter.codes);
+        indexed.rows = first ? matches : RowBitmap::intersect(indexed.rows, matches);
+        first = false;
+        if (indexed.rows.isEmpty()) {
+            return indexed;
+        }
+    }
+    if (!scan.regionFilter()) {
+        return indexed;
+    }
+
+    indexed.spatial = true;
+    QVector<const RowBitmap *> inside, edge;
+    for (const CellSummary &cell : index.cells()) {
+        if (!cell.bounds.overlaps(scan.region)) {
+            continue;
+        }
+        if (!scan.regionCovers(cell.bounds)) {
+            edge.append(&cell.rows);
+        } else if (foldInside) {
+            indexed.aqi.merge(cell.aqi);
+            indexed.concentration.merge(cell.concentration);
+            indexed.folded += cell.rows.cardinality();
+        } else {
+            inside.append(&cell.rows);
+        }
+    }
+    if (!edge.isEmpty()) {
+        indexed.edge = RowBitmap::unite(edge);
+    }
+    inside += edge;
+    const RowBitmap inRegion = inside.isEmpty() ? RowBitmap() : RowBitmap::unite(inside);
+    indexed.rows = first ? inRegion : RowBitmap::intersect(indexed.rows, inRegion);
+    return indexed;
+}
+
+// Builds the row mask for one segment and returns the number of selected rows.
+// Predicates the zone map shows every row satisfies are not evaluated; masked is
+// left false when nothing had to be evaluated, in which case all rows are selected.
+// With indexed rows (from indexedRows) the mask starts from them, and only filters
+// the index does not cover are evaluated; the spatial ones only on edge rows.
+qint64 buildMask(const QuerySpec &spec, const ScanPlan &scan, const SegmentColumns &segment,
+                 const IndexedRows *indexed, quint8 *mask, quint8 *scratch, bool &masked) {
+    const int count = segment.size();
+    const ZoneMap &zone = *segment.zone;
+    qint64 selected = count;
+    bool first = true;
+    if (indexed && indexed->rows.cardinality() < count) {
+        indexed->rows.fillMask(mask, count);
+        selected = indexed->rows.cardinality();
+        first = false;
+    }
+    for (const ScanPlan::CodeFilter &filter : scan.codeFilters) {
+        if (indexed && filter.indexColumn >= 0) {
+            continue;
+        }
+        if (filter.column == &SegmentColumns::pollutant && zone.pollutants.size() == 1
+            && filter.codes.contains(zone.pollutants.first())) {
+            continue;
+        }
+        const quint32 *codes = segment.*filter.column;
+        if (filter.codes.size() == 1) {
+            quint8 *target = first ? mask : scratch;
+            selected = AggregationKernels::equalsMask(codes, filter.codes[0], target, count);
+            if (!first) {
+                selected = AggregationKernels::andMask(mask, scratch, count);
+            }
+        } else {
+            const QVector<quint32> &wanted = filter.codes;
+            selected = restrictMask(mask, first, count, [&](int i) { return wanted.contains(codes[i]); });
+        }
+        first = false;
+        if (selected == 0) {
+            return 0;
+        }
+    }
+    if (scan.timeFilter && !zone.withinTime(spec.from, spec.to)) {
+        const qint64 *timestamps = segment.timestamp;
+        selected = restrictMask(mask, first, count, [&](int i) {
+            return timestamps[i] >= spec.from && timestamps[i] < spec.to;
+        });
+        first = false;
+    }
+    const double *latitudes = segment.latitude;
+    const double *longitudes = segment.longitude;
+    if (indexed && indexed->spatial) {
+        if (!indexed->edge.isEmpty() && selected > 0) {
+            if (first) {
+                std::fill(mask, mask + count, quint8(1));
+                first = false;
+            }
+            indexed->edge.forEach([&](quint16 row) {
+                if (mask[row] && !scan.inRegion(latitudes[row], longitudes[row])) {
+                    mask[row] = 0;
+                    --selected;
+                }
+            });
+        }
+    } else if (scan.regionFilter() && selected > 0 && !scan.regionCovers(zone.box())) {
+        selected = restrictMask(mask, first, count, [&](int i) { return scan.inRegion(latitudes[i], longitudes[i]); });
+        first = false;
+    }
+    masked = !first;
+    return selected;
+}
+
+using GroupCodes = QPair<quint64, quint64>;
+
+quint32 groupCode(GroupField field, const SegmentColumns &segment, int row, int cellPrecision) {
+    switch (field) {
+    case GroupField::Area: return segment.area[row];
+    case GroupField::Agency: return segment.agency[row];
+    case GroupField::Pollutant: return segment.pollutant[row];
+    case GroupField::Station: return segment.station[row];
+    case GroupField::Hour: return static_cast<quint32>(segment.timestamp[row] / 3600);
+    case GroupField::Cell:
+        return static_cast<quint32>(GeoGrid::cell(segment.latitude[row], segment.longitude[row], cellPrecision));
+    }
+    return 0;
+}
+
+QString groupValue(GroupField field, quint32 code, const ColumnStore &store, int cellPrecision) {
+    if (field == GroupField::Hour) {
+        return AqiRecord::formatTimestamp(static_cast<qint64>(code) * 3600);
+    }
+    if (field == GroupField::Cell) {
+        return GeoGrid::name(code, cellPrecision);
+    }
+    return store.dictionary().value(code);
+}
+
+}
+
+void FieldState::add(double value, bool keepDigest) {
+    ++count;
+    sum += value;
+    min = qMin(min, value);
+    max = qMax(max, value);
+    if (keepDigest) {
+        digest.add(value);
+    }
+}
+
+void FieldState::add(const AggregationKernels::Aggregate &aggregate) {
+    count += aggregate.count;
+    sum += aggregate.sum;
+    min = qMin(min, aggregate.min);
+    max = qMax(max, aggregate.max);
+}
+
+void FieldState::merge(const FieldState &other) {
+    count += other.count;
+    sum += other.sum;
+    min = qMin(min, other.min);
+    max = qMax(max, other.max);
+    digest.merge(other.digest);
+}
+
+double FieldState::percentile(double p) const {
+    return digest.quantile(p / 100.0);
+}
+
+QJsonObject FieldState::toJson() const {
+    QJsonObject json{
+        {"count", static_cast<double>(count)},
+        {"sum", sum},
+        {"min", min},
+        {"max", max}
+    };
+    if (!digest.isEmpty()) {
+        json["digest"] = QString::fromLatin1(digest.serialize().toBase64());
+    }
+    return json;
+}
+
+FieldState FieldState::fromJson(const QJsonObject &json) {
+    FieldState state;
+    state.count = static_cast<qint64>(json["count"].toDouble());
+    if (state.count > 0) {
+        state.sum = json["sum"].toDouble();
+        state.min = json["min"].toDouble();
+        state.max = json["max"].toDouble();
+    }
+    if (json.contains("digest")
+        && !TDigest::deserialize(QByteArray::fromBase64(json["digest"].toString().toLatin1()), state.digest)) {
+        qWarning() << "Ignoring malformed t-digest in partial result";
+    }
+    return state;
+}
+
+void GroupState::merge(const GroupState &other) {
+    aqi.merge(other.aqi);
+    concentration.merge(other.concentration);
+    stations.merge(other.stations);
+}
+
+QJsonObject GroupState::toJson() const {
+    QJsonObject json;
+    if (aqi.count > 0) {
+        json["aqi"] = aqi.toJson();
+    }
+    if (concentration.count > 0) {
+        json["concentration"] = concentration.toJson();
+    }
+    if (!stations.isEmpty()) {
+        json["stations"] = QString::fromLatin1(stations.serialize().toBase64());
+    }
+    return json;
+}
+
+GroupState GroupState::fromJson(const QJsonObject &json) {
+    GroupState state;
+    state.aqi = FieldState::fromJson(json["aqi"].toObject());
+    state.concentration = FieldState::fromJson(json["concentration"].toObject());
+    if (json.contains("stations")
+        && !HyperLogLog::deserialize(QByteArray::fromBase64(json["stations"].toString().toLatin1()), state.stations)) {
+        qWarning() << "Ignoring malformed station sketch in partial result";
+    }
+    return state;
+}
+
+void QueryResult::merge(const QueryResult &other) {
+    segmentsScanned += other.segmentsScanned;
+    segmentsSkipped += other.segmentsSkipped;
+    for (auto it = other.groups.constBegin(); it != other.groups.constEnd(); ++it) {
+        groups[it.key()].merge(it.value());
+    }
+}
+
+QJsonObject QueryResult::toJson() const {
+    QJsonArray columns;
+    for (GroupField field : spec.groupBy) {
+        columns.append(QuerySpec::groupFieldName(field));
+    }
+    for (const AggregateSpec &aggregate : spec.aggregates) {
+        columns.append(aggregate.name());
+    }
+
+    QStringList keys = groups.keys();
+    std::sort(keys.begin(), keys.end());
+    QJsonArray rows;
+    for (const QString &key : keys) {
+        const GroupState &group = groups[key];
+        QJsonArray row;
+        if (!spec.groupBy.isEmpty()) {
+            for (const QString &value : key.split(KeySeparator)) {
+                row.append(value);
+            }
+        }
+        for (const AggregateSpec &aggregate : spec.aggregates) {
+            const FieldState &field = group.field(aggregate.field);
+            switch (aggregate.op) {
+            case AggregateSpec::Op::Count: row.append(static_cast<double>(field.count)); break;
+            case AggregateSpec::Op::Sum: row.append(field.sum); break;
+            case AggregateSpec::Op::Avg: row.append(field.count > 0 ? field.sum / field.count : 0); break;
+            case AggregateSpec::Op::Min: row.append(field.count > 0 ? field.min : 0); break;
+            case AggregateSpec::Op::Max: row.append(field.count > 0 ? field.max : 0); break;
+            case AggregateSpec::Op::Percentile: row.append(field.percentile(aggregate.percentile)); break;
+            case AggregateSpec::Op::Distinct: row.append(std::round(group.stations.estimate())); break;
+            }
+        }
+        rows.append(row);
+    }
+    return QJsonObject{
+        {"columns", columns},
+        {"rows", rows},
+        {"segmentsScanned", static_cast<double>(segmentsScanned)},
+        {"segmentsSkipped", static_cast<double>(segmentsSkipped)}
+    };
+}
+
+QJsonObject QueryResult::toPartialJson() const {
+    QJsonArray list;
+    for (auto it = groups.constBegin(); it != groups.constEnd(); ++it) {
+        QJsonObject group = it.value().toJson();
+        group["key"] = spec.groupBy.isEmpty() ? QJsonArray() : QJsonArray::fromStringList(it.key().split(KeySeparator));
+        list.append(group);
+    }
+    return QJsonObject{
+        {"groups", list},
+        {"segmentsScanned", static_cast<double>(segmentsScanned)},
+        {"segmentsSkipped", static_cast<double>(segmentsSkipped)}
+    };
+}
+
+QueryResult QueryResult::fromPartialJson(const QuerySpec &spec, const QJsonObject &json) {
+    QueryResult result;
+    result.spec = spec;
+    for (const QJsonValue &value : json["groups"].toArray()) {
+        const QJsonObject group = value.toObject();
+        QStringList key;
+        for (const QJsonValue &part : group["key"].toArray()) {
+            key.append(part.toString());
+        }
+        result.groups[key.join(KeySeparator)].merge(GroupState::fromJson(group));
+    }
+    result.segmentsScanned = static_cast<qint64>(json["segmentsScanned"].toDouble());
+    result.segmentsSkipped = static_cast<qint64>(json["segmentsSkipped"].toDouble());
+    return result;
+}
+
+namespace {
+
+// Scans the segments of store that include accepts; the caller holds its partition's
+// read lock.
+template <typename Include>
+QueryResult scanSegments(const QuerySpec &spec, const ScanPlan &scan, const ColumnStore &store, bool useIndexes,
+                         Include include) {
+    thread_local QVector<quint8> mask(AqiSegment::Capacity);
+    thread_local QVector<quint8> scratch(AqiSegment::Capacity);
+
+    QueryResult result;
+    result.spec = spec;
+
+    // Without groupBy or sketches the whole segment folds into one group via the kernels.
+    const bool vectorized = spec.groupBy.isEmpty() && !scan.keepDigests && !scan.needStations;
+    QHash<GroupCodes, GroupState> codeGroups;
+    // Station hashes by dictionary code (0 until first seen), so each station string is
+    // hashed at most once per scan.
+    QVector<quint64> stationHashes;
+    if (scan.needStations) {
+        stationHashes.fill(0, store.dictionary().size());
+    }
+
+    for (int index = 0; index < store.segmentCount(); ++index) {
+        if (!include(index)) {
+            continue;
+        }
+        const quint8 *rowMask = nullptr;
+        if (scan.filtered() && canSkip(spec, scan, store.zone(index))) {
+            ++result.segmentsSkipped;
+            continue;
+        }
+        const SegmentIndex *segmentIndex =
+            useIndexes && (scan.indexed || scan.regionFilter()) ? store.index(index) : nullptr;
+        IndexedRows indexed;
+        if (segmentIndex) {
+            // Cells inside the region can be summed whole when nothing else filters rows.
+            const bool foldInside = vectorized && scan.codeFilters.isEmpty()
+                && (!scan.timeFilter || store.zone(index).withinTime(spec.from, spec.to));
+            indexed = indexedRows(scan, *segmentIndex, foldInside);
+            if (indexed.folded > 0) {
+                GroupState &group = codeGroups[GroupCodes()];
+                if (scan.needAqi) {
+                    group.aqi.add(indexed.aqi);
+                }
+                if (scan.needConcentration) {
+                    group.concentration.add(indexed.concentration);
+                }
+            }
+            if (indexed.rows.isEmpty()) {
+                ++(indexed.folded > 0 ? result.segmentsScanned : result.segmentsSkipped);
+                continue;
+            }
+        }
+        // Segments in files are only decoded once the zone map says they can match.
+        const SegmentColumns segment = store.columns(index, scan.decode);
+        if (scan.filtered()) {
+            bool masked = false;
+            if (buildMask(spec, scan, segment, segmentIndex ? &indexed : nullptr, mask.data(), scratch.data(),
+                          masked) == 0) {
+                ++result.segmentsScanned;
+                continue;
+            }
+            rowMask = masked ? mask.constData() : nullptr;
+        }
+        ++result.segmentsScanned;
+
+        if (vectorized) {
+            GroupState &group = codeGroups[GroupCodes()];
+            if (scan.needAqi) {
+                group.aqi.add(AggregationKernels::aggregate(segment.aqi, rowMask, segment.size()));
+            }
+            if (scan.needConcentration) {
+                group.concentration.add(AggregationKernels::aggregate(segment.concentration, rowMask, segment.size()));
+            }
+            continue;
+        }
+
+        for (int row = 0; row < segment.size(); ++row) {
+            if (rowMask && !rowMask[row]) {
+                continue;
+            }
+            quint32 parts[4] = {0, 0, 0, 0};
+            for (int i = 0; i < spec.groupBy.size(); ++i) {
+                parts[i] = groupCode(spec.groupBy[i], segment, row, spec.cellPrecision);
+            }
+            GroupCodes key((static_cast<quint64>(parts[0]) << 32) | parts[1],
+                           (static_cast<quint64>(parts[2]) << 32) | parts[3]);
+            GroupState &group = codeGroups[key];
+            if (scan.needAqi) {
+                group.aqi.add(segment.aqi[row], scan.keepDigests);
+            }
+            if (scan.needConcentration) {
+                group.concentration.add(segment.concentration[row], scan.keepDigests);
+            }
+            if (scan.needStations) {
+                quint64 &hash = stationHashes[static_cast<int>(segment.station[row])];
+                if (hash == 0) {
+                    hash = HyperLogLog::hash(store.dictionary().value(segment.station[row]));
+                }
+                group.stations.add(hash);
+            }
+        }
+    }
+
+    // Codes are local to this partition, so groups leave it keyed by their values.
+    for (auto it = codeGroups.constBegin(); it != codeGroups.constEnd(); ++it) {
+        const quint32 parts[4] = {
+            static_cast<quint32>(it.key().first >> 32), static_cast<quint32>(it.key().first),
+            static_cast<quint32>(it.key().second >> 32), static_cast<quint32>(it.key().second)
+        };
+        QStringList values;
+        for (int i = 0; i < spec.groupBy.size(); ++i) {
+            values.append(groupValue(spec.groupBy[i], parts[i], store, spec.cellPrecision));
+        }
+        result.groups[values.join(QueryResult::KeySeparator)].merge(it.value());
+    }
+    return result;
+}
+
+// Partition scan through the cache: the cached result while the partition is unchanged,
+// else the cached sealed segments' result merged with a scan of the rest.
+QueryResult executeCached(const QuerySpec &spec, const QString &fingerprint, const PartitionedStore &store,
+                          int partitionIndex, QueryCache &cache) {
+    const PartitionedStore::Partition &partition = store.partition(partitionIndex);
+    QReadLocker locker(&partition.lock);
+    const ColumnStore &columns = partition.store;
+    const ScanPlan scan = plan(spec, columns);
+    if (scan.matchesNothing) {
+        QueryResult result;
+        result.spec = spec;
+        return result;
+    }
+
+    QueryCache::Entry entry;
+    const bool found = cache.find(fingerprint, &store, partitionIndex, entry);
+    if (found && entry.version == columns.version()) {
+        cache.record(QueryCache::Hit);
+        QueryResult result = entry.sealed;
+        result.spec = spec;
+        result.merge(entry.open);
+        return result;
+    }
+
+    QSet<quint64> sealed;
+    for (int index = 0; index < columns.segmentCount(); ++index) {
+        if (const quint64 id = columns.segmentId(index)) {
+            sealed.insert(id);
+        }
+    }
+    // Segments only leave a partition when dropped, which makes the sealed result stale.
+    const bool reuse = found && sealed.contains(entry.segments);
+    cache.record(reuse ? QueryCache::Partial : QueryCache::Miss);
+    if (!reuse) {
+        entry = QueryCache::Entry();
+        entry.sealed.spec = spec;
+    }
+    const QueryResult fresh = scanSegments(spec, scan, columns, true, [&](int index) {
+        const quint64 id = columns.segmentId(index);
+        return id != 0 && !entry.segments.contains(id);
+    });
+    entry.open = scanSegments(spec, scan, columns, true, [&](int index) { return columns.segmentId(index) == 0; });
+    entry.sealed.merge(fresh);
+
+    QueryResult result = entry.sealed;
+    result.spec = spec;
+    result.merge(entry.open);
+    // Scan counts go to the query that did the scanning only.
+    entry.sealed.segmentsScanned = entry.sealed.segmentsSkipped = 0;
+    entry.open.segmentsScanned = entry.open.segmentsSkipped = 0;
+    entry.version = columns.version();
+    entry.segments = sealed;
+    cache.insert(fingerprint, &store, partitionIndex, std::move(entry));
+    return result;
+}
+
+}
+
+QueryResult QueryEngine::execute(const QuerySpec &spec, const PartitionedStore::Partition &partition,
+                                 bool useIndexes) {
+    QReadLocker locker(&partition.lock);
+    const ScanPlan scan = plan(spec, partition.store);
+    if (scan.matchesNothing) {
+        QueryResult result;
+        result.spec = spec;
+        return result;
+    }
+    return scanSegments(spec, scan, partition.store, useIndexes, [](int) { return true; });
+}
+
+QueryResult QueryEngine::execute(const QuerySpec &spec, const PartitionedStore &store, WorkStealingPool &pool,
+                                 QueryCache *cache) {
+    QVector<QueryResult> partials(store.partitionCount());
+    const bool cached = cache && cache->maxBytes() > 0;
+    const QString fingerprint = cached ? QueryCache::fingerprint(spec) : QString();
+    pool.parallelFor(store.partitionCount(), [&](int index) {
+        partials[index] = cached ? executeCached(spec, fingerprint, store, index, *cache)
+                                 : execute(spec, store.partition(index));
+    });
+
+    QueryResult result;
+    result.spec = spec;
+    if (spec.groupBy.isEmpty()) {
+        result.groups.insert(QString(), GroupState());  // an ungrouped query always yields one row
+    }
+    for (const QueryResult &partial : partials) {
+        result.merge(partial);
+    }
+    return result;
+}
@@ -0,0 +1,94 @@
+#ifndef QUERYENGINE_H
+#define QUERYENGINE_H
+
+#include <QHash>
+#include <QJsonObject>
+#include <QString>
+#include "AggregationKernels.h"
+#include "PartitionedStore.h"
+#include "QuerySpec.h"
+#include "Sketches.h"
+#include "WorkStealingPool.h"
+
+// Max/average AQI over every stored row, optionally restricted to one pollutant.
+struct MaxAverageResult {
+    AggregationKernels::Aggregate aqi;
+    QString maxArea;
+
+    void merge(const MaxAverageResult &other);
+    // Mergeable partial for the query coordinator: {"count", "sum", "max", "maxArea"}.
+    QJsonObject toJson() const;
+    static MaxAverageResult fromJson(const QJsonObject &json);
+};
+
+// Mergeable partial aggregate of one value column within one group.
+struct FieldState {
+    qint64 count = 0;
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    TDigest digest;  // only fed when a percentile is requested
+
+    void add(double value, bool keepDigest);
+    void add(const AggregationKernels::Aggregate &aggregate);
+    void merge(const FieldState &other);
+    double percentile(double p) const;
+    QJsonObject toJson() const;
+    static FieldState fromJson(const QJsonObject &json);
+};
+
+struct GroupState {
+    FieldState aqi;
+    FieldState concentration;
+    HyperLogLog stations;  // only fed for distinct(station)
+
+    void merge(const GroupState &other);
+    QJsonObject toJson() const;
+    static GroupState fromJson(const QJsonObject &json);
+    const FieldState &field(AggregateSpec::Field field) const {
+        return field == AggregateSpec::Field::Concentration ? concentration : aqi;
+    }
+};
+
+// Result of a QuerySpec: one GroupState per distinct combination of groupBy values.
+struct QueryResult {
+    static constexpr QChar KeySeparator = QChar(0x1f);
+
+    QuerySpec spec;
+    QHash<QString, GroupState> groups;  // groupBy values joined by KeySeparator
+    qint64 segmentsScanned = 0;
+    qint64 segmentsSkipped = 0;  // pruned by zone maps or indexes without reading any column
+
+    void merge(const QueryResult &other);
+    // {"columns": [groupBy..., aggregates...], "rows": [[...], ...], "segmentsScanned": n,
+    //  "segmentsSkipped": n} with rows sorted by group.
+    QJsonObject toJson() const;
+
+    // Partial aggregates a coordinator can merge: per group the counts, sums and extremes
+    // rather than finished averages, plus base64 t-digests ("digest") and station
+    // HyperLogLog sketches ("stations") a few KB in size however many rows they cover.
+    // {"groups": [{"key": [...], "aqi": {...}, "concentration": {...}, "stations": "..."}],
+    //  "segmentsScanned", "segmentsSkipped"}
+    QJsonObject toPartialJson() const;
+    static QueryResult fromPartialJson(const QuerySpec &spec, const QJsonObject &json);
+};
+
+class QueryCache;
+
+namespace QueryEngine {
+    // Scans all partitions in parallel on the pool and merges the partial aggregates.
+    MaxAverageResult maxAverage(const PartitionedStore &store, WorkStealingPool &pool, const QString &pollutant);
+    MaxAverageResult maxAverage(const PartitionedStore::Partition &partition, const QString &pollutant);
+
+    // Compiles the spec against each partition's dictionaries and runs the filtered,
+    // grouped scan on the pool. With a cache, partitions unchanged since the same query
+    // are not scanned, and of the others only segments the cached result lacks.
+    QueryResult execute(const QuerySpec &spec, const PartitionedStore &store, WorkStealingPool &pool,
+                        QueryCache *cache = nullptr);
+    // Sealed in-memory segments answer area, station and pollutant filters from their
+    // indexes; useIndexes = false scans the columns instead, for comparison.
+    QueryResult execute(const QuerySpec &spec, const PartitionedStore::Partition &partition,
+                        bool useIndexes = true);
+}
+
+#endif
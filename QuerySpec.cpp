@@ -0,0 +1,260 @@
+#include "QuerySpec.h"
+#include <QJsonArray>
+#include <QRegularExpression>
+#include "AqiRecord.h"
+
+namespace {
+
+QStringList stringList(const QJsonValue &value) {
+    QStringList list;
+    if (value.isString()) {
+        list.append(value.toString());
+    }
+    for (const QJsonValue &item : value.toArray()) {
+        list.append(item.toString());
+    }
+    return list;
+}
+
+bool parseTime(const QJsonValue &value, qint64 &time) {
+    if (value.isUndefined() || value.isNull()) {
+        return true;
+    }
+    if (value.isDouble()) {
+        time = static_cast<qint64>(value.toDouble());
+        return true;
+    }
+    if (value.isString() && !value.toString().isEmpty()) {
+        time = AqiRecord::parseTimestamp(value.toString());
+        return time != 0;
+    }
+    return false;
+}
+
+QString fieldName(AggregateSpec::Field field) {
+    switch (field) {
+    case AggregateSpec::Field::Aqi: return "aqi";
+    case AggregateSpec::Field::Concentration: return "concentration";
+    case AggregateSpec::Field::Station: return "station";
+    }
+    return QString();
+}
+
+}
+
+QString AggregateSpec::name() const {
+    switch (op) {
+    case Op::Count: return "count";
+    case Op::Sum: return QString("sum(%1)").arg(fieldName(field));
+    case Op::Avg: return QString("avg(%1)").arg(fieldName(field));
+    case Op::Min: return QString("min(%1)").arg(fieldName(field));
+    case Op::Max: return QString("max(%1)").arg(fieldName(field));
+    case Op::Percentile: return QString("p%1(%2)").arg(percentile).arg(fieldName(field));
+    case Op::Distinct: return QString("distinct(%1)").arg(fieldName(field));
+    }
+    return QString();
+}
+
+bool AggregateSpec::parse(const QString &text, AggregateSpec &spec) {
+    static const QRegularExpression pattern("^\\s*(\\w+)\\s*(?:\\(\\s*(\\w*)\\s*\\))?\\s*$");
+    QRegularExpressionMatch match = pattern.match(text);
+    if (!match.hasMatch()) {
+        return false;
+    }
+    const QString op = match.captured(1).toLower();
+    const QString field = match.captured(2).toLower();
+
+    if (field.isEmpty() || field == "aqi") {
+        spec.field = Field::Aqi;
+    } else if (field == "concentration") {
+        spec.field = Field::Concentration;
+    } else if (field == "station") {
+        spec.field = Field::Station;
+    } else {
+        return false;
+    }
+
+    bool ok = true;
+    if (op == "count") {
+        spec.op = Op::Count;
+    } else if (op == "sum") {
+        spec.op = Op::Sum;
+    } else if (op == "avg") {
+        spec.op = Op::Avg;
+    } else if (op == "min") {
+        spec.op = Op::Min;
+    } else if (op == "max") {
+        spec.op = Op::Max;
+    } else if (op == "median") {
+        spec.op = Op::Percentile;
+        spec.percentile = 50;
+    } else if (op.startsWith('p')) {
+        spec.op = Op::Percentile;
+        spec.percentile = op.mid(1).toDouble(&ok);
+        ok = ok && spec.percentile >= 0 && spec.percentile <= 100;
+    } else if (op == "distinct") {
+        spec.op = Op::Distinct;
+        ok = spec.field == Field::Station;
+    } else {
+        ok = false;
+    }
+    // Stations are strings: only their distinct count is defined.
+    return ok && (spec.field != Field::Station || spec.op == Op::Distinct);
+}
+
+bool QuerySpec::hasTimeRange() const {
+    return from != std::numeric_limits<qint64>::min() || to != std::numeric_limits<qint64>::max();
+}
+
+bool QuerySpec::needsPercentiles() const {
+    for (const AggregateSpec &aggregate : aggregates) {
+        if (aggregate.op == AggregateSpec::Op::Percentile) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool QuerySpec::needsDistinctStations() const {
+    for (const AggregateSpec &aggregate : aggregates) {
+        if (aggregate.op == AggregateSpec::Op::Distinct) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QString QuerySpec::groupFieldName(GroupField field) {
+    switch (field) {
+    case GroupField::Area: return "area";
+    case GroupField::Agency: return "agency";
+    case GroupField::Pollutant: return "pollutant";
+    case GroupField::Station: return "station";
+    case GroupField::Hour: return "hour";
+    case GroupField::Cell: return "cell";
+    }
+    return QString();
+}
+
+bool QuerySpec::fromJson(const QJsonObject &json, QuerySpec &spec, QString &error) {
+    spec = QuerySpec();
+    const QJsonObject filters = json["filters"].toObject();
+    spec.pollutants = stringList(filters["pollutant"]);
+    spec.areas = stringList(filters["area"]);
+    spec.agencies = stringList(filters["agency"]);
+    spec.stations = stringList(filters["station"]);
+    if (!parseTime(filters["from"], spec.from) || !parseTime(filters["to"], spec.to)) {
+        error = "invalid time range";
+        return false;
+    }
+    if (filters.contains("bbox")) {
+        QJsonArray box = filters["bbox"].toArray();
+        if (box.size() != 4) {
+            error = "bbox must be [minLat, minLon, maxLat, maxLon]";
+            return false;
+        }
+        spec.hasBoundingBox = true;
+        spec.minLatitude = box[0].toDouble();
+        spec.minLongitude = box[1].toDouble();
+        spec.maxLatitude = box[2].toDouble();
+        spec.maxLongitude = box[3].toDouble();
+    }
+    if (filters.contains("radius")) {
+        QJsonArray circle = filters["radius"].toArray();
+        if (circle.size() != 3 || circle[2].toDouble() < 0) {
+            error = "radius must be [lat, lon, km]";
+            return false;
+        }
+        spec.hasRadius = true;
+        spec.centerLatitude = circle[0].toDouble();
+        spec.centerLongitude = circle[1].toDouble();
+        spec.radiusKm = circle[2].toDouble();
+    }
+
+    for (const QString &name : stringList(json["groupBy"])) {
+        const QString field = name.toLower();
+        if (field == "area") {
+            spec.groupBy.append(GroupField::Area);
+        } else if (field == "agency") {
+            spec.groupBy.append(GroupField::Agency);
+        } else if (field == "pollutant") {
+            spec.groupBy.append(GroupField::Pollutant);
+        } else if (field == "station") {
+            spec.groupBy.append(GroupField::Station);
+        } else if (field == "hour") {
+            spec.groupBy.append(GroupField::Hour);
+        } else if (field == "cell" || field.startsWith("cell:")) {
+            bool ok = true;
+            const int precision = field == "cell" ? DefaultCellPrecision : field.mid(5).toInt(&ok);
+            if (!ok || precision < 1 || precision > MaxCellPrecision || spec.groupBy.contains(GroupField::Cell)) {
+                error = "invalid cell groupBy: " + name;
+                return false;
+            }
+            spec.cellPrecision = precision;
+            spec.groupBy.append(GroupField::Cell);
+        } else {
+            error = "unknown groupBy field: " + name;
+            return false;
+        }
+    }
+    if (spec.groupBy.size() > 4) {
+        error = "at most four groupBy fields are supported";
+        return false;
+    }
+
+    for (const QString &text : stringList(json["aggregates"])) {
+        AggregateSpec aggregate;
+        if (!AggregateSpec::parse(text, aggregate)) {
+            error = "unknown aggregate: " + text;
+            return false;
+        }
+        spec.aggregates.append(aggregate);
+    }
+    if (spec.aggregates.isEmpty()) {
+        AggregateSpec count;
+        spec.aggregates.append(count);
+    }
+    return true;
+}
+
+QJsonObject QuerySpec::toJson() const {
+    QJsonObject filters;
+    if (!pollutants.isEmpty()) {
+        filters["pollutant"] = QJsonArray::fromStringList(pollutants);
+    }
+    if (!areas.isEmpty()) {
+        filters["area"] = QJsonArray::fromStringList(areas);
+    }
+    if (!agencies.isEmpty()) {
+        filters["agency"] = QJsonArray::fromStringList(agencies);
+    }
+    if (!stations.isEmpty()) {
+        filters["station"] = QJsonArray::fromStringList(stations);
+    }
+    if (from != std::numeric_limits<qint64>::min()) {
+        filters["from"] = static_cast<double>(from);
+    }
+    if (to != std::numeric_limits<qint64>::max()) {
+        filters["to"] = static_cast<double>(to);
+    }
+    if (hasBoundingBox) {
+        filters["bbox"] = QJsonArray{minLatitude, minLongitude, maxLatitude, maxLongitude};
+    }
+    if (hasRadius) {
+        filters["radius"] = QJsonArray{centerLatitude, centerLongitude, radiusKm};
+    }
+
+    QJsonArray groups;
+    for (GroupField field : groupBy) {
+        groups.append(field == GroupField::Cell ? QString("cell:%1").arg(cellPrecision) : groupFieldName(field));
+    }
+    QJsonArray aggregateNames;
+    for (const AggregateSpec &aggregate : aggregates) {
+        aggregateNames.append(aggregate.name());
+    }
+    return QJsonObject{
+        {"filters", filters},
+        {"groupBy", groups},
+        {"aggregates", aggregateNames}
+    };
+}
@@ -0,0 +1,69 @@
+#ifndef QUERYSPEC_H
+#define QUERYSPEC_H
+
+#include <QJsonObject>
+#include <QStringList>
+#include <QVector>
+#include <limits>
+
+/*
+ * Declarative query carried in the "query" field of a query message:
+ *
+ *   {
+ *     "filters":    {"pollutant": ["PM2.5"], "area": ["Crescent City"], "agency": [...],
+ *                    "station": [...], "from": "2020-08-10T00:00", "to": "2020-08-11T00:00",
+ *                    "bbox": [minLat, minLon, maxLat, maxLon], "radius": [lat, lon, km]},
+ *     "groupBy":    ["area", "agency", "pollutant", "station", "hour", "cell:4"],
+ *     "aggregates": ["count", "sum(aqi)", "avg(aqi)", "min(concentration)", "max(aqi)", "p95(aqi)",
+ *                    "distinct(station)"]
+ *   }
+ *
+ * Every part is optional; "to" is exclusive and times may also be epoch seconds.
+ * "cell:<precision>" groups by geohash cell, precision 1 to 6 (plain "cell" is 4).
+ * Percentiles are estimated from t-digests and distinct counts from HyperLogLog
+ * sketches, so both stay cheap to ship and merge across analytics nodes.
+ */
+
+struct AggregateSpec {
+    enum class Op { Count, Sum, Avg, Min, Max, Percentile, Distinct };
+    enum class Field { Aqi, Concentration, Station };  // Station only for Op::Distinct
+
+    Op op = Op::Count;
+    Field field = Field::Aqi;
+    double percentile = 0;  // 0..100, only for Op::Percentile
+
+    QString name() const;
+    static bool parse(const QString &text, AggregateSpec &spec);
+};
+
+enum class GroupField { Area, Agency, Pollutant, Station, Hour, Cell };
+
+struct QuerySpec {
+    static constexpr int DefaultCellPrecision = 4;
+    static constexpr int MaxCellPrecision = 6;  // cells fit a 32-bit group code
+
+    QStringList pollutants;
+    QStringList areas;
+    QStringList agencies;
+    QStringList stations;
+    qint64 from = std::numeric_limits<qint64>::min();
+    qint64 to = std::numeric_limits<qint64>::max();
+    bool hasBoundingBox = false;
+    double minLatitude = 0, minLongitude = 0, maxLatitude = 0, maxLongitude = 0;
+    bool hasRadius = false;
+    double centerLatitude = 0, centerLongitude = 0, radiusKm = 0;
+    int cellPrecision = DefaultCellPrecision;  // of GroupField::Cell
+    QVector<GroupField> groupBy;
+    QVector<AggregateSpec> aggregates;
+
+    bool hasTimeRange() const;
+    bool hasRegion() const { return hasBoundingBox || hasRadius; }
+    bool needsPercentiles() const;
+    bool needsDistinctStations() const;
+
+    static bool fromJson(const QJsonObject &json, QuerySpec &spec, QString &error);
+    QJsonObject toJson() const;
+    static QString groupFieldName(GroupField field);
+};
+
+#endif
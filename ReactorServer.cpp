@@ -0,0 +1,367 @@
+#include "ReactorServer.h"
+#include <QDebug>
+#include <QThread>
+#include "Logging.h"
+#include "Metrics.h"
+
+namespace {
+// Events handled per wake-up of the node thread before it yields to its other work.
+const int MaxEventsPerDrain = 4096;
+
+QString peerName(const QHostAddress &address) {
+    const QString text = address.toString();
+    return text.startsWith("::ffff:") ? text.mid(7) : text;
+}
+}
+
+// One I/O thread's sockets. Lives on that thread; only send() is called from others.
+class IoReactor : public QObject {
+public:
+    struct Command {
+        enum Kind { Write, Pause, Resume, Abort };
+        Kind kind = Write;
+        quint64 id = 0;
+        QByteArray data;
+    };
+
+    IoReactor(ReactorServer *server, int index, WireCodec::Rows rows)
+        : server(server), rows(rows),
+          open(Metrics::Registry::global().gauge("aqi_io_connections", "Connections served by an I/O thread.",
+                                                 {{"thread", QString::number(index)}})) {}
+
+    void adopt(qintptr descriptor, quint64 id);
+    void send(Command &&command);
+
+private:
+    struct Channel {
+        QTcpSocket *socket = nullptr;
+        FrameReader reader;
+        bool paused = false;
+        Metrics::Counter *bytesReceived = nullptr;
+    };
+
+    void drain();
+    void read(quint64 id);
+    void close(quint64 id);
+
+    ReactorServer *server;
+    WireCodec::Rows rows;
+    QHash<quint64, Channel> channels;
+    MpscQueue<Command> commands;
+    std::atomic<bool> wakePending{false};
+    Metrics::Gauge &open;
+};
+
+void IoReactor::adopt(qintptr descriptor, quint64 id) {
+    QTcpSocket *socket = new QTcpSocket(this);
+    if (!socket->setSocketDescriptor(descriptor)) {
+        qCWarning(lcCluster) << "ReactorServer: cannot adopt accepted socket:" << socket->errorString();
+        delete socket;
+        return;
+    }
+    // Bounded so that a paused connection pushes back through TCP instead of buffering here.
+    socket->setReadBufferSize(MessageFraming::MaxFrameSize);
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+    const QHostAddress peer = socket->peerAddress();
+    const Metrics::Labels labels{{"peer", peerName(peer)}};
+    Metrics::Registry &registry = Metrics::Registry::global();
+    Channel &channel = channels[id];
+    channel.socket = socket;
+    channel.bytesReceived = &registry.counter("aqi_client_bytes_received_total",
+                                              "Bytes read from accepted connections, by peer address.", labels);
+    Metrics::Counter *bytesSent = &registry.counter("aqi_client_bytes_sent_total",
+                                                    "Bytes written to accepted connections, by peer address.", labels);
+    connect(socket, &QTcpSocket::bytesWritten, this, [bytesSent](qint64 bytes) { bytesSent->add(bytes); });
+    connect(socket, &QTcpSocket::readyRead, this, [this, id] { read(id); });
+    connect(socket, &QAbstractSocket::stateChanged, this, [this, id](QAbstractSocket::SocketState state) {
+        if (state == QAbstractSocket::UnconnectedState) {
+            close(id);
+        }
+    });
+    open.set(channels.size());
+
+    ReactorServer::Event event;
+    event.kind = ReactorServer::Event::Opened;
+    event.id = id;
+    event.reactor = this;
+    event.peer = peer;
+    server->post(std::move(event));
+    read(id);
+}
+
+void IoReactor::read(quint64 id) {
+    auto it = channels.find(id);
+    if (it == channels.end() || it->paused) {
+        return;
+    }
+    it->bytesReceived->add(it->socket->bytesAvailable());
+    it->reader.readFrom(it->socket);
+    QByteArray payload;
+    while (it->reader.nextFrame(payload)) {
+        ReactorServer::Event event;
+        if (!WireCodec::decode(payload, event.message, rows)) {
+            qCWarning(lcCluster) << "Dropping undecodable message from" << peerName(it->socket->peerAddress());
+            continue;
+        }
+        event.kind = ReactorServer::Event::Message;
+        event.id = id;
+        event.bytes = payload.size();
+        server->post(std::move(event));
+    }
+    if (it->reader.hasError()) {
+        qCWarning(lcCluster) << "Dropping connection with malformed frame:" << peerName(it->socket->peerAddress());
+        it->socket->abort();
+    }
+}
+
+void IoReactor::close(quint64 id) {
+    auto it = channels.find(id);
+    if (it == channels.end()) {
+        return;
+    }
+    it->socket->disconnect(this);
+    it->socket->deleteLater();
+    channels.erase(it);
+    open.set(channels.size());
+
+    ReactorServer::Event event;
+    event.kind = ReactorServer::Event::Closed;
+    event.id = id;
+    server->post(std::move(event));
+}
+
+void IoReactor::send(Command &&command) {
+    commands.push(std::move(command));
+    if (!wakePending.exchange(true, std::memory_order_acq_rel)) {
+        QMetaObject::invokeMethod(this, [this] { drain(); }, Qt::QueuedConnection);
+    }
+}
+
+void IoReactor::drain() {
+    wakePending.store(false, std::memory_order_release);
+    Command command;
+    while (commands.pop(command)) {
+        auto it = channels.find(command.id);
+        if (it == channels.end()) {
+            continue;  // closed in the meantime
+        }
+        switch (command.kind) {
+        case Command::Write:
+            it->socket->write(command.data);
+            break;
+        case Command::Pause:
+            it->paused = true;
+            break;
+        case Command::Resume:
+            it->paused = false;
+            read(command.id);
+            break;
+        case Command::Abort:
+            it->socket->abort();  // close() runs from stateChanged
+            break;
+        }
+    }
+}
+
+ClientConnection::ClientConnection(QTcpSocket *socket, WireCodec::Rows rows, QObject *parent)
+    : QObject(parent), local(socket), rows(rows) {
+    connect(socket, &QTcpSocket::readyRead, this, &ClientConnection::readLocal);
+    connect(socket, &QTcpSocket::disconnected, this, [this] {
+        closed = true;
+        emit disconnected();
+    });
+}
+
+ClientConnection::ClientConnection(IoReactor *reactor, quint64 id, const QHostAddress &peer, QObject *parent)
+    : QObject(parent), peer(peer), reactor(reactor), id(id) {}
+
+QHostAddress ClientConnection::peerAddress() const {
+    return local ? local->peerAddress() : peer;
+}
+
+void ClientConnection::write(const QByteArray &frame) {
+    if (local) {
+        local->write(frame);
+    } else if (!closed) {
+        reactor->send(IoReactor::Command{IoReactor::Command::Write, id, frame});
+    }
+}
+
+void ClientConnection::abort() {
+    if (local) {
+        local->abort();
+    } else if (!closed) {
+        reactor->send(IoReactor::Command{IoReactor::Command::Abort, id, QByteArray()});
+    }
+}
+
+void ClientConnection::setReadPaused(bool pause) {
+    if (paused == pause) {
+        return;
+    }
+    paused = pause;
+    if (local) {
+        if (!paused) {
+            readLocal();
+        }
+    } else if (!closed) {
+        reactor->send(IoReactor::Command{paused ? IoReactor::Command::Pause : IoReactor::Command::Resume, id,
+                                         QByteArray()});
+    }
+}
+
+bool ClientConnection::nextMessage(WireMessage &message, int &bytes) {
+    if (inbox.isEmpty()) {
+        return false;
+    }
+    Received received = inbox.dequeue();
+    message = std::move(received.message);
+    bytes = received.bytes;
+    return true;
+}
+
+void ClientConnection::readLocal() {
+    if (!local || paused) {
+        return;
+    }
+    localReader.readFrom(local);
+    QByteArray payload;
+    const int before = inbox.size();
+    while (localReader.nextFrame(payload)) {
+        Received received;
+        if (!WireCodec::decode(payload, received.message, rows)) {
+            qCWarning(lcCluster) << "Dropping undecodable message from" << peerName(local->peerAddress());
+            continue;
+        }
+        received.bytes = payload.size();
+        inbox.enqueue(std::move(received));
+    }
+    if (localReader.hasError()) {
+        qCWarning(lcCluster) << "Dropping connection with malformed frame:" << peerName(local->peerAddress());
+        local->abort();
+    }
+    if (inbox.size() > before) {
+        emit messagesReady();
+    }
+}
+
+ReactorServer::ReactorServer(int ioThreads, WireCodec::Rows rows, QObject *parent)
+    : QObject(parent), acceptor(new Acceptor(this)) {
+    for (int i = 0; i < qMax(1, ioThreads); ++i) {
+        QThread *thread = new QThread(this);
+        thread->setObjectName(QString("io-%1").arg(i));
+        IoReactor *reactor = new IoReactor(this, i, rows);
+        reactor->moveToThread(thread);
+        connect(thread, &QThread::finished, reactor, &QObject::deleteLater);
+        thread->start();
+        threads.append(thread);
+        reactors.append(reactor);
+    }
+}
+
+ReactorServer::~ReactorServer() {
+    acceptor->close();
+    for (QThread *thread : threads) {
+        thread->quit();
+    }
+    for (QThread *thread : threads) {
+        thread->wait();
+    }
+}
+
+int ReactorServer::defaultThreadCount() {
+    return qBound(1, QThread::idealThreadCount() / 2, 8);
+}
+
+bool ReactorServer::listen(const QHostAddress &address, quint16 port) {
+    return acceptor->listen(address, port);
+}
+
+void ReactorServer::close() {
+    acceptor->close();
+}
+
+ClientConnection *ReactorServer::nextPendingConnection() {
+    while (!pending.isEmpty()) {
+        if (ClientConnection *connection = pending.dequeue()) {
+            return connection;
+        }
+    }
+    return nullptr;
+}
+
+void ReactorServer::adopt(qintptr descriptor) {
+    IoReactor *reactor = reactors[nextReactor];
+    nextReactor = (nextReactor + 1) % reactors.size();
+    const quint64 id = nextId++;
+    QMetaObject::invokeMethod(reactor, [reactor, descriptor, id] { reactor->adopt(descriptor, id); },
+                              Qt::QueuedConnection);
+}
+
+void ReactorServer::post(Event &&event) {
+    events.push(std::move(event));
+    if (!wakePending.exchange(true, std::memory_order_acq_rel)) {
+        QMetaObject::invokeMethod(this, [this] { drain(); }, Qt::QueuedConnection);
+    }
+}
+
+void ReactorServer::drain() {
+    wakePending.store(false, std::memory_order_release);
+    // Each connection is told once per drain, after all of its messages are queued;
+    // a connection that closes is told about its last messages before it goes.
+    QVector<QPointer<ClientConnection>> ready;
+    auto signalReady = [](ClientConnection *connection) {
+        if (connection->signalQueued) {
+            connection->signalQueued = false;
+            emit connection->messagesReady();
+        }
+    };
+    Event event;
+    int handled = 0;
+    while (handled < MaxEventsPerDrain && events.pop(event)) {
+        ++handled;
+        switch (event.kind) {
+        case Event::Opened: {
+            ClientConnection *connection = new ClientConnection(event.reactor, event.id, event.peer, this);
+            connections.insert(event.id, connection);
+            pending.enqueue(connection);
+            emit newConnection();
+            break;
+        }
+        case Event::Message: {
+            ClientConnection *connection = connections.value(event.id);
+            if (!connection) {
+                break;
+            }
+            connection->inbox.enqueue(ClientConnection::Received{std::move(event.message), event.bytes});
+            if (!connection->signalQueued) {
+                connection->signalQueued = true;
+                ready.append(connection);
+            }
+            break;
+        }
+        case Event::Closed: {
+            ClientConnection *connection = connections.take(event.id);
+            if (!connection) {
+                break;
+            }
+            QPointer<ClientConnection> guard(connection);
+            signalReady(connection);
+            if (guard) {
+                connection->closed = true;
+                emit connection->disconnected();
+            }
+            break;
+        }
+        }
+    }
+    for (const QPointer<ClientConnection> &connection : ready) {
+        if (connection) {
+            signalReady(connection);
+        }
+    }
+    if (handled == MaxEventsPerDrain && !wakePending.exchange(true, std::memory_order_acq_rel)) {
+        QMetaObject::invokeMethod(this, [this] { drain(); }, Qt::QueuedConnection);
+    }
+}
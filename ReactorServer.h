@@ -0,0 +1,131 @@
+#ifndef REACTORSERVER_H
+#define REACTORSERVER_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QVector>
+#include <atomic>
+#include "MessageFraming.h"
+#include "MpscQueue.h"
+#include "WireCodec.h"
+
+class IoReactor;
+class QThread;
+class ReactorServer;
+
+// A client connection as seen from the node's thread. The socket itself lives on an
+// I/O thread that frames and decodes what arrives; decoded messages wait here until
+// the node takes them with nextMessage(), and write() and abort() are handed back to
+// the I/O thread. A connection can also wrap a socket of the node's own thread (its
+// link to the register node), which is then read on that thread.
+class ClientConnection : public QObject {
+    Q_OBJECT
+
+public:
+    explicit ClientConnection(QTcpSocket *socket, WireCodec::Rows rows = WireCodec::Rows::Records,
+                              QObject *parent = nullptr);
+
+    QHostAddress peerAddress() const;
+    // Writes an already framed message, like QTcpSocket::write.
+    void write(const QByteArray &frame);
+    void abort();
+    // While paused nothing more is read from the socket, so TCP pushes back on the
+    // sender; messages decoded before the pause are still returned by nextMessage().
+    void setReadPaused(bool paused);
+    bool nextMessage(WireMessage &message, int &bytes);
+
+signals:
+    // New messages are waiting for nextMessage().
+    void messagesReady();
+    void disconnected();
+
+private:
+    friend class ReactorServer;
+    struct Received {
+        WireMessage message;
+        int bytes = 0;
+    };
+
+    ClientConnection(IoReactor *reactor, quint64 id, const QHostAddress &peer, QObject *parent);
+    void readLocal();
+
+    QQueue<Received> inbox;
+    QHostAddress peer;
+    IoReactor *reactor = nullptr;
+    quint64 id = 0;
+    QPointer<QTcpSocket> local;
+    FrameReader localReader;
+    WireCodec::Rows rows = WireCodec::Rows::Records;
+    bool paused = false;
+    bool closed = false;
+    bool signalQueued = false;  // in ReactorServer::drain's ready list
+};
+
+// Accepts connections on the node's thread and hands them round-robin to a fixed set
+// of I/O threads, each with its own event loop, frame readers and decoder, so that
+// parsing scales with cores instead of saturating the node's event loop. Decoded
+// messages come back through one lock-free queue, drained in batches after a single
+// queued wake-up; writes go out through a lock-free queue per I/O thread. Node state
+// is only ever touched on the node's thread. Mirrors the QTcpServer API.
+class ReactorServer : public QObject {
+    Q_OBJECT
+
+public:
+    explicit ReactorServer(int ioThreads, WireCodec::Rows rows = WireCodec::Rows::Records, QObject *parent = nullptr);
+    ~ReactorServer();
+
+    // Half the cores, at least one and at most eight.
+    static int defaultThreadCount();
+
+    bool listen(const QHostAddress &address, quint16 port);
+    void close();
+    quint16 serverPort() const { return acceptor->serverPort(); }
+    ClientConnection *nextPendingConnection();
+    int threadCount() const { return reactors.size(); }
+
+signals:
+    void newConnection();
+
+private:
+    friend class IoReactor;
+    struct Event {
+        enum Kind { Opened, Message, Closed };
+        Kind kind = Message;
+        quint64 id = 0;
+        IoReactor *reactor = nullptr;
+        QHostAddress peer;  // Opened
+        WireMessage message;
+        int bytes = 0;
+    };
+    class Acceptor : public QTcpServer {
+    public:
+        explicit Acceptor(ReactorServer *server) : QTcpServer(server), server(server) {}
+
+    protected:
+        void incomingConnection(qintptr descriptor) override { server->adopt(descriptor); }
+
+    private:
+        ReactorServer *server;
+    };
+
+    void adopt(qintptr descriptor);
+    void post(Event &&event);  // from the I/O threads
+    void drain();
+
+    Acceptor *acceptor;
+    QVector<QThread *> threads;
+    QVector<IoReactor *> reactors;
+    int nextReactor = 0;
+    quint64 nextId = 1;
+    MpscQueue<Event> events;
+    std::atomic<bool> wakePending{false};
+    QHash<quint64, ClientConnection *> connections;
+    QQueue<QPointer<ClientConnection>> pending;  // accepted, not yet taken
+};
+
+#endif
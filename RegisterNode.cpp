@@ -1,20 +1,69 @@
 #include "RegisterNode.h"
+#include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDateTime>
 #include <QJsonArray>
 #include <QNetworkInterface>
+#include "Logging.h"
+#include "MetricsEndpoint.h"
 
-RegisterNode::RegisterNode(quint16 port, QObject *parent)
-    : QObject(parent), server(new QTcpServer(this)), myId(QDateTime::currentMSecsSinceEpoch() % 1000), localIP(getLocalIPAddress())
+RegisterNode::RegisterNode(quint16 port, const QHostAddress &bindAddress, int ioThreads, QObject *parent)
+    : QObject(parent), localIP(bindAddress.isNull() ? getLocalIPAddress() : bindAddress.toString()),
+      server(new ReactorServer(ioThreads, WireCodec::Rows::Records, this)), connections(new ConnectionPool(this)),
+      myId(QDateTime::currentMSecsSinceEpoch() % 1000), batcher(new MicroBatcher(MicroBatcher::Options(), this)),
+      ingestAckLatency(Metrics::Registry::global().histogram(
+          "aqi_ingest_ack_seconds", "Time from an ingestion request to its acknowledgment."))
 {
-    connect(server, &QTcpServer::newConnection, this, &RegisterNode::onNewConnection);
-    server->listen(QHostAddress::Any, port);
+    connect(server, &ReactorServer::newConnection, this, &RegisterNode::onNewConnection);
+    connect(connections, &ConnectionPool::frameReceived, this, &RegisterNode::onPeerFrame);
+    connect(connections, &ConnectionPool::peerDisconnected, this, [this](const QString &host, quint16 port) {
+        // Batches still queued in the pool go out on reconnect; those already written
+        // to the dropped connection will not be acknowledged.
+        const QSet<int> queued = connections->queuedTags(host, port);
+        QList<int> lost;
+        for (int batchId : ingest.inFlight(host)) {
+            if (!queued.contains(batchId)) {
+                lost.append(batchId);
+            }
+        }
+        loseBatches(host, lost);
+    });
+    connect(connections, &ConnectionPool::framesLost, this, [this](const QString &host, quint16, const QList<int> &tags) {
+        loseBatches(host, tags);
+    });
+    connect(batcher, &MicroBatcher::batchReady, this, &RegisterNode::onBatchReady);
+    if (!bindAddress.isNull()) {
+        connections->setLocalAddress(bindAddress);
+    }
+    server->listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, port);
+
+    Metrics::Registry &registry = Metrics::Registry::global();
+    registry.gaugeCallback("aqi_ingest_queued_rows", "Rows waiting for metadata node credits.", this,
+                           [this] { return static_cast<double>(ingest.queuedRows()); });
+    registry.gaugeCallback("aqi_batcher_pending_rows", "Rows waiting to be coalesced into a batch.", this,
+                           [this] { return static_cast<double>(batcher->pendingRows()); });
+    registry.gaugeCallback("aqi_pending_ingests", "Ingestion requests not yet acknowledged.", this,
+                           [this] { return static_cast<double>(pendingIngests.size()); });
+    registry.gaugeCallback("aqi_pending_queries", "Queries waiting for their result.", this,
+                           [this] { return static_cast<double>(pendingQueries.size()); });
+    registry.gaugeCallback("aqi_paused_clients", "Client connections not read from until the backlog drains.", this,
+                           [this] { return static_cast<double>(pausedClients.size()); });
+    registry.gaugeCallback("aqi_pool_connections", "Open pooled connections to other nodes.", this,
+                           [this] { return static_cast<double>(connections->openConnections()); });
+}
+
+void RegisterNode::setIngestPolicy(IngestQueue::Policy policy) {
+    ingest.setPolicy(policy);
+}
+
+void RegisterNode::setMicroBatching(const MicroBatcher::Options &options) {
+    batcher->setOptions(options);
 }
 
 RegisterNode::~RegisterNode() {
     server->close();
-    qDebug() << "[RegisterNode] Server shut down.";
+    qCDebug(lcCluster) << "[RegisterNode] Server shut down.";
 }
 
 QString extractIPv4Address(const QString& ipAddress) {
@@ -45,102 +94,335 @@ QList<QJsonObject> RegisterNode::getRegisterNodes() {
 }
 
 void RegisterNode::onNewConnection() {
-    QTcpSocket *client = server->nextPendingConnection();
+    ClientConnection *client = server->nextPendingConnection();
     clients.append(client);
-    connect(client, &QTcpSocket::readyRead, this, &RegisterNode::onReadyRead);
-    connect(client, &QTcpSocket::disconnected, this, &RegisterNode::onClientDisconnected);
-    qDebug() << "Metadata Node: New connection " << client;
+    connect(client, &ClientConnection::messagesReady, this, &RegisterNode::onReadyRead);
+    connect(client, &ClientConnection::disconnected, this, &RegisterNode::onClientDisconnected);
+    qCDebug(lcCluster) << "Register Node: New connection" << client->peerAddress().toString();
 }
 
 void RegisterNode::onReadyRead() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
-    QJsonDocument doc = QJsonDocument::fromJson(client->readAll());
-    processMessage(client, doc.object());
+    readFrames(qobject_cast<ClientConnection*>(sender()));
+}
+
+void RegisterNode::readFrames(ClientConnection *client) {
+    if (pausedClients.contains(client)) {
+        return;
+    }
+    // Framed and decoded on the connection's I/O thread.
+    WireMessage message;
+    int bytes = 0;
+    while (client->nextMessage(message, bytes)) {
+        const QString type = message.fields["requestType"].toString();
+        messageMetrics.received(type, bytes);
+        QElapsedTimer handling;
+        handling.start();
+        processMessage(client, message);
+        messageMetrics.handled(type, handling.nsecsElapsed());
+        if (ingest.policy() == IngestQueue::Policy::Delay && ingest.isFull()) {
+            // The rest stays queued; finishBatch resumes reading once the backlog drains.
+            pausedClients.append(client);
+            client->setReadPaused(true);
+            ingest.countDelay();
+            qCDebug(lcIngest) << "[RegisterNode] Ingest backlog full at" << ingest.queuedRows() << "rows; pausing"
+                              << client->peerAddress().toString();
+            return;
+        }
+    }
 }
 
 void RegisterNode::onClientDisconnected() {
-    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
+    ClientConnection *client = qobject_cast<ClientConnection*>(sender());
     QString clientIp = extractIPv4Address(client->peerAddress().toString());
     clients.removeAll(client);
+    pausedClients.removeAll(client);
+    for (auto it = pendingQueries.begin(); it != pendingQueries.end();) {
+        if (it.value().requester == client) {
+            it = pendingQueries.erase(it);
+        } else {
+            ++it;
+        }
+    }
     client->deleteLater();
     for (auto it = nodeList.begin(); it != nodeList.end(); ++it) {
         if ((*it)["IP"].toString() == clientIp) {
-            qDebug() << "Removing node from nodeList: " << clientIp;
+            qCDebug(lcCluster) << "Removing node from nodeList: " << clientIp;
             nodeList.erase(it);
             break;
         }
     }
     broadcastNodeList();
 }
-void RegisterNode::sendAnalyticsRequest(const QJsonArray& data) {
+void RegisterNode::sendAnalyticsRequest(ClientConnection *requester, const WireMessage &wireMessage) {
+    const AqiBatch &rows = wireMessage.rows;
+    const int id = nextIngestId++;
+    PendingIngest &pending = pendingIngests[id];
+    pending.requester = requester;
+    pending.requestId = wireMessage.fields["requestID"].toInt();
+    pending.format = wireMessage.format;
+    pending.rows = rows.size();
+    pending.received.start();
+
+    // Only the metadata leader takes ingestion: every metadata node shards rows onto
+    // the same ring, so sending them to more than one would store each row again.
+    const QJsonObject *leader = metadataLeader();
+    // Small requests are coalesced per metadata node; onBatchReady sends the result.
+    // add() may flush, and so settle a part, at once: one extra count keeps the
+    // request open until every part is handed over.
+    pending.outstanding = (leader ? 1 : 0) + 1;
+    if (leader) {
+        batcher->add((*leader)["IP"].toString(), QString(), rows.constData(), rows.size(), id);
+    } else if (!rows.isEmpty()) {
+        qCWarning(lcIngest) << "[RegisterNode] No metadata node to forward" << rows.size() << "rows to";
+    }
+    settleIngest(id, leader || rows.isEmpty() ? "stored" : "failed");
+}
+
+void RegisterNode::onBatchReady(const QString &ip, const QString &shard, const AqiBatch &rows, const QVector<int> &tags) {
+    Q_UNUSED(shard);
+    WireCodec::Format format = WireCodec::Format::Json;
+    bool known = false;
     for (const QJsonObject &node : nodeList) {
-        if (node["nodeType"].toString() == "metadata Analytics") {
-            QString analyticsNodeIp = node["IP"].toString();
-            QJsonObject requestObj;
-            requestObj["requestType"] = "analytics";
-            requestObj["requestID"] = 123;
-            requestObj["data"] = data;
+        if (node["nodeType"].toString() == "metadata Analytics" && node["IP"].toString() == ip) {
+            format = WireCodec::negotiate(node);
+            known = true;
+            break;
+        }
+    }
+    if (!known) {
+        qCWarning(lcIngest) << "[RegisterNode] Metadata node" << ip << "left; dropping" << rows.size() << "rows";
+        for (int id : tags) {
+            settleIngest(id, "failed");
+        }
+        return;
+    }
+
+    const int batchId = nextBatchId++;
+    QJsonObject requestObj;
+    requestObj["requestType"] = "ingestion";
+    requestObj["requestID"] = batchId;
+    if (!ingest.push(ip, batchId, WireCodec::encode(requestObj, rows, format), rows.size())) {
+        qCDebug(lcIngest) << "[RegisterNode] Ingest backlog full; shed" << rows.size() << "rows for" << ip;
+        for (int id : tags) {
+            settleIngest(id, "shed");
+        }
+        return;
+    }
+    ingestsOfBatch.insert(batchId, tags);
+    flushIngest(ip);
+}
+
+void RegisterNode::flushIngest(const QString &ip) {
+    for (const IngestQueue::Batch &batch : ingest.takeSendable(ip)) {
+        connections->send(ip, 12351, batch.payload, batch.id);
+        qCDebug(lcIngest) << "Analytics request sent: -> " << ip << batch.rows << "rows as request" << batch.id;
+    }
+}
+
+void RegisterNode::loseBatches(const QString &ip, const QList<int> &batchIds) {
+    if (batchIds.isEmpty()) {
+        return;
+    }
+    for (int batchId : batchIds) {
+        ingest.acknowledge(ip, batchId);
+        finishBatch(batchId, "failed");
+    }
+    flushIngest(ip);
+}
 
+void RegisterNode::finishBatch(int batchId, const QString &status) {
+    for (int id : ingestsOfBatch.take(batchId)) {
+        settleIngest(id, status);
+    }
+}
 
-            QJsonDocument doc(requestObj);
-            sendMessageToNode(analyticsNodeIp, doc);
-            qDebug() << "Analytics request sent: -> " << analyticsNodeIp;
+void RegisterNode::settleIngest(int id, const QString &status) {
+    auto it = pendingIngests.find(id);
+    if (it == pendingIngests.end()) {
+        return;
+    }
+    if (status == "shed") {
+        ++it->shed;
+    } else if (status != "stored") {
+        ++it->failed;
+    }
+    if (--it->outstanding > 0) {
+        return;
+    }
+    const PendingIngest pending = it.value();
+    pendingIngests.erase(it);
+    ingestAckLatency.record(pending.received.nsecsElapsed());
+    if (pending.requester) {
+        // "credits" is how many more rows this node can take before its backlog is full.
+        QJsonObject ack{
+            {"requestType", "ingestion acknowledgment"},
+            {"requestID", pending.requestId},
+            {"rows", pending.rows},
+            {"status", pending.failed > 0 ? "failed" : pending.shed > 0 ? "shed" : "stored"},
+            {"credits", static_cast<double>(ingest.freeRows())}
+        };
+        pending.requester->write(MessageFraming::frame(WireCodec::encode(ack, pending.format)));
+    }
+    if (!pausedClients.isEmpty() && ingest.canResume()) {
+        const QList<QPointer<ClientConnection>> resumed = pausedClients;
+        pausedClients.clear();
+        for (const QPointer<ClientConnection> &client : resumed) {
+            if (client) {
+                client->setReadPaused(false);
+                readFrames(client);
+            }
         }
     }
 }
 
-void RegisterNode::processQueryRequest(const QJsonObject &message) {
-    int requestId = 123;
-    int queryType = message["param"].toInt(); // Assuming 0 or 1 indicates different types of queries
+void RegisterNode::processQueryRequest(ClientConnection *client, const WireMessage &wireMessage) {
+    const QJsonObject &message = wireMessage.fields;
+    int requestId = message.contains("requestID") ? message["requestID"].toInt() : 123;
+    // A query spec object (see QuerySpec.h) is passed through untouched; older
+    // clients send a bare "param" number, which analytics nodes treat as max/avg.
+    QJsonValue query = message.contains("query") ? message["query"] : QJsonValue(message["param"].toInt());
 
+    // Client request IDs may collide, so the leader sees our own; the answer is
+    // mapped back in onPeerFrame.
+    const int id = nextQueryId++;
+    // The trace ID follows the query to every node, which adds its span to the result.
+    const QString trace = message.contains("trace") ? message["trace"].toString()
+                                                    : localIP + '-' + QString::number(id);
+    PendingQuery &pending = pendingQueries[id];
+    pending.requester = client;
+    pending.requestId = requestId;
+    pending.format = wireMessage.format;
+    pending.span.start(trace);
     QJsonObject queryRequest{
         {"requestType", "query"},
-        {"requestId", requestId},
-        {"query", queryType}
+        {"requestID", id},
+        {"query", query},
+        {"trace", trace}
     };
-    QJsonDocument doc(queryRequest);
-    forwardQueryToAnalyticsNode(doc);
+    if (message.contains("deadlineMs")) {
+        queryRequest["deadlineMs"] = message["deadlineMs"];
+    }
+    if (!forwardQueryToAnalyticsNode(queryRequest)) {
+        pendingQueries.remove(id);
+        QJsonObject response{
+            {"requestType", "query response"},
+            {"requestID", requestId},
+            {"error", "no metadata node to coordinate the query"}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
+    }
 }
 
-void RegisterNode::forwardQueryToAnalyticsNode(const QJsonDocument &doc) {
+const QJsonObject *RegisterNode::metadataLeader() const {
     for (const QJsonObject &node : nodeList) {
-        if (node["nodeType"].toString() == "metadata Analytics") {
-            QString analyticsNodeIp = node["Ip"].toString();
-            sendMessageToNode(analyticsNodeIp, doc);
-            qDebug() << "Send query to analytics node:" << analyticsNodeIp;
+        if (node["nodeType"].toString() == "metadata Analytics"
+            && (leaderIP.isEmpty() || node["IP"].toString() == leaderIP)) {
+            return &node;
         }
     }
+    return nullptr;
 }
 
-void RegisterNode::sendMessageToNode(const QString &ip, const QJsonDocument &doc) {
-    QTcpSocket *analyticsClient = new QTcpSocket(this);
-    analyticsClient->connectToHost(ip, 12351);
-    analyticsClient->write(doc.toJson());
-    qDebug() << "No client found with IP:" << ip;
+bool RegisterNode::forwardQueryToAnalyticsNode(const QJsonObject &query) {
+    // Only the metadata leader coordinates queries; before an election the first
+    // metadata node stands in.
+    const QJsonObject *leader = metadataLeader();
+    if (!leader) {
+        qCWarning(lcQuery) << "No metadata node to coordinate query" << query["trace"].toString();
+        return false;
+    }
+    const QString metadataNodeIp = (*leader)["IP"].toString();
+    sendMessageToNode(metadataNodeIp, WireCodec::encode(query, WireCodec::negotiate(*leader)));
+    qCDebug(lcQuery) << "Send query" << query["trace"].toString() << "to metadata node:" << metadataNodeIp;
+    return true;
+}
+
+void RegisterNode::onPeerFrame(const QString &host, quint16 port, const QByteArray &payload) {
+    Q_UNUSED(port);
+    WireMessage message;
+    if (!WireCodec::decode(payload, message)) {
+        qCWarning(lcCluster) << "Dropping undecodable message from" << host;
+        return;
+    }
+    messageMetrics.received(message.fields["requestType"].toString(), payload.size());
+    if (message.fields["requestType"].toString() == "ingestion acknowledgment") {
+        const int batchId = message.fields["requestID"].toInt();
+        ingest.acknowledge(host, batchId, message.fields.contains("credits")
+                                              ? static_cast<qint64>(message.fields["credits"].toDouble()) : -1);
+        finishBatch(batchId, message.fields["status"].toString("stored"));
+        flushIngest(host);
+        return;
+    }
+    if (message.fields["requestType"].toString() != "query response") {
+        qCDebug(lcCluster) << "Received message on pooled connection from" << host << ":" << message.fields;
+        return;
+    }
+    const int id = message.fields["requestID"].toInt();
+    if (!pendingQueries.contains(id)) {
+        qCDebug(lcQuery) << "Received query response for no pending query" << id;
+        return;
+    }
+    PendingQuery query = pendingQueries.take(id);
+    if (!query.requester) {
+        qCDebug(lcQuery) << "Requester of query" << query.requestId << "went away; dropping result";
+        return;
+    }
+    QJsonObject response = message.fields;
+    response["requestID"] = query.requestId;
+    query.span.finish(response, localIP, "register.route");
+    query.requester->write(MessageFraming::frame(WireCodec::encode(response, query.format)));
+}
+
+void RegisterNode::sendMessageToNode(const QString &ip, const QByteArray &payload) {
+    connections->send(ip, 12351, payload);
+    qCDebug(lcCluster) << "send message to IP:" << ip;
 }
 
-void RegisterNode::processMessage(QTcpSocket* client, const QJsonObject &message) {
+void RegisterNode::processMessage(ClientConnection* client, const WireMessage &wireMessage) {
+    const QJsonObject &message = wireMessage.fields;
     QString type = message["requestType"].toString();
 
     if (type == "registering") {
-        qDebug() << "Register Node: Registration request from" << message["IP"].toString();
+        qCDebug(lcCluster) << "Register Node: Registration request from" << message["IP"].toString();
         updateNodeList(message);
         broadcastNodeList();
     }
     else if (type == "ingestion") {
-        QJsonArray dataArray = message["data"].toArray();
-        qDebug() << "Register Node: Ingestion request" ;
-        sendAnalyticsRequest(dataArray);
+        qCDebug(lcIngest) << "Register Node: Ingestion request" << wireMessage.rows.size() << "rows";
+        sendAnalyticsRequest(client, wireMessage);
     } else if (type == "query") {
-        qDebug() << "Register Node: Query request from" << message["IP"].toString();
-        processQueryRequest(message);
+        qCDebug(lcQuery) << "Register Node: Query request" << message["requestID"].toInt();
+        processQueryRequest(client, wireMessage);
     }
     else if (type == "Leader Announcement") {
         leaderIP = message["leaderIP"].toString();
-        qDebug() << "New leader elected:" << leaderIP;
+        qCDebug(lcCluster) << "New leader elected:" << leaderIP;
+    }
+    else if (type == "metrics") {
+        QJsonObject response{
+            {"requestType", "metrics response"},
+            {"requestID", message["requestID"]},
+            {"ingest", ingest.metrics()},
+            {"batching", QJsonObject{
+                {"pendingRows", static_cast<double>(batcher->pendingRows())},
+                {"batches", static_cast<double>(batcher->batchesFlushed())},
+                {"rows", static_cast<double>(batcher->rowsFlushed())}
+            }}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
+    }
+    else if (type == "log level") {
+        Logging::setRules(message["rules"].toString());
+        qInfo() << "Register Node: log rules set to" << Logging::rules();
+        QJsonObject response{
+            {"requestType", "log level acknowledgment"},
+            {"requestID", message["requestID"]},
+            {"rules", Logging::rules()}
+        };
+        client->write(MessageFraming::frame(WireCodec::encode(response, wireMessage.format)));
     }
     else {
-        qDebug() << "Received unrecognized message type:" << type << message;
+        qCWarning(lcCluster) << "Received unrecognized message type:" << type;
     }
 }
 
@@ -159,7 +441,7 @@ void RegisterNode::updateNodeList(const QJsonObject &nodeData) {
     QJsonObject tamp = nodeData;
     tamp.remove("requestType");
     nodeList.append(tamp);
-    qDebug() << "[RegisterNode] Updated node list. Total nodes:" << nodeList.size();
+    qCDebug(lcCluster) << "[RegisterNode] Updated node list. Total nodes:" << nodeList.size();
 }
 
 void RegisterNode::broadcastNodeList() {
@@ -172,19 +454,36 @@ void RegisterNode::broadcastNodeList() {
     data["metadataAnalyticsLeader"] = leaderIP;
     data["metadataIngestionLeader"] = "";
     data["initElectionIngestion"] = "192.168.1.108";
+    data["codecs"] = WireCodec::supportedCodecs();
     QJsonObject message = createMessage("Node Discovery", data);
-    QJsonDocument doc(message);
+    QByteArray payload = WireCodec::encode(message);
 
-    qDebug() << "Clients:" << clients.size();
-    for (QTcpSocket *client : clients) {
-        client->write(doc.toJson());
-        qDebug() << "[RegisterNode] Broadcasting node list to" << extractIPv4Address(client->peerAddress().toString());
-        qDebug() << "Processed broadcasting request, message: " << message;
+    qCDebug(lcCluster) << "Clients:" << clients.size();
+    for (ClientConnection *client : clients) {
+        client->write(MessageFraming::frame(payload));
+        qCDebug(lcCluster) << "[RegisterNode] Broadcasting node list to" << extractIPv4Address(client->peerAddress().toString());
+        qCDebug(lcCluster) << "Processed broadcasting request, message: " << message;
     }
 }
 
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
-    RegisterNode node(12351);
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({"bind", "Address to listen on and connect from (default: all interfaces).", "address"});
+    parser.addOption({"metrics-port", "Port of the plain-text metrics endpoint, 0 to disable.", "port",
+                      QString::number(MetricsEndpoint::DefaultPort)});
+    parser.addOption({"io-threads", "Threads reading and decoding client connections.", "count",
+                      QString::number(ReactorServer::defaultThreadCount())});
+    parser.process(app);
+    const QHostAddress bindAddress(parser.value("bind"));
+    RegisterNode node(12351, bindAddress, parser.value("io-threads").toInt());
+    node.setIngestPolicy(IngestQueue::policyFromName(qEnvironmentVariable("AQI_INGEST_POLICY")));
+
+    Metrics::Registry::global().setConstantLabels({{"node", "register"}, {"address", node.localIP}});
+    MetricsEndpoint metrics;
+    if (const quint16 metricsPort = parser.value("metrics-port").toUShort()) {
+        metrics.listen(bindAddress.isNull() ? QHostAddress(QHostAddress::Any) : bindAddress, metricsPort);
+    }
     return app.exec();
 }
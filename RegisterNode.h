@@ -1,42 +1,102 @@
 #ifndef RegisterNode_H
 #define RegisterNode_H
 
-#include <QTcpServer>
-#include <QTcpSocket>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QTimer>
+#include <QPointer>
+#include "ConnectionPool.h"
+#include "IngestQueue.h"
+#include "MessageFraming.h"
+#include "Metrics.h"
+#include "MicroBatcher.h"
+#include "ReactorServer.h"
+#include "WireCodec.h"
 
 class RegisterNode : public QObject {
     Q_OBJECT
 public:
-    explicit RegisterNode(quint16 port, QObject *parent = nullptr);
+    // bindAddress, when set, is the address this node listens on and connects from;
+    // otherwise it listens on every interface. Client connections are read and decoded
+    // on ioThreads threads of their own.
+    explicit RegisterNode(quint16 port, const QHostAddress &bindAddress = QHostAddress(),
+                          int ioThreads = ReactorServer::defaultThreadCount(), QObject *parent = nullptr);
     ~RegisterNode();
     QString localIP; //"192.168.1.107";
+    // Applies when more rows are waiting for metadata node credits than the ingest
+    // backlog holds: Delay stops reading from the ingesting client, Shed refuses the batch.
+    void setIngestPolicy(IngestQueue::Policy policy);
+    // Size and latency budget for coalescing rows per metadata node.
+    void setMicroBatching(const MicroBatcher::Options &options);
 
 private slots:
     void onNewConnection();
     void onReadyRead();
+    void readFrames(ClientConnection *client);
     void onClientDisconnected();
+    void onPeerFrame(const QString &host, quint16 port, const QByteArray &payload);
+    void onBatchReady(const QString &ip, const QString &shard, const AqiBatch &rows, const QVector<int> &tags);
 
 private:
-    QTcpServer *server;
-    QList<QTcpSocket*> clients;
+    ReactorServer *server;
+    ConnectionPool *connections;
+    QList<ClientConnection*> clients;
     QList<QJsonObject> nodeList;
     int myId;
     QString leaderIP;
+    // Queries forwarded to the metadata leader, by the request ID used towards it.
+    struct PendingQuery {
+        QPointer<ClientConnection> requester;
+        int requestId = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+        Metrics::Span span;
+    };
+    QHash<int, PendingQuery> pendingQueries;
+    int nextQueryId = 1;
+    // Ingestion requests forwarded to every metadata node, coalesced with other
+    // requests' rows into batches; the client is acknowledged once every batch holding
+    // its rows has been answered.
+    struct PendingIngest {
+        QPointer<ClientConnection> requester;
+        int requestId = 0;
+        WireCodec::Format format = WireCodec::Format::Json;
+        int rows = 0;
+        int outstanding = 0;
+        int shed = 0;
+        int failed = 0;
+        QElapsedTimer received;
+    };
+    MicroBatcher *batcher;
+    IngestQueue ingest;
+    QHash<int, PendingIngest> pendingIngests;
+    QHash<int, QVector<int>> ingestsOfBatch;  // batch request ID -> pending ingests with rows in it
+    int nextIngestId = 1;
+    int nextBatchId = 1;
+    QList<QPointer<ClientConnection>> pausedClients;  // not read from until the backlog halves
+    Metrics::MessageMetrics messageMetrics{QStringList{
+        "registering", "ingestion", "query", "Leader Announcement", "metrics", "log level",
+        "ingestion acknowledgment", "query response"}};
+    Metrics::Histogram &ingestAckLatency;
 
-    void processMessage(QTcpSocket* client, const QJsonObject &message);
+    void processMessage(ClientConnection* client, const WireMessage &wireMessage);
     QJsonObject createMessage(const QString &type, const QVariantMap &data);
     void updateNodeList(const QJsonObject &nodeData);
     void broadcastNodeList();
     QList<QJsonObject> getRegisterNodes();
     QString getLocalIPAddress() const;
-    void sendMessageToNode(const QString &ip, const QJsonDocument &doc);
-    void sendAnalyticsRequest(const QJsonArray& data);
-    void processQueryRequest(const QJsonObject &message);
-    void forwardQueryToAnalyticsNode(const QJsonDocument &doc);
+    void sendMessageToNode(const QString &ip, const QByteArray &payload);
+    void sendAnalyticsRequest(ClientConnection *requester, const WireMessage &wireMessage);
+    void flushIngest(const QString &ip);
+    void loseBatches(const QString &ip, const QList<int> &batchIds);
+    void finishBatch(int batchId, const QString &status);
+    void settleIngest(int id, const QString &status);
+    void processQueryRequest(ClientConnection *client, const WireMessage &wireMessage);
+    // False when there is no metadata node to send the query to.
+    bool forwardQueryToAnalyticsNode(const QJsonObject &query);
+    // The metadata leader, or before an election the first metadata node; null when
+    // no metadata node is known.
+    const QJsonObject *metadataLeader() const;
 };
 
 #endif
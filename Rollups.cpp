@@ -0,0 +1,393 @@
+#include "Rollups.h"
+#include <QDataStream>
+#include <algorithm>
+
+namespace {
+
+const quint8 FormatVersion = 1;
+
+qint64 floorDivide(qint64 value, qint64 divisor) {
+    qint64 quotient = value / divisor;
+    return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+}
+
+bool aligned(qint64 value, qint64 seconds) {
+    return floorDivide(value, seconds) * seconds == value;
+}
+
+// Counts, sums and extremes only, for queries that ask for no percentile.
+void mergeTotals(FieldState &into, const FieldState &from) {
+    into.count += from.count;
+    into.sum += from.sum;
+    into.min = qMin(into.min, from.min);
+    into.max = qMax(into.max, from.max);
+}
+
+void writeField(QDataStream &out, const FieldState &field) {
+    out << field.count << field.sum << field.min << field.max
+        << (field.digest.isEmpty() ? QByteArray() : field.digest.serialize());
+}
+
+bool readField(QDataStream &in, FieldState &field) {
+    QByteArray digest;
+    in >> field.count >> field.sum >> field.min >> field.max >> digest;
+    return digest.isEmpty() || TDigest::deserialize(digest, field.digest);
+}
+
+}
+
+qint64 RollupStore::bucketSeconds(Tier tier) {
+    switch (tier) {
+    case Minute: return 60;
+    case Hour: return 3600;
+    case Day: return 24 * 3600;
+    }
+    return 0;
+}
+
+qint64 RollupStore::retentionSeconds(Tier tier) {
+    switch (tier) {
+    case Minute: return 2 * 24 * 3600;
+    case Hour: return 92 * 24 * 3600;
+    case Day: return 0;
+    }
+    return 0;
+}
+
+QString RollupStore::tierName(Tier tier) {
+    switch (tier) {
+    case Minute: return QStringLiteral("minute");
+    case Hour: return QStringLiteral("hour");
+    case Day: return QStringLiteral("day");
+    }
+    return QString();
+}
+
+void RollupStore::fold(qint64 timestamp, quint32 area, quint32 pollutant, double aqi, double concentration,
+                       quint64 station, Touched &touched) {
+    data.newest = qMax(data.newest, timestamp);
+    const quint64 group = (static_cast<quint64>(area) << 32) | pollutant;
+    for (int t = 0; t < TierCount; ++t) {
+        const qint64 seconds = bucketSeconds(static_cast<Tier>(t));
+        const qint64 bucket = floorDivide(timestamp, seconds);
+        if (bucket * seconds < data.horizon[t]) {
+            continue;  // that bucket has already expired from this tier
+        }
+        const RollupKey key(group, bucket);
+        RollupCell &cell = data.cells[t][key];
+        const bool keepDigest = t != Minute;
+        cell.aqi.add(aqi, keepDigest);
+        cell.concentration.add(concentration, false);
+        auto it = std::lower_bound(cell.stations.begin(), cell.stations.end(), station);
+        if (it == cell.stations.end() || *it != station) {
+            cell.stations.insert(it, station);
+        }
+        if (keepDigest) {
+            touched[t].insert(key);
+        }
+    }
+}
+
+void RollupStore::settle(const Touched &touched) {
+    for (int t = 0; t < TierCount; ++t) {
+        for (const RollupKey &key : touched[t]) {
+            data.cells[t][key].aqi.digest.centroidCount();
+        }
+    }
+}
+
+void RollupStore::add(const ColumnBatch &batch, int offset, int count) {
+    // Each batch string is interned and hashed at most once.
+    QVector<quint32> codes(batch.strings.size(), StringDictionary::NotFound);
+    QVector<quint64> stationHashes(batch.strings.size(), 0);
+    Touched touched;
+    QWriteLocker locker(&lock);
+    auto code = [&](quint32 index) {
+        quint32 &slot = codes[static_cast<int>(index)];
+        if (slot == StringDictionary::NotFound) {
+            slot = data.strings.intern(batch.string(index));
+        }
+        return slot;
+    };
+    for (int i = offset; i < offset + count; ++i) {
+        quint64 &station = stationHashes[static_cast<int>(batch.aqsId[i])];
+        if (station == 0) {
+            station = HyperLogLog::hash(batch.string(batch.aqsId[i]));
+        }
+        fold(batch.timestamp[i], code(batch.siteName[i]), code(batch.pollutant[i]), batch.aqi[i],
+             batch.concentration[i], station, touched);
+    }
+    settle(touched);
+}
+
+void RollupStore::add(const AqiRecord *records, int count) {
+    Touched touched;
+    QWriteLocker locker(&lock);
+    for (int i = 0; i < count; ++i) {
+        const AqiRecord &record = records[i];
+        fold(record.timestamp, data.strings.intern(record.siteName), data.strings.intern(record.pollutant),
+             record.aqi, record.concentration, HyperLogLog::hash(record.aqsId), touched);
+    }
+    settle(touched);
+}
+
+void RollupStore::add(const ColumnStore &store) {
+    const StringDictionary &dictionary = store.dictionary();
+    QVector<quint32> codes(dictionary.size(), StringDictionary::NotFound);
+    QVector<quint64> stationHashes(dictionary.size(), 0);
+    Touched touched;
+    QWriteLocker locker(&lock);
+    auto code = [&](quint32 index) {
+        quint32 &slot = codes[static_cast<int>(index)];
+        if (slot == StringDictionary::NotFound) {
+            slot = data.strings.intern(dictionary.value(index));
+        }
+        return slot;
+    };
+    for (int index = 0; index < store.segmentCount(); ++index) {
+        const SegmentColumns segment = store.columns(index, SegmentColumns::DecodeAll);
+        for (int row = 0; row < segment.size(); ++row) {
+            quint64 &station = stationHashes[static_cast<int>(segment.station[row])];
+            if (station == 0) {
+                station = HyperLogLog::hash(dictionary.value(segment.station[row]));
+            }
+            fold(segment.timestamp[row], code(segment.area[row]), code(segment.pollutant[row]), segment.aqi[row],
+                 segment.concentration[row], station, touched);
+        }
+    }
+    settle(touched);
+}
+
+void RollupStore::expire() {
+    QWriteLocker locker(&lock);
+    if (data.newest == std::numeric_limits<qint64>::min()) {
+        return;
+    }
+    for (int t = 0; t < TierCount; ++t) {
+        const qint64 retention = retentionSeconds(static_cast<Tier>(t));
+        if (retention == 0) {
+            continue;
+        }
+        const qint64 seconds = bucketSeconds(static_cast<Tier>(t));
+        // The bucket holding the retention boundary is kept whole.
+        const qint64 horizon = floorDivide(data.newest - retention, seconds) * seconds;
+        if (horizon <= data.horizon[t]) {
+            continue;
+        }
+        QHash<RollupKey, RollupCell> &cells = data.cells[t];
+        for (auto it = cells.begin(); it != cells.end();) {
+            if (it.key().second * seconds < horizon) {
+                it = cells.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        data.horizon[t] = horizon;
+    }
+}
+
+bool RollupStore::tierFor(const QuerySpec &spec, Tier &tier) const {
+    if (!spec.agencies.isEmpty() || !spec.stations.isEmpty() || spec.hasRegion()) {
+        return false;
+    }
+    bool byHour = false;
+    for (GroupField field : spec.groupBy) {
+        if (field == GroupField::Hour) {
+            byHour = true;
+        } else if (field != GroupField::Area && field != GroupField::Pollutant) {
+            return false;
+        }
+    }
+    for (const AggregateSpec &aggregate : spec.aggregates) {
+        if (aggregate.op == AggregateSpec::Op::Percentile && aggregate.field != AggregateSpec::Field::Aqi) {
+            return false;  // only AQI keeps a digest
+        }
+    }
+    for (int t = TierCount - 1; t >= 0; --t) {
+        const qint64 seconds = bucketSeconds(static_cast<Tier>(t));
+        if ((byHour && seconds > 3600) || (t == Minute && spec.needsPercentiles())) {
+            continue;
+        }
+        // Open ends are only covered by a tier that has not expired anything.
+        if (spec.from < data.horizon[t]) {
+            continue;
+        }
+        if ((spec.from != std::numeric_limits<qint64>::min() && !aligned(spec.from, seconds))
+            || (spec.to != std::numeric_limits<qint64>::max() && !aligned(spec.to, seconds))) {
+            continue;
+        }
+        tier = static_cast<Tier>(t);
+        return true;
+    }
+    return false;
+}
+
+bool RollupStore::answer(const QuerySpec &spec, QueryResult &result, Tier &tier) const {
+    QReadLocker locker(&lock);
+    if (!tierFor(spec, tier)) {
+        return false;
+    }
+    result = QueryResult();
+    result.spec = spec;
+    if (spec.groupBy.isEmpty()) {
+        result.groups.insert(QString(), GroupState());  // an ungrouped query always yields one row
+    }
+
+    bool matchesNothing = false;
+    auto resolve = [&](const QStringList &values) {
+        QVector<quint32> codes;
+        for (const QString &value : values) {
+            const quint32 code = data.strings.find(value);
+            if (code != StringDictionary::NotFound) {
+                codes.append(code);
+            }
+        }
+        matchesNothing |= !values.isEmpty() && codes.isEmpty();
+        return codes;
+    };
+    const QVector<quint32> areas = resolve(spec.areas);
+    const QVector<quint32> pollutants = resolve(spec.pollutants);
+    if (matchesNothing) {
+        return true;
+    }
+
+    const qint64 seconds = bucketSeconds(tier);
+    const qint64 first = spec.from == std::numeric_limits<qint64>::min() ? spec.from : spec.from / seconds;
+    const qint64 last = spec.to == std::numeric_limits<qint64>::max() ? spec.to : spec.to / seconds;
+    const bool keepDigests = spec.needsPercentiles();
+    const bool needStations = spec.needsDistinctStations();
+
+    using GroupCodes = QPair<quint64, quint64>;
+    QHash<GroupCodes, GroupState> codeGroups;
+    const QHash<RollupKey, RollupCell> &cells = data.cells[tier];
+    for (auto it = cells.constBegin(); it != cells.constEnd(); ++it) {
+        const qint64 bucket = it.key().second;
+        const quint32 area = static_cast<quint32>(it.key().first >> 32);
+        const quint32 pollutant = static_cast<quint32>(it.key().first);
+        if (bucket < first || bucket >= last || (!areas.isEmpty() && !areas.contains(area))
+            || (!pollutants.isEmpty() && !pollutants.contains(pollutant))) {
+            continue;
+        }
+        quint32 parts[4] = {0, 0, 0, 0};
+        for (int i = 0; i < spec.groupBy.size(); ++i) {
+            switch (spec.groupBy[i]) {
+            case GroupField::Area: parts[i] = area; break;
+            case GroupField::Pollutant: parts[i] = pollutant; break;
+            default: parts[i] = static_cast<quint32>(bucket * seconds / 3600); break;
+            }
+        }
+        GroupState &group = codeGroups[GroupCodes((static_cast<quint64>(parts[0]) << 32) | parts[1],
+                                                  (static_cast<quint64>(parts[2]) << 32) | parts[3])];
+        const RollupCell &cell = it.value();
+        if (keepDigests) {
+            group.aqi.merge(cell.aqi);
+        } else {
+            mergeTotals(group.aqi, cell.aqi);
+        }
+        mergeTotals(group.concentration, cell.concentration);
+        if (needStations) {
+            for (quint64 station : cell.stations) {
+                group.stations.add(station);
+            }
+        }
+    }
+
+    for (auto it = codeGroups.constBegin(); it != codeGroups.constEnd(); ++it) {
+        const quint32 parts[4] = {
+            static_cast<quint32>(it.key().first >> 32), static_cast<quint32>(it.key().first),
+            static_cast<quint32>(it.key().second >> 32), static_cast<quint32>(it.key().second)
+        };
+        QStringList values;
+        for (int i = 0; i < spec.groupBy.size(); ++i) {
+            values.append(spec.groupBy[i] == GroupField::Hour
+                              ? AqiRecord::formatTimestamp(static_cast<qint64>(parts[i]) * 3600)
+                              : data.strings.value(parts[i]));
+        }
+        result.groups[values.join(QueryResult::KeySeparator)].merge(it.value());
+    }
+    return true;
+}
+
+RollupTiers RollupStore::tiers() const {
+    QReadLocker locker(&lock);
+    return data;
+}
+
+void RollupStore::restore(const RollupTiers &tiers) {
+    QWriteLocker locker(&lock);
+    data = tiers;
+}
+
+qint64 RollupStore::newestTimestamp() const {
+    QReadLocker locker(&lock);
+    return data.newest;
+}
+
+int RollupStore::cellCount(Tier tier) const {
+    QReadLocker locker(&lock);
+    return data.cells[tier].size();
+}
+
+QByteArray RollupTiers::serialize() const {
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << FormatVersion << static_cast<quint32>(strings.size());
+    for (int code = 0; code < strings.size(); ++code) {
+        out << strings.value(static_cast<quint32>(code));
+    }
+    out << newest;
+    for (int t = 0; t < Count; ++t) {
+        out << horizon[t] << static_cast<quint32>(cells[t].size());
+        for (auto it = cells[t].constBegin(); it != cells[t].constEnd(); ++it) {
+            out << it.key().first << it.key().second;
+            writeField(out, it.value().aqi);
+            writeField(out, it.value().concentration);
+            out << static_cast<quint32>(it.value().stations.size());
+            for (quint64 station : it.value().stations) {
+                out << station;
+            }
+        }
+    }
+    return bytes;
+}
+
+bool RollupTiers::deserialize(const QByteArray &bytes, RollupTiers &tiers) {
+    QDataStream in(bytes);
+    quint8 version = 0;
+    quint32 stringCount = 0;
+    in >> version >> stringCount;
+    if (version != FormatVersion) {
+        return false;
+    }
+    RollupTiers loaded;
+    for (quint32 i = 0; i < stringCount && in.status() == QDataStream::Ok; ++i) {
+        QString value;
+        in >> value;
+        loaded.strings.intern(value);
+    }
+    in >> loaded.newest;
+    bool ok = true;
+    for (int t = 0; t < Count && ok; ++t) {
+        quint32 cellCount = 0;
+        in >> loaded.horizon[t] >> cellCount;
+        for (quint32 i = 0; i < cellCount && ok && in.status() == QDataStream::Ok; ++i) {
+            RollupKey key;
+            RollupCell cell;
+            quint32 stationCount = 0;
+            in >> key.first >> key.second;
+            ok = readField(in, cell.aqi) && readField(in, cell.concentration);
+            in >> stationCount;
+            for (quint32 s = 0; s < stationCount && in.status() == QDataStream::Ok; ++s) {
+                quint64 station = 0;
+                in >> station;
+                cell.stations.append(station);
+            }
+            loaded.cells[t].insert(key, cell);
+        }
+    }
+    if (!ok || in.status() != QDataStream::Ok) {
+        return false;
+    }
+    tiers = std::move(loaded);
+    return true;
+}
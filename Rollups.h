@@ -0,0 +1,102 @@
+#ifndef ROLLUPS_H
+#define ROLLUPS_H
+
+#include <QHash>
+#include <QPair>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QVector>
+#include <array>
+#include <limits>
+#include "AqiRecord.h"
+#include "ColumnBatch.h"
+#include "ColumnStore.h"
+#include "QueryEngine.h"
+#include "QuerySpec.h"
+
+// Rollup of one (area, pollutant, time bucket).
+struct RollupCell {
+    FieldState aqi;             // digest only on the hour and day tiers
+    FieldState concentration;   // no digest
+    QVector<quint64> stations;  // sorted distinct HyperLogLog::hash of the station IDs
+};
+
+// area << 32 | pollutant codes, bucket number (bucket start / tier seconds)
+using RollupKey = QPair<quint64, qint64>;
+
+// Contents of every tier. Copies share their hashes until one side writes, so taking
+// one for a snapshot costs a reference per tier.
+struct RollupTiers {
+    static constexpr int Count = 3;
+
+    StringDictionary strings;  // areas and pollutants
+    std::array<QHash<RollupKey, RollupCell>, Count> cells;
+    // Start of the oldest bucket each tier still holds in full; earlier ones expired.
+    std::array<qint64, Count> horizon{{std::numeric_limits<qint64>::min(), std::numeric_limits<qint64>::min(),
+                                       std::numeric_limits<qint64>::min()}};
+    qint64 newest = std::numeric_limits<qint64>::min();  // newest reading time seen
+
+    // QDataStream of quint8 version | quint32 strings | strings | qint64 newest | per tier:
+    // qint64 horizon | quint32 cells | per cell: key, aqi and concentration fields, stations.
+    QByteArray serialize() const;
+    static bool deserialize(const QByteArray &data, RollupTiers &tiers);
+};
+
+/*
+ * Materialized rollups of one store: per (area, pollutant, time bucket) the count,
+ * sum, min and max of AQI and concentration, the distinct station hashes and, on
+ * the hour and day tiers, an AQI t-digest. Rows are folded into all three tiers as
+ * they are stored; a late row lands in the bucket of its reading time, so it merges
+ * into the rollup already there.
+ *
+ *   tier     bucket   kept behind the newest reading
+ *   minute   60 s     2 days
+ *   hour     1 h      92 days
+ *   day      1 d      forever
+ *
+ * A query on area, pollutant and time only is answered from the coarsest tier whose
+ * buckets line up with its time range and whose history covers it, which reads a few
+ * cells per area and bucket instead of every reading. Anything else scans raw rows,
+ * which may therefore be kept for a shorter time than the rollups.
+ */
+class RollupStore {
+public:
+    enum Tier { Minute, Hour, Day };
+    static constexpr int TierCount = RollupTiers::Count;
+
+    static qint64 bucketSeconds(Tier tier);
+    // 0 keeps the tier forever.
+    static qint64 retentionSeconds(Tier tier);
+    static QString tierName(Tier tier);
+
+    void add(const ColumnBatch &batch, int offset, int count);
+    void add(const AqiRecord *records, int count);
+    // Folds in every row of store, e.g. one restored from a snapshot without rollups.
+    void add(const ColumnStore &store);
+    // Drops buckets past each tier's retention.
+    void expire();
+
+    // Fills result from the coarsest tier that answers spec exactly and returns true,
+    // or returns false when the spec needs raw rows.
+    bool answer(const QuerySpec &spec, QueryResult &result, Tier &tier) const;
+
+    RollupTiers tiers() const;
+    void restore(const RollupTiers &tiers);
+    qint64 newestTimestamp() const;
+    int cellCount(Tier tier) const;
+
+private:
+    using Touched = std::array<QSet<RollupKey>, TierCount>;
+
+    void fold(qint64 timestamp, quint32 area, quint32 pollutant, double aqi, double concentration, quint64 station,
+              Touched &touched);
+    // Flushes the digests of the touched cells. Readers share cells under the read
+    // lock and a t-digest flushes lazily even when const, so none may be left unflushed.
+    void settle(const Touched &touched);
+    bool tierFor(const QuerySpec &spec, Tier &tier) const;
+
+    RollupTiers data;
+    mutable QReadWriteLock lock;
+};
+
+#endif
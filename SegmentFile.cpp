@@ -0,0 +1,457 @@
+#include "SegmentFile.h"
+#include <QSaveFile>
+#include <QtAlgorithms>
+#include <cstring>
+
+namespace {
+
+const QByteArray HeaderMagic("AQSEG001");
+const QByteArray TrailerMagic("AQSEGEND");
+constexpr int Alignment = 8;
+
+template <typename T>
+void appendValue(QByteArray &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+bool readValue(const uchar *&cursor, const uchar *end, T &value) {
+    if (end - cursor < static_cast<qint64>(sizeof(T))) {
+        return false;
+    }
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return true;
+}
+
+void appendVarint(QByteArray &out, quint64 value) {
+    while (value >= 0x80) {
+        out.append(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(static_cast<char>(value));
+}
+
+quint64 readVarint(const uchar *&cursor, const uchar *end) {
+    quint64 value = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+        const uchar byte = *cursor++;
+        value |= quint64(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+// Bits are packed most significant first.
+class BitWriter {
+public:
+    void write(quint64 value, int bits) {
+        while (bits > 0) {
+            const int take = qMin(64 - used, bits);
+            const quint64 chunk = (value >> (bits - take)) & (take == 64 ? ~quint64(0) : (quint64(1) << take) - 1);
+            buffer = take == 64 ? chunk : (buffer << take) | chunk;
+            used += take;
+            bits -= take;
+            if (used == 64) {
+                flushBytes(8);
+            }
+        }
+    }
+
+    QByteArray finish() {
+        if (used > 0) {
+            buffer <<= 64 - used;
+            flushBytes((used + 7) / 8);
+        }
+        return bytes;
+    }
+
+private:
+    void flushBytes(int count) {
+        for (int i = 0; i < count; ++i) {
+            bytes.append(static_cast<char>(buffer >> (56 - 8 * i)));
+        }
+        buffer = 0;
+        used = 0;
+    }
+
+    QByteArray bytes;
+    quint64 buffer = 0;
+    int used = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const uchar *data, qint64 size) : data(data), size(size) {}
+
+    // Reads past the end as zero bits.
+    quint64 read(int bits) {
+        quint64 value = 0;
+        while (bits > 0) {
+            const qint64 byte = position >> 3;
+            const int available = 8 - static_cast<int>(position & 7);
+            const int take = qMin(available, bits);
+            const quint64 current = byte < size ? data[byte] : 0;
+            value = (value << take) | ((current >> (available - take)) & ((1u << take) - 1));
+            position += take;
+            bits -= take;
+        }
+        return value;
+    }
+
+private:
+    const uchar *data;
+    qint64 size;
+    qint64 position = 0;
+};
+
+quint64 doubleBits(double value) {
+    quint64 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+double bitsDouble(quint64 bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+QByteArray encodeDelta(const QVector<qint64> &values) {
+    QByteArray out;
+    qint64 previous = 0;
+    for (qint64 value : values) {
+        const qint64 delta = static_cast<qint64>(static_cast<quint64>(value) - static_cast<quint64>(previous));
+        appendVarint(out, (static_cast<quint64>(delta) << 1) ^ static_cast<quint64>(delta >> 63));
+        previous = value;
+    }
+    return out;
+}
+
+void decodeDelta(const uchar *cursor, qint64 bytes, int rows, QVector<qint64> &values) {
+    const uchar *end = cursor + bytes;
+    values.resize(rows);
+    quint64 previous = 0;
+    for (int i = 0; i < rows; ++i) {
+        const quint64 zigzag = readVarint(cursor, end);
+        previous += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+        values[i] = static_cast<qint64>(previous);
+    }
+}
+
+int dictionaryWidth(int distinct) {
+    return distinct <= 0x100 ? 1 : distinct <= 0x10000 ? 2 : 4;
+}
+
+QByteArray encodeDictionary(const QVector<quint32> &codes) {
+    QVector<quint32> distinct;
+    QHash<quint32, quint32> slots;
+    for (quint32 code : codes) {
+        if (!slots.contains(code)) {
+            slots.insert(code, static_cast<quint32>(distinct.size()));
+            distinct.append(code);
+        }
+    }
+    QByteArray out;
+    appendValue<quint32>(out, static_cast<quint32>(distinct.size()));
+    for (quint32 code : distinct) {
+        appendValue<quint32>(out, code);
+    }
+    const int width = dictionaryWidth(distinct.size());
+    for (quint32 code : codes) {
+        const quint32 slot = slots.value(code);
+        if (width == 1) {
+            appendValue<quint8>(out, static_cast<quint8>(slot));
+        } else if (width == 2) {
+            appendValue<quint16>(out, static_cast<quint16>(slot));
+        } else {
+            appendValue<quint32>(out, slot);
+        }
+    }
+    return out;
+}
+
+void decodeDictionary(const uchar *cursor, qint64 bytes, int rows, QVector<quint32> &codes) {
+    const uchar *end = cursor + bytes;
+    codes.resize(rows);
+    quint32 distinct = 0;
+    readValue(cursor, end, distinct);
+    const uchar *table = cursor;
+    if (end - table < qint64(distinct) * 4) {
+        codes.fill(0);
+        return;
+    }
+    auto code = [table](quint32 slot) {
+        quint32 value;
+        std::memcpy(&value, table + qint64(slot) * 4, sizeof(value));
+        return value;
+    };
+    cursor += qint64(distinct) * 4;
+    const int width = dictionaryWidth(static_cast<int>(distinct));
+    for (int i = 0; i < rows; ++i) {
+        quint32 slot = 0;
+        if (width == 1) {
+            quint8 narrow = 0;
+            readValue(cursor, end, narrow);
+            slot = narrow;
+        } else if (width == 2) {
+            quint16 narrow = 0;
+            readValue(cursor, end, narrow);
+            slot = narrow;
+        } else {
+            readValue(cursor, end, slot);
+        }
+        codes[i] = slot < distinct ? code(slot) : 0;
+    }
+}
+
+QByteArray encodeGorilla(const QVector<double> &values) {
+    BitWriter out;
+    if (values.isEmpty()) {
+        return out.finish();
+    }
+    quint64 previous = doubleBits(values[0]);
+    out.write(previous, 64);
+    int windowLeading = -1;
+    int windowTrailing = 0;
+    for (int i = 1; i < values.size(); ++i) {
+        const quint64 current = doubleBits(values[i]);
+        const quint64 x = current ^ previous;
+        previous = current;
+        if (x == 0) {
+            out.write(0, 1);
+            continue;
+        }
+        const int leading = qMin(31u, qCountLeadingZeroBits(x));
+        const int trailing = static_cast<int>(qCountTrailingZeroBits(x));
+        if (windowLeading >= 0 && leading >= windowLeading && trailing >= windowTrailing) {
+            out.write(0b10, 2);
+            out.write(x >> windowTrailing, 64 - windowLeading - windowTrailing);
+        } else {
+            const int meaningful = 64 - leading - trailing;
+            out.write(0b11, 2);
+            out.write(static_cast<quint64>(leading), 5);
+            out.write(static_cast<quint64>(meaningful - 1), 6);
+            out.write(x >> trailing, meaningful);
+            windowLeading = leading;
+            windowTrailing = trailing;
+        }
+    }
+    return out.finish();
+}
+
+void decodeGorilla(const uchar *cursor, qint64 bytes, int rows, QVector<double> &values) {
+    values.resize(rows);
+    if (rows == 0) {
+        return;
+    }
+    BitReader in(cursor, bytes);
+    quint64 previous = in.read(64);
+    values[0] = bitsDouble(previous);
+    int leading = 0;
+    int meaningful = 64;
+    for (int i = 1; i < rows; ++i) {
+        if (in.read(1)) {
+            if (in.read(1)) {
+                leading = static_cast<int>(in.read(5));
+                meaningful = static_cast<int>(in.read(6)) + 1;
+            }
+            const int trailing = qMax(0, 64 - leading - meaningful);
+            previous ^= in.read(meaningful) << trailing;
+        }
+        values[i] = bitsDouble(previous);
+    }
+}
+
+template <typename T>
+QByteArray rawBytes(const QVector<T> &values) {
+    return QByteArray(reinterpret_cast<const char *>(values.constData()), values.size() * static_cast<int>(sizeof(T)));
+}
+
+}
+
+QSharedPointer<const SegmentFile> SegmentFile::write(const QString &path, const QVector<AqiSegment> &segments,
+                                                     QString &error) {
+    QSaveFile output(path);
+    if (!output.open(QIODevice::WriteOnly)) {
+        error = output.errorString();
+        return {};
+    }
+    output.write(HeaderMagic);
+    qint64 offset = HeaderMagic.size();
+
+    QVector<Entry> written;
+    for (const AqiSegment &segment : segments) {
+        Entry entry;
+        entry.bucket = segment.bucket;
+        entry.rows = segment.size();
+        entry.zone = segment.zone;
+        const QByteArray blocks[BlockCount] = {
+            encodeDelta(segment.timestamp),
+            encodeGorilla(segment.aqi),
+            rawBytes(segment.concentration),
+            rawBytes(segment.latitude),
+            rawBytes(segment.longitude),
+            rawBytes(segment.pollutant),
+            encodeDictionary(segment.area),
+            encodeDictionary(segment.agency),
+            rawBytes(segment.station)
+        };
+        for (int i = 0; i < BlockCount; ++i) {
+            const qint64 padding = (Alignment - offset % Alignment) % Alignment;
+            output.write(QByteArray(static_cast<int>(padding), '\0'));
+            offset += padding;
+            entry.blocks[i] = Block{offset, blocks[i].size(), BlockEncodings[i]};
+            output.write(blocks[i]);
+            offset += blocks[i].size();
+        }
+        written.append(entry);
+    }
+
+    QByteArray index;
+    appendValue<quint32>(index, static_cast<quint32>(written.size()));
+    for (const Entry &entry : written) {
+        appendValue<qint64>(index, entry.bucket);
+        appendValue<quint32>(index, static_cast<quint32>(entry.rows));
+        const ZoneMap &zone = entry.zone;
+        appendValue(index, zone.minTimestamp);
+        appendValue(index, zone.maxTimestamp);
+        appendValue(index, zone.minAqi);
+        appendValue(index, zone.maxAqi);
+        appendValue(index, zone.minLatitude);
+        appendValue(index, zone.maxLatitude);
+        appendValue(index, zone.minLongitude);
+        appendValue(index, zone.maxLongitude);
+        appendValue<quint32>(index, static_cast<quint32>(zone.pollutants.size()));
+        for (quint32 code : zone.pollutants) {
+            appendValue<quint32>(index, code);
+        }
+        for (const Block &block : entry.blocks) {
+            appendValue<qint64>(index, block.offset);
+            appendValue<qint64>(index, block.bytes);
+            appendValue<quint8>(index, block.encoding);
+        }
+    }
+    appendValue<quint64>(index, static_cast<quint64>(offset));
+    index.append(TrailerMagic);
+    output.write(index);
+    if (!output.commit()) {
+        error = output.errorString();
+        return {};
+    }
+    return open(path, error);
+}
+
+QSharedPointer<const SegmentFile> SegmentFile::open(const QString &path, QString &error) {
+    QSharedPointer<SegmentFile> segmentFile(new SegmentFile);
+    QFile &file = segmentFile->file;
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return {};
+    }
+    const qint64 size = file.size();
+    const qint64 tail = sizeof(quint64) + TrailerMagic.size();
+    const uchar *data = size >= HeaderMagic.size() + tail ? file.map(0, size) : nullptr;
+    if (!data || std::memcmp(data, HeaderMagic.constData(), HeaderMagic.size()) != 0
+        || std::memcmp(data + size - TrailerMagic.size(), TrailerMagic.constData(), TrailerMagic.size()) != 0) {
+        error = path + " is not a segment file";
+        return {};
+    }
+
+    quint64 indexOffset = 0;
+    std::memcpy(&indexOffset, data + size - tail, sizeof(indexOffset));
+    if (indexOffset < quint64(HeaderMagic.size()) || indexOffset > quint64(size - tail)) {
+        error = path + " has a corrupt index";
+        return {};
+    }
+    const uchar *cursor = data + indexOffset;
+    const uchar *end = data + size - tail;
+
+    bool ok = true;
+    quint32 count = 0;
+    ok = readValue(cursor, end, count);
+    for (quint32 s = 0; ok && s < count; ++s) {
+        Entry entry;
+        quint32 rows = 0;
+        quint32 pollutants = 0;
+        ZoneMap &zone = entry.zone;
+        ok = readValue(cursor, end, entry.bucket) && readValue(cursor, end, rows)
+             && readValue(cursor, end, zone.minTimestamp) && readValue(cursor, end, zone.maxTimestamp)
+             && readValue(cursor, end, zone.minAqi) && readValue(cursor, end, zone.maxAqi)
+             && readValue(cursor, end, zone.minLatitude) && readValue(cursor, end, zone.maxLatitude)
+             && readValue(cursor, end, zone.minLongitude) && readValue(cursor, end, zone.maxLongitude)
+             && readValue(cursor, end, pollutants) && rows <= quint32(AqiSegment::Capacity);
+        for (quint32 p = 0; ok && p < pollutants; ++p) {
+            quint32 code = 0;
+            ok = readValue(cursor, end, code);
+            zone.pollutants.append(code);
+        }
+        entry.rows = static_cast<int>(rows);
+        for (int i = 0; ok && i < BlockCount; ++i) {
+            Block &block = entry.blocks[i];
+            ok = readValue(cursor, end, block.offset) && readValue(cursor, end, block.bytes)
+                 && readValue(cursor, end, block.encoding) && block.encoding == BlockEncodings[i]
+                 && block.offset >= HeaderMagic.size() && block.bytes >= 0
+                 && block.offset + block.bytes <= qint64(indexOffset);
+            if (ok && block.encoding == Raw) {
+                const qint64 width = i >= PollutantBlock ? sizeof(quint32) : sizeof(double);
+                ok = block.offset % Alignment == 0 && block.bytes == width * rows;
+            }
+        }
+        segmentFile->rows += rows;
+        segmentFile->entries.append(entry);
+    }
+    if (!ok) {
+        error = path + " has a corrupt index";
+        return {};
+    }
+    segmentFile->data = data;
+    segmentFile->size = size;
+    return segmentFile;
+}
+
+SegmentColumns SegmentFile::columns(int index, int decode) const {
+    struct Decoded {
+        QVector<qint64> timestamp;
+        QVector<double> aqi;
+        QVector<quint32> area;
+        QVector<quint32> agency;
+    };
+    thread_local Decoded decoded;
+
+    const Entry &entry = entries[index];
+    SegmentColumns columns;
+    columns.rows = entry.rows;
+    columns.zone = &entry.zone;
+    columns.concentration = raw<double>(entry.blocks[ConcentrationBlock]);
+    columns.latitude = raw<double>(entry.blocks[LatitudeBlock]);
+    columns.longitude = raw<double>(entry.blocks[LongitudeBlock]);
+    columns.pollutant = raw<quint32>(entry.blocks[PollutantBlock]);
+    columns.station = raw<quint32>(entry.blocks[StationBlock]);
+
+    auto blockData = [this](const Block &block) { return data + block.offset; };
+    if (decode & SegmentColumns::Timestamp) {
+        const Block &block = entry.blocks[TimestampBlock];
+        decodeDelta(blockData(block), block.bytes, entry.rows, decoded.timestamp);
+        columns.timestamp = decoded.timestamp.constData();
+    }
+    if (decode & SegmentColumns::Aqi) {
+        const Block &block = entry.blocks[AqiBlock];
+        decodeGorilla(blockData(block), block.bytes, entry.rows, decoded.aqi);
+        columns.aqi = decoded.aqi.constData();
+    }
+    if (decode & SegmentColumns::Area) {
+        const Block &block = entry.blocks[AreaBlock];
+        decodeDictionary(blockData(block), block.bytes, entry.rows, decoded.area);
+        columns.area = decoded.area.constData();
+    }
+    if (decode & SegmentColumns::Agency) {
+        const Block &block = entry.blocks[AgencyBlock];
+        decodeDictionary(blockData(block), block.bytes, entry.rows, decoded.agency);
+        columns.agency = decoded.agency.constData();
+    }
+    return columns;
+}
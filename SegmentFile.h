@@ -0,0 +1,76 @@
+#ifndef SEGMENTFILE_H
+#define SEGMENTFILE_H
+
+#include <QFile>
+#include <QSharedPointer>
+#include <QVector>
+#include "ColumnStore.h"
+
+/*
+ * Immutable file of sealed segments moved out of memory. Layout:
+ *
+ *   "AQSEG001" | column blocks, each starting on an 8-byte boundary | index | quint64 index offset | "AQSEGEND"
+ *
+ * The index lists per segment its bucket, row count and zone map, then offset, length
+ * and encoding of each of its nine column blocks. Encodings:
+ *
+ *   Raw         the in-memory array (concentration, latitude, longitude, pollutant, station)
+ *   Delta       zigzag varint differences between consecutive values (timestamp)
+ *   Dictionary  quint32 n | n codes | one index per row, 1, 2 or 4 bytes wide (area, agency)
+ *   Gorilla     each value XORed with the previous one, leading and trailing zero bits
+ *               elided, reusing the previous window when it fits (aqi)
+ *
+ * Codes refer to the dictionary of the partition that wrote the file, which is saved
+ * with its snapshot. Numbers are native-endian. The file stays mapped while open: raw
+ * columns are scanned in place and encoded ones are decoded only when a scan needs them.
+ */
+class SegmentFile {
+public:
+    // Writes segments to path (via a temporary file) and opens the result.
+    static QSharedPointer<const SegmentFile> write(const QString &path, const QVector<AqiSegment> &segments,
+                                                   QString &error);
+    static QSharedPointer<const SegmentFile> open(const QString &path, QString &error);
+
+    QString path() const { return file.fileName(); }
+    int segmentCount() const { return entries.size(); }
+    qint64 rowCount() const { return rows; }
+    qint64 fileSize() const { return size; }
+    qint64 bucket(int index) const { return entries[index].bucket; }
+    const ZoneMap &zone(int index) const { return entries[index].zone; }
+    // Columns of one segment; decode is a set of SegmentColumns::Decode flags. Decoded
+    // columns live in a per-thread buffer that the next call on the same thread reuses.
+    SegmentColumns columns(int index, int decode) const;
+
+private:
+    enum Encoding : quint8 { Raw, Delta, Dictionary, Gorilla };
+    enum BlockIndex {
+        TimestampBlock, AqiBlock, ConcentrationBlock, LatitudeBlock, LongitudeBlock,
+        PollutantBlock, AreaBlock, AgencyBlock, StationBlock, BlockCount
+    };
+    static constexpr quint8 BlockEncodings[BlockCount] = {
+        Delta, Gorilla, Raw, Raw, Raw, Raw, Dictionary, Dictionary, Raw
+    };
+    struct Block {
+        qint64 offset = 0;
+        qint64 bytes = 0;
+        quint8 encoding = Raw;
+    };
+    struct Entry {
+        qint64 bucket = 0;
+        int rows = 0;
+        ZoneMap zone;
+        Block blocks[BlockCount];
+    };
+
+    SegmentFile() = default;
+    template <typename T>
+    const T *raw(const Block &block) const { return reinterpret_cast<const T *>(data + block.offset); }
+
+    QFile file;  // unmapping happens on close, so it stays open
+    const uchar *data = nullptr;
+    qint64 size = 0;
+    qint64 rows = 0;
+    QVector<Entry> entries;
+};
+
+#endif
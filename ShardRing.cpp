@@ -0,0 +1,118 @@
+#include "ShardRing.h"
+#include <algorithm>
+
+ShardRing::ShardRing(int replicationFactor, KeyField keyField)
+    : replicas(qMax(1, replicationFactor)), field(keyField) {}
+
+void ShardRing::clear() {
+    points.clear();
+    nodeNames.clear();
+}
+
+void ShardRing::setReplicationFactor(int factor) {
+    replicas = qMax(1, factor);
+}
+
+QString ShardRing::keyFilterName() const {
+    return field == KeyField::Area ? "area" : "station";
+}
+
+quint64 ShardRing::hash(const QString &key) {
+    // FNV-1a over the UTF-16 code units, then a 64-bit finalizer to spread nearby keys.
+    quint64 value = 14695981039346656037ULL;
+    for (QChar c : key) {
+        value ^= c.unicode();
+        value *= 1099511628211ULL;
+    }
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+void ShardRing::addNode(const QString &node, double capacity) {
+    if (nodeNames.contains(node)) {
+        return;
+    }
+    const int index = nodeNames.size();
+    nodeNames.append(node);
+    const int count = qMax(1, static_cast<int>(capacity * PointsPerCapacity + 0.5));
+    for (int i = 0; i < count; ++i) {
+        points.append(qMakePair(hash(node + '#' + QString::number(i)), index));
+    }
+    std::sort(points.begin(), points.end());
+}
+
+QString ShardRing::keyOf(const AqiRecord &record) const {
+    return field == KeyField::Area ? record.siteName : record.aqsId;
+}
+
+int ShardRing::firstPointAtOrAfter(quint64 position) const {
+    auto it = std::lower_bound(points.constBegin(), points.constEnd(), position,
+                               [](const QPair<quint64, int> &point, quint64 value) { return point.first < value; });
+    return it == points.constEnd() ? 0 : static_cast<int>(it - points.constBegin());
+}
+
+QVector<int> ShardRing::walk(int index, int count) const {
+    QVector<int> found;
+    count = qMin(count, nodeNames.size());
+    for (int step = 0; step < points.size() && found.size() < count; ++step) {
+        const int node = points[(index + step) % points.size()].second;
+        if (!found.contains(node)) {
+            found.append(node);
+        }
+    }
+    return found;
+}
+
+QStringList ShardRing::owners(const QString &key) const {
+    QStringList result;
+    if (points.isEmpty()) {
+        return result;
+    }
+    for (int node : walk(firstPointAtOrAfter(hash(key)), replicas)) {
+        result.append(nodeNames[node]);
+    }
+    return result;
+}
+
+QString ShardRing::primaryOf(const QString &key) const {
+    if (points.isEmpty()) {
+        return QString();
+    }
+    return nodeNames[points[firstPointAtOrAfter(hash(key))].second];
+}
+
+QStringList ShardRing::replicaHolders(const QString &node, int rank) const {
+    QStringList holders;
+    const int owner = nodeNames.indexOf(node);
+    if (owner < 0 || rank < 1 || rank >= replicas) {
+        return holders;
+    }
+    // Keys landing just before one of node's points are owned by it; their replicas
+    // are the next distinct nodes clockwise from that point.
+    for (int i = 0; i < points.size(); ++i) {
+        if (points[i].second != owner) {
+            continue;
+        }
+        const QVector<int> chain = walk(i, rank + 1);
+        if (chain.size() > rank && !holders.contains(nodeNames[chain[rank]])) {
+            holders.append(nodeNames[chain[rank]]);
+        }
+    }
+    return holders;
+}
+
+QStringList ShardRing::replicasFor(const QString &node) const {
+    QStringList result;
+    for (int rank = 1; rank < replicas; ++rank) {
+        for (const QString &holder : replicaHolders(node, rank)) {
+            if (!result.contains(holder)) {
+                result.append(holder);
+            }
+        }
+    }
+    return result;
+}
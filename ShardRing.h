@@ -0,0 +1,60 @@
+#ifndef SHARDRING_H
+#define SHARDRING_H
+
+#include <QPair>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+#include "AqiRecord.h"
+
+// Consistent-hash ring assigning shard keys (station IDs or areas) to analytics
+// nodes. Each node gets virtual points in proportion to its computing capacity,
+// so stronger nodes own more keys, and adding or removing a node only moves the
+// keys next to its points.
+//
+// A key is owned by the first replicationFactor distinct nodes clockwise from its
+// hash: the primary, then the replica of rank 1, 2, ... Every key has exactly one
+// holder per rank, so the rank-k replicas of a node together hold all of its keys once.
+class ShardRing {
+public:
+    enum class KeyField { Station, Area };
+
+    static constexpr int PointsPerCapacity = 256;  // virtual points for capacity 1.0
+
+    explicit ShardRing(int replicationFactor = 2, KeyField keyField = KeyField::Station);
+
+    void clear();
+    void addNode(const QString &node, double capacity);
+    bool isEmpty() const { return points.isEmpty(); }
+    const QStringList &nodes() const { return nodeNames; }
+
+    int replicationFactor() const { return replicas; }
+    void setReplicationFactor(int factor);
+    KeyField keyField() const { return field; }
+    // Name of the query filter on the shard key: "station" or "area".
+    QString keyFilterName() const;
+
+    QString keyOf(const AqiRecord &record) const;
+    // Primary first, then replicas by rank; fewer when the ring has fewer nodes.
+    QStringList owners(const QString &key) const;
+    QString primaryOf(const QString &key) const;
+
+    // Nodes holding a replica of any key whose primary is node.
+    QStringList replicasFor(const QString &node) const;
+    // Nodes holding the rank-th replica of node's keys (rank >= 1).
+    QStringList replicaHolders(const QString &node, int rank) const;
+
+    static quint64 hash(const QString &key);
+
+private:
+    // Distinct nodes clockwise from the point at index, at most count of them.
+    QVector<int> walk(int index, int count) const;
+    int firstPointAtOrAfter(quint64 position) const;
+
+    QVector<QPair<quint64, int>> points;  // (position, node index), sorted by position
+    QStringList nodeNames;
+    int replicas;
+    KeyField field;
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include "Sketches.h"
+#include <QtEndian>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+constexpr quint8 DigestVersion = 1;
+constexpr quint8 SketchVersion = 1;
+constexpr quint8 SparseLayout = 0;
+constexpr quint8 DenseLayout = 1;
+constexpr double Pi = 3.14159265358979323846;
+
+template <typename T>
+void appendValue(QByteArray &out, T value) {
+    char bytes[sizeof(T)];
+    qToLittleEndian(value, bytes);
+    out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+bool readValue(const char *&cursor, const char *end, T &value) {
+    if (end - cursor < static_cast<qint64>(sizeof(T))) {
+        return false;
+    }
+    value = qFromLittleEndian<T>(cursor);
+    cursor += sizeof(T);
+    return true;
+}
+
+}
+
+TDigest::TDigest(double compression)
+    : compression(compression) {}
+
+void TDigest::add(double value) {
+    if (std::isnan(value)) {
+        return;
+    }
+    minimum = std::min(minimum, value);
+    maximum = std::max(maximum, value);
+    buffered.append(value);
+    if (buffered.size() >= 8 * compression) {
+        flush();
+    }
+}
+
+void TDigest::merge(const TDigest &other) {
+    if (other.isEmpty()) {
+        return;
+    }
+    other.flush();
+    flush();
+    minimum = std::min(minimum, other.minimum);
+    maximum = std::max(maximum, other.maximum);
+    const int ours = centroids.size();
+    centroids += other.centroids;
+    std::inplace_merge(centroids.begin(), centroids.begin() + ours, centroids.end(),
+                       [](const Centroid &a, const Centroid &b) { return a.mean < b.mean; });
+    const qint64 weight = total + other.total;
+    QVector<Centroid> all;
+    all.swap(centroids);
+    fold(all, weight);
+}
+
+void TDigest::flush() const {
+    if (buffered.isEmpty()) {
+        return;
+    }
+    std::sort(buffered.begin(), buffered.end());
+    QVector<Centroid> all;
+    all.reserve(centroids.size() + buffered.size());
+    int c = 0;
+    for (double value : qAsConst(buffered)) {
+        while (c < centroids.size() && centroids[c].mean <= value) {
+            all.append(centroids[c++]);
+        }
+        all.append({value, 1});
+    }
+    while (c < centroids.size()) {
+        all.append(centroids[c++]);
+    }
+    const qint64 weight = total + buffered.size();
+    buffered.clear();
+    fold(all, weight);
+}
+
+void TDigest::fold(const QVector<Centroid> &sorted, qint64 weight) const {
+    // Greedy pass: a centroid may grow while it spans at most one unit of the scale
+    // function k(q) = compression / 2pi * asin(2q - 1), which is steep near q = 0 and 1.
+    const double normalizer = compression / (2 * Pi);
+    auto scale = [&](double q) { return normalizer * std::asin(2 * q - 1); };
+    auto limit = [&](double k) {
+        return k >= normalizer * Pi / 2 ? 1.0 : (std::sin(k / normalizer) + 1) / 2;
+    };
+    centroids.clear();
+    Centroid current = sorted.first();
+    qint64 before = 0;
+    double bound = limit(scale(0) + 1) * weight;
+    for (int i = 1; i < sorted.size(); ++i) {
+        const Centroid &next = sorted[i];
+        if (before + current.weight + next.weight <= bound) {
+            current.weight += next.weight;
+            current.mean += (next.mean - current.mean) * next.weight / current.weight;
+        } else {
+            centroids.append(current);
+            before += current.weight;
+            bound = limit(scale(double(before) / weight) + 1) * weight;
+            current = next;
+        }
+    }
+    centroids.append(current);
+    total = weight;
+}
+
+int TDigest::centroidCount() const {
+    flush();
+    return centroids.size();
+}
+
+double TDigest::quantile(double q) const {
+    flush();
+    if (centroids.isEmpty()) {
+        return 0;
+    }
+    q = std::min(std::max(q, 0.0), 1.0);
+    if (centroids.size() == total) {
+        // Every centroid is a single value: interpolate between ranks exactly.
+        const double rank = q * (total - 1);
+        const int lower = static_cast<int>(std::floor(rank));
+        const int upper = static_cast<int>(std::ceil(rank));
+        return centroids[lower].mean + (centroids[upper].mean - centroids[lower].mean) * (rank - lower);
+    }
+
+    // Each centroid's mean sits at the middle of its weight; interpolate between those
+    // midpoints, and towards the exact extremes beyond the outermost ones.
+    const double index = q * total;
+    const Centroid &first = centroids.first();
+    if (index < first.weight / 2.0) {
+        return minimum + (first.mean - minimum) * index / (first.weight / 2.0);
+    }
+    double cumulative = 0;
+    for (int i = 0; i + 1 < centroids.size(); ++i) {
+        const Centroid &left = centroids[i];
+        const Centroid &right = centroids[i + 1];
+        const double from = cumulative + left.weight / 2.0;
+        const double to = cumulative + left.weight + right.weight / 2.0;
+        if (index < to) {
+            return left.mean + (right.mean - left.mean) * (index - from) / (to - from);
+        }
+        cumulative += left.weight;
+    }
+    const Centroid &last = centroids.last();
+    const double from = total - last.weight / 2.0;
+    return last.mean + (maximum - last.mean) * std::min(1.0, (index - from) / (last.weight / 2.0));
+}
+
+QByteArray TDigest::serialize() const {
+    flush();
+    QByteArray out;
+    out.reserve(1 + 2 + 16 + 4 + centroids.size() * 8);
+    appendValue<quint8>(out, DigestVersion);
+    appendValue<quint16>(out, static_cast<quint16>(compression));
+    appendValue<double>(out, minimum);
+    appendValue<double>(out, maximum);
+    appendValue<quint32>(out, static_cast<quint32>(centroids.size()));
+    for (const Centroid &centroid : qAsConst(centroids)) {
+        appendValue<float>(out, static_cast<float>(centroid.mean));
+        appendValue<quint32>(out, static_cast<quint32>(centroid.weight));
+    }
+    return out;
+}
+
+bool TDigest::deserialize(const QByteArray &data, TDigest &digest) {
+    const char *cursor = data.constData();
+    const char *end = cursor + data.size();
+    quint8 version = 0;
+    quint16 compression = 0;
+    double minimum = 0;
+    double maximum = 0;
+    quint32 count = 0;
+    if (!readValue(cursor, end, version) || version != DigestVersion
+        || !readValue(cursor, end, compression) || !readValue(cursor, end, minimum)
+        || !readValue(cursor, end, maximum) || !readValue(cursor, end, count)
+        || end - cursor != qint64(count) * 8) {
+        return false;
+    }
+    TDigest result(compression);
+    result.centroids.reserve(static_cast<int>(count));
+    for (quint32 i = 0; i < count; ++i) {
+        float mean = 0;
+        quint32 weight = 0;
+        readValue(cursor, end, mean);
+        readValue(cursor, end, weight);
+        result.centroids.append({mean, weight});
+        result.total += weight;
+    }
+    if (count > 0) {
+        result.minimum = minimum;
+        result.maximum = maximum;
+    }
+    digest = std::move(result);
+    return true;
+}
+
+void HyperLogLog::add(quint64 hash) {
+    if (registers.isEmpty()) {
+        registers.fill(0, Registers);
+    }
+    const int index = static_cast<int>(hash >> (64 - Precision));
+    // The guard bit caps the rank at 64 - Precision + 1 when the remaining bits are zero.
+    const quint64 rest = (hash << Precision) | (quint64(1) << (Precision - 1));
+    const char rank = static_cast<char>(qCountLeadingZeroBits(rest) + 1);
+    if (registers[index] < rank) {
+        registers[index] = rank;
+    }
+}
+
+void HyperLogLog::merge(const HyperLogLog &other) {
+    if (other.registers.isEmpty()) {
+        return;
+    }
+    if (registers.isEmpty()) {
+        registers = other.registers;
+        return;
+    }
+    char *ours = registers.data();
+    const char *theirs = other.registers.constData();
+    for (int i = 0; i < Registers; ++i) {
+        ours[i] = std::max(ours[i], theirs[i]);
+    }
+}
+
+double HyperLogLog::estimate() const {
+    if (registers.isEmpty()) {
+        return 0;
+    }
+    double harmonic = 0;
+    int zeros = 0;
+    for (char rank : registers) {
+        harmonic += std::ldexp(1.0, -rank);
+        zeros += rank == 0;
+    }
+    const double m = Registers;
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+    const double raw = alpha * m * m / harmonic;
+    if (raw <= 2.5 * m && zeros > 0) {
+        return m * std::log(m / zeros);
+    }
+    return raw;
+}
+
+QByteArray HyperLogLog::serialize() const {
+    QByteArray out;
+    appendValue<quint8>(out, SketchVersion);
+    int used = 0;
+    for (char rank : registers) {
+        used += rank != 0;
+    }
+    // Sparse pairs cost 3 bytes each, so they win until a third of the registers are set.
+    if (used * 3 < Registers) {
+        appendValue<quint8>(out, SparseLayout);
+        appendValue<quint16>(out, static_cast<quint16>(used));
+        for (int i = 0; i < registers.size(); ++i) {
+            if (registers[i] != 0) {
+                appendValue<quint16>(out, static_cast<quint16>(i));
+                appendValue<quint8>(out, static_cast<quint8>(registers[i]));
+            }
+        }
+    } else {
+        appendValue<quint8>(out, DenseLayout);
+        out.append(registers);
+    }
+    return out;
+}
+
+bool HyperLogLog::deserialize(const QByteArray &data, HyperLogLog &sketch) {
+    const char *cursor = data.constData();
+    const char *end = cursor + data.size();
+    quint8 version = 0;
+    quint8 layout = 0;
+    if (!readValue(cursor, end, version) || version != SketchVersion || !readValue(cursor, end, layout)) {
+        return false;
+    }
+    HyperLogLog result;
+    if (layout == DenseLayout) {
+        if (end - cursor != Registers) {
+            return false;
+        }
+        result.registers = QByteArray(cursor, Registers);
+    } else if (layout == SparseLayout) {
+        quint16 used = 0;
+        if (!readValue(cursor, end, used) || end - cursor != qint64(used) * 3) {
+            return false;
+        }
+        if (used > 0) {
+            result.registers.fill(0, Registers);
+        }
+        for (int i = 0; i < used; ++i) {
+            quint16 index = 0;
+            quint8 rank = 0;
+            readValue(cursor, end, index);
+            readValue(cursor, end, rank);
+            if (index >= Registers) {
+                return false;
+            }
+            result.registers[index] = static_cast<char>(rank);
+        }
+    } else {
+        return false;
+    }
+    sketch = std::move(result);
+    return true;
+}
+
+quint64 HyperLogLog::hash(const QString &value) {
+    // FNV-1a over the UTF-16 code units, then the splitmix64 finalizer so that the
+    // leading bits used for the register index are well mixed.
+    quint64 h = 0xcbf29ce484222325ULL;
+    for (QChar c : value) {
+        h ^= c.unicode();
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
@@ -0,0 +1,82 @@
+#ifndef SKETCHES_H
+#define SKETCHES_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <limits>
+
+// Mergeable quantile sketch (a merging t-digest with the arcsine scale function).
+// Values are buffered and folded into at most about compression centroids, kept
+// small near the tails so p99 stays accurate. While every centroid still holds a
+// single value the quantiles are exact. Merging two digests gives the same
+// accuracy as adding all of their values to one.
+class TDigest {
+public:
+    static constexpr double DefaultCompression = 100;
+
+    explicit TDigest(double compression = DefaultCompression);
+
+    void add(double value);
+    void merge(const TDigest &other);
+    // q in [0, 1]; 0 for an empty digest.
+    double quantile(double q) const;
+    qint64 count() const { return total + buffered.size(); }
+    bool isEmpty() const { return count() == 0; }
+    int centroidCount() const;
+    qint64 memoryUsage() const {
+        return centroids.capacity() * qint64(sizeof(Centroid)) + buffered.capacity() * qint64(sizeof(double));
+    }
+
+    // Little-endian: quint8 version | quint16 compression | double min | double max |
+    // quint32 centroids | per centroid float mean, quint32 weight.
+    QByteArray serialize() const;
+    static bool deserialize(const QByteArray &data, TDigest &digest);
+
+private:
+    struct Centroid {
+        double mean;
+        qint64 weight;
+    };
+
+    void flush() const;
+    // Replaces the centroids with sorted folded under the size limit.
+    void fold(const QVector<Centroid> &sorted, qint64 weight) const;
+
+    double compression;
+    double minimum = std::numeric_limits<double>::infinity();
+    double maximum = -std::numeric_limits<double>::infinity();
+    // Folded lazily so that adds stay O(1); quantile() and serialize() flush first.
+    mutable QVector<Centroid> centroids;  // sorted by mean
+    mutable QVector<double> buffered;
+    mutable qint64 total = 0;             // weight in centroids
+};
+
+// Distinct count estimate over 2^Precision one-byte registers (about 1.6% standard
+// error), with the linear counting correction for small cardinalities. Register-wise
+// max merges two sketches exactly as if every value had gone into one.
+class HyperLogLog {
+public:
+    static constexpr int Precision = 12;
+    static constexpr int Registers = 1 << Precision;
+
+    void add(quint64 hash);
+    void add(const QString &value) { add(hash(value)); }
+    void merge(const HyperLogLog &other);
+    double estimate() const;
+    bool isEmpty() const { return registers.isEmpty(); }
+    qint64 memoryUsage() const { return registers.capacity(); }
+
+    // quint8 version | quint8 layout, then either (sparse) quint16 count and
+    // (quint16 register, quint8 rank) pairs, or (dense) one byte per register.
+    QByteArray serialize() const;
+    static bool deserialize(const QByteArray &data, HyperLogLog &sketch);
+
+    // 64-bit hash of the UTF-16 text, the same on every node.
+    static quint64 hash(const QString &value);
+
+private:
+    QByteArray registers;  // empty until the first add
+};
+
+#endif
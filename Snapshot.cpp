@@ -0,0 +1,307 @@
+#include "Snapshot.h"
+#include "SegmentFile.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QFile>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const QByteArray HeaderMagic("AQSNAP03");
+const QByteArray HeaderMagicWithoutRollups("AQSNAP02");
+const QByteArray TrailerMagic("AQSNAPOK");
+
+class Writer {
+public:
+    explicit Writer(QSaveFile &file) : file(file) {}
+
+    template <typename T>
+    void value(T v) { file.write(reinterpret_cast<const char *>(&v), sizeof(T)); }
+
+    template <typename T>
+    void array(const QVector<T> &values) {
+        file.write(reinterpret_cast<const char *>(values.constData()), qint64(values.size()) * qint64(sizeof(T)));
+    }
+
+    void string(const QString &text) { bytes(text.toUtf8()); }
+
+    void bytes(const QByteArray &data) {
+        value<quint32>(static_cast<quint32>(data.size()));
+        file.write(data);
+    }
+
+private:
+    QSaveFile &file;
+};
+
+// Bounds-checked cursor over the mapped file; any overrun marks it failed.
+class Reader {
+public:
+    Reader(const uchar *data, qint64 size) : data(data), size(size) {}
+
+    bool failed() const { return bad; }
+
+    template <typename T>
+    T value() {
+        T v{};
+        if (take(sizeof(T))) {
+            std::memcpy(&v, data + offset - sizeof(T), sizeof(T));
+        }
+        return v;
+    }
+
+    template <typename T>
+    void array(QVector<T> &values, int count) {
+        const qint64 bytes = qint64(count) * qint64(sizeof(T));
+        if (take(bytes)) {
+            values.resize(count);
+            std::memcpy(values.data(), data + offset - bytes, static_cast<size_t>(bytes));
+        }
+    }
+
+    QString string() { return QString::fromUtf8(bytes()); }
+
+    QByteArray bytes() {
+        const quint32 length = value<quint32>();
+        if (!take(length)) {
+            return QByteArray();
+        }
+        return QByteArray(reinterpret_cast<const char *>(data + offset - length), static_cast<int>(length));
+    }
+
+    bool magic(const QByteArray &expected) {
+        return take(expected.size())
+               && std::memcmp(data + offset - expected.size(), expected.constData(), expected.size()) == 0;
+    }
+
+private:
+    bool take(qint64 bytes) {
+        if (bad || bytes < 0 || offset + bytes > size) {
+            bad = true;
+            return false;
+        }
+        offset += bytes;
+        return true;
+    }
+
+    const uchar *data;
+    qint64 size;
+    qint64 offset = 0;
+    bool bad = false;
+};
+
+void writeZone(Writer &out, const ZoneMap &zone) {
+    out.value(zone.minTimestamp);
+    out.value(zone.maxTimestamp);
+    out.value(zone.minAqi);
+    out.value(zone.maxAqi);
+    out.value(zone.minLatitude);
+    out.value(zone.maxLatitude);
+    out.value(zone.minLongitude);
+    out.value(zone.maxLongitude);
+    out.value<quint32>(static_cast<quint32>(zone.pollutants.size()));
+    out.array(zone.pollutants);
+}
+
+void readZone(Reader &in, ZoneMap &zone) {
+    zone.minTimestamp = in.value<qint64>();
+    zone.maxTimestamp = in.value<qint64>();
+    zone.minAqi = in.value<double>();
+    zone.maxAqi = in.value<double>();
+    zone.minLatitude = in.value<double>();
+    zone.maxLatitude = in.value<double>();
+    zone.minLongitude = in.value<double>();
+    zone.maxLongitude = in.value<double>();
+    in.array(zone.pollutants, static_cast<int>(in.value<quint32>()));
+}
+
+void writeStore(Writer &out, const ColumnStore &store, const QDir &directory) {
+    out.value<qint64>(store.bucketSeconds());
+    const StringDictionary &dictionary = store.dictionary();
+    out.value<quint32>(static_cast<quint32>(dictionary.size()));
+    for (int code = 0; code < dictionary.size(); ++code) {
+        out.string(dictionary.value(static_cast<quint32>(code)));
+    }
+    out.value<quint32>(static_cast<quint32>(store.segments().size()));
+    for (const AqiSegment &segment : store.segments()) {
+        out.value<qint64>(segment.bucket);
+        out.value<quint8>(segment.sealed ? 1 : 0);
+        out.value<quint32>(static_cast<quint32>(segment.size()));
+        writeZone(out, segment.zone);
+        out.array(segment.timestamp);
+        out.array(segment.aqi);
+        out.array(segment.concentration);
+        out.array(segment.latitude);
+        out.array(segment.longitude);
+        out.array(segment.pollutant);
+        out.array(segment.area);
+        out.array(segment.agency);
+        out.array(segment.station);
+    }
+    out.value<quint32>(static_cast<quint32>(store.segmentFiles().size()));
+    for (const QSharedPointer<const SegmentFile> &file : store.segmentFiles()) {
+        out.string(directory.relativeFilePath(file->path()));
+    }
+}
+
+ColumnStore readStore(Reader &in, const QDir &directory, QString &error) {
+    const qint64 bucketSeconds = in.value<qint64>();
+    QVector<QString> dictionary(static_cast<int>(in.value<quint32>()));
+    for (QString &value : dictionary) {
+        value = in.string();
+    }
+    QVector<AqiSegment> segments;
+    const quint32 segmentCount = in.value<quint32>();
+    for (quint32 i = 0; i < segmentCount && !in.failed(); ++i) {
+        AqiSegment segment;
+        segment.bucket = in.value<qint64>();
+        segment.sealed = in.value<quint8>() != 0;
+        const int rows = static_cast<int>(in.value<quint32>());
+        readZone(in, segment.zone);
+        in.array(segment.timestamp, rows);
+        in.array(segment.aqi, rows);
+        in.array(segment.concentration, rows);
+        in.array(segment.latitude, rows);
+        in.array(segment.longitude, rows);
+        in.array(segment.pollutant, rows);
+        in.array(segment.area, rows);
+        in.array(segment.agency, rows);
+        in.array(segment.station, rows);
+        segments.append(std::move(segment));
+    }
+    QVector<QSharedPointer<const SegmentFile>> files;
+    const quint32 fileCount = in.value<quint32>();
+    for (quint32 i = 0; i < fileCount && !in.failed(); ++i) {
+        QSharedPointer<const SegmentFile> file = SegmentFile::open(directory.filePath(in.string()), error);
+        if (!file) {
+            break;
+        }
+        files.append(file);
+    }
+    return ColumnStore::restored(bucketSeconds > 0 ? bucketSeconds : ColumnStore::DefaultBucketSeconds,
+                                 dictionary, segments, files);
+}
+
+QVector<quint64> snapshotSequences(const QString &directory) {
+    QVector<quint64> sequences;
+    for (const QString &name : QDir(directory).entryList(QStringList{"snapshot-*.snap"}, QDir::Files)) {
+        bool ok = false;
+        const quint64 sequence = name.mid(9, name.size() - 14).toULongLong(&ok);
+        if (ok) {
+            sequences.append(sequence);
+        }
+    }
+    std::sort(sequences.begin(), sequences.end());
+    return sequences;
+}
+
+}
+
+QString Snapshot::fileName(const QString &directory, quint64 walSequence) {
+    return QDir(directory).filePath(QString("snapshot-%1.snap").arg(walSequence, 20, 10, QChar('0')));
+}
+
+QString Snapshot::latest(const QString &directory) {
+    const QVector<quint64> sequences = snapshotSequences(directory);
+    return sequences.isEmpty() ? QString() : fileName(directory, sequences.last());
+}
+
+void Snapshot::removeBefore(const QString &directory, quint64 walSequence) {
+    for (quint64 sequence : snapshotSequences(directory)) {
+        if (sequence < walSequence) {
+            QFile::remove(fileName(directory, sequence));
+        }
+    }
+}
+
+bool Snapshot::write(const QString &path, quint64 walSequence, const std::vector<StoreSnapshot> &stores, QString &error) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    Writer out(file);
+    const QDir directory = QFileInfo(path).dir();
+    file.write(HeaderMagic);
+    out.value<quint64>(walSequence);
+    out.value<quint32>(static_cast<quint32>(stores.size()));
+    for (const StoreSnapshot &store : stores) {
+        out.string(store.shard);
+        out.bytes(store.rollups ? store.rollups->serialize() : QByteArray());
+        out.value<quint32>(static_cast<quint32>(store.partitions.size()));
+        for (const ColumnStore &partition : store.partitions) {
+            writeStore(out, partition, directory);
+        }
+    }
+    file.write(TrailerMagic);
+    // commit() syncs the temporary file before renaming it over path.
+    if (!file.commit()) {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::read(const QString &path, quint64 &walSequence, std::vector<StoreSnapshot> &stores, QString &error) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    const qint64 size = file.size();
+    const uchar *data = size > 0 ? file.map(0, size) : nullptr;
+    if (!data) {
+        error = "cannot map " + path;
+        return false;
+    }
+
+    Reader trailer(data + qMax<qint64>(0, size - TrailerMagic.size()), qMin<qint64>(size, TrailerMagic.size()));
+    if (!trailer.magic(TrailerMagic)) {
+        error = "snapshot is incomplete";
+        return false;
+    }
+
+    Reader in(data, size - TrailerMagic.size());
+    const bool hasRollups = in.magic(HeaderMagic);
+    if (!hasRollups) {
+        Reader older(data, size - TrailerMagic.size());
+        if (!older.magic(HeaderMagicWithoutRollups)) {
+            error = "not a snapshot file";
+            return false;
+        }
+        in = older;
+    }
+    walSequence = in.value<quint64>();
+    const QDir directory = QFileInfo(path).dir();
+    QString fileError;
+    std::vector<StoreSnapshot> loaded(in.value<quint32>());
+    for (StoreSnapshot &store : loaded) {
+        if (in.failed() || !fileError.isEmpty()) {
+            break;
+        }
+        store.shard = in.string();
+        if (hasRollups) {
+            const QByteArray rollups = in.bytes();
+            QSharedPointer<RollupTiers> tiers(new RollupTiers);
+            if (!rollups.isEmpty() && RollupTiers::deserialize(rollups, *tiers)) {
+                store.rollups = tiers;
+            }
+        }
+        const quint32 partitionCount = in.value<quint32>();
+        for (quint32 i = 0; i < partitionCount && !in.failed() && fileError.isEmpty(); ++i) {
+            store.partitions.push_back(readStore(in, directory, fileError));
+        }
+    }
+    if (!fileError.isEmpty()) {
+        error = fileError;
+        return false;
+    }
+    if (in.failed()) {
+        error = "snapshot is truncated";
+        return false;
+    }
+    stores = std::move(loaded);
+    return true;
+}
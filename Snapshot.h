@@ -0,0 +1,46 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <QSharedPointer>
+#include <QString>
+#include <vector>
+#include "ColumnStore.h"
+#include "Rollups.h"
+
+// The partitions and rollups of one Worker store; shard is empty for the node's own data.
+struct StoreSnapshot {
+    QString shard;
+    std::vector<ColumnStore> partitions;
+    QSharedPointer<const RollupTiers> rollups;  // null when read from an AQSNAP02 file
+};
+
+/*
+ * Point-in-time copy of a Worker's column stores, named snapshot-<WAL sequence>.snap:
+ * the stores hold every WAL record before that sequence. Layout (native endianness,
+ * the file is only read back on the machine that wrote it):
+ *
+ *   "AQSNAP03" | quint64 WAL sequence | quint32 store count
+ *   per store:     string shard | quint32 rollup bytes | RollupTiers::serialize() | quint32 partition count
+ *   per partition: qint64 bucket seconds | quint32 dictionary size | strings | quint32 segment count
+ *                  | segments | quint32 segment file count | segment file paths
+ *   per segment:   qint64 bucket | quint8 sealed | quint32 rows | zone map | one raw array per column
+ *   "AQSNAPOK"
+ *
+ * Strings are a quint32 byte length followed by UTF-8. Only in-memory segments are
+ * copied; segment files are referenced by their path relative to the snapshot and
+ * reopened on load. A file without the trailer was cut short and is ignored.
+ * "AQSNAP02" files, which have no rollups, are still read.
+ */
+namespace Snapshot {
+    QString fileName(const QString &directory, quint64 walSequence);
+    // The newest snapshot in directory, or an empty string if there is none.
+    QString latest(const QString &directory);
+    // Deletes snapshots older than walSequence.
+    void removeBefore(const QString &directory, quint64 walSequence);
+
+    // Writes to a temporary file, syncs it and renames it into place.
+    bool write(const QString &path, quint64 walSequence, const std::vector<StoreSnapshot> &stores, QString &error);
+    bool read(const QString &path, quint64 &walSequence, std::vector<StoreSnapshot> &stores, QString &error);
+}
+
+#endif
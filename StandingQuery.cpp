@@ -0,0 +1,339 @@
+#include "StandingQuery.h"
+#include <QJsonArray>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const int MaxPanes = 10000;
+
+// Seconds from a number or a "90s" / "30m" / "1h" / "7d" string; 0 when invalid.
+qint64 parseDuration(const QJsonValue &value) {
+    if (value.isDouble()) {
+        return static_cast<qint64>(value.toDouble());
+    }
+    QString text = value.toString().trimmed().toLower();
+    if (text.isEmpty()) {
+        return 0;
+    }
+    qint64 unit = 1;
+    switch (text.back().unicode()) {
+    case 's': unit = 1; break;
+    case 'm': unit = 60; break;
+    case 'h': unit = 3600; break;
+    case 'd': unit = 24 * 3600; break;
+    default: unit = 0; break;
+    }
+    if (unit != 0) {
+        text.chop(1);
+    } else {
+        unit = 1;
+    }
+    bool ok = false;
+    qint64 amount = text.toLongLong(&ok);
+    return ok ? amount * unit : 0;
+}
+
+qint64 floorDivide(qint64 value, qint64 divisor) {
+    qint64 quotient = value / divisor;
+    return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+}
+
+const QString &groupValue(GroupField field, const AqiRecord &record) {
+    switch (field) {
+    case GroupField::Agency: return record.agency;
+    case GroupField::Pollutant: return record.pollutant;
+    case GroupField::Station: return record.aqsId;
+    default: return record.siteName;
+    }
+}
+
+}
+
+bool StandingQuerySpec::fromJson(const QJsonObject &json, StandingQuerySpec &spec, QString &error) {
+    spec = StandingQuerySpec();
+    spec.name = json["name"].toString();
+    if (spec.name.isEmpty()) {
+        error = "standing query needs a name";
+        return false;
+    }
+    if (json.contains("window")) {
+        spec.windowSeconds = parseDuration(json["window"]);
+    }
+    spec.paneSeconds = json.contains("pane") ? parseDuration(json["pane"]) : qMax<qint64>(1, spec.windowSeconds / 60);
+    if (spec.windowSeconds <= 0 || spec.paneSeconds <= 0 || spec.paneSeconds > spec.windowSeconds) {
+        error = "window and pane must be positive with pane <= window";
+        return false;
+    }
+    if ((spec.windowSeconds + spec.paneSeconds - 1) / spec.paneSeconds > MaxPanes) {
+        error = QString("a window may have at most %1 panes").arg(MaxPanes);
+        return false;
+    }
+
+    const QJsonValue pollutant = json["pollutant"];
+    if (pollutant.isString()) {
+        spec.pollutants.append(pollutant.toString());
+    }
+    for (const QJsonValue &item : pollutant.toArray()) {
+        spec.pollutants.append(item.toString());
+    }
+
+    const QString group = json["groupBy"].toString("area").toLower();
+    if (group == "area") {
+        spec.groupBy = GroupField::Area;
+    } else if (group == "agency") {
+        spec.groupBy = GroupField::Agency;
+    } else if (group == "pollutant") {
+        spec.groupBy = GroupField::Pollutant;
+    } else if (group == "station") {
+        spec.groupBy = GroupField::Station;
+    } else {
+        error = "standing queries group by area, agency, pollutant or station";
+        return false;
+    }
+
+    for (const QJsonValue &item : json["percentiles"].toArray()) {
+        const double percentile = item.toDouble(-1);
+        if (percentile < 0 || percentile > 100) {
+            error = "percentiles must be numbers between 0 and 100";
+            return false;
+        }
+        spec.percentiles.append(percentile);
+    }
+    spec.distinctStations = json["distinctStations"].toBool();
+    return true;
+}
+
+QJsonObject StandingQuerySpec::toJson() const {
+    QJsonObject json{
+        {"name", name},
+        {"window", static_cast<double>(windowSeconds)},
+        {"pane", static_cast<double>(paneSeconds)},
+        {"groupBy", QuerySpec::groupFieldName(groupBy)}
+    };
+    if (!pollutants.isEmpty()) {
+        json["pollutant"] = QJsonArray::fromStringList(pollutants);
+    }
+    if (!percentiles.isEmpty()) {
+        QJsonArray list;
+        for (double percentile : percentiles) {
+            list.append(percentile);
+        }
+        json["percentiles"] = list;
+    }
+    if (distinctStations) {
+        json["distinctStations"] = true;
+    }
+    return json;
+}
+
+StandingQuery::StandingQuery(const StandingQuerySpec &spec)
+    : definition(spec),
+      panes(static_cast<int>((spec.windowSeconds + spec.paneSeconds - 1) / spec.paneSeconds)) {
+    rebuildSnapshot();
+}
+
+bool StandingQuery::add(const AqiRecord *records, int count) {
+    bool changed = false;
+    for (int i = 0; i < count; ++i) {
+        const AqiRecord &record = records[i];
+        if (!definition.pollutants.isEmpty() && !definition.pollutants.contains(record.pollutant)) {
+            continue;
+        }
+        const quint64 station = definition.distinctStations ? HyperLogLog::hash(record.aqsId) : 0;
+        changed |= fold(record.timestamp, groupValue(definition.groupBy, record), record.aqi, station);
+    }
+    if (changed) {
+        rebuildSnapshot();
+    }
+    return changed;
+}
+
+bool StandingQuery::add(const ColumnBatch &batch) {
+    // The pollutant filter is decided once per batch string rather than once per row.
+    QVector<bool> wanted(batch.strings.size(), definition.pollutants.isEmpty());
+    if (!definition.pollutants.isEmpty()) {
+        for (int i = 0; i < batch.strings.size(); ++i) {
+            wanted[i] = definition.pollutants.contains(batch.strings[i]);
+        }
+    }
+    const QVector<quint32> *keys = &batch.siteName;
+    switch (definition.groupBy) {
+    case GroupField::Agency: keys = &batch.agency; break;
+    case GroupField::Pollutant: keys = &batch.pollutant; break;
+    case GroupField::Station: keys = &batch.aqsId; break;
+    default: break;
+    }
+    // Station hashes by batch string, computed on first use.
+    QVector<quint64> stationHashes(definition.distinctStations ? batch.strings.size() : 0, 0);
+    bool changed = false;
+    for (int i = 0; i < batch.size(); ++i) {
+        if (wanted[static_cast<int>(batch.pollutant[i])]) {
+            quint64 station = 0;
+            if (definition.distinctStations) {
+                quint64 &hash = stationHashes[static_cast<int>(batch.aqsId[i])];
+                if (hash == 0) {
+                    hash = HyperLogLog::hash(batch.string(batch.aqsId[i]));
+                }
+                station = hash;
+            }
+            changed |= fold(batch.timestamp[i], batch.string((*keys)[i]), batch.aqi[i], station);
+        }
+    }
+    if (changed) {
+        rebuildSnapshot();
+    }
+    return changed;
+}
+
+bool StandingQuery::fold(qint64 timestamp, const QString &key, double aqi, quint64 station) {
+    const qint64 index = floorDivide(timestamp, definition.paneSeconds);
+    if (newestPane != std::numeric_limits<qint64>::min() && index <= newestPane - panes.size()) {
+        return false;  // already slid out of the window
+    }
+    if (index > newestPane) {
+        advanceTo(index);
+    }
+    Cell &cell = paneFor(index).cells[key];
+    ++cell.count;
+    cell.sum += aqi;
+    cell.max = qMax(cell.max, aqi);
+    if (!definition.percentiles.isEmpty()) {
+        cell.digest.add(aqi);
+    }
+    if (definition.distinctStations) {
+        cell.stations.add(station);
+    }
+    if (definition.needsSketches()) {
+        staleSketches.insert(key);
+    }
+    Cell &total = totals[key];
+    ++total.count;
+    total.sum += aqi;
+    total.max = qMax(total.max, aqi);
+    return true;
+}
+
+StandingQuery::Pane &StandingQuery::paneFor(qint64 index) {
+    const qint64 size = panes.size();
+    Pane &pane = panes[static_cast<int>(((index % size) + size) % size)];
+    if (pane.index != index) {
+        pane.index = index;
+        pane.cells.clear();
+    }
+    return pane;
+}
+
+void StandingQuery::advanceTo(qint64 index) {
+    newestPane = index;
+    for (Pane &pane : panes) {
+        if (pane.index != std::numeric_limits<qint64>::min() && pane.index <= newestPane - panes.size()) {
+            expire(pane);
+        }
+    }
+}
+
+void StandingQuery::expire(Pane &pane) {
+    const QHash<QString, Cell> cells = std::move(pane.cells);
+    pane.cells.clear();
+    pane.index = std::numeric_limits<qint64>::min();
+
+    const qint64 oldest = newestPane - panes.size();
+    for (auto it = cells.constBegin(); it != cells.constEnd(); ++it) {
+        if (definition.needsSketches()) {
+            staleSketches.insert(it.key());
+        }
+        auto total = totals.find(it.key());
+        total->count -= it.value().count;
+        total->sum -= it.value().sum;
+        if (total->count <= 0) {
+            totals.erase(total);
+            continue;
+        }
+        if (it.value().max < total->max) {
+            continue;
+        }
+        // The expiring pane held the maximum: recompute it from the panes still in the window.
+        total->max = -std::numeric_limits<double>::infinity();
+        for (const Pane &live : panes) {
+            if (live.index > oldest) {
+                auto cell = live.cells.constFind(it.key());
+                if (cell != live.cells.constEnd()) {
+                    total->max = qMax(total->max, cell.value().max);
+                }
+            }
+        }
+    }
+}
+
+void StandingQuery::mergeSketches() {
+    const qint64 oldest = newestPane - panes.size();
+    for (const QString &key : qAsConst(staleSketches)) {
+        if (!totals.contains(key)) {
+            windowSketches.remove(key);
+            continue;
+        }
+        Cell merged;
+        for (const Pane &pane : panes) {
+            if (pane.index > oldest) {
+                auto cell = pane.cells.constFind(key);
+                if (cell != pane.cells.constEnd()) {
+                    merged.digest.merge(cell.value().digest);
+                    merged.stations.merge(cell.value().stations);
+                }
+            }
+        }
+        windowSketches.insert(key, merged);
+    }
+    staleSketches.clear();
+}
+
+void StandingQuery::rebuildSnapshot() {
+    QStringList keys = totals.keys();
+    std::sort(keys.begin(), keys.end());
+    mergeSketches();
+
+    QJsonArray columns{QuerySpec::groupFieldName(definition.groupBy), "count", "avg(aqi)", "max(aqi)"};
+    for (double percentile : definition.percentiles) {
+        columns.append(QString("p%1(aqi)").arg(percentile));
+    }
+    if (definition.distinctStations) {
+        columns.append("distinct(station)");
+    }
+
+    QJsonArray rows;
+    QString maxGroup;
+    double maxAverage = 0;
+    for (const QString &key : keys) {
+        const Cell &total = totals[key];
+        const double average = total.sum / total.count;
+        QJsonArray row{key, static_cast<double>(total.count), average, total.max};
+        if (definition.needsSketches()) {
+            const Cell &sketches = windowSketches[key];
+            for (double percentile : definition.percentiles) {
+                row.append(sketches.digest.quantile(percentile / 100.0));
+            }
+            if (definition.distinctStations) {
+                row.append(std::round(sketches.stations.estimate()));
+            }
+        }
+        rows.append(row);
+        if (maxGroup.isNull() || average > maxAverage) {
+            maxGroup = key;
+            maxAverage = average;
+        }
+    }
+
+    snapshot = QJsonObject{
+        {"name", definition.name},
+        {"window", static_cast<double>(definition.windowSeconds)},
+        {"columns", columns},
+        {"rows", rows},
+        {"maxGroup", maxGroup},
+        {"maxAverage", maxAverage}
+    };
+    if (newestPane != std::numeric_limits<qint64>::min()) {
+        snapshot["windowStart"] = AqiRecord::formatTimestamp((newestPane - panes.size() + 1) * definition.paneSeconds);
+        snapshot["windowEnd"] = AqiRecord::formatTimestamp((newestPane + 1) * definition.paneSeconds);
+    }
+}
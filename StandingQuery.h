@@ -0,0 +1,88 @@
+#ifndef STANDINGQUERY_H
+#define STANDINGQUERY_H
+
+#include <QHash>
+#include <QJsonObject>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+#include "AqiRecord.h"
+#include "ColumnBatch.h"
+#include "QuerySpec.h"
+#include "Sketches.h"
+
+/*
+ * A registered query kept up to date at ingest instead of being recomputed on read:
+ *
+ *   {"name": "aqi-1h-area", "window": "1h", "pane": "1m", "groupBy": "area", "pollutant": ["PM2.5"],
+ *    "percentiles": [50, 95], "distinctStations": true}
+ *
+ * "window" and "pane" take seconds or "30m" / "1h" / "7d"; the pane defaults to a
+ * sixtieth of the window. The window is in reading (event) time and ends at the
+ * newest reading seen. "percentiles" and "distinctStations" add p<N>(aqi) and
+ * distinct(station) columns, estimated from per-pane sketches.
+ */
+struct StandingQuerySpec {
+    QString name;
+    qint64 windowSeconds = 3600;
+    qint64 paneSeconds = 60;
+    QStringList pollutants;
+    GroupField groupBy = GroupField::Area;
+    QVector<double> percentiles;
+    bool distinctStations = false;
+
+    bool needsSketches() const { return !percentiles.isEmpty() || distinctStations; }
+
+    static bool fromJson(const QJsonObject &json, StandingQuerySpec &spec, QString &error);
+    QJsonObject toJson() const;
+};
+
+// Rolling count/avg/max per group over a sliding window split into panes. Each
+// pane holds per-group partials; sums and counts for the whole window are kept
+// running and the expiring pane is subtracted, so a window advance costs the
+// size of one pane rather than a rescan. Sketches cannot be subtracted, so each
+// pane keeps its own per-group t-digest and station HyperLogLog, and only the
+// groups touched since the last change are re-merged across the window.
+class StandingQuery {
+public:
+    explicit StandingQuery(const StandingQuerySpec &spec = StandingQuerySpec());
+
+    // Folds rows into their panes; returns true when the window result changed.
+    bool add(const AqiRecord *records, int count);
+    bool add(const ColumnBatch &batch);
+    const StandingQuerySpec &spec() const { return definition; }
+
+    // Result as of the last add(), built once per change so reading it is O(1):
+    // {"name", "window", "windowStart", "windowEnd", "columns", "rows", "maxGroup", "maxAverage"}.
+    const QJsonObject &result() const { return snapshot; }
+
+private:
+    struct Cell {
+        qint64 count = 0;
+        double sum = 0;
+        double max = -std::numeric_limits<double>::infinity();
+        TDigest digest;        // only fed when the spec asks for percentiles
+        HyperLogLog stations;  // only fed for distinctStations
+    };
+    struct Pane {
+        qint64 index = std::numeric_limits<qint64>::min();  // pane number, start / paneSeconds
+        QHash<QString, Cell> cells;
+    };
+
+    bool fold(qint64 timestamp, const QString &key, double aqi, quint64 station);
+    Pane &paneFor(qint64 index);
+    void advanceTo(qint64 index);
+    void expire(Pane &pane);
+    void mergeSketches();
+    void rebuildSnapshot();
+
+    StandingQuerySpec definition;
+    QVector<Pane> panes;  // ring buffer, slot = index % size
+    QHash<QString, Cell> totals;          // counts, sums and maxima only
+    QHash<QString, Cell> windowSketches;  // sketches merged over the live panes
+    QSet<QString> staleSketches;          // groups whose panes changed since the last merge
+    qint64 newestPane = std::numeric_limits<qint64>::min();
+    QJsonObject snapshot;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QSemaphore>
+#include <QTemporaryDir>
+#include <QtTest>
+#include <atomic>
+#include "ColumnBatch.h"
+#include "PartitionedStore.h"
+#include "QueryCache.h"
+#include "QueryEngine.h"
+#include "Snapshot.h"
+#include "WorkStealingPool.h"
+#include "Worker.h"
+#include "WriteAheadLog.h"
+
+// Pass/fail checks of what a node relies on to keep and answer for its rows: the
+// write-ahead log, snapshot recovery and the query cache. MicroBenchmarks measures
+// the same code; these only assert on results.
+class StorageTests : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void walReplaysAcrossFilesAfterTornTails();
+    void walFailsEveryRecordAfterAFailedWrite();
+    void workerRecoversFromSnapshotAndLog();
+    void queryCacheReusesUnchangedSegments();
+};
+
+namespace {
+
+const qint64 FirstDay = 1596240000;  // 2020-08-01T00:00, a bucket boundary
+
+// Hourly readings of stations over one day, starting FirstDay + day days.
+AqiBatch readings(int day, int stations) {
+    AqiBatch rows;
+    rows.reserve(24 * stations);
+    for (int hour = 0; hour < 24; ++hour) {
+        for (int station = 0; station < stations; ++station) {
+            AqiRecord record;
+            record.timestamp = FirstDay + day * 24 * 3600 + hour * 3600;
+            record.pollutant = "PM2.5";
+            record.unit = "UG/M3";
+            record.concentration = 10 + (station + hour) % 40;
+            record.aqi = 20 + (station * 7 + hour + day) % 120;
+            record.siteName = "Sacramento";
+            record.agency = "California Air Resources Board";
+            record.aqsId = QString::number(840060000000LL + station);
+            record.fullAqsId = record.aqsId;
+            rows.append(record);
+        }
+    }
+    return rows;
+}
+
+// Rows a Worker holds in its own store, from a partial max/avg query.
+qint64 storedRows(Worker &worker) {
+    QSemaphore answered;
+    qint64 count = -1;
+    const QMetaObject::Connection connection = QObject::connect(
+        &worker, &Worker::queryProcessed, &worker, [&](const QJsonObject &response) {
+            count = static_cast<qint64>(response["partial"].toObject()["count"].toDouble());
+            answered.release();
+        }, Qt::DirectConnection);
+    worker.processQuery(QJsonObject{{"requestType", "query"}, {"requestID", 1}, {"partial", true}});
+    const bool done = answered.tryAcquire(1, 30000);
+    QObject::disconnect(connection);
+    return done ? count : -1;
+}
+
+bool sameGroups(const QueryResult &a, const QueryResult &b) {
+    if (a.groups.size() != b.groups.size()) {
+        return false;
+    }
+    for (auto it = a.groups.constBegin(); it != a.groups.constEnd(); ++it) {
+        const FieldState &expected = it.value().aqi;
+        const FieldState &actual = b.groups.value(it.key()).aqi;
+        if (expected.count != actual.count || expected.sum != actual.sum || expected.max != actual.max) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+void StorageTests::initTestCase() {
+    // The Worker logs every batch it stores.
+    QLoggingCategory::setFilterRules("default.debug=false");
+}
+
+void StorageTests::walReplaysAcrossFilesAfterTornTails() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QVector<QByteArray> records;
+    {
+        WriteAheadLog wal(dir.path());
+        QString error;
+        QVERIFY2(wal.start(1, error), qPrintable(error));
+        for (int i = 1; i <= 6; ++i) {
+            records.append("record " + QByteArray::number(i));
+            QCOMPARE(wal.append(records.last()), quint64(i));
+            if (i == 3) {
+                QCOMPARE(wal.rotate(), quint64(4));
+            }
+        }
+        QVERIFY(wal.waitDurable(6));
+    }
+    const QDir logDir(dir.path());
+    const QStringList files = logDir.entryList(QStringList{"wal-*.log"}, QDir::Files, QDir::Name);
+    QCOMPARE(files.size(), 2);
+
+    // A crash mid-write leaves part of a header after the first file's records, and
+    // cuts the last record of the second file short.
+    const QString first = logDir.filePath(files[0]);
+    const qint64 firstSize = QFileInfo(first).size();
+    QFile torn(first);
+    QVERIFY(torn.open(QIODevice::Append));
+    torn.write(QByteArray("WAL1\0\0", 6));
+    torn.close();
+    const QString second = logDir.filePath(files[1]);
+    QVERIFY(QFile::resize(second, QFileInfo(second).size() - 3));
+
+    QVector<QPair<quint64, QByteArray>> replayed;
+    WriteAheadLog wal(dir.path());
+    const quint64 last = wal.replay(0, [&replayed](quint64 sequence, const QByteArray &payload) {
+        replayed.append(qMakePair(sequence, QByteArray(payload.constData(), payload.size())));
+    });
+    QCOMPARE(last, quint64(5));
+    QCOMPARE(replayed.size(), 5);
+    for (int i = 0; i < replayed.size(); ++i) {
+        QCOMPARE(replayed[i].first, quint64(i + 1));
+        QCOMPARE(replayed[i].second, records[i]);
+    }
+    // The torn tail is cut off, so a record appended after it would be read again.
+    QCOMPARE(QFileInfo(first).size(), firstSize);
+
+    QVector<quint64> fromFour;
+    QCOMPARE(wal.replay(4, [&fromFour](quint64 sequence, const QByteArray &) { fromFour.append(sequence); }),
+             quint64(5));
+    QCOMPARE(fromFour, (QVector<quint64>{4, 5}));
+}
+
+void StorageTests::walFailsEveryRecordAfterAFailedWrite() {
+    if (!QFileInfo::exists("/dev/full")) {
+        QSKIP("needs /dev/full, on which every write fails");
+    }
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    // The log's first file is /dev/full, so the first group fails to write and sync.
+    QVERIFY(QFile::link("/dev/full", QDir(dir.path()).filePath(QString("wal-%1.log").arg(1, 20, 10, QChar('0')))));
+
+    std::atomic<quint64> lost{0};
+    std::atomic<quint64> durable{0};
+    WriteAheadLog wal(dir.path());  // after what its callbacks write to, which outlives it
+    wal.setFailedCallback([&lost](quint64 upTo) { lost = upTo; });
+    wal.setDurableCallback([&durable](quint64 upTo) { durable = upTo; });
+    QString error;
+    QVERIFY2(wal.start(1, error), qPrintable(error));
+
+    const quint64 first = wal.append("first");
+    QVERIFY(!wal.waitDurable(first));
+    QVERIFY(wal.failed());
+    QTRY_COMPARE(lost.load(), first);
+
+    // Nothing after the failed group becomes durable either.
+    const quint64 second = wal.append("second");
+    QVERIFY(!wal.waitDurable(second));
+    QTRY_COMPARE(lost.load(), second);
+    QCOMPARE(wal.durableSequence(), quint64(0));
+    QCOMPARE(durable.load(), quint64(0));
+}
+
+void StorageTests::workerRecoversFromSnapshotAndLog() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const AqiBatch batch = readings(0, 400);
+    // One snapshot's worth of rows, then a few batches that are only in the log.
+    const qint64 batches = (Worker::SnapshotRows + batch.size() - 1) / batch.size() + 3;
+    {
+        Worker worker(2, dir.path());
+        for (qint64 i = 0; i < batches; ++i) {
+            worker.storeData(batch);
+        }
+        QCOMPARE(storedRows(worker), batches * batch.size());
+    }  // waits for the snapshot to be written
+    QVERIFY(!Snapshot::latest(dir.path()).isEmpty());
+
+    Worker restarted(2, dir.path());
+    QCOMPARE(storedRows(restarted), batches * batch.size());
+}
+
+void StorageTests::queryCacheReusesUnchangedSegments() {
+    WorkStealingPool pool(1);
+    PartitionedStore store(1);  // one partition: each query makes exactly one cache lookup
+    const int stations = 50;
+    for (int day = 0; day < 5; ++day) {
+        store.append(ColumnBatch::fromRows(readings(day, stations)));
+    }
+
+    QuerySpec spec;
+    spec.pollutants = QStringList{"PM2.5"};
+    spec.groupBy = {GroupField::Station};
+    for (const QString &name : {QString("count"), QString("max(aqi)"), QString("avg(aqi)")}) {
+        AggregateSpec aggregate;
+        QVERIFY(AggregateSpec::parse(name, aggregate));
+        spec.aggregates.append(aggregate);
+    }
+
+    QueryCache cache;
+    auto lookups = [&cache] {
+        return QVector<qint64>{cache.lookups(QueryCache::Hit), cache.lookups(QueryCache::Partial),
+                               cache.lookups(QueryCache::Miss)};
+    };
+    auto cachedMatchesScan = [&] {
+        return sameGroups(QueryEngine::execute(spec, store, pool, &cache), QueryEngine::execute(spec, store, pool));
+    };
+
+    QVERIFY(cachedMatchesScan());
+    QCOMPARE(lookups(), (QVector<qint64>{0, 0, 1}));
+    // Nothing stored since: the entry is the answer.
+    QVERIFY(cachedMatchesScan());
+    QCOMPARE(lookups(), (QVector<qint64>{1, 0, 1}));
+    // A new day seals another segment; the sealed ones cached are reused.
+    store.append(ColumnBatch::fromRows(readings(5, stations)));
+    QVERIFY(cachedMatchesScan());
+    QCOMPARE(lookups(), (QVector<qint64>{1, 1, 1}));
+
+    // Retention drops segments the entry covered, so it is scanned afresh ...
+    QVERIFY(store.applyRetention(3 * 24 * 3600) > 0);
+    QVERIFY(cachedMatchesScan());
+    QCOMPARE(lookups(), (QVector<qint64>{1, 1, 2}));
+    // ... and the new entry is reused in part again after the next day.
+    store.append(ColumnBatch::fromRows(readings(6, stations)));
+    QVERIFY(cachedMatchesScan());
+    QCOMPARE(lookups(), (QVector<qint64>{1, 2, 2}));
+}
+
+QTEST_GUILESS_MAIN(StorageTests)
+#include "StorageTests.moc"
@@ -0,0 +1,69 @@
+#include "StringPool.h"
+#include <cstring>
+
+StringPool &StringPool::global() {
+    static StringPool pool;
+    return pool;
+}
+
+quint64 StringPool::hash(const char *utf8, int size) {
+    quint64 h = 14695981039346656037ULL;
+    for (int i = 0; i < size; ++i) {
+        h ^= static_cast<uchar>(utf8[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+QString StringPool::intern(const QString &value) {
+    {
+        QReadLocker locker(&lock);
+        auto it = values.constFind(value);
+        if (it != values.constEnd()) {
+            return *it;
+        }
+    }
+    QWriteLocker locker(&lock);
+    if (values.size() >= MaxEntries) {
+        return value;
+    }
+    return *values.insert(value);  // keeps the stored copy if another thread got here first
+}
+
+QString StringPool::intern(const char *utf8, int size) {
+    const quint64 key = hash(utf8, size);
+    auto matches = [utf8, size](const Utf8Entry &entry) {
+        return entry.utf8.size() == size && std::memcmp(entry.utf8.constData(), utf8, size) == 0;
+    };
+    {
+        QReadLocker locker(&lock);
+        auto it = encoded.constFind(key);
+        if (it != encoded.constEnd() && matches(it.value())) {
+            return it->value;
+        }
+    }
+
+    QString value = QString::fromUtf8(utf8, size);
+    QWriteLocker locker(&lock);
+    auto it = encoded.constFind(key);
+    if (it != encoded.constEnd()) {
+        // Either another thread added it meanwhile, or a hash collision that stays unpooled.
+        return matches(it.value()) ? it->value : value;
+    }
+    if (encoded.size() >= MaxEntries) {
+        return value;
+    }
+    auto shared = values.constFind(value);
+    if (shared != values.constEnd()) {
+        value = *shared;
+    } else if (values.size() < MaxEntries) {
+        values.insert(value);
+    }
+    encoded.insert(key, Utf8Entry{QByteArray(utf8, size), value});
+    return value;
+}
+
+int StringPool::size() const {
+    QReadLocker locker(&lock);
+    return values.size();
+}
@@ -0,0 +1,39 @@
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QString>
+
+// One shared QString per distinct field value. The categorical fields of AQI rows
+// (pollutant, unit, area, agency, site ids) repeat from row to row and batch to
+// batch, so decoded rows hold references into the pool rather than copies of their
+// own, and a value decoded from UTF-8 that the pool has seen costs no allocation.
+// Once MaxEntries values are held new ones are returned unpooled.
+class StringPool {
+public:
+    static constexpr int MaxEntries = 1 << 16;
+
+    static StringPool &global();
+
+    QString intern(const QString &value);
+    QString intern(const char *utf8, int size);
+
+    int size() const;
+
+private:
+    struct Utf8Entry {
+        QByteArray utf8;
+        QString value;
+    };
+
+    // FNV-1a; equal bytes are still compared before an entry is used.
+    static quint64 hash(const char *utf8, int size);
+
+    mutable QReadWriteLock lock;
+    QSet<QString> values;
+    QHash<quint64, Utf8Entry> encoded;
+};
+
+#endif
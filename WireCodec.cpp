@@ -0,0 +1,389 @@
+#include "WireCodec.h"
+#include <QCborValue>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QtEndian>
+#include <cstring>
+#include "MessageFraming.h"
+#include "StringPool.h"
+
+/*
+ * Binary layout (QDataStream, big endian):
+ *   quint8 magic, quint8 version
+ *   QByteArray fields       CBOR map of the control fields
+ *   quint32 rowCount
+ *   quint32 stringCount, then stringCount UTF-8 QByteArrays (interned strings)
+ *   rowCount rows of:
+ *     qint64 timestamp, double latitude, double longitude, quint32 pollutant,
+ *     double concentration, quint32 unit, double rawConcentration, qint32 aqi,
+ *     qint32 category, quint32 siteName, quint32 agency, quint32 aqsId, quint32 fullAqsId
+ * String fields of a row are indices into the string table.
+ */
+
+namespace {
+
+// Typical size of one row in compact JSON, for sizing the payload buffer up front.
+constexpr int JsonRowSize = 160;
+
+// The rows are written as JSON text straight into this thread's payload buffer; only
+// the control fields go through QJsonDocument.
+QByteArray encodeJson(QJsonObject fields, const AqiBatch &rows, const QString &rowsKey) {
+    if (rows.isEmpty()) {
+        return QJsonDocument(fields).toJson(QJsonDocument::Compact);
+    }
+    fields.remove(rowsKey);
+    const QByteArray head = QJsonDocument(fields).toJson(QJsonDocument::Compact);               // {...}
+    const QByteArray key = QJsonDocument(QJsonArray{rowsKey}).toJson(QJsonDocument::Compact);  // ["key"]
+    QByteArray &payload = MessageFraming::buffer(MessageFraming::Buffer::Payload,
+                                                 head.size() + key.size() + rows.size() * JsonRowSize);
+    payload.append(head.constData(), head.size() - 1);
+    if (head.size() > 2) {
+        payload.append(',');
+    }
+    payload.append(key.constData() + 1, key.size() - 2);
+    payload.append(":[");
+    for (int i = 0; i < rows.size(); ++i) {
+        if (i > 0) {
+            payload.append(',');
+        }
+        rows[i].appendJsonArray(payload);
+    }
+    payload.append("]}");
+    return payload;
+}
+
+template <typename T>
+void appendBigEndian(QByteArray &out, T value) {
+    char bytes[sizeof(T)];
+    qToBigEndian(value, bytes);
+    out.append(bytes, sizeof(bytes));
+}
+
+// A QDataStream QByteArray: quint32 length, then the bytes.
+void putBytes(QByteArray &out, const char *data, int size) {
+    appendBigEndian(out, static_cast<quint32>(size));
+    out.append(data, size);
+}
+
+// value as a QDataStream QByteArray of its UTF-8, converted in place when it is ASCII.
+void putUtf8(QByteArray &out, const QString &value) {
+    const QChar *text = value.constData();
+    const int size = value.size();
+    int ascii = 0;
+    while (ascii < size && text[ascii].unicode() < 0x80) {
+        ++ascii;
+    }
+    if (ascii < size) {
+        const QByteArray utf8 = value.toUtf8();
+        putBytes(out, utf8.constData(), utf8.size());
+        return;
+    }
+    appendBigEndian(out, static_cast<quint32>(size));
+    for (int i = 0; i < size; ++i) {
+        out.append(static_cast<char>(text[i].unicode()));
+    }
+}
+
+// The header of the binary layout, byte for byte what QDataStream writes.
+void putBinaryHeader(QByteArray &out, const QJsonObject &fields, int rowCount, const QVector<QString> &strings) {
+    appendBigEndian(out, WireCodec::BinaryMagic);
+    appendBigEndian(out, WireCodec::BinaryVersion);
+    const QByteArray cbor = QCborValue::fromJsonValue(fields).toCbor();
+    putBytes(out, cbor.constData(), cbor.size());
+    appendBigEndian(out, static_cast<quint32>(rowCount));
+    appendBigEndian(out, static_cast<quint32>(strings.size()));
+    for (const QString &value : strings) {
+        putUtf8(out, value);
+    }
+}
+
+QByteArray encodeBinaryColumns(const QJsonObject &fields, const ColumnBatch &rows) {
+    int stringBytes = 0;
+    for (const QString &value : rows.strings) {
+        stringBytes += 4 + value.size();
+    }
+    QByteArray &payload = MessageFraming::buffer(MessageFraming::Buffer::Payload,
+                                                 64 + stringBytes + rows.size() * WireCodec::BinaryRowSize);
+    putBinaryHeader(payload, fields, rows.size(), rows.strings);
+    const int headerSize = payload.size();
+    payload.resize(headerSize + rows.size() * WireCodec::BinaryRowSize);
+    uchar *out = reinterpret_cast<uchar *>(payload.data()) + headerSize;
+    auto putDouble = [&out](double value) {
+        quint64 bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        qToBigEndian(bits, out);
+        out += sizeof(bits);
+    };
+    auto put = [&out](auto value) {
+        qToBigEndian(value, out);
+        out += sizeof(value);
+    };
+    for (int i = 0; i < rows.size(); ++i) {
+        put(rows.timestamp[i]);
+        putDouble(rows.latitude[i]);
+        putDouble(rows.longitude[i]);
+        put(rows.pollutant[i]);
+        putDouble(rows.concentration[i]);
+        put(rows.unit[i]);
+        putDouble(rows.rawConcentration[i]);
+        put(rows.aqi[i]);
+        put(rows.category[i]);
+        put(rows.siteName[i]);
+        put(rows.agency[i]);
+        put(rows.aqsId[i]);
+        put(rows.fullAqsId[i]);
+    }
+    return payload;
+}
+
+// Rows go through a pooled ColumnBatch, which builds the same string table.
+QByteArray encodeBinary(const QJsonObject &fields, const AqiBatch &rows) {
+    const ColumnBatchPointer columns = ColumnBatch::pooled();
+    columns->assign(rows);
+    return encodeBinaryColumns(fields, *columns);
+}
+
+// Reads big-endian values straight out of a payload; any overrun clears ok.
+class PayloadReader {
+public:
+    explicit PayloadReader(const QByteArray &payload)
+        : cursor(reinterpret_cast<const uchar *>(payload.constData())), end(cursor + payload.size()) {}
+
+    bool ok() const { return valid; }
+    qint64 remaining() const { return end - cursor; }
+
+    template <typename T>
+    T read() {
+        if (!valid || remaining() < static_cast<qint64>(sizeof(T))) {
+            valid = false;
+            return T();
+        }
+        const T value = qFromBigEndian<T>(cursor);
+        cursor += sizeof(T);
+        return value;
+    }
+
+    double readDouble() {
+        const quint64 bits = read<quint64>();
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // A QDataStream QByteArray: quint32 length (0xffffffff for null), then the bytes,
+    // left where they are in the payload.
+    void readBytes(const char *&data, int &size) {
+        data = reinterpret_cast<const char *>(cursor);
+        size = 0;
+        const quint32 length = read<quint32>();
+        if (length == 0xffffffffu || !valid) {
+            return;
+        }
+        if (remaining() < length) {
+            valid = false;
+            return;
+        }
+        data = reinterpret_cast<const char *>(cursor);
+        size = static_cast<int>(length);
+        cursor += length;
+    }
+
+private:
+    const uchar *cursor;
+    const uchar *end;
+    bool valid = true;
+};
+
+bool decodeBinaryColumns(const QByteArray &payload, WireMessage &message) {
+    PayloadReader in(payload);
+    if (in.read<quint8>() != WireCodec::BinaryMagic || in.read<quint8>() != WireCodec::BinaryVersion) {
+        return false;
+    }
+    const char *cbor;
+    int cborSize;
+    in.readBytes(cbor, cborSize);
+    const quint32 rowCount = in.read<quint32>();
+    const quint32 stringCount = in.read<quint32>();
+    if (!in.ok()) {
+        return false;
+    }
+    message.format = WireCodec::Format::Binary;
+    message.fields = QCborValue::fromCbor(QByteArray::fromRawData(cbor, cborSize)).toJsonValue().toObject();
+
+    // Repeated values come out of the string pool, so a batch of known stations
+    // decodes without allocating, into columns recycled from an earlier batch.
+    ColumnBatchPointer batch = ColumnBatch::pooled();
+    StringPool &pool = StringPool::global();
+    batch->strings.reserve(static_cast<int>(qMin<quint32>(stringCount, 1u << 16)));
+    for (quint32 i = 0; i < stringCount && in.ok(); ++i) {
+        const char *utf8;
+        int size;
+        in.readBytes(utf8, size);
+        batch->strings.append(pool.intern(utf8, size));
+    }
+    if (!in.ok() || in.remaining() < qint64(rowCount) * WireCodec::BinaryRowSize) {
+        return false;
+    }
+
+    batch->resize(static_cast<int>(rowCount));
+    bool indexesValid = true;
+    auto readIndex = [&](quint32 &index) {
+        index = in.read<quint32>();
+        indexesValid &= index < stringCount;
+    };
+    for (int i = 0; i < static_cast<int>(rowCount); ++i) {
+        batch->timestamp[i] = in.read<qint64>();
+        batch->latitude[i] = in.readDouble();
+        batch->longitude[i] = in.readDouble();
+        readIndex(batch->pollutant[i]);
+        batch->concentration[i] = in.readDouble();
+        readIndex(batch->unit[i]);
+        batch->rawConcentration[i] = in.readDouble();
+        batch->aqi[i] = in.read<qint32>();
+        batch->category[i] = in.read<qint32>();
+        readIndex(batch->siteName[i]);
+        readIndex(batch->agency[i]);
+        readIndex(batch->aqsId[i]);
+        readIndex(batch->fullAqsId[i]);
+    }
+    if (!indexesValid) {
+        return false;
+    }
+    message.columns = batch;
+    return true;
+}
+
+bool decodeJson(const QByteArray &payload, WireMessage &message) {
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(payload, &error);
+    if (error.error != QJsonParseError::NoError || !doc.isObject()) {
+        return false;
+    }
+    message.format = WireCodec::Format::Json;
+    message.fields = doc.object();
+    for (const QString &key : {QStringLiteral("Data"), QStringLiteral("data")}) {
+        auto it = message.fields.constFind(key);
+        if (it == message.fields.constEnd() || !it.value().isArray()) {
+            continue;
+        }
+        const QJsonArray data = it.value().toArray();
+        message.rows.reserve(data.size());
+        for (const QJsonValue &value : data) {
+            AqiRecord record;
+            if (AqiRecord::fromJsonArray(value.toArray(), record)) {
+                message.rows.append(record);
+            }
+        }
+        message.fields.remove(key);
+        break;
+    }
+    return true;
+}
+
+bool decodeBinary(const QByteArray &payload, WireMessage &message) {
+    QDataStream in(payload);
+    in.setVersion(QDataStream::Qt_5_12);
+    in.setFloatingPointPrecision(QDataStream::DoublePrecision);
+
+    quint8 magic, version;
+    in >> magic >> version;
+    if (magic != WireCodec::BinaryMagic || version != WireCodec::BinaryVersion) {
+        return false;
+    }
+    QByteArray cbor;
+    quint32 rowCount, stringCount;
+    in >> cbor >> rowCount >> stringCount;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+    message.format = WireCodec::Format::Binary;
+    message.fields = QCborValue::fromCbor(cbor).toJsonValue().toObject();
+
+    StringPool &pool = StringPool::global();
+    QStringList strings;
+    strings.reserve(static_cast<int>(qMin<quint32>(stringCount, 1u << 16)));
+    for (quint32 i = 0; i < stringCount && in.status() == QDataStream::Ok; ++i) {
+        QByteArray utf8;
+        in >> utf8;
+        strings.append(pool.intern(utf8.constData(), utf8.size()));
+    }
+    if (in.status() != QDataStream::Ok
+        || in.device()->bytesAvailable() < qint64(rowCount) * WireCodec::BinaryRowSize) {
+        return false;
+    }
+
+    auto lookup = [&strings](quint32 index, QString &value) {
+        if (index >= static_cast<quint32>(strings.size())) {
+            return false;
+        }
+        value = strings[static_cast<int>(index)];
+        return true;
+    };
+
+    message.rows.resize(static_cast<int>(rowCount));
+    int decoded = 0;
+    for (AqiRecord &record : message.rows) {
+        quint32 pollutant, unit, siteName, agency, aqsId, fullAqsId;
+        qint32 aqi, category;
+        in >> record.timestamp >> record.latitude >> record.longitude >> pollutant
+           >> record.concentration >> unit >> record.rawConcentration >> aqi >> category
+           >> siteName >> agency >> aqsId >> fullAqsId;
+        if (in.status() != QDataStream::Ok) {
+            break;
+        }
+        record.aqi = aqi;
+        record.category = category;
+        if (!lookup(pollutant, record.pollutant) || !lookup(unit, record.unit)
+            || !lookup(siteName, record.siteName) || !lookup(agency, record.agency)
+            || !lookup(aqsId, record.aqsId) || !lookup(fullAqsId, record.fullAqsId)) {
+            break;
+        }
+        ++decoded;
+    }
+    message.rows.resize(decoded);
+    return decoded == static_cast<int>(rowCount);
+}
+
+}
+
+QJsonArray WireCodec::supportedCodecs() {
+    return QJsonArray{"binary", "json"};
+}
+
+WireCodec::Format WireCodec::negotiate(const QJsonObject &peer) {
+    return peer["codecs"].toArray().contains(QJsonValue("binary")) ? Format::Binary : Format::Json;
+}
+
+QString WireCodec::formatName(Format format) {
+    return format == Format::Binary ? "binary" : "json";
+}
+
+QByteArray WireCodec::encode(const QJsonObject &fields, Format format) {
+    return encode(fields, AqiBatch(), format);
+}
+
+QByteArray WireCodec::encode(const QJsonObject &fields, const AqiBatch &rows, Format format,
+                             const QString &rowsKey) {
+    return format == Format::Binary ? encodeBinary(fields, rows) : encodeJson(fields, rows, rowsKey);
+}
+
+QByteArray WireCodec::encode(const QJsonObject &fields, const ColumnBatch &rows) {
+    return encodeBinaryColumns(fields, rows);
+}
+
+bool WireCodec::decode(const QByteArray &payload, WireMessage &message, Rows rows) {
+    message = WireMessage();
+    const bool binary = !payload.isEmpty() && static_cast<quint8>(payload[0]) == BinaryMagic;
+    if (binary && rows == Rows::Columns) {
+        return decodeBinaryColumns(payload, message);
+    }
+    if (!(binary ? decodeBinary(payload, message) : decodeJson(payload, message))) {
+        return false;
+    }
+    if (rows == Rows::Columns) {
+        message.columns = ColumnBatch::pooled();
+        message.columns->assign(message.rows);
+        message.rows.clear();
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef WIRECODEC_H
+#define WIRECODEC_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QStringList>
+#include "AqiRecord.h"
+#include "ColumnBatch.h"
+
+// Message payload encodings. Every node understands both; the compact binary
+// encoding is only sent to peers that advertised it in their "codecs" list at
+// registration, everything else falls back to compact JSON.
+namespace WireCodec {
+    enum class Format { Json, Binary };
+
+    constexpr quint8 BinaryMagic = 0xB1;
+    constexpr quint8 BinaryVersion = 1;
+    // Bytes per row in the binary encoding, not counting the shared string table.
+    constexpr int BinaryRowSize = 8 * 5 + 4 * 8;
+
+    QJsonArray supportedCodecs();
+    Format negotiate(const QJsonObject &peer);
+    QString formatName(Format format);
+}
+
+// A decoded message: the control fields plus any AQI rows it carried. For JSON
+// payloads the "Data"/"data" row array is parsed into rows and removed from fields.
+// Rows are in rows, or in columns when they were decoded as a ColumnBatch.
+struct WireMessage {
+    QJsonObject fields;
+    AqiBatch rows;
+    ColumnBatchPointer columns;
+    WireCodec::Format format = WireCodec::Format::Json;
+};
+
+namespace WireCodec {
+    // rowsKey names the JSON array the rows are written to in the JSON fallback.
+    QByteArray encode(const QJsonObject &fields, Format format = Format::Json);
+    QByteArray encode(const QJsonObject &fields, const AqiBatch &rows, Format format,
+                      const QString &rowsKey = "Data");
+    // Always binary: the column batch's string table is written as is.
+    QByteArray encode(const QJsonObject &fields, const ColumnBatch &rows);
+
+    enum class Rows { Records, Columns };
+    // With Rows::Columns a binary payload is decoded in place into a ColumnBatch, with
+    // no per-row allocation; JSON rows are parsed as usual and converted.
+    bool decode(const QByteArray &payload, WireMessage &message, Rows rows = Rows::Records);
+}
+
+#endif
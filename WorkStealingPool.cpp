@@ -0,0 +1,111 @@
+#include "WorkStealingPool.h"
+
+namespace {
+// Pool and queue index of the pool thread running on this thread, if any.
+thread_local const WorkStealingPool *currentPool = nullptr;
+thread_local int currentQueue = -1;
+}
+
+WorkStealingPool::WorkStealingPool(int threadCount) {
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    int target = currentPool == this
+        ? currentQueue
+        : static_cast<int>(nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size());
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(task));
+    }
+    {
+        // Taken so a worker cannot miss the wakeup between its check and its wait.
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        pending.fetch_add(1, std::memory_order_release);
+    }
+    wake.notify_one();
+}
+
+bool WorkStealingPool::runOne(int home) {
+    std::function<void()> task;
+    const int count = static_cast<int>(queues.size());
+    const int start = home >= 0 ? home : 0;
+    if (home >= 0) {
+        Queue &own = *queues[home];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+        }
+    }
+    for (int offset = 1; !task && offset <= count; ++offset) {
+        Queue &victim = *queues[(start + offset) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    pending.fetch_sub(1, std::memory_order_acq_rel);
+    task();
+    return true;
+}
+
+void WorkStealingPool::workerLoop(int index) {
+    currentPool = this;
+    currentQueue = index;
+    for (;;) {
+        if (runOne(index)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this] { return stopping || pending.load(std::memory_order_acquire) > 0; });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+void WorkStealingPool::parallelFor(int count, const std::function<void(int)> &body) {
+    if (count <= 0) {
+        return;
+    }
+    std::atomic<int> remaining(count);
+    for (int i = 1; i < count; ++i) {
+        submit([&body, &remaining, i] {
+            body(i);
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    body(0);
+    remaining.fetch_sub(1, std::memory_order_release);
+
+    const int home = currentPool == this ? currentQueue : -1;
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!runOne(home)) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads, each with its own task deque. A thread pops its newest
+// task first and, when idle, steals the oldest task from another thread's deque.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threadCount);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    int threadCount() const { return static_cast<int>(threads.size()); }
+
+    void submit(std::function<void()> task);
+
+    // Runs body(0) .. body(count - 1) on the pool and returns once all have finished.
+    // The calling thread runs tasks while it waits, so this may be nested inside a task.
+    void parallelFor(int count, const std::function<void(int)> &body);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool runOne(int home);
+    void workerLoop(int index);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> pending{0};
+    std::atomic<unsigned> nextQueue{0};
+    bool stopping = false;
+};
+
+#endif
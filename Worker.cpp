@@ -1,45 +1,485 @@
 #include "Worker.h"
+#include "QueryEngine.h"
+#include "Rollups.h"
+#include "Snapshot.h"
+#include "WireCodec.h"
+#include "SegmentFile.h"
+#include "Logging.h"
+#include "Metrics.h"
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSet>
 
-Worker::Worker(QObject *parent) : QObject(parent) {}
+namespace {
 
-void Worker::storeData(const QJsonArray &dataArray) {
-    for (const QJsonValue &value : dataArray) {
-        aqiData.append(value.toArray());
+Metrics::Counter &answeredFrom(const QString &source) {
+    return Metrics::Registry::global().counter(
+        "aqi_query_sources_total", "Stores read for spec queries, by the rollup tier or raw scan that answered.",
+        {{"source", source}});
+}
+
+}
+
+Worker::Worker(int threadCount, const QString &dataDirectory, QObject *parent)
+    : QObject(parent), store(threadCount), dataDirectory(dataDirectory), pool(threadCount) {
+    qCDebug(lcIngest) << "Worker:" << store.partitionCount() << "partitions, aggregation kernels use"
+             << AggregationKernels::isaName(AggregationKernels::activeIsa());
+
+    // Rolling average, median and p95 AQI and the reporting station count per area for the dashboards.
+    StandingQuerySpec hourly;
+    hourly.name = "aqi-1h-area";
+    hourly.windowSeconds = 3600;
+    hourly.paneSeconds = 60;
+    hourly.percentiles = {50, 95};
+    hourly.distinctStations = true;
+    addStandingQuery(hourly);
+
+    StandingQuerySpec daily;
+    daily.name = "aqi-24h-area";
+    daily.windowSeconds = 24 * 3600;
+    daily.paneSeconds = 3600;
+    addStandingQuery(daily);
+
+    if (!dataDirectory.isEmpty()) {
+        recover();
+    }
+
+    const QString outcomeNames[QueryCache::OutcomeCount] = {"hit", "partial", "miss"};
+    for (int outcome = 0; outcome < QueryCache::OutcomeCount; ++outcome) {
+        Metrics::Registry::global().counterCallback(
+            "aqi_query_cache_lookups_total",
+            "Partition scans looked up in the query cache: answered whole (hit), merged with a scan of "
+            "the segments stored since (partial), or scanned in full (miss).",
+            this, [this, outcome] { return queryCache.lookups(static_cast<QueryCache::Outcome>(outcome)); },
+            {{"result", outcomeNames[outcome]}});
+    }
+    Metrics::Registry::global().counterCallback(
+        "aqi_query_cache_evictions_total", "Query cache entries evicted to stay within its memory budget.", this,
+        [this] { return queryCache.evictions(); });
+    Metrics::Registry::global().gaugeCallback(
+        "aqi_query_cache_bytes", "Estimated memory held by cached query results.", this,
+        [this] { return queryCache.bytes(); });
+    Metrics::Registry::global().gaugeCallback(
+        "aqi_query_cache_entries", "Cached partition results of spec queries.", this,
+        [this] { return queryCache.entryCount(); });
+
+    for (int t = 0; t < RollupStore::TierCount; ++t) {
+        const RollupStore::Tier tier = static_cast<RollupStore::Tier>(t);
+        Metrics::Registry::global().gaugeCallback(
+            "aqi_rollup_cells", "Rollup cells held for this node's own data, by tier.", this,
+            [this, tier] { return store.rollups().cellCount(tier); }, {{"tier", RollupStore::tierName(tier)}});
+    }
+}
+
+void Worker::recover() {
+    QElapsedTimer timer;
+    timer.start();
+    wal.reset(new WriteAheadLog(dataDirectory));
+
+    quint64 from = 0;
+    bool restored = true;
+    const QString latest = Snapshot::latest(dataDirectory);
+    if (!latest.isEmpty()) {
+        std::vector<StoreSnapshot> stores;
+        QString error;
+        if (Snapshot::read(latest, from, stores, error)) {
+            for (StoreSnapshot &saved : stores) {
+                if (saved.shard.isEmpty()) {
+                    store.restore(std::move(saved.partitions), saved.rollups.data());
+                } else {
+                    QSharedPointer<PartitionedStore> replica(new PartitionedStore(store.partitionCount()));
+                    replica->restore(std::move(saved.partitions), saved.rollups.data());
+                    replicaStores.insert(saved.shard, replica);
+                }
+            }
+        } else {
+            // Fall back to whatever log is left; rows only in the snapshot are lost.
+            qCWarning(lcIngest) << "Worker: ignoring snapshot" << latest << ":" << error;
+            from = 0;
+            restored = false;
+        }
+    }
+    if (restored) {
+        // Segment files written after the snapshot are not referenced by it; their rows
+        // are still in the log, so they are rebuilt by the replay below.
+        QSet<QString> referenced;
+        QVector<const PartitionedStore *> stores{&store};
+        for (const QSharedPointer<PartitionedStore> &replica : replicaStores) {
+            stores.append(replica.data());
+        }
+        for (const PartitionedStore *partitioned : stores) {
+            for (const ColumnStore &partition : partitioned->snapshot()) {
+                for (const QSharedPointer<const SegmentFile> &file : partition.segmentFiles()) {
+                    referenced.insert(QFileInfo(file->path()).fileName());
+                }
+            }
+        }
+        QDir segments(segmentDirectory());
+        for (const QString &name : segments.entryList(QStringList{"*.seg"}, QDir::Files)) {
+            if (!referenced.contains(name)) {
+                segments.remove(name);
+            }
+        }
+    }
+    const qint64 snapshotRows = store.rowCount();
+
+    qint64 replayed = 0;
+    const quint64 last = wal->replay(from, [this, &replayed](quint64, const QByteArray &payload) {
+        WireMessage message;
+        if (WireCodec::decode(payload, message, WireCodec::Rows::Columns)) {
+            apply(*message.columns, message.fields["shard"].toString());
+            replayed += message.columns->size();
+        }
+    });
+
+    QString error;
+    if (!wal->start(qMax(from, last + 1), error)) {
+        qWarning() << "Worker: cannot open write-ahead log in" << dataDirectory << ":" << error
+                   << "- refusing batches";
+        wal.reset();
+        logUnavailable = true;
+    } else {
+        wal->setDurableCallback([this](quint64 durable) {
+            for (int ticket : takeTickets(durable)) {
+                emit batchStored(ticket);
+            }
+        });
+        wal->setFailedCallback([this](quint64 lost) {
+            qWarning() << "Worker: write-ahead log failed - refusing batches";
+            for (int ticket : takeTickets(lost)) {
+                emit batchFailed(ticket);
+            }
+        });
+    }
+    qCDebug(lcIngest) << "Worker: recovered" << snapshotRows << "rows from snapshot and" << replayed
+             << "from the write-ahead log in" << timer.elapsed() << "ms";
+}
+
+void Worker::storeData(const AqiBatch &rows, const QString &shard) {
+    ColumnBatchPointer batch = ColumnBatch::pooled();
+    batch->assign(rows);
+    storeColumns(batch, shard);
+}
+
+QVector<int> Worker::takeTickets(quint64 upTo) {
+    QVector<int> tickets;
+    QMutexLocker locker(&ticketLock);
+    int done = 0;
+    while (done < pendingTickets.size() && pendingTickets[done].first <= upTo) {
+        tickets.append(pendingTickets[done++].second);
+    }
+    pendingTickets.remove(0, done);
+    return tickets;
+}
+
+void Worker::storeColumns(const ColumnBatchPointer &batch, const QString &shard, int ticket) {
+    const ColumnBatch &rows = *batch;
+    if (logUnavailable || (wal && wal->failed())) {
+        // Rows that cannot be logged are not stored, so nothing is acknowledged that a
+        // restart would lose.
+        qCWarning(lcIngest) << "Worker: refusing" << rows.size() << "rows, the write-ahead log is unavailable";
+        if (ticket != 0) {
+            emit batchFailed(ticket);
+        }
+        return;
+    }
+    // Applied before it is logged, so the rows are in the store by the time the
+    // commit thread syncs the record with the rest of its group and reports the
+    // ticket stored. This thread is the only appender, so a snapshot still sees the
+    // store and the log agree.
+    const QVector<QJsonObject> updates = apply(rows, shard);
+    if (wal) {
+        const QByteArray record = WireCodec::encode(QJsonObject{{"shard", shard}}, rows);
+        QMutexLocker locker(&ticketLock);
+        const quint64 sequence = wal->append(record);
+        if (ticket != 0) {
+            pendingTickets.append(qMakePair(sequence, ticket));
+        }
+    } else if (ticket != 0) {
+        emit batchStored(ticket);
+    }
+    for (const QJsonObject &update : updates) {
+        emit standingQueryUpdated(update);
     }
-    qDebug() << "Data stored successfully in worker. Current data count:" << aqiData.size();
     emit dataStored();
+
+    rowsSinceSnapshot += rows.size();
+    if (wal && rowsSinceSnapshot >= SnapshotRows && !snapshotRunning.exchange(true)) {
+        rowsSinceSnapshot = 0;
+        startSnapshot();
+    }
+    rowsSinceHousekeeping += rows.size();
+    if (rowsSinceHousekeeping >= HousekeepingRows && !housekeepingRunning.exchange(true)) {
+        rowsSinceHousekeeping = 0;
+        startHousekeeping();
+    }
+}
+
+QString Worker::segmentDirectory() const {
+    return QDir(dataDirectory).filePath("segments");
+}
+
+void Worker::startHousekeeping() {
+    QVector<QSharedPointer<PartitionedStore>> replicas;
+    {
+        QReadLocker locker(&replicaLock);
+        for (const QSharedPointer<PartitionedStore> &replica : replicaStores) {
+            replicas.append(replica);
+        }
+    }
+    const qint64 rawSeconds = rawRetention.load(std::memory_order_relaxed);
+    // Retention and cold moves both remove segments, so they run one after the other.
+    pool.submit([this, replicas, rawSeconds]() {
+        qint64 dropped = store.applyRetention(rawSeconds);
+        for (const QSharedPointer<PartitionedStore> &replica : replicas) {
+            dropped += replica->applyRetention(rawSeconds);
+        }
+        if (dropped > 0) {
+            qCDebug(lcIngest) << "Worker: dropped" << dropped << "raw rows past retention";
+        }
+        if (!wal) {
+            housekeepingRunning.store(false);
+            return;
+        }
+        QDir().mkpath(segmentDirectory());
+        QString error;
+        int moved = store.moveColdSegments(MaxHotBytes, segmentDirectory(), error);
+        for (const QSharedPointer<PartitionedStore> &replica : replicas) {
+            if (error.isEmpty()) {
+                moved += replica->moveColdSegments(MaxHotBytes, segmentDirectory(), error);
+            }
+        }
+        if (!error.isEmpty()) {
+            qCWarning(lcIngest) << "Worker: cannot write segment file:" << error;
+        }
+        if (moved > 0) {
+            qCDebug(lcIngest) << "Worker: moved" << moved << "sealed segments to disk, memory now"
+                     << store.memoryUsage() << "bytes";
+        }
+        housekeepingRunning.store(false);
+    });
+}
+
+void Worker::startSnapshot() {
+    // Runs on the worker thread, the only appender, so the captured stores hold exactly
+    // the records before the rotation boundary. Copies share column data until the next
+    // append detaches the segment being written.
+    const quint64 boundary = wal->rotate();
+    auto stores = std::make_shared<std::vector<StoreSnapshot>>();
+    auto capture = [](const QString &shard, const PartitionedStore &partitioned) {
+        return StoreSnapshot{shard, partitioned.snapshot(),
+                             QSharedPointer<const RollupTiers>(new RollupTiers(partitioned.rollups().tiers()))};
+    };
+    stores->push_back(capture(QString(), store));
+    {
+        QReadLocker locker(&replicaLock);
+        for (auto it = replicaStores.constBegin(); it != replicaStores.constEnd(); ++it) {
+            stores->push_back(capture(it.key(), *it.value()));
+        }
+    }
+
+    pool.submit([this, boundary, stores]() {
+        QElapsedTimer timer;
+        timer.start();
+        QString error;
+        if (Snapshot::write(Snapshot::fileName(dataDirectory, boundary), boundary, *stores, error)) {
+            wal->removeBefore(boundary);
+            Snapshot::removeBefore(dataDirectory, boundary);
+            qCDebug(lcIngest) << "Worker: snapshot at sequence" << boundary << "written in" << timer.elapsed() << "ms";
+        } else {
+            qCWarning(lcIngest) << "Worker: snapshot failed:" << error;
+        }
+        snapshotRunning.store(false);
+    });
+}
+
+QVector<QJsonObject> Worker::apply(const ColumnBatch &rows, const QString &shard) {
+    QVector<QJsonObject> updates;
+    if (!shard.isEmpty()) {
+        QSharedPointer<PartitionedStore> replica;
+        {
+            QReadLocker locker(&replicaLock);
+            replica = replicaStores.value(shard);
+        }
+        if (!replica) {
+            QWriteLocker locker(&replicaLock);
+            QSharedPointer<PartitionedStore> &slot = replicaStores[shard];
+            if (!slot) {
+                slot.reset(new PartitionedStore(store.partitionCount()));
+            }
+            replica = slot;
+        }
+        replica->append(rows);
+        static Metrics::Counter &replicaRows = Metrics::Registry::global().counter(
+            "aqi_rows_stored_total", "Rows applied to the in-memory store.", {{"store", "replica"}});
+        replicaRows.add(rows.size());
+        qCDebug(lcIngest) << "Replica rows stored for shard" << shard << ". Current count:" << replica->rowCount();
+        return updates;
+    }
+
+    store.append(rows);
+    static Metrics::Counter &primaryRows = Metrics::Registry::global().counter(
+        "aqi_rows_stored_total", "Rows applied to the in-memory store.", {{"store", "primary"}});
+    primaryRows.add(rows.size());
+    qCDebug(lcIngest) << "Data stored successfully in worker. Current data count:" << store.rowCount();
+
+    QMutexLocker locker(&standingLock);
+    for (StandingQuery &query : standingQueries) {
+        if (query.add(rows)) {
+            updates.append(query.result());
+        }
+    }
+    return updates;
+}
+
+void Worker::addStandingQuery(const StandingQuerySpec &spec) {
+    QMutexLocker locker(&standingLock);
+    standingQueries.insert(spec.name, StandingQuery(spec));
+}
+
+void Worker::registerStandingQuery(const QJsonObject &definition) {
+    StandingQuerySpec spec;
+    QString error;
+    if (!StandingQuerySpec::fromJson(definition, spec, error)) {
+        qCWarning(lcQuery) << "Worker: rejected standing query:" << error;
+        return;
+    }
+    QJsonObject current;
+    {
+        QMutexLocker locker(&standingLock);
+        auto it = standingQueries.find(spec.name);
+        if (it == standingQueries.end() || definition.size() > 1) {
+            // Panes are only filled from here on; older rows are not replayed.
+            it = standingQueries.insert(spec.name, StandingQuery(spec));
+        }
+        current = it.value().result();
+    }
+    qCDebug(lcQuery) << "Worker: standing query" << spec.name << spec.toJson();
+    emit standingQueryUpdated(current);
 }
 
 void Worker::processQuery(const QJsonObject &message) {
+    // Runs on the pool so the worker thread keeps ingesting while the query scans.
+    pool.submit([this, message]() {
+        static Metrics::Histogram &execution = Metrics::Registry::global().histogram(
+            "aqi_query_execution_seconds", "Time the worker spent executing a query.");
+        QElapsedTimer timer;
+        timer.start();
+        QJsonObject response = executeQuery(message);
+        execution.record(timer.nsecsElapsed());
+        emit queryProcessed(response);
+    });
+}
+
+QVector<const PartitionedStore *> Worker::storesFor(const QJsonObject &message) const {
+    // "shards": ["", "10.0.0.7#1"] -- "" is this node's own data. Absent means own data only.
+    // Replica stores are never removed, so their pointers outlive the lock.
+    QVector<const PartitionedStore *> stores;
+    if (!message.contains("shards")) {
+        stores.append(&store);
+        return stores;
+    }
+    QReadLocker locker(&replicaLock);
+    for (const QJsonValue &value : message["shards"].toArray()) {
+        const QString shard = value.toString();
+        if (shard.isEmpty()) {
+            stores.append(&store);
+        } else if (replicaStores.contains(shard)) {
+            stores.append(replicaStores.value(shard).data());
+        }
+    }
+    return stores;
+}
+
+QJsonObject Worker::executeQuery(const QJsonObject &message) {
     int requestId = message["requestID"].toInt();
-    double maxAqi = 0;
-    double totalAqi = 0;
-    QString maxArea;
-    int count = 0;
 
-    for (const QJsonArray &entry : aqiData) {
-        if (entry.size() >= 5) {
-            double aqi = entry[9].toString().toDouble();
-            QString area = entry[10].toString();
-            totalAqi += aqi;
-            count++;
+    if (message["standing"].isString()) {
+        // Standing query results are maintained at ingest, so this is a lookup.
+        const QString name = message["standing"].toString();
+        QMutexLocker locker(&standingLock);
+        auto it = standingQueries.constFind(name);
+        QJsonObject response = it != standingQueries.constEnd() ? it.value().result()
+                                                                : QJsonObject{{"error", "unknown standing query: " + name}};
+        response["requestType"] = "query response";
+        response["requestID"] = requestId;
+        return response;
+    }
 
-            if (aqi > maxAqi) {
-                maxAqi = aqi;
-                maxArea = area;
+    if (message["query"].isObject()) {
+        QJsonObject response{
+            {"requestType", "query response"},
+            {"requestID", requestId}
+        };
+        QuerySpec spec;
+        QString error;
+        if (!QuerySpec::fromJson(message["query"].toObject(), spec, error)) {
+            qCWarning(lcQuery) << "Worker: rejected query" << requestId << ":" << error;
+            response["error"] = error;
+            return response;
+        }
+        static Metrics::Counter &rawScans = answeredFrom("raw");
+        static Metrics::Counter *rollupReads[RollupStore::TierCount] = {
+            &answeredFrom(RollupStore::tierName(RollupStore::Minute)),
+            &answeredFrom(RollupStore::tierName(RollupStore::Hour)),
+            &answeredFrom(RollupStore::tierName(RollupStore::Day))
+        };
+        QueryResult merged;
+        merged.spec = spec;
+        if (spec.groupBy.isEmpty()) {
+            merged.groups.insert(QString(), GroupState());
+        }
+        for (const PartitionedStore *shard : storesFor(message)) {
+            // The coarsest rollup tier that answers the spec exactly, else a scan of raw rows.
+            QueryResult partial;
+            RollupStore::Tier tier;
+            if (shard->rollups().answer(spec, partial, tier)) {
+                rollupReads[tier]->add();
+                qCDebug(lcQuery) << "Worker: query" << requestId << "answered from the"
+                                 << RollupStore::tierName(tier) << "rollups";
+            } else {
+                partial = QueryEngine::execute(spec, *shard, pool, &queryCache);
+                rawScans.add();
             }
+            merged.merge(partial);
+        }
+        if (message["partial"].toBool()) {
+            // Sent to a coordinator, which merges shards before finishing aggregates.
+            response["partial"] = merged.toPartialJson();
+            return response;
         }
+        QJsonObject result = merged.toJson();
+        response["columns"] = result["columns"];
+        response["rows"] = result["rows"];
+        response["segmentsScanned"] = result["segmentsScanned"];
+        response["segmentsSkipped"] = result["segmentsSkipped"];
+        return response;
+    }
+
+    // Legacy query without a spec: max/average AQI over everything.
+    MaxAverageResult result;
+    for (const PartitionedStore *shard : storesFor(message)) {
+        result.merge(QueryEngine::maxAverage(*shard, pool, message["pollutant"].toString()));
+    }
+    if (message["partial"].toBool()) {
+        return QJsonObject{
+            {"requestType", "query response"},
+            {"requestID", requestId},
+            {"partial", result.toJson()}
+        };
     }
 
-    double averageAqi = (count > 0) ? totalAqi / count : 0;
-    qDebug() << "Worker: Max Area:" << maxArea << ", Max AQI:" << maxAqi << ", Average AQI:" << averageAqi;
+    double maxAqi = result.aqi.count > 0 ? result.aqi.max : 0;
+    double averageAqi = result.aqi.average();
+    qCDebug(lcQuery) << "Worker: Max Area:" << result.maxArea << ", Max AQI:" << maxAqi << ", Average AQI:" << averageAqi;
 
-    QJsonObject response{
+    return QJsonObject{
         {"requestType", "query response"},
         {"requestID", requestId},
-        {"maxArea", maxArea},
+        {"maxArea", result.maxArea},
+        {"maxAqi", maxAqi},
         {"maxAverage", averageAqi}
     };
-    emit queryProcessed(response);
 }
@@ -4,23 +4,95 @@
 #include <QObject>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QMap>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <atomic>
+#include <memory>
+#include "PartitionedStore.h"
+#include "QueryCache.h"
+#include "StandingQuery.h"
+#include "WorkStealingPool.h"
+#include "WriteAheadLog.h"
 
 class Worker : public QObject {
     Q_OBJECT
 
 public:
-    explicit Worker(QObject *parent = nullptr);
+    // Data is split into one partition per thread; queries scan partitions in parallel.
+    // Rows this node owns as shard primary live in the main store; rows held as a
+    // replica for another node live in a separate store per shard ("<ip>#<rank>").
+    // With a dataDirectory, every batch is logged there before it is stored and the
+    // stores are snapshotted every SnapshotRows rows; the constructor recovers from
+    // the latest snapshot plus the log written after it. Sealed segments beyond
+    // MaxHotBytes per store are moved into segment files there as well. Every store
+    // keeps rollup tiers that answer area/pollutant/time queries without a scan; other
+    // spec queries reuse cached partition results where no rows have changed since.
+    explicit Worker(int threadCount = 1, const QString &dataDirectory = QString(), QObject *parent = nullptr);
+
+    // Raw readings more than seconds older than the newest one are dropped (a sealed
+    // segment at a time) while the rollups keep them summarized; 0, the default, keeps
+    // every reading. Safe to call from any thread.
+    void setRawRetention(qint64 seconds) { rawRetention.store(seconds, std::memory_order_relaxed); }
+    // Memory for cached scan results of spec queries (QueryCache); 0 turns caching off.
+    void setQueryCacheBytes(qint64 bytes) { queryCache.setMaxBytes(bytes); }
+
+    static constexpr qint64 SnapshotRows = 1000000;
+    static constexpr qint64 MaxHotBytes = 2LL * 1024 * 1024 * 1024;
+    // Rows stored between retention and cold segment passes.
+    static constexpr qint64 HousekeepingRows = 256 * 1024;
 
 signals:
     void dataStored();
+    // The batch storeColumns() was given ticket for is stored, and durable when the
+    // Worker has a data directory. Emitted on the log's commit thread in that case.
+    void batchStored(int ticket);
+    // The batch could not be logged (the data directory's log failed or could not be
+    // opened); it is not acknowledged as stored.
+    void batchFailed(int ticket);
     void queryProcessed(const QJsonObject &response);
+    // A standing query's window result changed (or it was just registered).
+    void standingQueryUpdated(const QJsonObject &result);
 
 public slots:
-    void storeData(const QJsonArray &dataArray);
+    void storeData(const AqiBatch &rows, const QString &shard = QString());
+    // The batch is handed over by pointer from the socket's decoder; the Worker is
+    // its only user from here on and drops it once its columns are appended.
+    void storeColumns(const ColumnBatchPointer &batch, const QString &shard = QString(), int ticket = 0);
     void processQuery(const QJsonObject &message);
+    void registerStandingQuery(const QJsonObject &definition);
 
 private:
-    QList<QJsonArray> aqiData;
+    QJsonObject executeQuery(const QJsonObject &message);
+    void addStandingQuery(const StandingQuerySpec &spec);
+    QVector<const PartitionedStore *> storesFor(const QJsonObject &message) const;
+    QVector<QJsonObject> apply(const ColumnBatch &rows, const QString &shard);
+    void recover();
+    // Removes and returns the tickets of records up to sequence upTo.
+    QVector<int> takeTickets(quint64 upTo);
+    void startSnapshot();
+    void startHousekeeping();
+    QString segmentDirectory() const;
+
+    PartitionedStore store;
+    QString dataDirectory;
+    QMutex ticketLock;
+    QVector<QPair<quint64, int>> pendingTickets;  // WAL sequence -> ticket, until durable
+    std::unique_ptr<WriteAheadLog> wal;
+    bool logUnavailable = false;  // a data directory was given but its log could not be opened
+    qint64 rowsSinceSnapshot = 0;
+    std::atomic<bool> snapshotRunning{false};
+    qint64 rowsSinceHousekeeping = 0;
+    std::atomic<bool> housekeepingRunning{false};
+    std::atomic<qint64> rawRetention{0};
+    QueryCache queryCache;
+    WorkStealingPool pool;  // declared after the log so snapshot tasks finish before it closes
+    QMap<QString, QSharedPointer<PartitionedStore>> replicaStores;
+    mutable QReadWriteLock replicaLock;
+    // Updated on the worker thread in storeData; results are read by queries on the pool.
+    QMap<QString, StandingQuery> standingQueries;
+    mutable QMutex standingLock;
 };
 
 #endif
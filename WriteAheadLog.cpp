@@ -0,0 +1,316 @@
+#include "WriteAheadLog.h"
+#include <QDebug>
+#include <QDir>
+#include <QtEndian>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#include <io.h>
+#endif
+
+namespace {
+
+constexpr quint32 RecordMagic = 0x57414C31;  // "WAL1"
+constexpr int HeaderSize = 20;
+constexpr quint32 MaxRecordSize = 256 * 1024 * 1024;
+
+struct LogFile {
+    quint64 firstSequence;
+    QString path;
+};
+
+QVector<LogFile> logFiles(const QString &directory) {
+    QVector<LogFile> files;
+    QDir dir(directory);
+    for (const QString &name : dir.entryList(QStringList{"wal-*.log"}, QDir::Files, QDir::Name)) {
+        bool ok = false;
+        quint64 first = name.mid(4, name.size() - 8).toULongLong(&ok);
+        if (ok) {
+            files.append(LogFile{first, dir.filePath(name)});
+        }
+    }
+    std::sort(files.begin(), files.end(),
+              [](const LogFile &a, const LogFile &b) { return a.firstSequence < b.firstSequence; });
+    return files;
+}
+
+bool syncFile(QFile &file) {
+    if (!file.flush()) {
+        return false;
+    }
+#if defined(Q_OS_LINUX)
+    return ::fdatasync(file.handle()) == 0;
+#elif defined(Q_OS_UNIX)
+    return ::fsync(file.handle()) == 0;
+#elif defined(Q_OS_WIN)
+    return ::_commit(file.handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+}
+
+quint32 WriteAheadLog::crc32(const char *data, qint64 size) {
+    static const auto table = [] {
+        std::array<quint32, 256> entries{};
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    quint32 crc = 0xFFFFFFFFu;
+    for (qint64 i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<quint8>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+WriteAheadLog::WriteAheadLog(const QString &directory, const Options &options)
+    : directory(directory), options(options) {
+    QDir().mkpath(directory);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (committer.joinable()) {
+        committer.join();
+    }
+}
+
+QString WriteAheadLog::fileName(quint64 firstSequence) const {
+    return QDir(directory).filePath(QString("wal-%1.log").arg(firstSequence, 20, 10, QChar('0')));
+}
+
+quint64 WriteAheadLog::replay(quint64 from, const std::function<void(quint64, const QByteArray &)> &visit) {
+    quint64 last = 0;
+    for (const LogFile &log : logFiles(directory)) {
+        QFile input(log.path);
+        if (!input.open(QIODevice::ReadOnly)) {
+            qWarning() << "WriteAheadLog: cannot read" << log.path << input.errorString();
+            continue;
+        }
+        const qint64 size = input.size();
+        const uchar *data = size > 0 ? input.map(0, size) : nullptr;
+        QByteArray contents;
+        if (size > 0 && !data) {
+            contents = input.readAll();
+            data = reinterpret_cast<const uchar *>(contents.constData());
+        }
+
+        qint64 offset = 0;
+        while (offset + HeaderSize <= size) {
+            const uchar *header = data + offset;
+            const quint32 length = qFromBigEndian<quint32>(header + 4);
+            if (qFromBigEndian<quint32>(header) != RecordMagic || length > MaxRecordSize
+                || offset + HeaderSize + length > size) {
+                break;
+            }
+            const char *payload = reinterpret_cast<const char *>(header + HeaderSize);
+            if (crc32(payload, length) != qFromBigEndian<quint32>(header + 8)) {
+                break;
+            }
+            const quint64 sequence = qFromBigEndian<quint64>(header + 12);
+            if (sequence >= from) {
+                visit(sequence, QByteArray::fromRawData(payload, static_cast<int>(length)));
+            }
+            last = qMax(last, sequence);
+            offset += HeaderSize + length;
+        }
+        input.close();
+        if (offset != size) {
+            // A torn group at the tail is expected after a crash. It is cut off so that
+            // records appended to this file's successors stay reachable after the next one.
+            qWarning() << "WriteAheadLog: truncating" << log.path << "to its last intact record at byte" << offset;
+            if (!QFile::resize(log.path, offset)) {
+                qWarning() << "WriteAheadLog: cannot truncate" << log.path;
+            }
+        }
+    }
+    return last;
+}
+
+bool WriteAheadLog::openFile(quint64 firstSequence) {
+    file.setFileName(fileName(firstSequence));
+    return file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+}
+
+bool WriteAheadLog::start(quint64 sequence, QString &error) {
+    nextSequence = qMax<quint64>(1, sequence);
+    durable = nextSequence - 1;
+    if (!openFile(nextSequence)) {
+        error = file.errorString();
+        return false;
+    }
+    committer = std::thread(&WriteAheadLog::commitLoop, this);
+    return true;
+}
+
+quint64 WriteAheadLog::append(const QByteArray &payload) {
+    uchar header[HeaderSize];
+    qToBigEndian<quint32>(RecordMagic, header);
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), header + 4);
+    qToBigEndian<quint32>(crc32(payload.constData(), payload.size()), header + 8);
+
+    quint64 sequence;
+    bool flushNow;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sequence = nextSequence++;
+        qToBigEndian<quint64>(sequence, header + 12);
+        queued.append(reinterpret_cast<const char *>(header), HeaderSize);
+        queued.append(payload);
+        queuedUpTo = sequence;
+        flushNow = queued.size() >= options.commitBytes || queued.size() == HeaderSize + payload.size();
+    }
+    if (flushNow) {
+        wake.notify_one();  // first record of a group starts its timer, a full group commits at once
+    }
+    return sequence;
+}
+
+quint64 WriteAheadLog::durableSequence() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return durable;
+}
+
+bool WriteAheadLog::waitDurable(quint64 sequence) {
+    std::unique_lock<std::mutex> lock(mutex);
+    committed.wait(lock, [&] { return durable >= sequence || stopping || broken; });
+    return durable >= sequence;
+}
+
+void WriteAheadLog::setDurableCallback(std::function<void(quint64)> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    onDurable = std::move(callback);
+}
+
+void WriteAheadLog::setFailedCallback(std::function<void(quint64)> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    onFailed = std::move(callback);
+}
+
+bool WriteAheadLog::failed() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return broken;
+}
+
+quint64 WriteAheadLog::rotate() {
+    std::unique_lock<std::mutex> lock(mutex);
+    const quint64 boundary = nextSequence;
+    rotateAt = boundary;
+    wake.notify_one();
+    committed.wait(lock, [&] { return rotateAt == 0 || stopping; });
+    return boundary;
+}
+
+void WriteAheadLog::removeBefore(quint64 sequence) {
+    const QVector<LogFile> files = logFiles(directory);
+    for (int i = 0; i + 1 < files.size(); ++i) {
+        if (files[i + 1].firstSequence <= sequence) {
+            QFile::remove(files[i].path);
+        }
+    }
+}
+
+qint64 WriteAheadLog::commits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return groupCount;
+}
+
+qint64 WriteAheadLog::bytesWritten() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
+}
+
+void WriteAheadLog::commitLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stopping || rotateAt != 0 || !queued.isEmpty(); });
+        if (!stopping && rotateAt == 0 && queued.size() < options.commitBytes) {
+            // Let the group fill up for the rest of the commit interval.
+            wake.wait_for(lock, std::chrono::milliseconds(options.commitIntervalMs), [this] {
+                return stopping || rotateAt != 0 || queued.size() >= options.commitBytes;
+            });
+        }
+
+        // Only records before a pending rotation belong in the current file; they are
+        // always a prefix of the queue since sequences are assigned in queue order.
+        QByteArray group;
+        quint64 upTo = queuedUpTo;
+        if (rotateAt != 0 && queuedUpTo >= rotateAt) {
+            qint64 offset = 0;
+            while (offset < queued.size()
+                   && qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(queued.constData() + offset + 12)) < rotateAt) {
+                offset += HeaderSize + qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(queued.constData() + offset + 4));
+            }
+            group = queued.left(static_cast<int>(offset));
+            queued.remove(0, static_cast<int>(offset));
+            upTo = rotateAt - 1;
+        } else {
+            group.swap(queued);
+        }
+
+        // Once a write or sync has failed the file may end in a partial group, so
+        // nothing more is written to it and every later record fails as well.
+        const bool writable = !broken;
+        lock.unlock();
+        bool ok = writable;
+        if (!group.isEmpty() && writable) {
+            ok = file.isOpen() && file.write(group) == group.size()
+                 && (options.sync ? syncFile(file) : file.flush());
+            if (!ok) {
+                qWarning() << "WriteAheadLog: cannot write" << file.fileName() << file.errorString();
+            }
+        }
+        lock.lock();
+
+        if (!group.isEmpty()) {
+            if (ok) {
+                durable = qMax(durable, upTo);
+                ++groupCount;
+                written += group.size();
+            } else {
+                broken = true;
+            }
+        }
+        if (rotateAt != 0) {
+            file.close();
+            if (!broken && !openFile(rotateAt)) {
+                qWarning() << "WriteAheadLog: cannot open" << file.fileName() << file.errorString();
+                broken = true;
+            }
+            rotateAt = 0;
+        }
+        std::function<void(quint64)> callback;
+        const quint64 reached = ok ? durable : upTo;
+        if (!group.isEmpty()) {
+            callback = ok ? onDurable : onFailed;
+        }
+        committed.notify_all();
+        const bool done = stopping && queued.isEmpty();
+        if (done) {
+            file.close();
+        }
+        if (callback) {
+            lock.unlock();
+            callback(reached);
+            lock.lock();
+        }
+        if (done) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/*
+ * Append-only log of ingested batches, split into files named wal-<first sequence>.log.
+ * Every record is
+ *
+ *   quint32 magic 'WAL1' | quint32 payload length | quint32 CRC-32 of payload | quint64 sequence | payload
+ *
+ * (big-endian). Appends are queued in memory and written by a commit thread, which
+ * syncs once per group: when commitBytes are waiting or commitIntervalMs has passed
+ * since the oldest waiting record. Recovery stops reading a file at its first torn
+ * or corrupt record, cuts the file off there and goes on with the next one, so a
+ * crash mid-write loses at most the group being committed. A failed write, sync or
+ * file rotation leaves the log failed: no record after it becomes durable.
+ */
+class WriteAheadLog {
+public:
+    struct Options {
+        int commitIntervalMs = 5;
+        qint64 commitBytes = 1024 * 1024;
+        bool sync = true;  // fdatasync each group; off only for benchmarks
+    };
+
+    explicit WriteAheadLog(const QString &directory, const Options &options = Options());
+    ~WriteAheadLog();
+
+    // Calls visit for every intact record with sequence >= from, oldest first, and
+    // returns the last sequence seen (0 when none). Files with a torn tail are
+    // truncated to their intact records. Call before start().
+    quint64 replay(quint64 from, const std::function<void(quint64, const QByteArray &)> &visit);
+    // Opens a new log file whose first record gets nextSequence and starts committing.
+    bool start(quint64 nextSequence, QString &error);
+
+    // Queues a record and returns its sequence; it is durable once durableSequence() reaches it.
+    quint64 append(const QByteArray &payload);
+    quint64 durableSequence() const;
+    // False when the record can no longer become durable.
+    bool waitDurable(quint64 sequence);
+    // Called on the commit thread after each group is synced.
+    void setDurableCallback(std::function<void(quint64)> callback);
+    // Called on the commit thread with the last sequence of a group that could not be
+    // written or synced; that group and everything after it is lost.
+    void setFailedCallback(std::function<void(quint64)> callback);
+    bool failed() const;
+
+    // Commits what is queued, then continues in a new file; returns the first sequence
+    // of that file. Everything before it can be dropped once a snapshot covers it.
+    quint64 rotate();
+    // Deletes log files whose records all precede sequence.
+    void removeBefore(quint64 sequence);
+
+    qint64 commits() const;
+    qint64 bytesWritten() const;
+
+    static quint32 crc32(const char *data, qint64 size);
+
+private:
+    void commitLoop();
+    bool openFile(quint64 firstSequence);
+    QString fileName(quint64 firstSequence) const;
+
+    QString directory;
+    Options options;
+    QFile file;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;       // commit thread: work queued or stopping
+    std::condition_variable committed;  // writers: a group became durable
+    QByteArray queued;
+    quint64 nextSequence = 1;
+    quint64 queuedUpTo = 0;   // last sequence in queued
+    quint64 durable = 0;
+    quint64 rotateAt = 0;     // non-zero while a rotation is pending
+    qint64 groupCount = 0;
+    qint64 written = 0;
+    bool stopping = false;
+    bool broken = false;      // a write, sync or rotation failed
+    std::function<void(quint64)> onDurable;
+    std::function<void(quint64)> onFailed;
+    std::thread committer;
+};
+
+#endif